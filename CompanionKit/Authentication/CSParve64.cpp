@@ -12,6 +12,7 @@
 
 #include "stdafx.h"
 #include "CSParve64.h"
+#include "CacheAligned.h"
 #include <string.h>
 
 /* CS64Crypt Implementation
@@ -78,14 +79,16 @@ public:
 	static const INT32 NUM_ROUNDS = 8;
 	static const INT32 CS_BLOCK_SIZE = sizeof(INT32);
 	static const UINT32 MODULUS = 0x7FFFFFFF;
+	static const UINT32 SMALL_MESSAGE_SIZE = CSPARVE64_SMALL_MESSAGE_SIZE; // default: at most this long, BV4 key setup dominates and BV4CryptSmall is used
 };
 
-class Context
+class alignas(CSPARVE64_CACHE_LINE_SIZE) Context : public CacheAligned
 {
 public:
 	Context(const UINT32* config20, const BYTE* sbox);
     
 	UINT32 Flags;
+	UINT32 SmallMessageSize; // copied into each instance created from the context
     
 	UINT32 Key1;
 	UINT32 Key2;
@@ -194,6 +197,17 @@ public:
 	/// <param name="inputBuf">buffer to be encrypted or decrypted</param>
 	void BV4Crypt(UINT32 inputBufBytes, BYTE* inputBuf);
     
+	/// <summary>
+	/// Key setup and BV4Crypt in one pass, for the 8-byte keys and short buffers of small messages.
+	/// Produces exactly what BV4Key(keyData, 0, 8) followed by BV4Crypt does, without building a BV4Key:
+	/// the key schedule is unrolled over the key bytes, held in registers, and the RC4 output that seeds
+	/// h and the y table is assembled directly instead of through a staging buffer.
+	/// </summary>
+	/// <param name="keyData">CS64Defs::KEY_SIZE bytes of key</param>
+	/// <param name="inputBufBytes">Size of buffer to be encrypted or decrypted</param>
+	/// <param name="inputBuf">buffer to be encrypted or decrypted</param>
+	static void BV4CryptSmall(const BYTE* keyData, UINT32 inputBufBytes, BYTE* inputBuf);
+    
 private:
     
 	/// <summary>
@@ -313,6 +327,111 @@ void BV4Key::BV4Crypt(UINT32 inputBufBytes, BYTE* inputBuf)
 	_h = h;
 }
 
+/// <summary>
+/// The identity permutation every RC4 key setup starts from, copied rather than generated.
+/// </summary>
+class RC4Identity
+{
+public:
+    
+	RC4Identity()
+	{
+		for (UINT32 i = 0; i < sizeof(S); i++)
+			S[i] = (BYTE)i;
+	}
+    
+	BYTE S[256];
+};
+
+static const RC4Identity Identity;
+
+/// <summary>
+/// One step of the RC4 key schedule.
+/// </summary>
+static inline void RC4KeyStep(BYTE* s, UINT32 i, UINT32& j, BYTE key)
+{
+	BYTE tmp = s[i];
+	j = (j + tmp + key) & 0xFF;
+	s[i] = s[j];
+	s[j] = tmp;
+}
+
+/// <summary>
+/// One byte of RC4 keystream.
+/// </summary>
+static inline UINT32 RC4Next(BYTE* s, UINT32& i, UINT32& j)
+{
+	i = (i + 1) & 0xFF;
+	BYTE tmp = s[i];
+	j = (j + tmp) & 0xFF;
+	s[i] = s[j];
+	s[j] = tmp;
+	return s[(s[i] + tmp) & 0xFF];
+}
+
+/// <summary>
+/// One big-endian word of RC4 keystream, as RC4Fill reads it back from its buffer.
+/// </summary>
+static inline UINT32 RC4NextWord(BYTE* s, UINT32& i, UINT32& j)
+{
+	UINT32 word = RC4Next(s, i, j) << 24;
+	word |= RC4Next(s, i, j) << 16;
+	word |= RC4Next(s, i, j) << 8;
+	word |= RC4Next(s, i, j);
+	return word;
+}
+
+void BV4Key::BV4CryptSmall(const BYTE* keyData, UINT32 inputBufBytes, BYTE* inputBuf)
+{
+	BYTE s[RC4_TABLESIZE];
+	UINT32 y[BV4_Y_TABLESIZE];
+	memcpy(s, Identity.S, RC4_TABLESIZE);
+    
+	// RC4 key setup, eight steps at a time so each uses a fixed key byte.
+	const BYTE k0 = keyData[0], k1 = keyData[1], k2 = keyData[2], k3 = keyData[3];
+	const BYTE k4 = keyData[4], k5 = keyData[5], k6 = keyData[6], k7 = keyData[7];
+	UINT32 i, j = 0;
+	for (i = 0; i < RC4_TABLESIZE; i += CS64Defs::KEY_SIZE)
+	{
+		RC4KeyStep(s, i, j, k0);
+		RC4KeyStep(s, i + 1, j, k1);
+		RC4KeyStep(s, i + 2, j, k2);
+		RC4KeyStep(s, i + 3, j, k3);
+		RC4KeyStep(s, i + 4, j, k4);
+		RC4KeyStep(s, i + 5, j, k5);
+		RC4KeyStep(s, i + 6, j, k6);
+		RC4KeyStep(s, i + 7, j, k7);
+	}
+    
+	// BV4 key setup: h and the y table straight from the keystream.
+	i = 0;
+	j = 0;
+	UINT32 h = RC4NextWord(s, i, j);
+	for (UINT32 k = 0; k < BV4_Y_TABLESIZE; ++k)
+		y[k] = RC4NextWord(s, i, j);
+    
+	// BV4Crypt, XORing each keystream word into the buffer a byte at a time.
+	BYTE* p = inputBuf;
+	for (UINT32 words = inputBufBytes >> 2; words > 0; --words, p += 4)
+	{
+		i = (i + 1) & (RC4_TABLESIZE - 1);
+		BYTE tmp = s[i];
+		j = (j + tmp) & (RC4_TABLESIZE - 1);
+		s[i] = s[j];
+		s[j] = tmp;
+		BYTE t = (BYTE)(s[i] + s[j]);
+        
+		UINT32 key = h * s[t];
+		p[0] ^= (BYTE)(key >> 24);
+		p[1] ^= (BYTE)(key >> 16);
+		p[2] ^= (BYTE)(key >> 8);
+		p[3] ^= (BYTE)key;
+        
+		h += y[t & (BV4_Y_TABLESIZE - 1)];
+		s[t] += (BYTE)y[t & (BV4_Y_TABLESIZE - 1)];
+	}
+}
+
 class WordSwapHelper
 {
 public:
@@ -477,6 +596,18 @@ public:
 	/// <returns>"Decrypted" MAC</returns>
 	UINT64 CS64InvertMAC(const BYTE* data, UINT32 dataLength, UINT64 hash) const;
     
+	/// <summary>
+	/// Write the key components and their inverses, big-endian, STATE_SIZE bytes.
+	/// </summary>
+	void Export(BYTE* dest, UINT32 offset) const;
+    
+	/// <summary>
+	/// Load key components written by Export.  Fails unless the multipliers are odd and the inverses match.
+	/// </summary>
+	bool Import(const BYTE* source, UINT32 offset);
+    
+	static const UINT32 STATE_SIZE = 8 * sizeof(UINT32);
+    
 private:
     
 	/// <summary>
@@ -564,6 +695,46 @@ void CS64Key::Init(UINT64 inHash, UINT32 key1, UINT32 key2, UINT32 key3)
 	_invE = ModInvert32_32(_e);
 }
 
+/// <summary>
+/// Write the key components and their inverses, big-endian.
+/// </summary>
+void CS64Key::Export(BYTE* dest, UINT32 offset) const
+{
+	const UINT32 words[] = { _a, _b, _c, _d, _e, _invA, _invC, _invE };
+    
+	for (UINT32 i = 0; i < sizeof(words) / sizeof(words[0]); ++i)
+		Utils::WriteUInt32(words[i], dest, offset + i * sizeof(UINT32));
+}
+
+/// <summary>
+/// Load key components written by Export.
+/// </summary>
+bool CS64Key::Import(const BYTE* source, UINT32 offset)
+{
+	UINT32 words[8];
+    
+	for (UINT32 i = 0; i < sizeof(words) / sizeof(words[0]); ++i)
+		words[i] = Utils::ReadUInt32(source, offset + i * sizeof(UINT32));
+    
+	// Init only ever produces odd multipliers, and the inverses are what decrypt relies on.
+	if ((words[0] & words[1] & words[2] & words[3] & words[4] & 1) == 0)
+		return false;
+	if (words[0] * words[5] != 1 || words[2] * words[6] != 1 || words[4] * words[7] != 1)
+		return false;
+    
+	_a = words[0];
+	_b = words[1];
+	_c = words[2];
+	_d = words[3];
+	_e = words[4];
+    
+	_invA = words[5];
+	_invC = words[6];
+	_invE = words[7];
+    
+	return true;
+}
+
 /// <summary>
 /// Invert chain-&-sum computation.
 ///   Limitations:
@@ -824,7 +995,7 @@ UINT64 MACHelper::CS64_Modular(UINT64 inHash, UINT32 keyC, UINT32 keyD, UINT32 k
 	return Utils::MakeUInt64(Utils::Lo(sum), Utils::Lo(mac));
 }
 
-class CSParve64
+class alignas(CSPARVE64_CACHE_LINE_SIZE) CSParve64 : public CacheAligned
 {
 public:
     
@@ -872,10 +1043,24 @@ public:
 	/// <returns>success</returns>
 	static CSPARVE64_RESULT CSH64_ParveCombined(Context* context, const BYTE* inputKey, const BYTE* data, UINT32 length, UINT64* hash);
     
+	/// <summary>
+	/// Recreate a helper from the state written by Export, without computing the initial hash again.
+	/// Returns NULL if the state is malformed or was not created with the given keys.
+	/// </summary>
+	static CSParve64* Import(const BYTE* sbox, UINT32 key1, UINT32 key2, UINT32 key3, const BYTE* state);
+    
+	/// <summary>
+	/// Write the derived state: C&S key, Parve key and initial hash.  CSPARVE64_INSTANCE_STATE_SIZE bytes.
+	/// </summary>
+	void Export(BYTE* state) const;
+    
 	UINT64 Hash; // generated when computing CsKey, so cached here.
+	UINT32 SmallMessageSize; // messages at most this long use BV4CryptSmall; set from the context.
     
 private:
     
+	CSParve64(const BYTE* sbox, UINT32 inKey1, UINT32 inKey2, UINT32 inKey3);
+    
 	UINT64 CS64Hash(const BYTE* inText, UINT32 inTextLength);
     
 	UINT32 C;
@@ -898,6 +1083,62 @@ CSParve64::CSParve64(const BYTE* parveKey, const BYTE* sbox, UINT32 inKey1, UINT
 	// US Patent No. 6,128,737 [Claims 1-5, 8-13]
 	// US Patent No. 5,956,405 [Claims 1-3, 5-8, 26]
 	Hash = CSParve64::CS64Hash(data, dataLength);
+	SmallMessageSize = CS64Defs::SMALL_MESSAGE_SIZE;
+}
+
+CSParve64::CSParve64(const BYTE* sbox, UINT32 inKey1, UINT32 inKey2, UINT32 inKey3)
+{
+	memset(ParveKey, 0, CS64Defs::KEY_SIZE);
+	memcpy_s(SBox, CS64Defs::SBOX_SIZE, sbox, CS64Defs::SBOX_SIZE);
+    
+	C = inKey1 | 1; // make odd
+	D = inKey2 | 1; // make odd
+	E = inKey3 | 1; // make odd
+    
+	Hash = 0;
+	SmallMessageSize = CS64Defs::SMALL_MESSAGE_SIZE;
+}
+
+// Instance state layout, big-endian:
+//   [4 magic][4 C][4 D][4 E][32 CsKey][8 ParveKey][8 Hash]
+static const UINT32 CSPARVE64_STATE_MAGIC = 0x43533634; // "CS64"
+
+void CSParve64::Export(BYTE* state) const
+{
+	UINT32 offset = 0;
+    
+	Utils::WriteUInt32(CSPARVE64_STATE_MAGIC, state, offset);
+	Utils::WriteUInt32(C, state, offset += 4);
+	Utils::WriteUInt32(D, state, offset += 4);
+	Utils::WriteUInt32(E, state, offset += 4);
+	CsKey.Export(state, offset += 4);
+	memcpy(state + (offset += CS64Key::STATE_SIZE), ParveKey, CS64Defs::KEY_SIZE);
+	Utils::WriteUInt64(Hash, state, offset += CS64Defs::KEY_SIZE);
+}
+
+CSParve64* CSParve64::Import(const BYTE* sbox, UINT32 key1, UINT32 key2, UINT32 key3, const BYTE* state)
+{
+	UINT32 offset = 0;
+    
+	if (Utils::ReadUInt32(state, offset) != CSPARVE64_STATE_MAGIC)
+		return NULL;
+    
+	CSParve64* cs64 = new CSParve64(sbox, key1, key2, key3);
+    
+	// C, D and E come from the context; state from another configuration would decrypt garbage.
+	if (Utils::ReadUInt32(state, offset += 4) != cs64->C
+		|| Utils::ReadUInt32(state, offset += 4) != cs64->D
+		|| Utils::ReadUInt32(state, offset += 4) != cs64->E
+		|| !cs64->CsKey.Import(state, offset += 4))
+	{
+		delete cs64;
+		return NULL;
+	}
+    
+	memcpy(cs64->ParveKey, state + (offset += CS64Key::STATE_SIZE), CS64Defs::KEY_SIZE);
+	cs64->Hash = Utils::ReadUInt64(state, offset += CS64Defs::KEY_SIZE);
+    
+	return cs64;
 }
 
 /// <summary>
@@ -925,13 +1166,17 @@ CSPARVE64_RESULT CSParve64::Encrypt(BYTE* data, UINT32 length, UINT64* mac)
 	// Encrypt the last two blocks (pre-MAC) with Parve to create the MAC.
 	MACHelper::ParveEncryptBlock(ParveKey, SBox, data + MACOffset);
     
-	// Generate BV4 key from the encrypted MAC.
-    
+	// Generate BV4 key from the encrypted MAC, and encrypt all but the last two blocks with BV4.
 	// Normally the BV4 key would be generated from the pre-MAC.
-	BV4Key bv4Key(data, MACOffset, MACLength);
-    
-	// Encrypt all but the last two blocks with BV4.
-	bv4Key.BV4Crypt(MACOffset, data);
+	if (length <= SmallMessageSize)
+	{
+		BV4Key::BV4CryptSmall(data + MACOffset, MACOffset, data);
+	}
+	else
+	{
+		BV4Key bv4Key(data, MACOffset, MACLength);
+		bv4Key.BV4Crypt(MACOffset, data);
+	}
     
 	return CSPARVE64_OK;
 }
@@ -952,11 +1197,16 @@ CSPARVE64_RESULT CSParve64::Decrypt(BYTE*  data, UINT32 length, UINT64* mac)
 	UINT32 MACLength = 2 * CS64Defs::CS_BLOCK_SIZE;
 	UINT32 MACOffset = length - 2 * CS64Defs::CS_BLOCK_SIZE;
     
-	// Generate BV4 key from the encrypted MAC.
-	BV4Key bv4Key(data, MACOffset, MACLength);
-    
-	// Decrypt all but the last two blocks with BV4.
-	bv4Key.BV4Crypt(MACOffset, data);
+	// Generate BV4 key from the encrypted MAC, and decrypt all but the last two blocks with BV4.
+	if (length <= SmallMessageSize)
+	{
+		BV4Key::BV4CryptSmall(data + MACOffset, MACOffset, data);
+	}
+	else
+	{
+		BV4Key bv4Key(data, MACOffset, MACLength);
+		bv4Key.BV4Crypt(MACOffset, data);
+	}
     
 	// Decrypt the last two blocks (MAC) with Parve to retrieve the C&S pre-MAC.
 	MACHelper::ParveDecryptBlock(ParveKey, SBox, data + MACOffset);
@@ -1071,6 +1321,7 @@ Context::Context(const UINT32* config20, const BYTE* sbox)
 	// Note: the "| 1" is to ensure the numbers are odd.
     
 	Flags = config20[i++];
+	SmallMessageSize = CS64Defs::SMALL_MESSAGE_SIZE;
     
 	// keys for hash
 	Key1 = config20[i++] | 1;
@@ -1166,6 +1417,7 @@ CSPARVE64_API CSPARVE64_RESULT CSParve64_Create(void* context, const BYTE* input
 	Context* authContext = reinterpret_cast<Context*>(context);
     
 	CSParve64* cs64 = new CSParve64(inputKey8, authContext->SBox, authContext->Key1, authContext->Key2, authContext->Key3, data, dataLength);
+	cs64->SmallMessageSize = authContext->SmallMessageSize;
     
 	*auth = reinterpret_cast<void*>(cs64);
     
@@ -1190,6 +1442,52 @@ CSPARVE64_API CSPARVE64_RESULT CSParve64_Destroy(void* auth)
 	return CSPARVE64_OK;
 }
 
+/// <summary>
+/// Save the state derived by CSParve64_Create.
+/// </summary>
+/// <param name="state">buffer of stateLength bytes, at least CSPARVE64_INSTANCE_STATE_SIZE</param>
+CSPARVE64_API CSPARVE64_RESULT CSParve64_ExportInstance(void* auth, BYTE* state, UINT32 stateLength)
+{
+	if (NULL == auth)
+		return CSPARVE64_FAIL;
+    
+	if (!state || stateLength < CSPARVE64_INSTANCE_STATE_SIZE)
+		return CSPARVE64_FAIL;
+    
+	CSParve64* cs64 = reinterpret_cast<CSParve64*>(auth);
+    
+	cs64->Export(state);
+    
+	return CSPARVE64_OK;
+}
+
+/// <summary>
+/// Recreate an instance from CSParve64_ExportInstance state, as if CSParve64_Create had been called again
+/// with the same context, key and data.
+/// </summary>
+CSPARVE64_API CSPARVE64_RESULT CSParve64_ImportInstance(void* context, const BYTE* state, UINT32 stateLength, UINT32* hiHash, UINT32* loHash, void** auth)
+{
+	if (!context)
+		return CSPARVE64_FAIL;
+    
+	if (!state || stateLength < CSPARVE64_INSTANCE_STATE_SIZE)
+		return CSPARVE64_FAIL;
+    
+	Context* authContext = reinterpret_cast<Context*>(context);
+    
+	CSParve64* cs64 = CSParve64::Import(authContext->SBox, authContext->Key1, authContext->Key2, authContext->Key3, state);
+	if (!cs64)
+		return CSPARVE64_FAIL;
+	cs64->SmallMessageSize = authContext->SmallMessageSize;
+    
+	*auth = reinterpret_cast<void*>(cs64);
+    
+	*hiHash = Utils::Hi(cs64->Hash);
+	*loHash = Utils::Lo(cs64->Hash);
+    
+	return CSPARVE64_OK;
+}
+
 /// <summary>
 /// Encrypt a BYTE array.
 /// </summary>
@@ -1277,3 +1575,19 @@ CSPARVE64_API CSPARVE64_RESULT CSParve64_ComputeHash(void* context, const BYTE*
     
 	return CSPARVE64_OK;
 }
+
+/// <summary>
+/// Set the longest message that instances created from the context afterwards put through the
+/// small-message path.  Both paths produce the same output.
+/// </summary>
+CSPARVE64_API CSPARVE64_RESULT CSParve64_SetSmallMessageSize(void* context, UINT32 size)
+{
+	if (!context)
+		return CSPARVE64_FAIL;
+    
+	Context* authContext = reinterpret_cast<Context*>(context);
+    
+	authContext->SmallMessageSize = size;
+    
+	return CSPARVE64_OK;
+}
@@ -16,6 +16,11 @@
  The other 2 32-bit numbers are passed in as an 8-byte array when creating a specific instance for hashing/encryption/decryption.
  The 3 32-bit keys, sBox, and word-swap factors could be unique for different purposes.
  The 8-byte 'instance' key could represent a particular identity.
+ Once a context has been set up (CSParve64_SetSmallMessageSize), contexts and instances are not modified, so any
+ number of threads may share them.
+ Each is allocated on cache lines of its own (CSPARVE64_CACHE_LINE_SIZE, CacheAligned.h), so that a thread
+ writing whatever the heap puts next to one does not take those lines from the threads reading it.  That is
+ all it does for scaling: the callers' own shared state, such as sequence windows, needs the same care.
  */
 
 #ifndef CSPARVE64_H
@@ -26,7 +31,7 @@
 // Any project whose source files include this file see CSPARVE64_API functions as being imported from a DLL,
 // whereas this DLL sees symbols defined with this macro as being exported.
 
-#ifndef __APPLE__
+#ifdef _WIN32
 
 #ifdef CSPARVE64_EXPORTS
 #define CSPARVE64_API __declspec(dllexport)
@@ -56,6 +61,16 @@ typedef long          CSPARVE64_RESULT;
 #define	CSPARVE64_OK	0L
 #define	CSPARVE64_FAIL	-1L
 
+#define CSPARVE64_INSTANCE_STATE_SIZE 64    // bytes written by CSParve64_ExportInstance
+
+#ifndef CSPARVE64_SMALL_MESSAGE_SIZE
+#define CSPARVE64_SMALL_MESSAGE_SIZE 56     // default for CSParve64_SetSmallMessageSize
+#endif
+
+#ifndef CSPARVE64_CACHE_LINE_SIZE
+#define CSPARVE64_CACHE_LINE_SIZE 64        // alignment of contexts and instances
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -95,6 +110,27 @@ extern "C" {
     /// </summary>
     CSPARVE64_API CSPARVE64_RESULT CSParve64_Destroy(void* instance);
     
+    /// <summary>
+    /// Save the state an instance derived when it was created: the C&S key and its inverses, the Parve key
+    /// and the initial hash.  The state contains the instance key, so it must be stored as carefully.
+    /// </summary>
+    /// <param name="instance">instance from CSParve64_Create or CSParve64_ImportInstance</param>
+    /// <param name="state">buffer to receive CSPARVE64_INSTANCE_STATE_SIZE bytes</param>
+    /// <param name="stateLength">size of the state buffer</param>
+    CSPARVE64_API CSPARVE64_RESULT CSParve64_ExportInstance(void* instance, BYTE* state, UINT32 stateLength);
+    
+    /// <summary>
+    /// Recreate an instance from saved state without repeating the key derivation done by CSParve64_Create.
+    /// The context must have the same configuration and sbox as the one the instance was created from.
+    /// </summary>
+    /// <param name="context">context reference</param>
+    /// <param name="state">state written by CSParve64_ExportInstance</param>
+    /// <param name="stateLength">size of the state, at least CSPARVE64_INSTANCE_STATE_SIZE</param>
+    /// <param name="hiHash">pointer to 32 MSB of hash computed for the context</param>
+    /// <param name="loHash">pointer to 32 LSB of hash computed for the context</param>
+    /// <param name="instance">pointer to receive the instance.</param>
+    CSPARVE64_API CSPARVE64_RESULT CSParve64_ImportInstance(void* context, const BYTE* state, UINT32 stateLength, UINT32* hiHash, UINT32* loHash, void** instance);
+    
     /// <summary>
     /// Encrypt a byte array.
     /// </summary>
@@ -124,6 +160,15 @@ extern "C" {
     /// <returns>success</returns>
     CSPARVE64_API CSPARVE64_RESULT CSParve64_ComputeHash(void* context, const BYTE* inputKey, const BYTE* data, UINT32 dataLength, UINT32* hi, UINT32* lo);
     
+    /// <summary>
+    /// Encode and Decode key the BV4 stream of messages up to size bytes in a single pass.  The output is
+    /// the same either way; 0 turns the small-message path off, for benchmarks and verification.
+    /// Instances take the size when they are created or imported, so set it before creating any, and before
+    /// the context is shared with other threads: it is the only call that modifies a context.
+    /// </summary>
+    /// <param name="size">longest message to take the small-message path, CSPARVE64_SMALL_MESSAGE_SIZE by default</param>
+    CSPARVE64_API CSPARVE64_RESULT CSParve64_SetSmallMessageSize(void* context, UINT32 size);
+    
 #ifdef __cplusplus
 } // used by C++ source code
 #endif
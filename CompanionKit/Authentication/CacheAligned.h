@@ -0,0 +1,62 @@
+//--------------------------------------------------------------------------
+// <copyright file="CacheAligned.h" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// A base for heap objects that threads share, allocated on whole cache lines.
+// </summary>
+//--------------------------------------------------------------------------
+
+/*
+ Using CacheAligned:
+ Before C++17, new ignores alignas on the class and returns memory aligned for the largest scalar only, so
+ the first and last line of an object could hold some other object that another thread writes.  A class
+ that derives from CacheAligned and is declared alignas(CSPARVE64_CACHE_LINE_SIZE) is given lines of its
+ own, however it is created:
+
+    class alignas(CSPARVE64_CACHE_LINE_SIZE) Shared : public CacheAligned { ... };
+
+ Members written by different threads still need lines of their own within the object.
+ */
+
+#ifndef CACHEALIGNED_H
+#define CACHEALIGNED_H
+
+#include "CSParve64.h"
+
+#include <new>
+#include <stddef.h>
+#include <stdlib.h>
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+class CacheAligned
+{
+public:
+
+	static void* operator new(size_t size)
+	{
+		void* memory = NULL;
+#ifdef _WIN32
+		memory = _aligned_malloc(size, CSPARVE64_CACHE_LINE_SIZE);
+#else
+		if (posix_memalign(&memory, CSPARVE64_CACHE_LINE_SIZE, size) != 0)
+			memory = NULL;
+#endif
+		if (memory == NULL)
+			throw std::bad_alloc();
+		return memory;
+	}
+
+	static void operator delete(void* memory)
+	{
+#ifdef _WIN32
+		_aligned_free(memory);
+#else
+		free(memory);
+#endif
+	}
+};
+
+#endif
@@ -0,0 +1,367 @@
+//--------------------------------------------------------------------------
+// <copyright file="ChunkedFrame.cpp" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// Chunked companion framing for large payloads.
+// </summary>
+//--------------------------------------------------------------------------
+
+#include "ChunkedFrame.h"
+
+#include <string.h>
+
+//------------------------------------------------------------------------------------------------------
+
+// Helper functions.
+
+static void UInt32ToBytes(UINT32 n, BYTE* data)
+{
+	data[0] = (BYTE)(n >> 24);
+	data[1] = (BYTE)(n >> 16);
+	data[2] = (BYTE)(n >> 8);
+	data[3] = (BYTE)(n);
+}
+
+static UINT32 BytesToUInt32(const BYTE* data)
+{
+	return ((UINT32)data[0] << 24) | ((UINT32)data[1] << 16) | ((UINT32)data[2] << 8) | (UINT32)data[3];
+}
+
+//------------------------------------------------------------------------------------------------------
+
+ChunkedFrameWriter::ChunkedFrameWriter(const CompanionCodec& codec, UINT32 streamId, UINT32 chunkSize)
+	: _codec(codec), _streamId(streamId), _chunkSize(chunkSize)
+{
+	if (_chunkSize == 0)
+		_chunkSize = COMPANION_CHUNK_DEFAULT_SIZE;
+	if (_chunkSize > COMPANION_CHUNK_MAX_SIZE)
+		_chunkSize = COMPANION_CHUNK_MAX_SIZE;
+}
+
+UINT32 ChunkedFrameWriter::FrameLength(UINT32 payloadLength)
+{
+	return COMPANION_CHUNK_PREFIX_SIZE + ((COMPANION_CHUNK_HEADER_SIZE + payloadLength + COMPANION_HASH_SIZE + 0x07) & ~0x07);
+}
+
+UINT32 ChunkedFrameWriter::ChunkCount(size_t length) const
+{
+	if (length == 0)
+		return 1;
+	return (UINT32)((length + _chunkSize - 1) / _chunkSize);
+}
+
+size_t ChunkedFrameWriter::EncodedLength(size_t length) const
+{
+	UINT32 count = ChunkCount(length);
+	size_t lastLength = length - (size_t)(count - 1) * _chunkSize;
+	return (size_t)(count - 1) * FrameLength(_chunkSize) + FrameLength((UINT32)lastLength);
+}
+
+COMPANION_RESULT ChunkedFrameWriter::EncodeChunk(UINT32 index, const BYTE* payload, UINT32 payloadLength, bool last, BYTE* frame) const
+{
+	if (payloadLength > COMPANION_CHUNK_MAX_SIZE)
+		return COMPANION_FAIL;
+
+	UINT32 blockLength = FrameLength(payloadLength) - COMPANION_CHUNK_PREFIX_SIZE;
+	UInt32ToBytes(blockLength, frame);
+
+	BYTE* block = frame + COMPANION_CHUNK_PREFIX_SIZE;
+	UInt32ToBytes(COMPANION_CHUNK_MAGIC, block);
+	UInt32ToBytes(_streamId, block + 4);
+	UInt32ToBytes(index, block + 8);
+	UInt32ToBytes(payloadLength | (last ? COMPANION_CHUNK_LAST : 0), block + 12);
+	if (payloadLength != 0)
+		memcpy(block + COMPANION_CHUNK_HEADER_SIZE, payload, payloadLength);
+	memset(block + COMPANION_CHUNK_HEADER_SIZE + payloadLength, 0, blockLength - COMPANION_CHUNK_HEADER_SIZE - payloadLength - COMPANION_HASH_SIZE);
+
+	UINT64 contextHash = _codec.ContextHash();
+	UInt32ToBytes((UINT32)(contextHash >> 32), block + blockLength - COMPANION_HASH_SIZE);
+	UInt32ToBytes((UINT32)contextHash, block + blockLength - 4);
+
+	return _codec.EncodeBlock(block, blockLength);
+}
+
+COMPANION_RESULT ChunkedFrameWriter::Encode(const BYTE* data, size_t length, std::vector<BYTE>* stream, CompanionWorkerPool* pool) const
+{
+	UINT32 count = ChunkCount(length);
+	UINT32 fullFrame = FrameLength(_chunkSize);
+	stream->resize(EncodedLength(length));
+	BYTE* out = &(*stream)[0];
+
+	// Every chunk but the last is full, so chunk i always starts at i * fullFrame.
+	auto encodeRange = [this, data, length, count, fullFrame, out](UINT32 first, UINT32 end) -> COMPANION_RESULT
+	{
+		for (UINT32 i = first; i < end; ++i)
+		{
+			size_t offset = (size_t)i * _chunkSize;
+			UINT32 chunkLength = (UINT32)(i + 1 < count ? _chunkSize : length - offset);
+			COMPANION_RESULT result = EncodeChunk(i, data + offset, chunkLength, i + 1 == count, out + (size_t)i * fullFrame);
+			if (result != COMPANION_OK)
+				return result;
+		}
+		return COMPANION_OK;
+	};
+
+	if (pool == NULL || pool->Size() < 2 || count < 2)
+		return encodeRange(0, count);
+
+	// A few batches per worker keeps the pool busy without a task per chunk.
+	UINT32 batches = pool->Size() * 4;
+	if (batches > count)
+		batches = count;
+	UINT32 perBatch = (count + batches - 1) / batches;
+
+	std::mutex lock;
+	std::condition_variable finished;
+	UINT32 remaining = 0;
+	COMPANION_RESULT result = COMPANION_OK;
+
+	for (UINT32 first = 0; first < count; first += perBatch)
+	{
+		UINT32 end = first + perBatch < count ? first + perBatch : count;
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			++remaining;
+		}
+		pool->Post([&, first, end]()
+		{
+			COMPANION_RESULT batchResult = encodeRange(first, end);
+			std::lock_guard<std::mutex> guard(lock);
+			if (batchResult != COMPANION_OK)
+				result = batchResult;
+			if (--remaining == 0)
+				finished.notify_all();
+		});
+	}
+
+	std::unique_lock<std::mutex> guard(lock);
+	while (remaining != 0)
+		finished.wait(guard);
+	return result;
+}
+
+//------------------------------------------------------------------------------------------------------
+
+ChunkedFrameReader::ChunkedFrameReader(const CompanionCodec& codec, UINT32 streamId, ChunkHandler handler, const ChunkedFrameOptions& options)
+	: _codec(codec), _streamId(streamId), _handler(handler), _options(options), _prefixFill(0), _frameLength(0),
+	  _nextSubmit(0), _nextDeliver(0), _complete(false), _error(COMPANION_OK), _buffered(0), _peakBuffered(0)
+{
+	if (_options.MaxPendingChunks == 0)
+		_options.MaxPendingChunks = 1;
+	if (_options.MaxChunkSize == 0 || _options.MaxChunkSize > COMPANION_CHUNK_MAX_SIZE)
+		_options.MaxChunkSize = COMPANION_CHUNK_MAX_SIZE;
+	memset(_prefix, 0, sizeof(_prefix));
+}
+
+ChunkedFrameReader::ChunkedFrameReader(const std::shared_ptr<const CompanionCodec>& codec, UINT32 streamId, ChunkHandler handler, const ChunkedFrameOptions& options)
+	: ChunkedFrameReader(*codec, streamId, handler, options)
+{
+	_codecOwner = codec;
+}
+
+ChunkedFrameReader::~ChunkedFrameReader()
+{
+	// Workers hold references into _window until they mark their job done.
+	std::unique_lock<std::mutex> guard(_lock);
+	for (size_t i = 0; i < _window.size(); ++i)
+	{
+		while (!_window[i]->Done)
+			_decoded.wait(guard);
+	}
+}
+
+COMPANION_RESULT ChunkedFrameReader::Feed(const BYTE* data, size_t length)
+{
+	if (_error != COMPANION_OK)
+		return _error;
+
+	while (length > 0)
+	{
+		if (_prefixFill < COMPANION_CHUNK_PREFIX_SIZE)
+		{
+			size_t take = COMPANION_CHUNK_PREFIX_SIZE - _prefixFill;
+			if (take > length)
+				take = length;
+			memcpy(_prefix + _prefixFill, data, take);
+			_prefixFill += (UINT32)take;
+			data += take;
+			length -= take;
+			if (_prefixFill < COMPANION_CHUNK_PREFIX_SIZE)
+				break;
+
+			// Nothing may follow the last chunk, and a frame can never be larger than the biggest chunk.
+			_frameLength = BytesToUInt32(_prefix);
+			if (_complete
+				|| _frameLength < COMPANION_CHUNK_HEADER_SIZE + COMPANION_HASH_SIZE
+				|| (_frameLength & 0x07) != 0
+				|| _frameLength > ChunkedFrameWriter::FrameLength(_options.MaxChunkSize) - COMPANION_CHUNK_PREFIX_SIZE)
+				return Fail(COMPANION_E_FORMAT);
+
+			if (!_free.empty())
+			{
+				_current = std::move(_free.back());
+				_free.pop_back();
+			}
+			else
+			{
+				_current.reset(new Job());
+			}
+			_current->Frame.clear();
+			_current->Frame.reserve(_frameLength);
+
+			_buffered += _frameLength;
+			if (_buffered > _peakBuffered)
+				_peakBuffered = _buffered;
+		}
+
+		size_t take = _frameLength - _current->Frame.size();
+		if (take > length)
+			take = length;
+		_current->Frame.insert(_current->Frame.end(), data, data + take);
+		data += take;
+		length -= take;
+
+		if (_current->Frame.size() == _frameLength)
+		{
+			_prefixFill = 0;
+			Submit();
+			if (_error != COMPANION_OK)
+				return _error;
+		}
+	}
+
+	return Deliver(false);
+}
+
+COMPANION_RESULT ChunkedFrameReader::Finish()
+{
+	if (_error != COMPANION_OK)
+		return _error;
+
+	if (_prefixFill != 0)
+		return Fail(COMPANION_E_FORMAT);
+
+	while (!_window.empty())
+	{
+		COMPANION_RESULT result = Deliver(true);
+		if (result != COMPANION_OK)
+			return result;
+	}
+
+	if (!_complete)
+		return Fail(COMPANION_E_FORMAT);
+	return COMPANION_OK;
+}
+
+COMPANION_RESULT ChunkedFrameReader::Poll()
+{
+	if (_error != COMPANION_OK)
+		return _error;
+	return Deliver(false);
+}
+
+void ChunkedFrameReader::Submit()
+{
+	// Bound memory: wait for the oldest chunk before taking on another, unless the caller stops reading
+	// instead.  Then the window can only run over by what one Feed brings.
+	while (!_options.Decoded && _window.size() >= _options.MaxPendingChunks)
+	{
+		if (Deliver(true) != COMPANION_OK)
+			return;
+	}
+
+	std::unique_ptr<Job> job = std::move(_current);
+	job->Index = _nextSubmit++;
+	job->Done = false;
+	Job* ref = job.get();
+	_window.push_back(std::move(job));
+
+	if (_options.Pool == NULL)
+	{
+		DecodeJob(*ref);
+		ref->Done = true;
+		return;
+	}
+
+	_options.Pool->Post([this, ref]()
+	{
+		DecodeJob(*ref);
+		std::lock_guard<std::mutex> guard(_lock);
+		ref->Done = true;
+		// Under the lock, or the destructor could return, and free Decoded, as it runs.
+		if (_options.Decoded)
+			_options.Decoded();
+		_decoded.notify_all();
+	});
+}
+
+void ChunkedFrameReader::DecodeJob(Job& job) const
+{
+	job.PayloadLength = 0;
+	job.Last = false;
+
+	UINT32 blockLength = (UINT32)job.Frame.size();
+	BYTE* block = &job.Frame[0];
+
+	job.Result = _codec.DecodeBlock(block, blockLength);
+	if (job.Result != COMPANION_OK)
+		return;
+
+	UINT32 lengthField = BytesToUInt32(block + 12);
+	UINT32 payloadLength = lengthField & ~COMPANION_CHUNK_LAST;
+
+	if (BytesToUInt32(block) != COMPANION_CHUNK_MAGIC
+		|| BytesToUInt32(block + 4) != _streamId
+		|| BytesToUInt32(block + 8) != job.Index
+		|| payloadLength > blockLength - COMPANION_CHUNK_HEADER_SIZE - COMPANION_HASH_SIZE)
+	{
+		job.Result = COMPANION_E_FORMAT;
+		return;
+	}
+
+	job.PayloadLength = payloadLength;
+	job.Last = (lengthField & COMPANION_CHUNK_LAST) != 0;
+}
+
+COMPANION_RESULT ChunkedFrameReader::Deliver(bool wait)
+{
+	while (!_window.empty())
+	{
+		Job& front = *_window.front();
+		{
+			std::unique_lock<std::mutex> guard(_lock);
+			if (!front.Done && !wait)
+				return COMPANION_OK;
+			while (!front.Done)
+				_decoded.wait(guard);
+		}
+		wait = false;
+
+		COMPANION_RESULT result = front.Result;
+		if (result == COMPANION_OK && _complete)
+			result = COMPANION_E_FORMAT;
+		if (result == COMPANION_OK)
+			result = _handler(front.Index, &front.Frame[COMPANION_CHUNK_HEADER_SIZE], front.PayloadLength, front.Last);
+
+		bool last = front.Last;
+		_buffered -= front.Frame.size();
+		_free.push_back(std::move(_window.front()));
+		_window.pop_front();
+
+		if (result != COMPANION_OK)
+			return Fail(result);
+
+		++_nextDeliver;
+		if (last)
+			_complete = true;
+	}
+	return COMPANION_OK;
+}
+
+COMPANION_RESULT ChunkedFrameReader::Fail(COMPANION_RESULT result)
+{
+	if (_error == COMPANION_OK)
+		_error = result;
+	return _error;
+}
@@ -0,0 +1,193 @@
+//--------------------------------------------------------------------------
+// <copyright file="ChunkedFrame.h" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// Chunked companion framing for large payloads.
+// </summary>
+//--------------------------------------------------------------------------
+
+/*
+ Using chunked frames:
+ CSParve64_Decode needs the whole message and the MAC is in its last 8 bytes, so an ordinary companion body
+ cannot be decoded until all of it has arrived.  In chunked mode a payload is cut into fixed-size chunks and
+ each chunk is encoded on its own.  On the wire a stream is a sequence of frames:
+    [4-byte encoded length][encoded chunk]
+ and each chunk, before encoding, is
+    [4-byte magic][4-byte stream id][4-byte chunk index][4-byte payload length | last flag][payload][zero padding][8-byte context hash]
+ The header is inside the encoded data, so a chunk cannot be moved to another stream or position without
+ failing the check.  The stream id is the request sequence number for companion responses.
+ ChunkedFrameReader decodes frames as they arrive, optionally on a CompanionWorkerPool, and hands payloads
+ to its handler in order.  At most MaxPendingChunks frames are buffered, whatever the size of the stream:
+ Feed waits for the oldest chunk when the window is full.  A caller that must not wait, such as an event
+ loop, sets Decoded instead.  Feed then never blocks; the caller stops reading while IsFull, and when told a
+ chunk is done calls Poll on its own thread and reads on.  Finish is called once IsIdle.
+ */
+
+#ifndef CHUNKEDFRAME_H
+#define CHUNKEDFRAME_H
+
+#include "CompanionCodec.h"
+#include "CompanionWorkerPool.h"
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#define COMPANION_CHUNK_MAGIC               0x4D524346      // "MRCF"
+#define COMPANION_CHUNK_PREFIX_SIZE         4
+#define COMPANION_CHUNK_HEADER_SIZE         16
+#define COMPANION_CHUNK_LAST                0x80000000
+#define COMPANION_CHUNK_DEFAULT_SIZE        (16 * 1024)
+#define COMPANION_CHUNK_MAX_SIZE            (1024 * 1024)
+#define COMPANION_CHUNKED_ENCODING_VALUE    "X-Mediaroom-Companion-Chunked"
+
+class ChunkedFrameWriter
+{
+public:
+
+	ChunkedFrameWriter(const CompanionCodec& codec, UINT32 streamId, UINT32 chunkSize = COMPANION_CHUNK_DEFAULT_SIZE);
+
+	/// <summary>
+	/// Size of one frame, including its length prefix, for a chunk payload of the given length.
+	/// </summary>
+	static UINT32 FrameLength(UINT32 payloadLength);
+
+	/// <summary>
+	/// Number of chunks for a payload.  An empty payload is still sent as one empty last chunk.
+	/// </summary>
+	UINT32 ChunkCount(size_t length) const;
+
+	/// <summary>
+	/// Size of the complete encoded stream.
+	/// </summary>
+	size_t EncodedLength(size_t length) const;
+
+	/// <summary>
+	/// Encode one chunk into frame, which must hold FrameLength(payloadLength) bytes.  Thread-safe.
+	/// </summary>
+	COMPANION_RESULT EncodeChunk(UINT32 index, const BYTE* payload, UINT32 payloadLength, bool last, BYTE* frame) const;
+
+	/// <summary>
+	/// Encode a complete payload.  With a pool the chunks are encoded in parallel.
+	/// </summary>
+	COMPANION_RESULT Encode(const BYTE* data, size_t length, std::vector<BYTE>* stream, CompanionWorkerPool* pool = NULL) const;
+
+	UINT32 ChunkSize() const { return _chunkSize; }
+
+private:
+
+	const CompanionCodec& _codec;
+	UINT32                _streamId;
+	UINT32                _chunkSize;
+};
+
+struct ChunkedFrameOptions
+{
+	UINT32                MaxChunkSize;        // larger frames are rejected before they are buffered
+	UINT32                MaxPendingChunks;    // frames buffered or being decoded; Feed blocks beyond this
+	CompanionWorkerPool*  Pool;                // NULL decodes on the thread calling Feed
+	std::function<void()> Decoded;             // if set, Feed does not block, and this is called on the worker
+	                                           // as each chunk is decoded; only to hand off, under the reader's lock
+
+	ChunkedFrameOptions() : MaxChunkSize(COMPANION_CHUNK_MAX_SIZE), MaxPendingChunks(4), Pool(NULL) {}
+};
+
+class ChunkedFrameReader
+{
+public:
+
+	/// <summary>
+	/// Receives each decoded payload in chunk order.  Anything but COMPANION_OK stops the stream.
+	/// </summary>
+	typedef std::function<COMPANION_RESULT(UINT32 index, const BYTE* payload, UINT32 length, bool last)> ChunkHandler;
+
+	ChunkedFrameReader(const CompanionCodec& codec, UINT32 streamId, ChunkHandler handler, const ChunkedFrameOptions& options = ChunkedFrameOptions());
+
+	/// <summary>
+	/// As above, keeping the codec alive for as long as the reader, which may be destroyed on a pool worker
+	/// after its owner has gone.
+	/// </summary>
+	ChunkedFrameReader(const std::shared_ptr<const CompanionCodec>& codec, UINT32 streamId, ChunkHandler handler, const ChunkedFrameOptions& options = ChunkedFrameOptions());
+
+	/// <summary>
+	/// Waits for chunks still being decoded on the pool.
+	/// </summary>
+	~ChunkedFrameReader();
+
+	/// <summary>
+	/// Consume the next bytes of the stream, in any split.  The handler runs on the calling thread.
+	/// </summary>
+	COMPANION_RESULT Feed(const BYTE* data, size_t length);
+
+	/// <summary>
+	/// The stream has ended.  Delivers the remaining chunks; fails if the last chunk was not seen.
+	/// </summary>
+	COMPANION_RESULT Finish();
+
+	/// <summary>
+	/// Deliver the chunks decoded so far, in order, without waiting for the rest.
+	/// </summary>
+	COMPANION_RESULT Poll();
+
+	/// <summary>
+	/// MaxPendingChunks frames are buffered; with Decoded set, stop feeding until one is delivered.
+	/// </summary>
+	bool IsFull() const { return _window.size() >= _options.MaxPendingChunks; }
+
+	/// <summary>
+	/// No chunk is buffered or being decoded, so Finish will not wait.
+	/// </summary>
+	bool IsIdle() const { return _window.empty(); }
+
+	bool IsComplete() const { return _complete; }
+	UINT32 ChunksDelivered() const { return _nextDeliver; }
+	size_t PeakBufferedBytes() const { return _peakBuffered; }
+
+private:
+
+	ChunkedFrameReader(const ChunkedFrameReader&);
+	ChunkedFrameReader& operator=(const ChunkedFrameReader&);
+
+	struct Job
+	{
+		UINT32            Index;
+		std::vector<BYTE> Frame;
+		COMPANION_RESULT  Result;
+		UINT32            PayloadLength;
+		bool              Last;
+		bool              Done;
+	};
+
+	void Submit();
+	void DecodeJob(Job& job) const;
+	COMPANION_RESULT Deliver(bool wait);
+	COMPANION_RESULT Fail(COMPANION_RESULT result);
+
+	std::shared_ptr<const CompanionCodec> _codecOwner;   // NULL when the caller keeps the codec alive
+	const CompanionCodec&              _codec;
+	UINT32                             _streamId;
+	ChunkHandler                       _handler;
+	ChunkedFrameOptions                _options;
+
+	BYTE                               _prefix[COMPANION_CHUNK_PREFIX_SIZE];
+	UINT32                             _prefixFill;
+	std::unique_ptr<Job>               _current;       // frame being received
+	UINT32                             _frameLength;   // encoded length of _current
+
+	std::mutex                         _lock;
+	std::condition_variable            _decoded;
+	std::deque<std::unique_ptr<Job> >  _window;        // submitted frames in chunk order
+	std::vector<std::unique_ptr<Job> > _free;
+	UINT32                             _nextSubmit;
+	UINT32                             _nextDeliver;
+	bool                               _complete;
+	COMPANION_RESULT                   _error;
+	size_t                             _buffered;
+	size_t                             _peakBuffered;
+};
+
+#endif
@@ -0,0 +1,262 @@
+//--------------------------------------------------------------------------
+// <copyright file="CommandScheduler.cpp" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// Prioritized companion command scheduler with key-repeat coalescing.
+// </summary>
+//--------------------------------------------------------------------------
+
+#include "CommandScheduler.h"
+#include "CompanionCodec.h"
+
+#include <chrono>
+#include <string.h>
+#include <strings.h>
+
+CommandScheduler::CommandScheduler(const CommandSchedulerOptions& options, Sink sink, Wake wake)
+	: _options(options), _sink(sink), _wake(wake), _head(&_stub), _tail(&_stub), _pumpPending(false), _pumping(false),
+	  _outstanding(0), _submitted(0), _dispatched(0), _coalesced(0), _droppedExpired(0), _droppedOverflow(0)
+{
+	if (_options.MaxOutstanding == 0)
+		_options.MaxOutstanding = 1;
+	if (_options.MaxLaneDepth == 0)
+		_options.MaxLaneDepth = 1;
+}
+
+CommandScheduler::~CommandScheduler()
+{
+	Node* node;
+	while ((node = Pop()) != NULL)
+		delete node;
+}
+
+void CommandScheduler::Submit(const std::string& request, CommandPriority priority, bool repeatable, UINT32 deadlineMs)
+{
+	if (priority >= CommandPriorityCount)
+		priority = CommandPriorityBackground;
+	if (deadlineMs == 0)
+		deadlineMs = _options.DefaultDeadlineMs;
+
+	Node* node = new Node();
+	node->Item.Request = request;
+	node->Item.Priority = priority;
+	node->Item.Repeatable = repeatable;
+	node->Item.Idempotent = CompanionCodec::IsIdempotent(request);
+	node->Item.EnqueuedUs = NowUs();
+	node->Item.DeadlineUs = deadlineMs != 0 ? node->Item.EnqueuedUs + (UINT64)deadlineMs * 1000 : 0;
+
+	_submitted.fetch_add(1, std::memory_order_relaxed);
+	Push(node);
+
+	// Only the first submission after a Pump started needs to wake the consumer.
+	if (!_pumpPending.exchange(true) && _wake)
+		_wake();
+}
+
+void CommandScheduler::Submit(const std::string& request)
+{
+	bool repeatable = false;
+	CommandPriority priority = Classify(request, &repeatable);
+	Submit(request, priority, repeatable);
+}
+
+void CommandScheduler::Pump()
+{
+	_pumping = true;
+	_pumpPending.store(false);
+
+	Node* node;
+	while ((node = Pop()) != NULL)
+	{
+		Admit(node->Item);
+		delete node;
+	}
+
+	Expire(NowUs());
+
+	// The sink may call Completed from inside this loop, which only frees a slot.
+	while (_outstanding < _options.MaxOutstanding)
+	{
+		std::deque<Command>* lane = NULL;
+		for (int i = 0; i < CommandPriorityCount; ++i)
+		{
+			if (!_lanes[i].empty())
+			{
+				lane = &_lanes[i];
+				break;
+			}
+		}
+		if (lane == NULL)
+			break;
+
+		Command command = lane->front();
+		lane->pop_front();
+
+		++_outstanding;
+		_dispatched.fetch_add(1, std::memory_order_relaxed);
+		_sink(command);
+	}
+
+	_pumping = false;
+}
+
+void CommandScheduler::Completed()
+{
+	if (_outstanding > 0)
+		--_outstanding;
+
+	if (!_pumping)
+		Pump();
+}
+
+CommandSchedulerStats CommandScheduler::Stats() const
+{
+	CommandSchedulerStats stats;
+	stats.Submitted = _submitted.load(std::memory_order_relaxed);
+	stats.Dispatched = _dispatched.load(std::memory_order_relaxed);
+	stats.Coalesced = _coalesced.load(std::memory_order_relaxed);
+	stats.DroppedExpired = _droppedExpired.load(std::memory_order_relaxed);
+	stats.DroppedOverflow = _droppedOverflow.load(std::memory_order_relaxed);
+
+	UINT64 gone = stats.Dispatched + stats.Coalesced + stats.DroppedExpired + stats.DroppedOverflow;
+	stats.QueueDepth = stats.Submitted > gone ? (UINT32)(stats.Submitted - gone) : 0;
+	stats.Outstanding = _outstanding;
+	return stats;
+}
+
+CommandPriority CommandScheduler::Classify(const std::string& request, bool* repeatable)
+{
+	// Only keys that are held down to step a value repeat; every other press means something on its own.
+	static const char* const critical[] = { "power", "stop", NULL };
+	static const char* const transport[] = { "play", "pause", "rec", "fwd", "rew", "skip", "replay", NULL };
+	static const char* const repeating[] = { "volup", "voldown", "chup", "chdown", NULL };
+
+	if (repeatable != NULL)
+		*repeatable = false;
+
+	const char* text = request.c_str();
+	if (strncasecmp(text, "op=key", 6) != 0 || (text[6] != '&' && text[6] != '\0'))
+		return CommandPriorityNavigation;
+
+	const char* key = strstr(text, "&k=");
+	if (key == NULL)
+		return CommandPriorityNavigation;
+	key += 3;
+	size_t keyLength = strcspn(key, "&");
+
+	CommandPriority priority = CommandPriorityNavigation;
+	for (int i = 0; critical[i] != NULL && priority == CommandPriorityNavigation; ++i)
+	{
+		if (strlen(critical[i]) == keyLength && strncasecmp(key, critical[i], keyLength) == 0)
+			priority = CommandPriorityCritical;
+	}
+	for (int i = 0; transport[i] != NULL && priority == CommandPriorityNavigation; ++i)
+	{
+		if (strlen(transport[i]) == keyLength && strncasecmp(key, transport[i], keyLength) == 0)
+			priority = CommandPriorityTransport;
+	}
+
+	bool repeats = false;
+	for (int i = 0; repeating[i] != NULL && !repeats; ++i)
+		repeats = strlen(repeating[i]) == keyLength && strncasecmp(key, repeating[i], keyLength) == 0;
+
+	if (repeatable != NULL)
+		*repeatable = repeats;
+	return priority;
+}
+
+UINT64 CommandScheduler::NowUs()
+{
+	return (UINT64)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void CommandScheduler::Push(Node* node)
+{
+	node->Next.store(NULL, std::memory_order_relaxed);
+	Node* prev = _head.exchange(node, std::memory_order_acq_rel);
+	prev->Next.store(node, std::memory_order_release);
+}
+
+CommandScheduler::Node* CommandScheduler::Pop()
+{
+	Node* tail = _tail;
+	Node* next = tail->Next.load(std::memory_order_acquire);
+
+	if (tail == &_stub)
+	{
+		if (next == NULL)
+			return NULL;
+		_tail = next;
+		tail = next;
+		next = next->Next.load(std::memory_order_acquire);
+	}
+
+	if (next != NULL)
+	{
+		_tail = next;
+		return tail;
+	}
+
+	// A producer has exchanged the head but not linked it yet; it will wake us again once it has.
+	if (tail != _head.load(std::memory_order_acquire))
+		return NULL;
+
+	Push(&_stub);
+
+	next = tail->Next.load(std::memory_order_acquire);
+	if (next != NULL)
+	{
+		_tail = next;
+		return tail;
+	}
+	return NULL;
+}
+
+void CommandScheduler::Admit(Command& command)
+{
+	std::deque<Command>& lane = _lanes[command.Priority];
+
+	// A repeat joins the run of presses at the tail; anything queued after that run starts a new one.
+	if (command.Repeatable && !lane.empty())
+	{
+		Command& tail = lane.back();
+		UINT64 window = (UINT64)_options.CoalesceWindowMs * 1000;
+		if (tail.Repeatable && command.EnqueuedUs - tail.EnqueuedUs <= window && tail.Request == command.Request)
+		{
+			// Keep the earlier slot in the queue but the later deadline.
+			++tail.Coalesced;
+			if (tail.DeadlineUs != 0 && (command.DeadlineUs == 0 || command.DeadlineUs > tail.DeadlineUs))
+				tail.DeadlineUs = command.DeadlineUs;
+			_coalesced.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+	}
+
+	if (lane.size() >= _options.MaxLaneDepth)
+	{
+		lane.pop_front();
+		_droppedOverflow.fetch_add(1, std::memory_order_relaxed);
+	}
+	lane.push_back(command);
+}
+
+void CommandScheduler::Expire(UINT64 now)
+{
+	for (int i = 0; i < CommandPriorityCount; ++i)
+	{
+		std::deque<Command>& lane = _lanes[i];
+		for (std::deque<Command>::iterator it = lane.begin(); it != lane.end(); )
+		{
+			if (it->DeadlineUs != 0 && now >= it->DeadlineUs)
+			{
+				it = lane.erase(it);
+				_droppedExpired.fetch_add(1, std::memory_order_relaxed);
+			}
+			else
+			{
+				++it;
+			}
+		}
+	}
+}
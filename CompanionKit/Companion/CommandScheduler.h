@@ -0,0 +1,157 @@
+//--------------------------------------------------------------------------
+// <copyright file="CommandScheduler.h" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// Prioritized companion command scheduler with key-repeat coalescing.
+// </summary>
+//--------------------------------------------------------------------------
+
+/*
+ Using the command scheduler:
+ UI threads Submit commands; Submit is lock-free and never blocks.  One consumer thread (the thread that
+ owns the companion connection) calls Pump, which moves submitted commands into per-priority lanes,
+ folds key repeats together, drops commands whose deadline has passed, and hands commands to the sink
+ while fewer than MaxOutstanding are in progress.  The consumer calls Completed once for every command
+ the sink received.
+ Only hold-to-repeat keys (volume and channel up and down) are folded, and only into the command at the
+ tail of their lane: a repeat stands for one more press of the same key, so Coalesced tells the sink how
+ many presses the command carries.  Any other command in between ends the run, so typed digits and
+ navigation keys are always sent one by one and in order.
+ When a Submit finds the scheduler idle it calls the wake callback once, so the owner can schedule a
+ Pump on the consumer thread (for instance by posting to its event loop).
+ */
+
+#ifndef COMMANDSCHEDULER_H
+#define COMMANDSCHEDULER_H
+
+#include "CSParve64.h"
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <string>
+
+enum CommandPriority
+{
+	CommandPriorityCritical = 0,    // power, stop: always ahead of everything else
+	CommandPriorityTransport,       // play, pause, record
+	CommandPriorityNavigation,      // keys, channel and volume changes
+	CommandPriorityBackground,      // queries that nobody is waiting on
+	CommandPriorityCount
+};
+
+struct Command
+{
+	std::string     Request;        // plaintext companion request, e.g. "op=key&k=up"
+	CommandPriority Priority;
+	bool            Repeatable;     // a hold-to-repeat key: the same command at the tail of its lane absorbs it
+	bool            Idempotent;     // CompanionCodec::IsIdempotent: safe to send more than once
+	UINT64          EnqueuedUs;
+	UINT64          DeadlineUs;     // 0 means no deadline
+	UINT32          Coalesced;      // repeats folded into this command; it stands for Coalesced + 1 presses
+
+	Command() : Priority(CommandPriorityNavigation), Repeatable(false), Idempotent(false), EnqueuedUs(0), DeadlineUs(0), Coalesced(0) {}
+};
+
+struct CommandSchedulerOptions
+{
+	UINT32 MaxOutstanding;      // commands handed to the sink and not yet completed
+	UINT32 CoalesceWindowMs;    // a repeat this soon after the command at the tail of its lane is merged
+	UINT32 DefaultDeadlineMs;   // used when Submit is given no deadline; 0 disables
+	UINT32 MaxLaneDepth;        // hard bound per priority lane; the oldest command is dropped beyond it
+
+	CommandSchedulerOptions() : MaxOutstanding(2), CoalesceWindowMs(250), DefaultDeadlineMs(1500), MaxLaneDepth(64) {}
+};
+
+struct CommandSchedulerStats
+{
+	UINT64 Submitted;
+	UINT64 Dispatched;
+	UINT64 Coalesced;           // repeats folded into a queued command, which then stands for one more press
+	UINT64 DroppedExpired;
+	UINT64 DroppedOverflow;
+	UINT32 QueueDepth;          // submitted and not yet dispatched or dropped
+	UINT32 Outstanding;
+};
+
+class CommandScheduler
+{
+public:
+
+	typedef std::function<void(Command&)> Sink;
+	typedef std::function<void()>         Wake;
+
+	CommandScheduler(const CommandSchedulerOptions& options, Sink sink, Wake wake = Wake());
+	~CommandScheduler();
+
+	/// <summary>
+	/// Queue a command.  Lock-free; safe to call from any thread.  deadlineMs of 0 uses the default.
+	/// </summary>
+	void Submit(const std::string& request, CommandPriority priority, bool repeatable, UINT32 deadlineMs = 0);
+
+	/// <summary>
+	/// Queue a command, deriving its priority and whether it repeats from the request with Classify.
+	/// </summary>
+	void Submit(const std::string& request);
+
+	/// <summary>
+	/// Consumer thread only: drain submissions, expire stale commands and dispatch to the sink.
+	/// </summary>
+	void Pump();
+
+	/// <summary>
+	/// Consumer thread only: a command handed to the sink has finished.
+	/// </summary>
+	void Completed();
+
+	CommandSchedulerStats Stats() const;
+
+	/// <summary>
+	/// Derive a priority class from a companion request: power and stop keys are critical.  Sets repeatable
+	/// for the hold-to-repeat keys: volup, voldown, chup and chdown.
+	/// </summary>
+	static CommandPriority Classify(const std::string& request, bool* repeatable);
+
+	static UINT64 NowUs();
+
+private:
+
+	CommandScheduler(const CommandScheduler&);
+	CommandScheduler& operator=(const CommandScheduler&);
+
+	// Intrusive multi-producer single-consumer queue (Vyukov).  Producers only exchange the head.
+	struct Node
+	{
+		std::atomic<Node*> Next;
+		Command            Item;
+
+		Node() : Next(NULL) {}
+	};
+
+	void Push(Node* node);
+	Node* Pop();
+	void Admit(Command& command);
+	void Expire(UINT64 now);
+
+	CommandSchedulerOptions  _options;
+	Sink                     _sink;
+	Wake                     _wake;
+
+	std::atomic<Node*>       _head;         // producers push here
+	Node*                    _tail;         // consumer pops here
+	Node                     _stub;
+	std::atomic<bool>        _pumpPending;  // a wake has been issued and Pump has not started yet
+	bool                     _pumping;
+
+	std::deque<Command>      _lanes[CommandPriorityCount];
+	std::atomic<UINT32>      _outstanding;
+
+	std::atomic<UINT64>      _submitted;
+	std::atomic<UINT64>      _dispatched;
+	std::atomic<UINT64>      _coalesced;
+	std::atomic<UINT64>      _droppedExpired;
+	std::atomic<UINT64>      _droppedOverflow;
+};
+
+#endif
@@ -0,0 +1,255 @@
+//--------------------------------------------------------------------------
+// <copyright file="CompanionArena.cpp" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// Per-request bump arena for the bytes of one companion round trip.
+// </summary>
+//--------------------------------------------------------------------------
+
+#include "CompanionArena.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static size_t RoundUp(size_t size)
+{
+	return (size + COMPANION_ARENA_ALIGNMENT - 1) & ~(size_t)(COMPANION_ARENA_ALIGNMENT - 1);
+}
+
+/// <summary>
+/// Header of a block taken from the heap when the arena's own block was full.  Its bytes follow.
+/// </summary>
+struct CompanionArena::Overflow
+{
+	Overflow* Next;
+	size_t    Size;
+};
+
+//------------------------------------------------------------------------------------------------------
+
+CompanionArena::CompanionArena(size_t size)
+	: _block(NULL), _size(0), _next(NULL), _limit(NULL), _overflow(NULL), _used(0), _needed(0)
+{
+	GrowBlock(size);
+}
+
+CompanionArena::~CompanionArena()
+{
+	while (_overflow != NULL)
+	{
+		Overflow* next = _overflow->Next;
+		free(_overflow);
+		_overflow = next;
+	}
+	free(_block);
+}
+
+bool CompanionArena::GrowBlock(size_t size)
+{
+	size = RoundUp(size);
+	BYTE* block = size != 0 ? (BYTE*)malloc(size) : NULL;
+	if (size != 0 && block == NULL)
+		return false;
+	if (block != NULL)
+		++_stats.HeapAllocations;
+
+	free(_block);
+	_block = block;
+	_size = size;
+	_next = _block;
+	_limit = _block + _size;
+	return true;
+}
+
+bool CompanionArena::Reserve(size_t size)
+{
+	size = RoundUp(size);
+	if (size <= (size_t)(_limit - _next))
+		return true;
+
+	// Nothing is allocated yet, so the block itself can be replaced.
+	if (_used == 0 && _overflow == NULL)
+		return GrowBlock(size);
+
+	// What the block would have needed to hold, for Reset to grow it to.
+	if (_used + size > _needed)
+		_needed = _used + size;
+
+	size_t blockSize = size > COMPANION_ARENA_MIN_OVERFLOW ? size : COMPANION_ARENA_MIN_OVERFLOW;
+	Overflow* overflow = (Overflow*)malloc(sizeof(Overflow) + blockSize);
+	if (overflow == NULL)
+		return false;
+	++_stats.HeapAllocations;
+	++_stats.Overflows;
+
+	overflow->Next = _overflow;
+	overflow->Size = blockSize;
+	_overflow = overflow;
+	_next = (BYTE*)(overflow + 1);
+	_limit = _next + blockSize;
+	return true;
+}
+
+void* CompanionArena::Allocate(size_t size)
+{
+	size = RoundUp(size);
+	if (size > (size_t)(_limit - _next) && !Reserve(size))
+		return NULL;
+
+	void* data = _next;
+	_next += size;
+	_used += size;
+	++_stats.Allocations;
+	return data;
+}
+
+void* CompanionArena::Extend(void* data, size_t size, size_t newSize)
+{
+	size = RoundUp(size);
+	newSize = RoundUp(newSize);
+	if (newSize <= size)
+		return data;
+
+	// The last allocation grows into the rest of its block.
+	if (data != NULL && (BYTE*)data + size == _next && newSize - size <= (size_t)(_limit - _next))
+	{
+		_next += newSize - size;
+		_used += newSize - size;
+		return data;
+	}
+
+	void* grown = Allocate(newSize);
+	if (grown != NULL && size != 0)
+		memcpy(grown, data, size);
+	return grown;
+}
+
+void* CompanionArena::Copy(const void* data, size_t length)
+{
+	void* copy = Allocate(length);
+	if (copy != NULL && length != 0)
+		memcpy(copy, data, length);
+	return copy;
+}
+
+void CompanionArena::Reset()
+{
+	++_stats.Resets;
+	if (_used > _stats.HighWater)
+		_stats.HighWater = _used;
+
+	if (_overflow != NULL)
+	{
+		while (_overflow != NULL)
+		{
+			Overflow* next = _overflow->Next;
+			free(_overflow);
+			_overflow = next;
+		}
+
+		// Next time the same round trip fits in the block.  If the heap says no, the old block stays.
+		size_t needed = _used > _needed ? _used : _needed;
+		if (needed > _size)
+			GrowBlock(needed);
+	}
+
+	_next = _block;
+	_limit = _block + _size;
+	_used = 0;
+	_needed = 0;
+}
+
+//------------------------------------------------------------------------------------------------------
+
+CompanionArenaPool::CompanionArenaPool(size_t size)
+	: _size(size)
+{
+}
+
+CompanionArenaPool::~CompanionArenaPool()
+{
+	for (size_t i = 0; i < _arenas.size(); ++i)
+		delete _arenas[i];
+}
+
+CompanionArena* CompanionArenaPool::Acquire(size_t size)
+{
+	CompanionArena* arena = NULL;
+	if (!_free.empty())
+	{
+		arena = _free.back();
+		_free.pop_back();
+	}
+	else
+	{
+		arena = new CompanionArena(size > _size ? size : _size);
+		_arenas.push_back(arena);
+
+		// Release never allocates.
+		_free.reserve(_arenas.size());
+	}
+
+	if (!arena->Reserve(size))
+	{
+		Release(arena);
+		return NULL;
+	}
+	return arena;
+}
+
+void CompanionArenaPool::Release(CompanionArena* arena)
+{
+	arena->Reset();
+	_free.push_back(arena);
+}
+
+CompanionArenaStats CompanionArenaPool::Stats() const
+{
+	CompanionArenaStats total;
+	total.HeapAllocations = _arenas.size();
+	for (size_t i = 0; i < _arenas.size(); ++i)
+	{
+		const CompanionArenaStats& stats = _arenas[i]->Stats();
+		total.Allocations += stats.Allocations;
+		total.HeapAllocations += stats.HeapAllocations;
+		total.Overflows += stats.Overflows;
+		total.Resets += stats.Resets;
+		if (stats.HighWater > total.HighWater)
+			total.HighWater = stats.HighWater;
+	}
+	return total;
+}
+
+//------------------------------------------------------------------------------------------------------
+
+CompanionArenaLease::CompanionArenaLease(const std::shared_ptr<CompanionArenaPool>& pool, size_t size)
+	: _pool(pool), _arena(pool->Acquire(size))
+{
+}
+
+CompanionArenaLease::CompanionArenaLease(CompanionArenaLease&& other)
+	: _pool(std::move(other._pool)), _arena(other._arena)
+{
+	other._arena = NULL;
+}
+
+CompanionArenaLease& CompanionArenaLease::operator=(CompanionArenaLease&& other)
+{
+	if (this != &other)
+	{
+		Release();
+		_pool = std::move(other._pool);
+		_arena = other._arena;
+		other._arena = NULL;
+	}
+	return *this;
+}
+
+void CompanionArenaLease::Release()
+{
+	if (_arena != NULL)
+		_pool->Release(_arena);
+	_arena = NULL;
+	_pool.reset();
+}
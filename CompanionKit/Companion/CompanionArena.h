@@ -0,0 +1,187 @@
+//--------------------------------------------------------------------------
+// <copyright file="CompanionArena.h" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// Per-request bump arena for the bytes of one companion round trip.
+// </summary>
+//--------------------------------------------------------------------------
+
+/*
+ Using the companion arena:
+ MRCompanion builds each request in an NSMutableData, copies it, grows _responseData a chunk at a time and
+ copies it again to decrypt it.  A CompanionArena holds every byte of one round trip instead - the query and
+ encoded body (CompanionCodec::EncodeRequest), the HTTP head, the received head and body, which are decoded
+ and parsed where they lie (CompanionCodec::DecryptResponseInPlace, ParseCompanionResponse) - and lets them
+ all go at once when the request completes:
+
+    CompanionArenaLease arena(pool, CompanionCodec::EncodedLength(length) + 1024);
+    CompanionEnvelope envelope;
+    codec.EncodeRequest(plain, length, seqNum, arena.Get(), &envelope);
+    ...                                     // every allocation is a pointer bump
+                                            // the lease's destructor resets the arena into the pool
+
+ Allocation carves from one block.  Reserve, called with the request length up front and the response
+ Content-Length once the head has arrived, makes sure what follows fits; whatever does not fit goes into an
+ overflow block from the heap.  Reset is O(1): it rewinds the block.  An arena that overflowed frees its
+ overflow blocks then and grows its block to the most it has held, so a pooled arena stops calling the heap
+ once it has seen the largest round trip of the steady state.  Stats count both kinds of allocation.
+
+ Nothing is constructed or destroyed in an arena; it holds bytes.  Neither arena nor pool is locked: both
+ belong to one thread, such as a client's event loop.
+ */
+
+#ifndef COMPANIONARENA_H
+#define COMPANIONARENA_H
+
+#include "CSParve64.h"
+
+#include <memory>
+#include <stddef.h>
+#include <vector>
+
+#define COMPANION_ARENA_ALIGNMENT       8
+#define COMPANION_ARENA_DEFAULT_SIZE    4096    // block of a new pooled arena
+#define COMPANION_ARENA_MIN_OVERFLOW    1024    // smallest overflow block
+
+struct CompanionArenaStats
+{
+	UINT64 Allocations;         // carved from the arena
+	UINT64 HeapAllocations;     // blocks (and, for a pool, arenas) taken from the heap
+	UINT64 Overflows;           // allocations that did not fit the block
+	UINT64 Resets;              // round trips completed
+	UINT64 HighWater;           // most bytes in use between two resets
+
+	CompanionArenaStats() : Allocations(0), HeapAllocations(0), Overflows(0), Resets(0), HighWater(0) {}
+};
+
+class CompanionArena
+{
+public:
+
+	explicit CompanionArena(size_t size = COMPANION_ARENA_DEFAULT_SIZE);
+	~CompanionArena();
+
+	/// <summary>
+	/// Make sure the next size bytes fit in one block.  Before the first allocation this grows the block
+	/// itself; after it, an overflow block is added if the rest of the block is too small.
+	/// </summary>
+	bool Reserve(size_t size);
+
+	/// <summary>
+	/// size bytes aligned to COMPANION_ARENA_ALIGNMENT, valid until Reset.  NULL if the heap is exhausted.
+	/// </summary>
+	void* Allocate(size_t size);
+
+	/// <summary>
+	/// Grow an allocation of size bytes to newSize, in place if it was the last one and there is room,
+	/// otherwise by copying it.  NULL if the heap is exhausted; data is then unchanged.
+	/// </summary>
+	void* Extend(void* data, size_t size, size_t newSize);
+
+	/// <summary>
+	/// Copy length bytes into the arena.
+	/// </summary>
+	void* Copy(const void* data, size_t length);
+
+	/// <summary>
+	/// Release everything allocated.  Frees the overflow blocks, if any, and grows the block to fit them.
+	/// </summary>
+	void Reset();
+
+	size_t Capacity() const { return _size; }
+	size_t Used() const { return _used; }
+	const CompanionArenaStats& Stats() const { return _stats; }
+
+private:
+
+	CompanionArena(const CompanionArena&);
+	CompanionArena& operator=(const CompanionArena&);
+
+	struct Overflow;
+
+	bool GrowBlock(size_t size);
+
+	BYTE*               _block;
+	size_t              _size;
+	BYTE*               _next;          // in the block or in the newest overflow block
+	BYTE*               _limit;
+	Overflow*           _overflow;      // newest first
+	size_t              _used;          // bytes allocated since Reset
+	size_t              _needed;        // block size that would have avoided the overflow blocks
+	CompanionArenaStats _stats;
+};
+
+/// <summary>
+/// Arenas kept between round trips, so that their blocks are reused.  The most recently released arena
+/// is handed out first.
+/// </summary>
+class CompanionArenaPool
+{
+public:
+
+	explicit CompanionArenaPool(size_t size = COMPANION_ARENA_DEFAULT_SIZE);
+	~CompanionArenaPool();
+
+	/// <summary>
+	/// A reset arena with room for size bytes in its block.  NULL if the heap is exhausted.
+	/// </summary>
+	CompanionArena* Acquire(size_t size);
+
+	/// <summary>
+	/// Reset an arena from Acquire and keep it for the next one.
+	/// </summary>
+	void Release(CompanionArena* arena);
+
+	/// <summary>
+	/// Arenas created; the most that were ever in use at once.
+	/// </summary>
+	size_t Count() const { return _arenas.size(); }
+
+	/// <summary>
+	/// The stats of every arena added up, with HighWater the largest.  HeapAllocations counts the arenas too.
+	/// </summary>
+	CompanionArenaStats Stats() const;
+
+private:
+
+	CompanionArenaPool(const CompanionArenaPool&);
+	CompanionArenaPool& operator=(const CompanionArenaPool&);
+
+	size_t                       _size;
+	std::vector<CompanionArena*> _arenas;
+	std::vector<CompanionArena*> _free;
+};
+
+/// <summary>
+/// An arena acquired from a pool for one round trip and released when the lease is destroyed.  The lease
+/// keeps the pool alive, so it may outlive the pool's owner (a request still being sent when its client
+/// goes away).
+/// </summary>
+class CompanionArenaLease
+{
+public:
+
+	CompanionArenaLease() : _arena(NULL) {}
+	CompanionArenaLease(const std::shared_ptr<CompanionArenaPool>& pool, size_t size);
+	CompanionArenaLease(CompanionArenaLease&& other);
+	CompanionArenaLease& operator=(CompanionArenaLease&& other);
+	~CompanionArenaLease() { Release(); }
+
+	CompanionArena* Get() const { return _arena; }
+
+	/// <summary>
+	/// Give the arena back to the pool now.
+	/// </summary>
+	void Release();
+
+private:
+
+	CompanionArenaLease(const CompanionArenaLease&);
+	CompanionArenaLease& operator=(const CompanionArenaLease&);
+
+	std::shared_ptr<CompanionArenaPool> _pool;
+	CompanionArena*                     _arena;
+};
+
+#endif
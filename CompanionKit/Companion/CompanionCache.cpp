@@ -0,0 +1,98 @@
+//--------------------------------------------------------------------------
+// <copyright file="CompanionCache.cpp" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// Bounded LRU cache used to memoize companion bodies.
+// </summary>
+//--------------------------------------------------------------------------
+
+#include "CompanionCache.h"
+
+CompanionLruCache::CompanionLruCache(UINT32 maxEntries, UINT32 maxEntryBytes)
+	: _maxEntries(maxEntries), _maxEntryBytes(maxEntryBytes), _hits(0), _misses(0), _evictions(0), _bytes(0)
+{
+}
+
+void CompanionLruCache::Configure(UINT32 maxEntries, UINT32 maxEntryBytes)
+{
+	std::lock_guard<std::mutex> guard(_lock);
+	_maxEntries = maxEntries;
+	_maxEntryBytes = maxEntryBytes;
+
+	while (_entries.size() > _maxEntries)
+	{
+		_bytes -= _entries.back().first.size() + _entries.back().second.size();
+		_index.erase(_entries.back().first);
+		_entries.pop_back();
+		++_evictions;
+	}
+}
+
+bool CompanionLruCache::Find(const std::string& key, std::string* value)
+{
+	std::lock_guard<std::mutex> guard(_lock);
+	if (_maxEntries == 0)
+		return false;
+
+	std::unordered_map<std::string, EntryRef>::iterator it = _index.find(key);
+	if (it == _index.end())
+	{
+		++_misses;
+		return false;
+	}
+
+	_entries.splice(_entries.begin(), _entries, it->second);
+	*value = it->second->second;
+	++_hits;
+	return true;
+}
+
+void CompanionLruCache::Insert(const std::string& key, const std::string& value)
+{
+	std::lock_guard<std::mutex> guard(_lock);
+	if (_maxEntries == 0 || key.size() > _maxEntryBytes || value.size() > _maxEntryBytes)
+		return;
+
+	std::unordered_map<std::string, EntryRef>::iterator it = _index.find(key);
+	if (it != _index.end())
+	{
+		_bytes += value.size();
+		_bytes -= it->second->second.size();
+		it->second->second = value;
+		_entries.splice(_entries.begin(), _entries, it->second);
+		return;
+	}
+
+	if (_entries.size() >= _maxEntries)
+	{
+		_bytes -= _entries.back().first.size() + _entries.back().second.size();
+		_index.erase(_entries.back().first);
+		_entries.pop_back();
+		++_evictions;
+	}
+
+	_entries.push_front(Entry(key, value));
+	_index[key] = _entries.begin();
+	_bytes += key.size() + value.size();
+}
+
+void CompanionLruCache::Clear()
+{
+	std::lock_guard<std::mutex> guard(_lock);
+	_entries.clear();
+	_index.clear();
+	_bytes = 0;
+}
+
+CompanionCacheStats CompanionLruCache::Stats() const
+{
+	std::lock_guard<std::mutex> guard(_lock);
+	CompanionCacheStats stats;
+	stats.Hits = _hits;
+	stats.Misses = _misses;
+	stats.Evictions = _evictions;
+	stats.Entries = (UINT32)_entries.size();
+	stats.Bytes = _bytes;
+	return stats;
+}
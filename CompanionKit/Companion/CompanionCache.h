@@ -0,0 +1,85 @@
+//--------------------------------------------------------------------------
+// <copyright file="CompanionCache.h" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// Bounded LRU cache used to memoize companion bodies.
+// </summary>
+//--------------------------------------------------------------------------
+
+/*
+ Using the companion cache:
+ The companion encoding has no nonce: the BV4 key is derived from a MAC over the data, so for one pairing
+ a given plaintext always encodes to the same body, and a given body always decodes to the same plaintext.
+ CompanionCodec uses two of these caches (plaintext -> encoded body, encoded body -> plaintext) so that
+ repeated commands and repeated STB responses skip CSParve64 entirely.  Only the signature, which depends
+ on the sequence number, has to be computed for every request.
+ The cache is internally locked, so it may be shared by the threads sharing a codec.
+ */
+
+#ifndef COMPANIONCACHE_H
+#define COMPANIONCACHE_H
+
+#include "CSParve64.h"
+
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+struct CompanionCacheStats
+{
+	UINT64 Hits;
+	UINT64 Misses;
+	UINT64 Evictions;
+	UINT32 Entries;
+	UINT64 Bytes;           // keys plus values
+};
+
+class CompanionLruCache
+{
+public:
+
+	/// <summary>
+	/// maxEntries of 0 disables the cache.  Entries whose key or value exceed maxEntryBytes are not kept.
+	/// </summary>
+	explicit CompanionLruCache(UINT32 maxEntries = 0, UINT32 maxEntryBytes = 4096);
+
+	void Configure(UINT32 maxEntries, UINT32 maxEntryBytes);
+	bool IsEnabled() const { return _maxEntries != 0; }
+
+	/// <summary>
+	/// Copy the value for key into value.  Returns false on a miss.
+	/// </summary>
+	bool Find(const std::string& key, std::string* value);
+
+	/// <summary>
+	/// Insert or refresh an entry, evicting the least recently used one when full.
+	/// </summary>
+	void Insert(const std::string& key, const std::string& value);
+
+	void Clear();
+
+	CompanionCacheStats Stats() const;
+
+private:
+
+	CompanionLruCache(const CompanionLruCache&);
+	CompanionLruCache& operator=(const CompanionLruCache&);
+
+	typedef std::pair<std::string, std::string>  Entry;
+	typedef std::list<Entry>::iterator           EntryRef;
+
+	mutable std::mutex                          _lock;
+	UINT32                                      _maxEntries;
+	UINT32                                      _maxEntryBytes;
+	std::list<Entry>                            _entries;       // most recently used first
+	std::unordered_map<std::string, EntryRef>   _index;
+	UINT64                                      _hits;
+	UINT64                                      _misses;
+	UINT64                                      _evictions;
+	UINT64                                      _bytes;
+};
+
+#endif
@@ -0,0 +1,608 @@
+//--------------------------------------------------------------------------
+// <copyright file="CompanionCapture.cpp" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// Binary capture of companion traffic, for replay.
+// </summary>
+//--------------------------------------------------------------------------
+
+#include "CompanionCapture.h"
+
+#include <algorithm>
+#include <chrono>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CAPTURE_FILE_MAGIC          0x50414343      // "CCAP"
+#define CAPTURE_BLOCK_MAGIC         0x4B4C4243      // "CBLK"
+#define CAPTURE_TRAILER_MAGIC       0x58444943      // "CIDX"
+#define CAPTURE_ALIGNMENT           8
+
+struct CaptureFileHeader
+{
+	UINT32 Magic;
+	UINT32 Version;
+	UINT32 BlockSize;
+	UINT32 Reserved;
+	UINT64 CreatedUs;
+	UINT64 Reserved2[5];
+};
+
+// The CRC covers everything after it: the rest of the header and the records.
+struct CaptureBlockHeader
+{
+	UINT32 Magic;
+	UINT32 Crc;
+	UINT32 Length;              // of the records that follow
+	UINT32 Count;
+	UINT64 FirstUs;
+	UINT64 LastUs;
+	UINT64 FirstRecord;         // number of records before this block
+};
+
+// Followed by the cid, ciphertext and plaintext, padded to CAPTURE_ALIGNMENT.
+struct CaptureRecordHeader
+{
+	UINT32 Length;              // including this header and the padding
+	BYTE   Kind;
+	BYTE   Flags;
+	UINT16 CidLength;
+	UINT32 SeqNum;
+	UINT32 SignedLength;
+	UINT32 CipherLength;
+	UINT32 PlainLength;
+	BYTE   TargetAddr[4];
+	UINT32 Reserved;
+	UINT64 TimestampUs;
+	UINT64 SignatureHash;
+};
+
+struct CaptureTrailer
+{
+	UINT32 Magic;
+	UINT32 Blocks;
+	UINT64 IndexOffset;
+	UINT64 Records;
+	UINT32 Crc;                 // of the index entries
+	UINT32 Reserved;
+};
+
+static_assert(sizeof(CaptureFileHeader) == 64, "capture layout is part of the file format");
+static_assert(sizeof(CaptureBlockHeader) == 40, "capture layout is part of the file format");
+static_assert(sizeof(CaptureRecordHeader) == 48, "capture layout is part of the file format");
+static_assert(sizeof(CaptureIndexEntry) == 24, "capture layout is part of the file format");
+static_assert(sizeof(CaptureTrailer) == 32, "capture layout is part of the file format");
+
+//------------------------------------------------------------------------------------------------------
+
+// Helper functions.
+
+static UINT64 WallClockUs()
+{
+	return (UINT64)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+static UINT32 Aligned(UINT32 length)
+{
+	return (length + CAPTURE_ALIGNMENT - 1) & ~(UINT32)(CAPTURE_ALIGNMENT - 1);
+}
+
+static bool ParseHex(const char* text, size_t length, UINT64* value)
+{
+	UINT64 result = 0;
+	for (size_t i = 0; i < length; ++i)
+	{
+		char c = text[i];
+		UINT64 digit;
+		if (c >= '0' && c <= '9')
+			digit = (UINT64)(c - '0');
+		else if (c >= 'A' && c <= 'F')
+			digit = (UINT64)(c - 'A' + 10);
+		else if (c >= 'a' && c <= 'f')
+			digit = (UINT64)(c - 'a' + 10);
+		else
+			return false;
+		result = (result << 4) | digit;
+	}
+	*value = result;
+	return true;
+}
+
+static UINT32 BlockCrc(const CaptureBlockHeader* header)
+{
+	const BYTE* start = (const BYTE*)header + offsetof(CaptureBlockHeader, Length);
+	return CompanionCrc32(start, sizeof(CaptureBlockHeader) - offsetof(CaptureBlockHeader, Length) + header->Length);
+}
+
+//------------------------------------------------------------------------------------------------------
+
+CaptureRecordView::CaptureRecordView()
+	: Kind(CaptureRequest), Flags(0), TimestampUs(0), SeqNum(0), SignedLength(0), SignatureHash(0),
+	  Cid(""), CidLength(0), Cipher(NULL), CipherLength(0), Plain(NULL), PlainLength(0)
+{
+	memset(TargetAddr, 0, sizeof(TargetAddr));
+}
+
+std::string CaptureRecordView::Signature() const
+{
+	if (Flags & CAPTURE_FLAG_TEST_PAIRING)
+		return std::string();
+
+	char signature[COMPANION_SIGNATURE_CHARS + 1];
+	snprintf(signature, sizeof(signature), "%08X%08X%016llX", SeqNum, SignedLength, (unsigned long long)SignatureHash);
+	return signature;
+}
+
+std::string CaptureRecordView::TargetIPAddr() const
+{
+	char text[16];
+	snprintf(text, sizeof(text), "%u.%u.%u.%u", TargetAddr[0], TargetAddr[1], TargetAddr[2], TargetAddr[3]);
+	return text;
+}
+
+//------------------------------------------------------------------------------------------------------
+
+CaptureWriter::CaptureWriter()
+	: _fd(-1), _blockSize(CAPTURE_DEFAULT_BLOCK_SIZE), _blockRecords(0), _blockFirstUs(0), _blockLastUs(0), _records(0), _offset(0), _error(COMPANION_OK)
+{
+}
+
+CaptureWriter::~CaptureWriter()
+{
+	Close();
+}
+
+COMPANION_RESULT CaptureWriter::Open(const std::string& path, UINT32 blockSize)
+{
+	Close();
+
+	std::lock_guard<std::mutex> guard(_lock);
+	_fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (_fd < 0)
+		return COMPANION_FAIL;
+
+	_blockSize = blockSize < 4096 ? 4096 : blockSize;
+	_block.assign(sizeof(CaptureBlockHeader), 0);
+	_block.reserve(_blockSize);
+	_blockRecords = 0;
+	_records = 0;
+	_offset = 0;
+	_index.clear();
+	_error = COMPANION_OK;
+
+	CaptureFileHeader header;
+	memset(&header, 0, sizeof(header));
+	header.Magic = CAPTURE_FILE_MAGIC;
+	header.Version = CAPTURE_VERSION;
+	header.BlockSize = _blockSize;
+	header.CreatedUs = WallClockUs();
+	COMPANION_RESULT result = WriteAll(&header, sizeof(header));
+	if (result != COMPANION_OK)
+	{
+		close(_fd);
+		_fd = -1;
+	}
+	return result;
+}
+
+COMPANION_RESULT CaptureWriter::Append(const CaptureRecordView& record)
+{
+	UINT32 length = Aligned((UINT32)sizeof(CaptureRecordHeader) + record.CidLength + record.CipherLength + record.PlainLength);
+
+	std::lock_guard<std::mutex> guard(_lock);
+	if (_fd < 0)
+		return COMPANION_FAIL;
+	if (_error != COMPANION_OK)
+		return _error;
+
+	// A record larger than a block gets a block of its own.
+	if (_blockRecords != 0 && _block.size() + length > _blockSize)
+	{
+		COMPANION_RESULT result = FlushBlock();
+		if (result != COMPANION_OK)
+			return result;
+	}
+
+	// Stamped under the lock, so records from several threads are in time order.
+	UINT64 timestampUs = record.TimestampUs != 0 ? record.TimestampUs : WallClockUs();
+	if (timestampUs < _blockLastUs)
+		timestampUs = _blockLastUs;
+
+	size_t at = _block.size();
+	_block.resize(at + length, 0);
+
+	CaptureRecordHeader header;
+	memset(&header, 0, sizeof(header));
+	header.Length = length;
+	header.Kind = (BYTE)record.Kind;
+	header.Flags = (BYTE)record.Flags;
+	header.CidLength = (UINT16)record.CidLength;
+	header.SeqNum = record.SeqNum;
+	header.SignedLength = record.SignedLength;
+	header.CipherLength = record.CipherLength;
+	header.PlainLength = record.PlainLength;
+	memcpy(header.TargetAddr, record.TargetAddr, sizeof(header.TargetAddr));
+	header.TimestampUs = timestampUs;
+	header.SignatureHash = record.SignatureHash;
+
+	BYTE* out = &_block[at];
+	memcpy(out, &header, sizeof(header));
+	out += sizeof(header);
+	memcpy(out, record.Cid, record.CidLength);
+	out += record.CidLength;
+	if (record.CipherLength != 0)
+		memcpy(out, record.Cipher, record.CipherLength);
+	out += record.CipherLength;
+	if (record.PlainLength != 0)
+		memcpy(out, record.Plain, record.PlainLength);
+
+	if (_blockRecords == 0)
+		_blockFirstUs = timestampUs;
+	_blockLastUs = timestampUs;
+	++_blockRecords;
+	++_records;
+	return COMPANION_OK;
+}
+
+COMPANION_RESULT CaptureWriter::Flush()
+{
+	std::lock_guard<std::mutex> guard(_lock);
+	if (_fd < 0)
+		return COMPANION_FAIL;
+	return FlushBlock();
+}
+
+COMPANION_RESULT CaptureWriter::FlushBlock()
+{
+	if (_error != COMPANION_OK || _blockRecords == 0)
+		return _error;
+
+	CaptureBlockHeader* header = (CaptureBlockHeader*)&_block[0];
+	header->Magic = CAPTURE_BLOCK_MAGIC;
+	header->Length = (UINT32)(_block.size() - sizeof(CaptureBlockHeader));
+	header->Count = _blockRecords;
+	header->FirstUs = _blockFirstUs;
+	header->LastUs = _blockLastUs;
+	header->FirstRecord = _records - _blockRecords;
+	header->Crc = BlockCrc(header);
+
+	CaptureIndexEntry entry;
+	entry.Offset = _offset;
+	entry.FirstUs = _blockFirstUs;
+	entry.FirstRecord = header->FirstRecord;
+
+	COMPANION_RESULT result = WriteAll(&_block[0], _block.size());
+	if (result != COMPANION_OK)
+		return result;
+
+	_index.push_back(entry);
+	_block.assign(sizeof(CaptureBlockHeader), 0);
+	_blockRecords = 0;
+	return COMPANION_OK;
+}
+
+COMPANION_RESULT CaptureWriter::WriteAll(const void* data, size_t length)
+{
+	const BYTE* bytes = (const BYTE*)data;
+	size_t written = 0;
+	while (written < length)
+	{
+		ssize_t n = write(_fd, bytes + written, length - written);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			_error = COMPANION_FAIL;
+			return _error;
+		}
+		written += (size_t)n;
+	}
+	_offset += length;
+	return COMPANION_OK;
+}
+
+COMPANION_RESULT CaptureWriter::Close()
+{
+	std::lock_guard<std::mutex> guard(_lock);
+	if (_fd < 0)
+		return COMPANION_OK;
+
+	COMPANION_RESULT result = FlushBlock();
+
+	CaptureTrailer trailer;
+	memset(&trailer, 0, sizeof(trailer));
+	trailer.Magic = CAPTURE_TRAILER_MAGIC;
+	trailer.Blocks = (UINT32)_index.size();
+	trailer.IndexOffset = _offset;
+	trailer.Records = _records;
+	trailer.Crc = _index.empty() ? 0 : CompanionCrc32((const BYTE*)&_index[0], _index.size() * sizeof(CaptureIndexEntry));
+
+	if (result == COMPANION_OK && !_index.empty())
+		result = WriteAll(&_index[0], _index.size() * sizeof(CaptureIndexEntry));
+	if (result == COMPANION_OK)
+		result = WriteAll(&trailer, sizeof(trailer));
+	if (result == COMPANION_OK && fsync(_fd) != 0)
+		result = COMPANION_FAIL;
+
+	close(_fd);
+	_fd = -1;
+	_index.clear();
+	_block.clear();
+	return result;
+}
+
+UINT64 CaptureWriter::Records() const
+{
+	std::lock_guard<std::mutex> guard(_lock);
+	return _records;
+}
+
+UINT64 CaptureWriter::Bytes() const
+{
+	std::lock_guard<std::mutex> guard(_lock);
+	return _offset + (_blockRecords != 0 ? _block.size() : 0);
+}
+
+//------------------------------------------------------------------------------------------------------
+
+void CaptureRecorder::OnRequest(const CompanionCodec& codec, const char* signature, const CompanionRequest& request, const char* plain, UINT32 plainLength)
+{
+	Record(codec, CaptureRequest, signature, request.Body.empty() ? NULL : &request.Body[0], (UINT32)request.Body.size(), plain, plainLength);
+}
+
+void CaptureRecorder::OnResponse(const CompanionCodec& codec, const char* signature, const BYTE* body, UINT32 bodyLength, const std::string* plain)
+{
+	Record(codec, CaptureResponse, signature, body, bodyLength, plain != NULL ? plain->data() : NULL, plain != NULL ? (UINT32)plain->length() : 0);
+}
+
+void CaptureRecorder::Record(const CompanionCodec& codec, CaptureKind kind, const char* signature, const BYTE* body, UINT32 bodyLength, const char* plain, UINT32 plainLength)
+{
+	CaptureRecordView record;
+	record.Kind = kind;
+	memcpy(record.TargetAddr, codec.TargetAddr(), sizeof(record.TargetAddr));
+	record.Cid = codec.DeviceId().data();
+	record.CidLength = (UINT32)codec.DeviceId().length();
+	record.Cipher = body;
+	record.CipherLength = bodyLength;
+
+	UINT64 seqNum = 0, length = 0, hash = 0;
+	if (signature == NULL)
+		record.Flags |= CAPTURE_FLAG_TEST_PAIRING;
+	else if (!ParseHex(signature, 8, &seqNum) || !ParseHex(signature + 8, 8, &length) || !ParseHex(signature + 16, 16, &hash))
+		return;
+	record.SeqNum = (UINT32)seqNum;
+	record.SignedLength = (UINT32)length;
+	record.SignatureHash = hash;
+
+	if (_includePlaintext && plain != NULL)
+	{
+		record.Flags |= CAPTURE_FLAG_PLAINTEXT;
+		record.Plain = plain;
+		record.PlainLength = plainLength;
+	}
+
+	_writer.Append(record);
+}
+
+//------------------------------------------------------------------------------------------------------
+
+CaptureReader::CaptureReader() : _fd(-1), _map(NULL), _mapped(0), _records(0), _hasIndex(false)
+{
+}
+
+CaptureReader::~CaptureReader()
+{
+	Close();
+}
+
+COMPANION_RESULT CaptureReader::Open(const std::string& path)
+{
+	Close();
+
+	_fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (_fd < 0)
+		return COMPANION_FAIL;
+
+	struct stat st;
+	if (fstat(_fd, &st) != 0 || (size_t)st.st_size < sizeof(CaptureFileHeader))
+	{
+		Close();
+		return COMPANION_E_FORMAT;
+	}
+
+	_mapped = (size_t)st.st_size;
+	void* mapped = mmap(NULL, _mapped, PROT_READ, MAP_SHARED, _fd, 0);
+	if (mapped == MAP_FAILED)
+	{
+		_mapped = 0;
+		Close();
+		return COMPANION_FAIL;
+	}
+	_map = (const BYTE*)mapped;
+
+	const CaptureFileHeader* header = (const CaptureFileHeader*)_map;
+	if (header->Magic != CAPTURE_FILE_MAGIC || header->Version != CAPTURE_VERSION)
+	{
+		Close();
+		return COMPANION_E_FORMAT;
+	}
+
+	// Replay reads front to back.
+	madvise((void*)_map, _mapped, MADV_SEQUENTIAL);
+
+	_hasIndex = ReadIndex();
+	if (!_hasIndex)
+		WalkBlocks();
+	return COMPANION_OK;
+}
+
+void CaptureReader::Close()
+{
+	if (_map != NULL)
+	{
+		munmap((void*)_map, _mapped);
+		_map = NULL;
+		_mapped = 0;
+	}
+	if (_fd >= 0)
+	{
+		close(_fd);
+		_fd = -1;
+	}
+	_blocks.clear();
+	_records = 0;
+	_hasIndex = false;
+}
+
+bool CaptureReader::ReadIndex()
+{
+	if (_mapped < sizeof(CaptureFileHeader) + sizeof(CaptureTrailer))
+		return false;
+
+	const CaptureTrailer* trailer = (const CaptureTrailer*)(_map + _mapped - sizeof(CaptureTrailer));
+	size_t indexLength = (size_t)trailer->Blocks * sizeof(CaptureIndexEntry);
+	if (trailer->Magic != CAPTURE_TRAILER_MAGIC
+		|| trailer->IndexOffset < sizeof(CaptureFileHeader)
+		|| trailer->IndexOffset + indexLength + sizeof(CaptureTrailer) != _mapped
+		|| (indexLength != 0 && CompanionCrc32(_map + trailer->IndexOffset, indexLength) != trailer->Crc))
+		return false;
+
+	const CaptureIndexEntry* index = (const CaptureIndexEntry*)(_map + trailer->IndexOffset);
+	for (UINT32 i = 0; i < trailer->Blocks; ++i)
+	{
+		UINT64 next;
+		if (index[i].Offset + sizeof(CaptureBlockHeader) > trailer->IndexOffset || !AddBlock(index[i].Offset, &next) || next > trailer->IndexOffset)
+		{
+			_blocks.clear();
+			_records = 0;
+			return false;
+		}
+	}
+	return _records == trailer->Records;
+}
+
+void CaptureReader::WalkBlocks()
+{
+	_blocks.clear();
+	_records = 0;
+
+	UINT64 offset = sizeof(CaptureFileHeader);
+	while (offset + sizeof(CaptureBlockHeader) <= _mapped)
+	{
+		const CaptureBlockHeader* header = (const CaptureBlockHeader*)(_map + offset);
+		if (header->Magic != CAPTURE_BLOCK_MAGIC || offset + sizeof(CaptureBlockHeader) + header->Length > _mapped || BlockCrc(header) != header->Crc)
+			break;
+
+		UINT64 next;
+		if (!AddBlock(offset, &next))
+			break;
+		offset = next;
+	}
+}
+
+bool CaptureReader::AddBlock(UINT64 offset, UINT64* next)
+{
+	const CaptureBlockHeader* header = (const CaptureBlockHeader*)(_map + offset);
+	if (header->Magic != CAPTURE_BLOCK_MAGIC || offset + sizeof(CaptureBlockHeader) + header->Length > _mapped)
+		return false;
+
+	Block block;
+	block.Records = _map + offset + sizeof(CaptureBlockHeader);
+	block.Length = header->Length;
+	block.Count = header->Count;
+	block.FirstUs = header->FirstUs;
+	block.LastUs = header->LastUs;
+	_blocks.push_back(block);
+	_records += header->Count;
+
+	*next = offset + sizeof(CaptureBlockHeader) + header->Length;
+	return true;
+}
+
+bool CaptureReader::Next(CapturePosition* position, CaptureRecordView* record) const
+{
+	while (position->Block < _blocks.size())
+	{
+		const Block& block = _blocks[position->Block];
+		if (position->Offset + sizeof(CaptureRecordHeader) > block.Length)
+		{
+			++position->Block;
+			position->Offset = 0;
+			continue;
+		}
+
+		CaptureRecordHeader header;
+		memcpy(&header, block.Records + position->Offset, sizeof(header));
+		UINT64 contents = (UINT64)sizeof(header) + header.CidLength + header.CipherLength + header.PlainLength;
+		if (header.Length < contents || position->Offset + header.Length > block.Length)
+		{
+			// Damaged: give up on the rest of the block.
+			++position->Block;
+			position->Offset = 0;
+			continue;
+		}
+
+		const BYTE* data = block.Records + position->Offset + sizeof(header);
+		record->Kind = (CaptureKind)header.Kind;
+		record->Flags = header.Flags;
+		record->TimestampUs = header.TimestampUs;
+		memcpy(record->TargetAddr, header.TargetAddr, sizeof(record->TargetAddr));
+		record->SeqNum = header.SeqNum;
+		record->SignedLength = header.SignedLength;
+		record->SignatureHash = header.SignatureHash;
+		record->Cid = (const char*)data;
+		record->CidLength = header.CidLength;
+		record->Cipher = data + header.CidLength;
+		record->CipherLength = header.CipherLength;
+		record->Plain = (const char*)data + header.CidLength + header.CipherLength;
+		record->PlainLength = header.PlainLength;
+
+		position->Offset += header.Length;
+		return true;
+	}
+	return false;
+}
+
+CapturePosition CaptureReader::Seek(UINT64 timestampUs) const
+{
+	CapturePosition position;
+
+	// The last block starting at or before the time; earlier blocks end before it.
+	size_t low = 0, high = _blocks.size();
+	while (low < high)
+	{
+		size_t middle = (low + high) / 2;
+		if (_blocks[middle].FirstUs <= timestampUs)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	position.Block = low != 0 ? low - 1 : 0;
+
+	CapturePosition at = position;
+	CaptureRecordView record;
+	while (Next(&at, &record))
+	{
+		if (record.TimestampUs >= timestampUs)
+			return position;
+		position = at;
+	}
+	return position;
+}
+
+UINT64 CaptureReader::FirstUs() const
+{
+	return _blocks.empty() ? 0 : _blocks.front().FirstUs;
+}
+
+UINT64 CaptureReader::LastUs() const
+{
+	return _blocks.empty() ? 0 : _blocks.back().LastUs;
+}
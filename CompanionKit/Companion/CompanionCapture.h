@@ -0,0 +1,239 @@
+//--------------------------------------------------------------------------
+// <copyright file="CompanionCapture.h" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// Binary capture of companion traffic, for replay.
+// </summary>
+//--------------------------------------------------------------------------
+
+/*
+ Using captures:
+ A capture records the requests a codec encodes and the responses it decodes, so that real traffic - its
+ mix of operations and message sizes - can be replayed against the encoder, the decoder or an STB later
+ (Gateway/Tools/CompanionReplay.cpp).  To record, give a codec a CaptureRecorder:
+
+    CaptureWriter writer;
+    writer.Open("/var/tmp/companion.cap");
+    CaptureRecorder recorder(writer, true);     // true keeps the plaintext too
+    codec.SetRecorder(&recorder);               // or CompanionClientOptions.Recorder
+
+ Each record holds the wall-clock time in microseconds, the STB address, cid, sequence number, the
+ signature (as its body length and 64-bit hash; the sequence number is the record's), the ciphertext and,
+ optionally, the plaintext.  Records are packed into blocks of about BlockSize bytes, each with a header
+ giving its first timestamp and record number and a CRC.  Close appends an index of the blocks and a
+ trailer, so a reader maps the file and seeks by time with a binary search over the index.  A capture that
+ was not closed (the recorder crashed) has no trailer; the reader then walks the block headers instead and
+ ignores a torn last block.  Nothing is read until it is asked for: records are views into the mapping.
+
+ The writer buffers one block and writes it whole, so recording costs a copy and a lock per message, and
+ the plaintext may be left out where the capture would otherwise hold user data.  Fields are stored in
+ host byte order; captures are read on the kind of machine that wrote them.
+ */
+
+#ifndef COMPANIONCAPTURE_H
+#define COMPANIONCAPTURE_H
+
+#include "CompanionCodec.h"
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+#define CAPTURE_VERSION             1
+#define CAPTURE_DEFAULT_BLOCK_SIZE  65536
+
+#define CAPTURE_FLAG_PLAINTEXT      0x01    // Plain holds the plaintext
+#define CAPTURE_FLAG_TEST_PAIRING   0x02    // enc=0: no signature, and the "ciphertext" is the plaintext
+
+enum CaptureKind
+{
+	CaptureRequest = 1,
+	CaptureResponse = 2
+};
+
+/// <summary>
+/// One record, pointing into the capture (when read) or the caller's buffers (when appended).
+/// </summary>
+struct CaptureRecordView
+{
+	CaptureKind Kind;
+	UINT32      Flags;
+	UINT64      TimestampUs;        // wall clock
+	BYTE        TargetAddr[4];
+	UINT32      SeqNum;
+	UINT32      SignedLength;       // body length carried by the signature
+	UINT64      SignatureHash;
+	const char* Cid;
+	UINT32      CidLength;
+	const BYTE* Cipher;
+	UINT32      CipherLength;
+	const char* Plain;
+	UINT32      PlainLength;
+
+	CaptureRecordView();
+
+	bool HasPlain() const { return (Flags & CAPTURE_FLAG_PLAINTEXT) != 0; }
+
+	/// <summary>
+	/// The %08X%08X%016llX signature as sent.
+	/// </summary>
+	std::string Signature() const;
+
+	std::string TargetIPAddr() const;
+	std::string CidString() const { return std::string(Cid, CidLength); }
+};
+
+/// <summary>
+/// One per block in the index Close writes.
+/// </summary>
+struct CaptureIndexEntry
+{
+	UINT64 Offset;          // of the block header
+	UINT64 FirstUs;
+	UINT64 FirstRecord;
+};
+
+/// <summary>
+/// Where a reader is in a capture.
+/// </summary>
+struct CapturePosition
+{
+	size_t Block;
+	size_t Offset;          // within the block's records
+
+	CapturePosition() : Block(0), Offset(0) {}
+};
+
+class CaptureWriter
+{
+public:
+
+	CaptureWriter();
+	~CaptureWriter();
+
+	/// <summary>
+	/// Create (or truncate) the capture at path.
+	/// </summary>
+	COMPANION_RESULT Open(const std::string& path, UINT32 blockSize = CAPTURE_DEFAULT_BLOCK_SIZE);
+
+	/// <summary>
+	/// Add a record.  Thread-safe.
+	/// </summary>
+	COMPANION_RESULT Append(const CaptureRecordView& record);
+
+	/// <summary>
+	/// Write the block being filled, so a crash loses nothing appended so far.
+	/// </summary>
+	COMPANION_RESULT Flush();
+
+	/// <summary>
+	/// Flush, write the index and trailer, and close the file.
+	/// </summary>
+	COMPANION_RESULT Close();
+
+	bool IsOpen() const { return _fd >= 0; }
+	UINT64 Records() const;
+	UINT64 Bytes() const;
+
+private:
+
+	CaptureWriter(const CaptureWriter&);
+	CaptureWriter& operator=(const CaptureWriter&);
+
+	COMPANION_RESULT FlushBlock();
+	COMPANION_RESULT WriteAll(const void* data, size_t length);
+
+	mutable std::mutex             _lock;
+	int                            _fd;
+	UINT32                         _blockSize;
+	std::vector<BYTE>              _block;         // header space, then the records
+	UINT32                         _blockRecords;
+	UINT64                         _blockFirstUs;
+	UINT64                         _blockLastUs;
+	UINT64                         _records;
+	UINT64                         _offset;        // file size so far
+	std::vector<CaptureIndexEntry> _index;
+	COMPANION_RESULT               _error;         // first write failure; the capture stops there
+};
+
+/// <summary>
+/// Records a codec's traffic into a CaptureWriter.
+/// </summary>
+class CaptureRecorder : public CompanionRecorder
+{
+public:
+
+	CaptureRecorder(CaptureWriter& writer, bool includePlaintext) : _writer(writer), _includePlaintext(includePlaintext) {}
+
+	virtual void OnRequest(const CompanionCodec& codec, const char* signature, const CompanionRequest& request, const char* plain, UINT32 plainLength);
+	virtual void OnResponse(const CompanionCodec& codec, const char* signature, const BYTE* body, UINT32 bodyLength, const std::string* plain);
+
+private:
+
+	void Record(const CompanionCodec& codec, CaptureKind kind, const char* signature, const BYTE* body, UINT32 bodyLength, const char* plain, UINT32 plainLength);
+
+	CaptureWriter& _writer;
+	bool           _includePlaintext;
+};
+
+class CaptureReader
+{
+public:
+
+	CaptureReader();
+	~CaptureReader();
+
+	/// <summary>
+	/// Map a capture.  COMPANION_E_FORMAT if it is not one.
+	/// </summary>
+	COMPANION_RESULT Open(const std::string& path);
+	void Close();
+
+	/// <summary>
+	/// Read the record at position and advance it.  False at the end of the capture.
+	/// </summary>
+	bool Next(CapturePosition* position, CaptureRecordView* record) const;
+
+	/// <summary>
+	/// Position of the first record at or after timestampUs.
+	/// </summary>
+	CapturePosition Seek(UINT64 timestampUs) const;
+
+	UINT64 Records() const { return _records; }
+	size_t Blocks() const { return _blocks.size(); }
+	UINT64 FirstUs() const;
+	UINT64 LastUs() const;
+
+	/// <summary>
+	/// False if the capture was not closed and its blocks had to be walked.
+	/// </summary>
+	bool HasIndex() const { return _hasIndex; }
+
+private:
+
+	CaptureReader(const CaptureReader&);
+	CaptureReader& operator=(const CaptureReader&);
+
+	struct Block
+	{
+		const BYTE* Records;
+		UINT32      Length;         // of the records
+		UINT32      Count;
+		UINT64      FirstUs;
+		UINT64      LastUs;
+	};
+
+	bool ReadIndex();
+	void WalkBlocks();
+	bool AddBlock(UINT64 offset, UINT64* next);
+
+	int                _fd;
+	const BYTE*        _map;
+	size_t             _mapped;
+	std::vector<Block> _blocks;
+	UINT64             _records;
+	bool               _hasIndex;
+};
+
+#endif
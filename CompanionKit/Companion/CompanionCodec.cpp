@@ -0,0 +1,767 @@
+//--------------------------------------------------------------------------
+// <copyright file="CompanionCodec.cpp" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// Portable companion request/response encoding.
+// </summary>
+//--------------------------------------------------------------------------
+
+#include "CompanionCodec.h"
+#include "CompanionArena.h"
+#include "CompanionConfig.h"
+#include "CompanionProbes.h"
+#include "SharedInstanceCache.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+//------------------------------------------------------------------------------------------------------
+
+// Helper functions.
+
+static void UInt32ToBytes(UINT32 n, BYTE* data)
+{
+	data[0] = (BYTE)(n >> 24);
+	data[1] = (BYTE)(n >> 16);
+	data[2] = (BYTE)(n >> 8);
+	data[3] = (BYTE)(n);
+}
+
+static void UInt64ToBytes(UINT64 n, BYTE* dest)
+{
+	UInt32ToBytes((UINT32)(n >> 32), dest);
+	UInt32ToBytes((UINT32)n, dest + 4);
+}
+
+static UINT32 BytesToUInt32(const BYTE* data)
+{
+	return ((UINT32)data[0] << 24) | ((UINT32)data[1] << 16) | ((UINT32)data[2] << 8) | (UINT32)data[3];
+}
+
+struct Crc32Table
+{
+	UINT32 Entries[256];
+
+	Crc32Table()
+	{
+		for (UINT32 i = 0; i < 256; ++i)
+		{
+			UINT32 c = i;
+			for (int k = 0; k < 8; ++k)
+				c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+			Entries[i] = c;
+		}
+	}
+};
+
+// Parse exactly count hex digits.  Returns 0 if successful, otherwise -1.
+static int HexToUInt64(const char* hex, UINT32 count, UINT64* value)
+{
+	UINT64 result = 0;
+	for (UINT32 i = 0; i < count; ++i)
+	{
+		unsigned char nibble;
+		if (hexToNibble(hex[i], &nibble) != 0)
+			return -1;
+		result = (result << 4) | nibble;
+	}
+	*value = result;
+	return 0;
+}
+
+// Parse a dotted IPv4 address.  Returns 0 if successful, otherwise -1.
+static int ParseIPv4(const char* ipAddr, BYTE* quads)
+{
+	unsigned int q[4];
+	char c1, c2, c3;
+	if (sscanf(ipAddr, "%u%c%u%c%u%c%u", q, &c1, q + 1, &c2, q + 2, &c3, q + 3) != 7)
+		return -1;
+	if (c1 != '.' || c2 != '.' || c3 != '.')
+		return -1;
+	for (int i = 0; i < 4; ++i)
+	{
+		if (q[i] > 255)
+			return -1;
+		quads[i] = (BYTE)q[i];
+	}
+	return 0;
+}
+
+UINT32 CompanionCrc32(const BYTE* data, size_t length)
+{
+	static const Crc32Table table;
+
+	UINT32 crc = 0xFFFFFFFF;
+	for (size_t i = 0; i < length; ++i)
+		crc = table.Entries[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+	return crc ^ 0xFFFFFFFF;
+}
+
+//------------------------------------------------------------------------------------------------------
+
+CompanionCodec::CompanionCodec()
+	: _open(false), _testPairing(false), _boxContext(NULL), _impContext(NULL), _contextHash(0), _recorder(NULL), _instanceCache(NULL)
+{
+	memset(_companionKey, 0, sizeof(_companionKey));
+	memset(_targetAddr, 0, sizeof(_targetAddr));
+	memset(&_guid, 0, sizeof(_guid));
+}
+
+CompanionCodec::~CompanionCodec()
+{
+	Close();
+}
+
+COMPANION_RESULT CompanionCodec::Open(const CompanionPairingInfo& pairing)
+{
+	Close();
+
+	if (ParseIPv4(pairing.TargetIPAddr.c_str(), _targetAddr) != 0)
+		return COMPANION_FAIL;
+
+	_targetIPAddr = pairing.TargetIPAddr;
+
+	if (pairing.DeviceKey.empty())
+	{
+		// Encoding 0 indicates a "test" pairing is to be used.  This only works for nondebug builds.
+		_testPairing = true;
+		_deviceId = COMPANION_TEST_DEVICE_ID;
+		_open = true;
+		return COMPANION_OK;
+	}
+
+	// A pairing key is 8 characters; the protocol requires 16, so the convention is to duplicate it.
+	std::string key = pairing.DeviceKey;
+	if (key.length() == COMPANION_KEY_LENGTH_IN_BYTES && strcasecmp(pairing.DeviceId.c_str(), COMPANION_PAIR_DEVICE_ID) == 0)
+		key += key;
+
+	if (key.length() != COMPANION_KEY_LENGTH_IN_BYTES * 2)
+		return COMPANION_FAIL;
+
+	for (int i = 0; i < COMPANION_KEY_LENGTH_IN_BYTES; ++i)
+	{
+		if (hexToByte(key.c_str() + i * 2, &_companionKey[i]) != 0)
+			return COMPANION_FAIL;
+	}
+
+	if (GuidFromString(pairing.DeviceId.c_str(), &_guid) != 0)
+		return COMPANION_FAIL;
+
+	_deviceId = pairing.DeviceId;
+
+	if (CSParve64_OpenContext(&_boxContext, CompanionConfig, CompanionSBox) != CSPARVE64_OK)
+		return COMPANION_FAIL;
+
+	COMPANION_PROBE3(instance_start, _deviceId.c_str(), pairing.SeqNum, 0);
+
+	UINT32 hi, lo;
+	UINT32 source = 0;
+	SharedInstance shared;
+	if (_instanceCache != NULL && _instanceCache->Find(_companionKey, _guid, &shared)
+		&& CSParve64_ImportInstance(_boxContext, shared.State, CSPARVE64_INSTANCE_STATE_SIZE, &hi, &lo, &_impContext) == CSPARVE64_OK
+		&& hi == shared.HiHash && lo == shared.LoHash)
+	{
+		// Another process derived this instance already.
+		source = 1;
+	}
+	else
+	{
+		if (_impContext != NULL)
+		{
+			CSParve64_Destroy(_impContext);
+			_impContext = NULL;
+		}
+		if (CSParve64_Create(_boxContext, _companionKey, (const BYTE*)&_guid, sizeof(_guid), &hi, &lo, &_impContext) != CSPARVE64_OK)
+		{
+			COMPANION_PROBE5(instance_done, _deviceId.c_str(), pairing.SeqNum, 0, COMPANION_FAIL, source);
+			Close();
+			return COMPANION_FAIL;
+		}
+
+		shared.HiHash = hi;
+		shared.LoHash = lo;
+		if (_instanceCache != NULL && CSParve64_ExportInstance(_impContext, shared.State, CSPARVE64_INSTANCE_STATE_SIZE) == CSPARVE64_OK)
+			_instanceCache->Insert(_companionKey, _guid, shared);
+	}
+	COMPANION_PROBE5(instance_done, _deviceId.c_str(), pairing.SeqNum, CSPARVE64_INSTANCE_STATE_SIZE, COMPANION_OK, source);
+
+	_contextHash = (((UINT64)hi) << 32) | lo;
+	_testPairing = false;
+	_open = true;
+
+	if (_cacheOptions.PrecomputeRemoteKeys)
+		PrecomputeBodies(RemoteKeyCommands());
+
+	return COMPANION_OK;
+}
+
+void CompanionCodec::Close()
+{
+	if (_impContext != NULL)
+	{
+		CSParve64_Destroy(_impContext);
+		_impContext = NULL;
+	}
+	if (_boxContext != NULL)
+	{
+		CSParve64_CloseContext(_boxContext);
+		_boxContext = NULL;
+	}
+	_open = false;
+	_testPairing = false;
+	_contextHash = 0;
+
+	// Cached bodies belong to the pairing that produced them.
+	_bodyCache.Clear();
+	_responseCache.Clear();
+}
+
+// Saved state layout, big-endian:
+//   [4 magic][2 version][2 flags][4 seqNum][4 IP address][16 GUID][8 device key]
+//   [CSPARVE64_INSTANCE_STATE_SIZE instance][1 device id length][device id][4 CRC-32 of all before]
+#define COMPANION_STATE_MAGIC       0x4D525753      // "MRWS"
+#define COMPANION_STATE_FLAG_TEST   0x0001
+#define COMPANION_STATE_FIXED_SIZE  (40 + CSPARVE64_INSTANCE_STATE_SIZE)
+
+COMPANION_RESULT CompanionCodec::SaveState(UINT32 seqNum, std::vector<BYTE>* state) const
+{
+	if (!_open || _deviceId.length() > COMPANION_STATE_MAX_ID)
+		return COMPANION_FAIL;
+
+	state->assign(COMPANION_STATE_FIXED_SIZE + 1 + _deviceId.length() + 4, 0);
+	BYTE* p = &(*state)[0];
+
+	UInt32ToBytes(COMPANION_STATE_MAGIC, p);
+	UInt32ToBytes(((UINT32)COMPANION_STATE_VERSION << 16) | (_testPairing ? COMPANION_STATE_FLAG_TEST : 0), p + 4);
+	UInt32ToBytes(seqNum, p + 8);
+	memcpy(p + 12, _targetAddr, 4);
+
+	if (!_testPairing)
+	{
+		memcpy(p + 16, &_guid, sizeof(_guid));
+		memcpy(p + 32, _companionKey, COMPANION_KEY_LENGTH_IN_BYTES);
+		if (CSParve64_ExportInstance(_impContext, p + 40, CSPARVE64_INSTANCE_STATE_SIZE) != CSPARVE64_OK)
+			return COMPANION_FAIL;
+	}
+
+	p += COMPANION_STATE_FIXED_SIZE;
+	*p++ = (BYTE)_deviceId.length();
+	memcpy(p, _deviceId.data(), _deviceId.length());
+	p += _deviceId.length();
+
+	UInt32ToBytes(CompanionCrc32(&(*state)[0], p - &(*state)[0]), p);
+	return COMPANION_OK;
+}
+
+COMPANION_RESULT CompanionCodec::RestoreState(const BYTE* state, size_t length, UINT32* seqNum)
+{
+	Close();
+
+	if (state == NULL || length < COMPANION_STATE_FIXED_SIZE + 1 + 4 || length > COMPANION_STATE_MAX_SIZE)
+		return COMPANION_E_FORMAT;
+
+	UINT32 idLength = state[COMPANION_STATE_FIXED_SIZE];
+	if (length != COMPANION_STATE_FIXED_SIZE + 1 + idLength + 4
+		|| BytesToUInt32(state) != COMPANION_STATE_MAGIC
+		|| (BytesToUInt32(state + 4) >> 16) != COMPANION_STATE_VERSION
+		|| BytesToUInt32(state + length - 4) != CompanionCrc32(state, length - 4))
+		return COMPANION_E_FORMAT;
+
+	UINT32 flags = BytesToUInt32(state + 4) & 0xFFFF;
+	char ipAddr[16];
+	memcpy(_targetAddr, state + 12, 4);
+	snprintf(ipAddr, sizeof(ipAddr), "%u.%u.%u.%u", _targetAddr[0], _targetAddr[1], _targetAddr[2], _targetAddr[3]);
+	_targetIPAddr = ipAddr;
+	_deviceId.assign((const char*)state + COMPANION_STATE_FIXED_SIZE + 1, idLength);
+
+	if (flags & COMPANION_STATE_FLAG_TEST)
+	{
+		_testPairing = true;
+		_open = true;
+		*seqNum = BytesToUInt32(state + 8);
+		return COMPANION_OK;
+	}
+
+	memcpy(&_guid, state + 16, sizeof(_guid));
+	memcpy(_companionKey, state + 32, COMPANION_KEY_LENGTH_IN_BYTES);
+
+	if (CSParve64_OpenContext(&_boxContext, CompanionConfig, CompanionSBox) != CSPARVE64_OK)
+		return COMPANION_FAIL;
+
+	// The import checks the instance against the context's keys, so state saved under a different
+	// CompanionConfig is refused rather than producing bodies the STB cannot read.
+	COMPANION_PROBE3(instance_start, _deviceId.c_str(), BytesToUInt32(state + 8), 0);
+	UINT32 hi, lo;
+	if (CSParve64_ImportInstance(_boxContext, state + 40, CSPARVE64_INSTANCE_STATE_SIZE, &hi, &lo, &_impContext) != CSPARVE64_OK)
+	{
+		COMPANION_PROBE5(instance_done, _deviceId.c_str(), BytesToUInt32(state + 8), 0, COMPANION_E_FORMAT, 2);
+		Close();
+		return COMPANION_E_FORMAT;
+	}
+	COMPANION_PROBE5(instance_done, _deviceId.c_str(), BytesToUInt32(state + 8), CSPARVE64_INSTANCE_STATE_SIZE, COMPANION_OK, 2);
+
+	_contextHash = (((UINT64)hi) << 32) | lo;
+	_testPairing = false;
+	_open = true;
+	*seqNum = BytesToUInt32(state + 8);
+
+	if (_cacheOptions.PrecomputeRemoteKeys)
+		PrecomputeBodies(RemoteKeyCommands());
+
+	return COMPANION_OK;
+}
+
+UINT32 CompanionCodec::EncodedLength(UINT32 plainLength)
+{
+	// Data must be a multiple of 8 bytes for the encrypt function.
+	return (plainLength + COMPANION_OVERHEAD_SIZE + 0x07) & ~0x07;
+}
+
+COMPANION_RESULT CompanionCodec::EncodeBody(const char* plain, UINT32 plainLength, BYTE* body, UINT32 bodyLength) const
+{
+	if (!_open || _testPairing || bodyLength != EncodedLength(plainLength))
+		return COMPANION_FAIL;
+
+	UInt32ToBytes(plainLength, body);                                                   // 4 bytes of length at header.
+	memcpy(body + COMPANION_ORIG_LENGTH_SIZE, plain, plainLength);                      // Plaintext goes after the header.
+	memset(body + COMPANION_ORIG_LENGTH_SIZE + plainLength, 0, bodyLength - plainLength - COMPANION_OVERHEAD_SIZE);
+	UInt64ToBytes(_contextHash, body + bodyLength - COMPANION_HASH_SIZE);               // Write hash at end of buffer.
+
+	UINT32 hi, lo;
+	if (CSParve64_Encode(_impContext, body, bodyLength, &hi, &lo) != CSPARVE64_OK)
+		return COMPANION_FAIL;
+
+	return COMPANION_OK;
+}
+
+COMPANION_RESULT CompanionCodec::DecodeBody(BYTE* body, UINT32 bodyLength, UINT32* plainLength) const
+{
+	if (!_open || _testPairing)
+		return COMPANION_FAIL;
+	if (bodyLength < COMPANION_OVERHEAD_SIZE)
+		return COMPANION_E_FORMAT;
+
+	UINT32 hi, lo;
+	if (CSParve64_Decode(_impContext, body, bodyLength, &hi, &lo) != CSPARVE64_OK)
+		return COMPANION_FAIL;
+
+	// EncodeBody ends every body with the context hash; a body that was altered, or encoded under
+	// another pairing, does not decode back to it.
+	BYTE expected[COMPANION_HASH_SIZE];
+	UInt64ToBytes(_contextHash, expected);
+	if (memcmp(body + bodyLength - COMPANION_HASH_SIZE, expected, COMPANION_HASH_SIZE) != 0)
+		return COMPANION_E_SIGNATURE;
+
+	UINT32 origLen = BytesToUInt32(body);
+	if (origLen > bodyLength - COMPANION_OVERHEAD_SIZE)
+		return COMPANION_E_FORMAT;
+
+	*plainLength = origLen;
+	return COMPANION_OK;
+}
+
+COMPANION_RESULT CompanionCodec::EncodeBlock(BYTE* block, UINT32 length) const
+{
+	if (!_open || _testPairing)
+		return COMPANION_FAIL;
+
+	UINT32 hi, lo;
+	if (CSParve64_Encode(_impContext, block, length, &hi, &lo) != CSPARVE64_OK)
+		return COMPANION_FAIL;
+
+	return COMPANION_OK;
+}
+
+COMPANION_RESULT CompanionCodec::DecodeBlock(BYTE* block, UINT32 length) const
+{
+	if (!_open || _testPairing || length < COMPANION_HASH_SIZE)
+		return COMPANION_FAIL;
+
+	UINT32 hi, lo;
+	if (CSParve64_Decode(_impContext, block, length, &hi, &lo) != CSPARVE64_OK)
+		return COMPANION_FAIL;
+
+	// Any change to the ciphertext scrambles the trailing hash.
+	BYTE expected[COMPANION_HASH_SIZE];
+	UInt64ToBytes(_contextHash, expected);
+	if (memcmp(block + length - COMPANION_HASH_SIZE, expected, COMPANION_HASH_SIZE) != 0)
+		return COMPANION_E_SIGNATURE;
+
+	return COMPANION_OK;
+}
+
+void CompanionCodec::FormatSignature(BYTE* signature, UINT32 seqNum, UINT32 length) const
+{
+	UInt32ToBytes(seqNum, signature);
+	UInt32ToBytes(length, signature + 4);
+	memcpy(signature + 8, _targetAddr, 4);
+	memcpy(signature + 12, &_guid, 4);
+}
+
+COMPANION_RESULT CompanionCodec::SignatureHash(UINT32 seqNum, UINT32 length, UINT64* hash) const
+{
+	if (!_open || _testPairing)
+		return COMPANION_FAIL;
+
+	BYTE signature[COMPANION_SIGNATURE_SIZE];
+	FormatSignature(signature, seqNum, length);
+
+	UINT32 hi, lo;
+	if (CSParve64_ComputeHash(_boxContext, _companionKey, signature, sizeof(signature), &hi, &lo) != CSPARVE64_OK)
+		return COMPANION_FAIL;
+
+	*hash = (((UINT64)hi) << 32) | lo;
+	return COMPANION_OK;
+}
+
+COMPANION_RESULT CompanionCodec::Sign(UINT32 seqNum, UINT32 length, char* signature) const
+{
+	COMPANION_PROBE3(sign_start, _deviceId.c_str(), seqNum, length);
+	UINT64 hash;
+	COMPANION_RESULT result = SignatureHash(seqNum, length, &hash);
+	COMPANION_PROBE4(sign_done, _deviceId.c_str(), seqNum, length, result);
+	if (result != COMPANION_OK)
+		return result;
+
+	snprintf(signature, COMPANION_SIGNATURE_CHARS + 1, "%08X%08X%016llX", seqNum, length, (unsigned long long)hash);
+	return COMPANION_OK;
+}
+
+COMPANION_RESULT CompanionCodec::Verify(const char* signature, UINT32 signatureLength, UINT32* seqNum, UINT32* length) const
+{
+	COMPANION_PROBE3(verify_start, _deviceId.c_str(), 0, signatureLength);
+	if (signature == NULL || signatureLength != COMPANION_SIGNATURE_CHARS)
+	{
+		COMPANION_PROBE4(verify_done, _deviceId.c_str(), 0, 0, COMPANION_E_SIGNATURE);
+		return COMPANION_E_SIGNATURE;
+	}
+
+	UINT64 rspSeq, rspLen, rspHash;
+	if (HexToUInt64(signature, 8, &rspSeq) != 0
+		|| HexToUInt64(signature + 8, 8, &rspLen) != 0
+		|| HexToUInt64(signature + 16, 16, &rspHash) != 0)
+	{
+		COMPANION_PROBE4(verify_done, _deviceId.c_str(), 0, 0, COMPANION_E_SIGNATURE);
+		return COMPANION_E_SIGNATURE;
+	}
+
+	UINT64 hash;
+	COMPANION_RESULT result = SignatureHash((UINT32)rspSeq, (UINT32)rspLen, &hash);
+	if (result == COMPANION_OK && hash != rspHash)
+		result = COMPANION_E_SIGNATURE;
+	COMPANION_PROBE4(verify_done, _deviceId.c_str(), (UINT32)rspSeq, (UINT32)rspLen, result);
+	if (result != COMPANION_OK)
+		return result;
+
+	*seqNum = (UINT32)rspSeq;
+	*length = (UINT32)rspLen;
+	return COMPANION_OK;
+}
+
+COMPANION_RESULT CompanionCodec::BuildRequest(const char* plain, UINT32 plainLength, UINT32 seqNum, BYTE* body, UINT32 bodyLength, char* query, size_t querySize, char* signature) const
+{
+	if (_testPairing)
+	{
+		if (plainLength != 0)
+			memcpy(body, plain, plainLength);
+		snprintf(query, querySize, "/companion?enc=0&cid=%s", COMPANION_TEST_DEVICE_ID);
+		return COMPANION_OK;
+	}
+
+	// Same plaintext, same body: a cache hit leaves only the signature hash to compute.
+	std::string key, cached;
+	if (_bodyCache.IsEnabled())
+		key.assign(plain, plainLength);
+
+	COMPANION_PROBE3(encode_start, _deviceId.c_str(), seqNum, plainLength);
+	COMPANION_RESULT result;
+	if (!key.empty() && _bodyCache.Find(key, &cached) && cached.size() == bodyLength)
+	{
+		memcpy(body, cached.data(), bodyLength);
+		COMPANION_PROBE4(encode_done, _deviceId.c_str(), seqNum, bodyLength, COMPANION_OK);
+	}
+	else
+	{
+		result = EncodeBody(plain, plainLength, body, bodyLength);
+		COMPANION_PROBE4(encode_done, _deviceId.c_str(), seqNum, bodyLength, result);
+		if (result != COMPANION_OK)
+			return result;
+
+		if (!key.empty())
+			_bodyCache.Insert(key, std::string((const char*)body, bodyLength));
+	}
+
+	result = Sign(seqNum, bodyLength, signature);
+	if (result != COMPANION_OK)
+		return result;
+
+	snprintf(query, querySize, "/companion?hash=%s&cid=%s&seq=%08X", signature, _deviceId.c_str(), seqNum);
+	return COMPANION_OK;
+}
+
+COMPANION_RESULT CompanionCodec::EncodeRequest(const char* plain, UINT32 plainLength, UINT32 seqNum, CompanionRequest* request) const
+{
+	if (!_open)
+		return COMPANION_FAIL;
+
+	char query[160];
+	char sig[COMPANION_SIGNATURE_CHARS + 1];
+	request->SeqNum = seqNum;
+	request->Body.resize(_testPairing ? plainLength : EncodedLength(plainLength));
+
+	COMPANION_RESULT result = BuildRequest(plain, plainLength, seqNum, request->Body.empty() ? NULL : &request->Body[0], (UINT32)request->Body.size(), query, sizeof(query), sig);
+	if (result != COMPANION_OK)
+		return result;
+
+	request->Query = query;
+	if (_recorder != NULL)
+		_recorder->OnRequest(*this, _testPairing ? NULL : sig, *request, plain, plainLength);
+	return COMPANION_OK;
+}
+
+COMPANION_RESULT CompanionCodec::EncodeRequest(const char* plain, UINT32 plainLength, UINT32 seqNum, CompanionArena* arena, CompanionEnvelope* envelope) const
+{
+	if (!_open)
+		return COMPANION_FAIL;
+
+	char query[160];
+	char sig[COMPANION_SIGNATURE_CHARS + 1];
+	UINT32 bodyLength = _testPairing ? plainLength : EncodedLength(plainLength);
+	BYTE* body = (BYTE*)arena->Allocate(bodyLength);
+	if (body == NULL)
+		return COMPANION_FAIL;
+
+	COMPANION_RESULT result = BuildRequest(plain, plainLength, seqNum, body, bodyLength, query, sizeof(query), sig);
+	if (result != COMPANION_OK)
+		return result;
+
+	size_t queryLength = strlen(query);
+	char* arenaQuery = (char*)arena->Copy(query, queryLength + 1);
+	if (arenaQuery == NULL)
+		return COMPANION_FAIL;
+
+	envelope->Query = arenaQuery;
+	envelope->QueryLength = (UINT32)queryLength;
+	envelope->Body = body;
+	envelope->BodyLength = bodyLength;
+	envelope->SeqNum = seqNum;
+
+	if (_recorder != NULL)
+	{
+		CompanionRequest request;
+		request.Body.assign(body, body + bodyLength);
+		request.Query.assign(query, queryLength);
+		request.SeqNum = seqNum;
+		_recorder->OnRequest(*this, _testPairing ? NULL : sig, request, plain, plainLength);
+	}
+	return COMPANION_OK;
+}
+
+COMPANION_RESULT CompanionCodec::DecryptResponse(const char* signature, UINT32 signatureLength, const BYTE* body, UINT32 bodyLength, UINT32* rspSeq, std::string* plain) const
+{
+	UINT32 seqNum = 0, length = 0;
+	COMPANION_RESULT result = Verify(signature, signatureLength, &seqNum, &length);
+	if (result != COMPANION_OK)
+		return result;
+
+	*rspSeq = seqNum;
+	COMPANION_PROBE3(decode_start, _deviceId.c_str(), seqNum, bodyLength);
+	result = DecodeResponse(body, bodyLength, plain);
+	COMPANION_PROBE4(decode_done, _deviceId.c_str(), seqNum, result == COMPANION_OK ? (UINT32)plain->length() : 0, result);
+	if (_recorder != NULL)
+		_recorder->OnResponse(*this, signature, body, bodyLength, result == COMPANION_OK ? plain : NULL);
+	return result;
+}
+
+COMPANION_RESULT CompanionCodec::DecodeResponse(const BYTE* body, UINT32 bodyLength, std::string* plain) const
+{
+	if (!_open || _testPairing)
+		return COMPANION_FAIL;
+
+	std::string key;
+	if (_responseCache.IsEnabled())
+	{
+		key.assign((const char*)body, bodyLength);
+		if (_responseCache.Find(key, plain))
+			return COMPANION_OK;
+	}
+
+	std::vector<BYTE> decoded(body, body + bodyLength);
+	UINT32 plainLength = 0;
+	COMPANION_RESULT result = DecodeBody(decoded.empty() ? NULL : &decoded[0], bodyLength, &plainLength);
+	if (result != COMPANION_OK)
+		return result;
+
+	plain->assign((const char*)&decoded[COMPANION_ORIG_LENGTH_SIZE], plainLength);
+
+	if (!key.empty())
+		_responseCache.Insert(key, *plain);
+	return COMPANION_OK;
+}
+
+COMPANION_RESULT CompanionCodec::DecryptResponseInPlace(const char* signature, UINT32 signatureLength, BYTE* body, UINT32 bodyLength, UINT32* rspSeq, char** plain, UINT32* plainLength) const
+{
+	UINT32 seqNum = 0, length = 0;
+	COMPANION_RESULT result = Verify(signature, signatureLength, &seqNum, &length);
+	if (result != COMPANION_OK)
+		return result;
+
+	*rspSeq = seqNum;
+	if (!_open || _testPairing)
+		return COMPANION_FAIL;
+
+	// The recorder is shown the body as received, which decoding overwrites.
+	std::vector<BYTE> received;
+	if (_recorder != NULL)
+		received.assign(body, body + bodyLength);
+
+	COMPANION_PROBE3(decode_start, _deviceId.c_str(), seqNum, bodyLength);
+	std::string key, cached;
+	if (_responseCache.IsEnabled())
+		key.assign((const char*)body, bodyLength);
+
+	if (!key.empty() && _responseCache.Find(key, &cached) && cached.size() <= bodyLength)
+	{
+		// The plaintext is never longer than its body.
+		memcpy(body, cached.data(), cached.size());
+		*plain = (char*)body;
+		*plainLength = (UINT32)cached.size();
+	}
+	else
+	{
+		result = DecodeBody(body, bodyLength, &length);
+		if (result == COMPANION_OK)
+		{
+			*plain = (char*)body + COMPANION_ORIG_LENGTH_SIZE;
+			*plainLength = length;
+			if (!key.empty())
+				_responseCache.Insert(key, std::string(*plain, length));
+		}
+	}
+	COMPANION_PROBE4(decode_done, _deviceId.c_str(), seqNum, result == COMPANION_OK ? *plainLength : 0, result);
+
+	if (_recorder != NULL)
+	{
+		std::string decoded;
+		if (result == COMPANION_OK)
+			decoded.assign(*plain, *plainLength);
+		_recorder->OnResponse(*this, signature, received.empty() ? NULL : &received[0], bodyLength, result == COMPANION_OK ? &decoded : NULL);
+	}
+	return result;
+}
+
+void CompanionCodec::EnableCache(const CompanionCacheOptions& options)
+{
+	_cacheOptions = options;
+	_bodyCache.Configure(options.MaxBodies, options.MaxEntryBytes);
+	_responseCache.Configure(options.MaxResponses, options.MaxEntryBytes);
+
+	if (options.PrecomputeRemoteKeys && _open && !_testPairing)
+		PrecomputeBodies(RemoteKeyCommands());
+}
+
+UINT32 CompanionCodec::PrecomputeBodies(const std::vector<std::string>& commands)
+{
+	if (!_open || _testPairing || !_bodyCache.IsEnabled())
+		return 0;
+
+	UINT32 cached = 0;
+	std::vector<BYTE> body;
+	for (size_t i = 0; i < commands.size(); ++i)
+	{
+		const std::string& command = commands[i];
+		UINT32 bodyLength = EncodedLength((UINT32)command.length());
+		body.resize(bodyLength);
+		if (EncodeBody(command.data(), (UINT32)command.length(), &body[0], bodyLength) != COMPANION_OK)
+			continue;
+
+		_bodyCache.Insert(command, std::string((const char*)&body[0], bodyLength));
+		++cached;
+	}
+	return cached;
+}
+
+std::vector<std::string> CompanionCodec::RemoteKeyCommands()
+{
+	static const char* const keys[] =
+	{
+		"0", "1", "2", "3", "4", "5", "6", "7", "8", "9",
+		"up", "down", "left", "right", "select", "back", "exit", "menu", "guide", "info",
+		"chup", "chdown", "volup", "voldown", "mute", "last",
+		"play", "pause", "stop", "rec", "fwd", "rew", "skip", "replay",
+		"power", NULL
+	};
+
+	std::vector<std::string> commands;
+	for (int i = 0; keys[i] != NULL; ++i)
+		commands.push_back(std::string("op=key&k=") + keys[i]);
+	return commands;
+}
+
+bool CompanionCodec::IsIdempotent(const std::string& request)
+{
+	// MRCompanion recognizes hello by its op parameter alone; every other op acts on the STB.
+	size_t at = 0;
+	while (at < request.length())
+	{
+		size_t end = request.find('&', at);
+		if (end == std::string::npos)
+			end = request.length();
+		if (end - at >= 3 && strncasecmp(request.c_str() + at, "op=", 3) == 0)
+			return end - at == 8 && strncasecmp(request.c_str() + at + 3, "hello", 5) == 0;
+		at = end + 1;
+	}
+	return false;
+}
+
+//------------------------------------------------------------------------------------------------------
+
+CompanionSequence::CompanionSequence(UINT32 seqNum)
+	: _seqNum(seqNum)
+{
+}
+
+UINT32 CompanionSequence::Next()
+{
+	UINT32 current = _seqNum.load(std::memory_order_relaxed);
+	UINT32 next;
+	do
+	{
+		next = (current | 1) + 2;
+	} while (!_seqNum.compare_exchange_weak(current, next, std::memory_order_acq_rel, std::memory_order_relaxed));
+	return next;
+}
+
+bool CompanionSequence::InWindow(UINT32 seqNum) const
+{
+	INT32 seqDelta = (INT32)(Current() - seqNum);
+	return seqDelta >= 0 && seqDelta < COMPANION_SEQUENCE_WINDOW;
+}
+
+bool CompanionSequence::Accept(UINT32 rspSeq)
+{
+	UINT32 current = _seqNum.load(std::memory_order_relaxed);
+	for (;;)
+	{
+		INT32 seqDelta = (INT32)(current - rspSeq);
+		if (seqDelta >= 0 && seqDelta < COMPANION_SEQUENCE_WINDOW)
+			return false;
+		// If returned sequence is bigger than ours, or we are way off, use returned sequence number.
+		if (_seqNum.compare_exchange_weak(current, rspSeq | 1, std::memory_order_acq_rel, std::memory_order_relaxed))
+			return true;
+	}
+}
+
+bool CompanionSequence::AcceptForward(UINT32 rspSeq)
+{
+	UINT32 current = _seqNum.load(std::memory_order_relaxed);
+	for (;;)
+	{
+		if ((INT32)(current - rspSeq) >= 0)
+			return false;
+		if (_seqNum.compare_exchange_weak(current, rspSeq | 1, std::memory_order_acq_rel, std::memory_order_relaxed))
+			return true;
+	}
+}
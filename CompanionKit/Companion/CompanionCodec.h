@@ -0,0 +1,375 @@
+//--------------------------------------------------------------------------
+// <copyright file="CompanionCodec.h" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// Portable companion request/response encoding.
+// </summary>
+//--------------------------------------------------------------------------
+
+/*
+ Using the companion codec:
+ The encoding behind MRPairing's encryptRequest:/decryptResponse: pair, in portable C++, so that the
+ companion protocol can also be driven without Foundation (for instance from a Linux gateway).
+ A request body is laid out as
+    [4-byte plaintext length][plaintext][zero padding][8-byte context hash]
+ padded to a multiple of 8 bytes and encoded in place with CSParve64_Encode.  The signature carried in the
+ "hash=" query parameter (request) or the X-Mediaroom-Companion-Signature header (response) is
+    %08X(seq) %08X(body length) %016llX(CSParve64_ComputeHash over seq, length, IP address, GUID)
+ The codec is immutable once opened, so a single codec may be used by several threads at once.
+ Because the encoding has no nonce, encoded bodies and decoded responses can be memoized per pairing; see
+ EnableCache.  The caches are locked internally and are cleared whenever the codec is closed or reopened.
+ Sequence numbers are owned by CompanionSequence, which applies the decryptResponse: acceptance rules.
+ SaveState captures everything Open derives (parsed address and GUID, device key, CSParve64 instance state)
+ together with a sequence number, so that RestoreState can bring a codec back at launch without
+ CSParve64_Create's key setup or an op=hello to learn the sequence.  A saved sequence that has fallen
+ behind is corrected by CompanionSequence::Accept on the first response.  The state holds the device key.
+ A CompanionRecorder set with SetRecorder sees every request EncodeRequest builds and every response
+ DecryptResponse accepts, ciphertext and plaintext, for capturing traffic (CompanionCapture.h).  With a
+ SharedInstanceCache set, Open imports the CSParve64 instance another process already derived for the same
+ key and GUID instead of running CSParve64_Create, and shares the ones it derives (SharedInstanceCache.h).
+ Given a CompanionArena, EncodeRequest builds the query and body there instead of in a CompanionRequest, and
+ DecryptResponseInPlace decodes a received body where it lies, so a round trip need not touch the heap
+ (CompanionArena.h).
+ */
+
+#ifndef COMPANIONCODEC_H
+#define COMPANIONCODEC_H
+
+#include "CompanionCache.h"
+#include "CSParve64.h"
+#include "iOSGUIDS.h"
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#ifndef COMPANION_PORT
+#define COMPANION_PORT 53208
+#endif
+
+#ifndef COMPANION_KEY_LENGTH_IN_BYTES
+#define COMPANION_KEY_LENGTH_IN_BYTES 8
+#endif
+
+#define COMPANION_ORIG_LENGTH_SIZE  4
+#define COMPANION_HASH_SIZE         8
+#define COMPANION_OVERHEAD_SIZE     (COMPANION_ORIG_LENGTH_SIZE + COMPANION_HASH_SIZE)
+#define COMPANION_SIGNATURE_SIZE    16      // seq, length, IP address, first 4 bytes of GUID
+#define COMPANION_SIGNATURE_CHARS   32      // %08X%08X%016llX
+#define COMPANION_SEQUENCE_WINDOW   1000    // decryptResponse: resyncs when seqDelta is negative or beyond this
+
+#define COMPANION_SIGNATURE_HEADER  "X-Mediaroom-Companion-Signature"
+#define COMPANION_ENCODING_HEADER   "Content-Encoding"
+#define COMPANION_ENCODING_VALUE    "X-Mediaroom-Companion-Encoding"
+#define COMPANION_PAIR_DEVICE_ID    "E7AAEC8C-F035-488a-AB39-C9A40547459F"
+#define COMPANION_TEST_DEVICE_ID    "AB72527A-582D-4d6d-98DD-3DDCD4E00EC4"
+
+#ifndef _WIN32
+typedef unsigned short UINT16;
+#endif
+
+typedef long COMPANION_RESULT;
+
+#define COMPANION_OK            0L
+#define COMPANION_FAIL         -1L
+#define COMPANION_E_SIGNATURE  -2L     // signature is malformed or its hash does not match
+#define COMPANION_E_FORMAT     -3L     // decoded body is inconsistent with its length header
+#define COMPANION_E_TIMEOUT    -4L
+#define COMPANION_E_CONNECTION -5L
+#define COMPANION_E_HTTP       -6L     // the STB answered with a non-2xx status
+#define COMPANION_E_CANCELLED  -7L
+#define COMPANION_E_DUPLICATE  -8L     // the STB is already paired (pairingCompletion: answers 304)
+#define COMPANION_E_NOT_FOUND  -9L
+
+#define COMPANION_STATE_VERSION     1
+#define COMPANION_STATE_MAX_ID      64      // longest device id SaveState accepts
+#define COMPANION_STATE_MAX_SIZE    (45 + CSPARVE64_INSTANCE_STATE_SIZE + COMPANION_STATE_MAX_ID)
+
+/// <summary>
+/// CRC-32 (IEEE 802.3) of a buffer, used to check persisted companion state.
+/// </summary>
+UINT32 CompanionCrc32(const BYTE* data, size_t length);
+
+/// <summary>
+/// Pairing values needed to talk to one STB.  These mirror the MRPairing request fields.
+/// </summary>
+struct CompanionPairingInfo
+{
+	std::string TargetIPAddr;   // dotted IPv4 address of the STB
+	std::string DeviceId;       // cid, assigned by the STB or COMPANION_PAIR_DEVICE_ID when pairing
+	std::string DeviceKey;      // 16 hex characters; empty selects the enc=0 test pairing
+	UINT32      SeqNum;         // last sequence number used with this pairing
+
+	CompanionPairingInfo() : SeqNum(0) {}
+};
+
+/// <summary>
+/// An encoded request ready to be posted to /companion.
+/// </summary>
+struct CompanionRequest
+{
+	std::vector<BYTE> Body;
+	std::string       Query;        // path and query string, e.g. /companion?hash=...&cid=...&seq=...
+	UINT32            SeqNum;
+};
+
+/// <summary>
+/// A request EncodeRequest built in an arena.  Valid until the arena is reset.
+/// </summary>
+struct CompanionEnvelope
+{
+	const char* Query;
+	UINT32      QueryLength;
+	BYTE*       Body;
+	UINT32      BodyLength;
+	UINT32      SeqNum;
+
+	CompanionEnvelope() : Query(""), QueryLength(0), Body(NULL), BodyLength(0), SeqNum(0) {}
+};
+
+class CompanionArena;
+class CompanionCodec;
+class SharedInstanceCache;
+
+/// <summary>
+/// Receives the traffic a codec encodes and decodes.  Called on whichever thread uses the codec, so an
+/// implementation shared between threads or codecs must lock.
+/// </summary>
+class CompanionRecorder
+{
+public:
+
+	virtual ~CompanionRecorder() {}
+
+	/// <summary>
+	/// A request EncodeRequest built.  signature is NULL for the test pairing.
+	/// </summary>
+	virtual void OnRequest(const CompanionCodec& codec, const char* signature, const CompanionRequest& request, const char* plain, UINT32 plainLength) = 0;
+
+	/// <summary>
+	/// A response whose signature verified.  plain is NULL if the body did not decode.
+	/// </summary>
+	virtual void OnResponse(const CompanionCodec& codec, const char* signature, const BYTE* body, UINT32 bodyLength, const std::string* plain) = 0;
+};
+
+/// <summary>
+/// Opt-in memoization of encoded request bodies and decoded responses.
+/// </summary>
+struct CompanionCacheOptions
+{
+	UINT32 MaxBodies;               // plaintext -> encoded body entries; 0 disables
+	UINT32 MaxResponses;            // encoded response -> plaintext entries; 0 disables
+	UINT32 MaxEntryBytes;           // larger bodies are never cached
+	bool   PrecomputeRemoteKeys;    // encode RemoteKeyCommands() when a pairing is opened
+
+	CompanionCacheOptions() : MaxBodies(0), MaxResponses(0), MaxEntryBytes(4096), PrecomputeRemoteKeys(false) {}
+};
+
+class CompanionCodec
+{
+public:
+
+	CompanionCodec();
+	~CompanionCodec();
+
+	/// <summary>
+	/// Derive the encryption state for a pairing.  An empty device key selects the unencrypted test pairing.
+	/// </summary>
+	COMPANION_RESULT Open(const CompanionPairingInfo& pairing);
+
+	/// <summary>
+	/// Release the CSParve64 context and instance.
+	/// </summary>
+	void Close();
+
+	/// <summary>
+	/// Serialize the opened pairing and seqNum into a CRC-checked blob of at most COMPANION_STATE_MAX_SIZE bytes.
+	/// </summary>
+	COMPANION_RESULT SaveState(UINT32 seqNum, std::vector<BYTE>* state) const;
+
+	/// <summary>
+	/// Open from a SaveState blob and return the sequence number saved with it.  COMPANION_E_FORMAT if the
+	/// blob is damaged or from another version or CSParve64 configuration.
+	/// </summary>
+	COMPANION_RESULT RestoreState(const BYTE* state, size_t length, UINT32* seqNum);
+
+	bool IsOpen() const { return _open; }
+	bool IsTestPairing() const { return _testPairing; }
+	const std::string& TargetIPAddr() const { return _targetIPAddr; }
+	const std::string& DeviceId() const { return _deviceId; }
+	const BYTE* TargetAddr() const { return _targetAddr; }
+	UINT64 ContextHash() const { return _contextHash; }
+
+	/// <summary>
+	/// Size of the encoded body for a plaintext of the given length.
+	/// </summary>
+	static UINT32 EncodedLength(UINT32 plainLength);
+
+	/// <summary>
+	/// Lay out and encode a plaintext into body, which must hold EncodedLength(plainLength) bytes.
+	/// </summary>
+	COMPANION_RESULT EncodeBody(const char* plain, UINT32 plainLength, BYTE* body, UINT32 bodyLength) const;
+
+	/// <summary>
+	/// Decode a body in place and check that it ends with the context hash.  On success the plaintext starts
+	/// at body + COMPANION_ORIG_LENGTH_SIZE.
+	/// </summary>
+	COMPANION_RESULT DecodeBody(BYTE* body, UINT32 bodyLength, UINT32* plainLength) const;
+
+	/// <summary>
+	/// Encode a caller-laid-out block in place.  length must be a multiple of 8 and the block should end
+	/// with the 8-byte ContextHash(), which DecodeBlock checks.
+	/// </summary>
+	COMPANION_RESULT EncodeBlock(BYTE* block, UINT32 length) const;
+
+	/// <summary>
+	/// Decode a block in place and check that it ends with the context hash.
+	/// </summary>
+	COMPANION_RESULT DecodeBlock(BYTE* block, UINT32 length) const;
+
+	/// <summary>
+	/// Compute the 64-bit signature hash for a sequence number and body length.
+	/// </summary>
+	COMPANION_RESULT SignatureHash(UINT32 seqNum, UINT32 length, UINT64* hash) const;
+
+	/// <summary>
+	/// Format the %08X%08X%016llX signature.  signature must hold COMPANION_SIGNATURE_CHARS + 1 characters.
+	/// </summary>
+	COMPANION_RESULT Sign(UINT32 seqNum, UINT32 length, char* signature) const;
+
+	/// <summary>
+	/// Check a received signature and return the sequence number and body length it carries.
+	/// </summary>
+	COMPANION_RESULT Verify(const char* signature, UINT32 signatureLength, UINT32* seqNum, UINT32* length) const;
+
+	/// <summary>
+	/// Build the complete request (body and query) for a plaintext command and sequence number.
+	/// </summary>
+	COMPANION_RESULT EncodeRequest(const char* plain, UINT32 plainLength, UINT32 seqNum, CompanionRequest* request) const;
+
+	/// <summary>
+	/// As above, allocating the query and body from arena.
+	/// </summary>
+	COMPANION_RESULT EncodeRequest(const char* plain, UINT32 plainLength, UINT32 seqNum, CompanionArena* arena, CompanionEnvelope* envelope) const;
+
+	/// <summary>
+	/// Decode a received body into plain without modifying it, using the response cache when enabled.
+	/// </summary>
+	COMPANION_RESULT DecodeResponse(const BYTE* body, UINT32 bodyLength, std::string* plain) const;
+
+	/// <summary>
+	/// The decryptResponse: equivalent: Verify the signature, then DecodeResponse the body.  rspSeq is set as
+	/// soon as the signature verifies, even if the body then fails to decode.
+	/// </summary>
+	COMPANION_RESULT DecryptResponse(const char* signature, UINT32 signatureLength, const BYTE* body, UINT32 bodyLength, UINT32* rspSeq, std::string* plain) const;
+
+	/// <summary>
+	/// Like DecryptResponse, but decodes body in place: on success plain points into it.  The response cache
+	/// and the recorder, when set, still cost a copy.
+	/// </summary>
+	COMPANION_RESULT DecryptResponseInPlace(const char* signature, UINT32 signatureLength, BYTE* body, UINT32 bodyLength, UINT32* rspSeq, char** plain, UINT32* plainLength) const;
+
+	/// <summary>
+	/// Report traffic to recorder, or to nobody if NULL.  Survives Open/Close; set it before the codec is
+	/// shared between threads.
+	/// </summary>
+	void SetRecorder(CompanionRecorder* recorder) { _recorder = recorder; }
+	CompanionRecorder* Recorder() const { return _recorder; }
+
+	/// <summary>
+	/// Look up and share derived instances in cache, or in none if NULL.  Used by Open; survives Close.
+	/// </summary>
+	void SetInstanceCache(SharedInstanceCache* cache) { _instanceCache = cache; }
+	SharedInstanceCache* InstanceCache() const { return _instanceCache; }
+
+	/// <summary>
+	/// Configure the body and response caches.  Takes effect immediately and survives Open/Close.
+	/// </summary>
+	void EnableCache(const CompanionCacheOptions& options);
+
+	/// <summary>
+	/// Encode each command into the body cache.  Returns the number of bodies now cached for them.
+	/// </summary>
+	UINT32 PrecomputeBodies(const std::vector<std::string>& commands);
+
+	/// <summary>
+	/// The op=key requests for the remote-control key set.
+	/// </summary>
+	static std::vector<std::string> RemoteKeyCommands();
+
+	/// <summary>
+	/// True for requests that only read STB state, so that sending one twice does no harm.  Key presses
+	/// are not: a repeated press acts twice.
+	/// </summary>
+	static bool IsIdempotent(const std::string& request);
+
+	CompanionCacheStats BodyCacheStats() const { return _bodyCache.Stats(); }
+	CompanionCacheStats ResponseCacheStats() const { return _responseCache.Stats(); }
+
+private:
+
+	CompanionCodec(const CompanionCodec&);
+	CompanionCodec& operator=(const CompanionCodec&);
+
+	void FormatSignature(BYTE* signature, UINT32 seqNum, UINT32 length) const;
+	COMPANION_RESULT BuildRequest(const char* plain, UINT32 plainLength, UINT32 seqNum, BYTE* body, UINT32 bodyLength, char* query, size_t querySize, char* signature) const;
+
+	bool        _open;
+	bool        _testPairing;
+	void*       _boxContext;
+	void*       _impContext;
+	UINT64      _contextHash;
+	BYTE        _companionKey[COMPANION_KEY_LENGTH_IN_BYTES];
+	BYTE        _targetAddr[4];
+	GUID        _guid;
+	std::string _targetIPAddr;
+	std::string _deviceId;
+
+	CompanionRecorder*        _recorder;
+	SharedInstanceCache*      _instanceCache;
+	CompanionCacheOptions     _cacheOptions;
+	mutable CompanionLruCache _bodyCache;       // plaintext -> encoded body
+	mutable CompanionLruCache _responseCache;   // encoded body -> plaintext
+};
+
+/// <summary>
+/// Sequence numbers for one pairing.  Numbers are odd and advance by 2, as in encryptRequest:.
+/// Safe for concurrent use.
+/// </summary>
+class CompanionSequence
+{
+public:
+
+	explicit CompanionSequence(UINT32 seqNum = 0);
+
+	/// <summary>
+	/// Allocate the next sequence number.
+	/// </summary>
+	UINT32 Next();
+
+	UINT32 Current() const { return _seqNum.load(std::memory_order_acquire); }
+
+	/// <summary>
+	/// True if seqNum is no newer than the current number and less than COMPANION_SEQUENCE_WINDOW behind it.
+	/// </summary>
+	bool InWindow(UINT32 seqNum) const;
+
+	/// <summary>
+	/// Apply the decryptResponse: rule to a response sequence number: if it is ahead of ours, or we are
+	/// way off, use it.  Returns true if the sequence was resynchronized.
+	/// </summary>
+	bool Accept(UINT32 rspSeq);
+
+	/// <summary>
+	/// Like Accept, but only ever moves forward.  Used when several requests are in flight and an old
+	/// response must not pull the sequence back behind requests that are still outstanding.
+	/// </summary>
+	bool AcceptForward(UINT32 rspSeq);
+
+private:
+
+	std::atomic<UINT32> _seqNum;
+};
+
+#endif
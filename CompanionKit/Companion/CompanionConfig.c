@@ -0,0 +1,54 @@
+//--------------------------------------------------------------------------
+// <copyright file="CompanionConfig.c" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// CSParve64 context configuration used by the companion protocol.
+// </summary>
+//--------------------------------------------------------------------------
+
+#include "CompanionConfig.h"
+
+const UINT32 CompanionConfig[COMPANION_CONFIG_LENGTH] =
+{
+    0,
+    0x47e83bd5, // Key1
+    0x9028abf7, // Key2
+    0xe6577c0d, // Key3
+    
+    0x30b31464, // WordSwap
+    0x3914a7b2,
+    0x77b1c677,
+    0xa18a09cb,
+    0x58ba62e5,
+    0x5ae810ce,
+    0x0d60f6aa,
+    0xe05e24f8,
+    0xacbb966d, // Reversible
+    0x9d8bccf1,
+    0x792c913c,
+    0xb0d4e493,
+    0x65daf8ee,
+    0x18a13319,
+    0x6cc3629c,
+    0x40837197
+};      // The values above for Key1, Key2, Key3 are the defaults for the STB.
+
+const BYTE CompanionSBox[COMPANION_SBOX_LENGTH] ={ 
+    0x30, 0xb3, 0x66, 0x64, 0x00, 0x01, 0x00, 0x00, 0x12, 0x70, 0x59, 0xff, 0x9e, 0xed, 0x97, 0x07,
+    0xc9, 0xf9, 0xfe, 0x98, 0xe8, 0x15, 0x5a, 0x60, 0xb7, 0xd2, 0xbb, 0x0c, 0xa5, 0xec, 0xc8, 0x87,
+    0x08, 0xe2, 0x9b, 0xef, 0x5d, 0x6e, 0x79, 0x23, 0x87, 0x5f, 0xef, 0xa5, 0xaa, 0x2f, 0x9c, 0x63,
+    0x87, 0x2b, 0x77, 0xc4, 0x7e, 0xc7, 0xe2, 0x86, 0xa0, 0xbe, 0x35, 0x88, 0x17, 0x31, 0xc3, 0xd3,
+    0xba, 0x8c, 0x58, 0x92, 0x68, 0xda, 0xf9, 0xb2, 0x95, 0x87, 0xd3, 0x0b, 0x6b, 0x83, 0x9b, 0xaf,
+    0x8f, 0x7d, 0x11, 0x6f, 0xc9, 0x95, 0x0d, 0xb1, 0x5b, 0x7d, 0xbb, 0x68, 0xef, 0x5e, 0xf3, 0x7c,
+    0x21, 0x2e, 0x24, 0xd6, 0x00, 0x82, 0x37, 0x48, 0x2d, 0x37, 0x04, 0xb7, 0x27, 0xfa, 0x78, 0x61,
+    0xe1, 0x0d, 0xd6, 0x71, 0xd8, 0xe5, 0x0c, 0x03, 0x34, 0xfb, 0xa4, 0x21, 0x71, 0x75, 0x39, 0x43,
+    0x55, 0xf9, 0x29, 0x0a, 0x04, 0xad, 0x46, 0x1f, 0x14, 0x9f, 0x6e, 0x54, 0xc7, 0x8d, 0x10, 0xe0,
+    0xb0, 0xfa, 0x88, 0x00, 0x48, 0x23, 0x55, 0xd2, 0x75, 0x0f, 0x79, 0x24, 0x81, 0x83, 0x56, 0x4c,
+    0x2e, 0xf3, 0x35, 0xa1, 0x85, 0xcc, 0x03, 0xa4, 0x76, 0x2a, 0xeb, 0xde, 0x46, 0xfa, 0x19, 0x99,
+    0x51, 0xa2, 0xb4, 0x9e, 0xa2, 0x20, 0x29, 0x9e, 0xad, 0xd2, 0x6a, 0x20, 0x28, 0x47, 0x6d, 0x70,
+    0x04, 0x68, 0xbb, 0xc8, 0x88, 0x29, 0x51, 0xd2, 0x52, 0x8b, 0xc5, 0x40, 0x73, 0xde, 0xd8, 0x57,
+    0xbf, 0xae, 0xae, 0x96, 0xee, 0x0a, 0x28, 0x77, 0x0d, 0x76, 0xf4, 0x52, 0xfa, 0x98, 0x44, 0x70,
+    0xfa, 0x11, 0x32, 0xc6, 0x4d, 0xfe, 0xfc, 0x3b, 0x45, 0x78, 0x59, 0x1c, 0x6d, 0x3a, 0x88, 0x52,
+    0x1a, 0x42, 0x81, 0x0d, 0xe8, 0x67, 0xaf, 0x05, 0x14, 0xc0, 0x07, 0xc2, 0xe9, 0x80, 0xad, 0x21
+};
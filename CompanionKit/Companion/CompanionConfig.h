@@ -0,0 +1,31 @@
+//--------------------------------------------------------------------------
+// <copyright file="CompanionConfig.h" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// CSParve64 context configuration used by the companion protocol.
+// </summary>
+//--------------------------------------------------------------------------
+
+#ifndef COMPANIONCONFIG_H
+#define COMPANIONCONFIG_H
+
+#include "CSParve64.h"
+
+#define COMPANION_CONFIG_LENGTH 20
+#define COMPANION_SBOX_LENGTH   256
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    // Configuration and substitution box passed to CSParve64_OpenContext for companion requests.
+    // The values for Key1, Key2, Key3 are the defaults for the STB.
+    extern const UINT32 CompanionConfig[COMPANION_CONFIG_LENGTH];
+    extern const BYTE   CompanionSBox[COMPANION_SBOX_LENGTH];
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,73 @@
+//--------------------------------------------------------------------------
+// <copyright file="CompanionProbes.h" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// Statically defined tracepoints at the boundaries of the companion pipeline.
+// </summary>
+//--------------------------------------------------------------------------
+
+/*
+ Using the companion probes:
+ Counters give averages; a single slow button press needs the time of each of its stages.  Where
+ <sys/sdt.h> is available (Linux with systemtap-sdt-dev installed), the codec and the gateway's
+ connections carry USDT probes of provider "companion".  A probe is a nop in the code and a note in the
+ binary until a tracer attaches to it, so they stay in production builds.  Elsewhere, or with
+ COMPANION_NO_PROBES defined, the macros expand to nothing.
+
+ Every probe carries the cid (a C string), the sequence number and a byte count; the "done" probes add
+ the COMPANION_RESULT.  In the order a request sees them:
+
+    probe           arg0   arg1   arg2                          arg3     where
+    instance_start  cid    seq    0                                      CompanionCodec::Open, RestoreState
+    instance_done   cid    seq    CSPARVE64_INSTANCE_STATE_SIZE result   arg4: 0 created, 1 shared, 2 restored
+    encode_start    cid    seq    plaintext bytes                        CompanionCodec::EncodeRequest
+    encode_done     cid    seq    body bytes                    result   (a body cache hit included)
+    sign_start      cid    seq    body bytes                             CompanionCodec::Sign
+    sign_done       cid    seq    body bytes                    result
+    send            cid    seq    head and body bytes                    HttpConnection: last byte written
+    first_byte      cid    seq    bytes in the first read                HttpConnection: response begins
+    verify_start    cid    0      signature characters                   CompanionCodec::Verify
+    verify_done     cid    seq    body bytes the signature covers result
+    decode_start    cid    seq    body bytes                             CompanionCodec::DecryptResponse
+    decode_done     cid    seq    plaintext bytes               result
+    xml_start       ""     0      XML bytes                              ParseCompanionResponse
+    xml_done        cid    seq    XML bytes                     result   cid and seq of <device>, if any
+
+ The response's seq is the STB's, not the request's: pair send and first_byte with the request by
+ connection order, or the verify and decode probes with the first_byte before them on the same thread.
+ For instance, the time from the last byte written to the first byte back, per cid:
+
+    bpftrace -e 'usdt:./companiond:companion:send { @s[str(arg0), arg1] = nsecs; }
+                 usdt:./companiond:companion:first_byte /@s[str(arg0), arg1]/ {
+                     @rtt_us[str(arg0)] = hist((nsecs - @s[str(arg0), arg1]) / 1000); delete(@s[str(arg0), arg1]); }'
+
+ Arguments are evaluated whether or not a tracer is attached, so they are limited to values at hand.
+ */
+
+#ifndef COMPANIONPROBES_H
+#define COMPANIONPROBES_H
+
+#if !defined(COMPANION_NO_PROBES) && defined(__linux__) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define COMPANION_PROBES_ENABLED 1
+#endif
+#endif
+
+#ifndef COMPANION_PROBES_ENABLED
+#define COMPANION_PROBES_ENABLED 0
+#endif
+
+#if COMPANION_PROBES_ENABLED
+#define COMPANION_PROBE3(name, a1, a2, a3)              DTRACE_PROBE3(companion, name, a1, a2, a3)
+#define COMPANION_PROBE4(name, a1, a2, a3, a4)          DTRACE_PROBE4(companion, name, a1, a2, a3, a4)
+#define COMPANION_PROBE5(name, a1, a2, a3, a4, a5)      DTRACE_PROBE5(companion, name, a1, a2, a3, a4, a5)
+#else
+// The arguments are still compiled, unevaluated, so they stay valid and their variables count as used.
+#define COMPANION_PROBE3(name, a1, a2, a3)              do { (void)sizeof(a1); (void)sizeof(a2); (void)sizeof(a3); } while (0)
+#define COMPANION_PROBE4(name, a1, a2, a3, a4)          do { COMPANION_PROBE3(name, a1, a2, a3); (void)sizeof(a4); } while (0)
+#define COMPANION_PROBE5(name, a1, a2, a3, a4, a5)      do { COMPANION_PROBE4(name, a1, a2, a3, a4); (void)sizeof(a5); } while (0)
+#endif
+
+#endif
@@ -0,0 +1,67 @@
+//--------------------------------------------------------------------------
+// <copyright file="CompanionWorkerPool.cpp" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// Fixed-size thread pool for spreading CSParve64 work across cores.
+// </summary>
+//--------------------------------------------------------------------------
+
+#include "CompanionWorkerPool.h"
+
+#include <utility>
+
+CompanionWorkerPool::CompanionWorkerPool(UINT32 threads)
+	: _stopping(false)
+{
+	if (threads == 0)
+		threads = HardwareThreads();
+
+	for (UINT32 i = 0; i < threads; ++i)
+		_threads.push_back(std::thread(&CompanionWorkerPool::Run, this));
+}
+
+CompanionWorkerPool::~CompanionWorkerPool()
+{
+	{
+		std::lock_guard<std::mutex> guard(_lock);
+		_stopping = true;
+	}
+	_wake.notify_all();
+
+	for (size_t i = 0; i < _threads.size(); ++i)
+		_threads[i].join();
+}
+
+void CompanionWorkerPool::Post(Task task)
+{
+	{
+		std::lock_guard<std::mutex> guard(_lock);
+		_tasks.push_back(std::move(task));
+	}
+	_wake.notify_one();
+}
+
+UINT32 CompanionWorkerPool::HardwareThreads()
+{
+	UINT32 count = std::thread::hardware_concurrency();
+	return count != 0 ? count : 1;
+}
+
+void CompanionWorkerPool::Run()
+{
+	for (;;)
+	{
+		Task task;
+		{
+			std::unique_lock<std::mutex> guard(_lock);
+			while (_tasks.empty() && !_stopping)
+				_wake.wait(guard);
+			if (_tasks.empty())
+				return;
+			task = std::move(_tasks.front());
+			_tasks.pop_front();
+		}
+		task();
+	}
+}
@@ -0,0 +1,61 @@
+//--------------------------------------------------------------------------
+// <copyright file="CompanionWorkerPool.h" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// Fixed-size thread pool for spreading CSParve64 work across cores.
+// </summary>
+//--------------------------------------------------------------------------
+
+#ifndef COMPANIONWORKERPOOL_H
+#define COMPANIONWORKERPOOL_H
+
+#include "CSParve64.h"
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class CompanionWorkerPool
+{
+public:
+
+	typedef std::function<void()> Task;
+
+	/// <summary>
+	/// Start threads workers; 0 uses one per core.
+	/// </summary>
+	explicit CompanionWorkerPool(UINT32 threads = 0);
+
+	/// <summary>
+	/// Runs the tasks already queued, then joins the workers.
+	/// </summary>
+	~CompanionWorkerPool();
+
+	/// <summary>
+	/// Queue a task to run on a worker.  Safe to call from any thread, including a worker.
+	/// </summary>
+	void Post(Task task);
+
+	UINT32 Size() const { return (UINT32)_threads.size(); }
+
+	static UINT32 HardwareThreads();
+
+private:
+
+	CompanionWorkerPool(const CompanionWorkerPool&);
+	CompanionWorkerPool& operator=(const CompanionWorkerPool&);
+
+	void Run();
+
+	std::mutex               _lock;
+	std::condition_variable  _wake;
+	std::deque<Task>         _tasks;
+	bool                     _stopping;
+	std::vector<std::thread> _threads;
+};
+
+#endif
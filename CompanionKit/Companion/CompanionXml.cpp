@@ -0,0 +1,573 @@
+//--------------------------------------------------------------------------
+// <copyright file="CompanionXml.cpp" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// In-place pull parser for companion XML responses.
+// </summary>
+//--------------------------------------------------------------------------
+
+#include "CompanionXml.h"
+#include "CompanionProbes.h"
+
+#include <string.h>
+#include <strings.h>
+
+#define COMPANION_XML_NOT_FOUND 0xFFFFFFFF
+
+//------------------------------------------------------------------------------------------------------
+
+// Helper functions.
+
+static inline bool IsSpace(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+static inline bool IsNameEnd(char c)
+{
+	return IsSpace(c) || c == '/' || c == '>' || c == '=';
+}
+
+// FNV-1a over an element name, to match end tags without keeping the names.
+static UINT32 NameHash(const char* name, UINT32 length)
+{
+	UINT32 hash = 2166136261u;
+	for (UINT32 i = 0; i < length; ++i)
+		hash = (hash ^ (BYTE)name[i]) * 16777619u;
+	return hash;
+}
+
+// The part of a qualified name after its prefix.
+static CompanionXmlSpan LocalName(const char* name, UINT32 length)
+{
+	const char* colon = (const char*)memchr(name, ':', length);
+	if (colon == NULL)
+		return CompanionXmlSpan(name, length);
+	return CompanionXmlSpan(colon + 1, (UINT32)(name + length - colon - 1));
+}
+
+static UINT32 EncodeUtf8(UINT32 code, char* out)
+{
+	if (code < 0x80)
+	{
+		out[0] = (char)code;
+		return 1;
+	}
+	if (code < 0x800)
+	{
+		out[0] = (char)(0xC0 | (code >> 6));
+		out[1] = (char)(0x80 | (code & 0x3F));
+		return 2;
+	}
+	if (code < 0x10000)
+	{
+		out[0] = (char)(0xE0 | (code >> 12));
+		out[1] = (char)(0x80 | ((code >> 6) & 0x3F));
+		out[2] = (char)(0x80 | (code & 0x3F));
+		return 3;
+	}
+	out[0] = (char)(0xF0 | (code >> 18));
+	out[1] = (char)(0x80 | ((code >> 12) & 0x3F));
+	out[2] = (char)(0x80 | ((code >> 6) & 0x3F));
+	out[3] = (char)(0x80 | (code & 0x3F));
+	return 4;
+}
+
+// Expand entity and character references in place.  A reference is never shorter than what it expands
+// to, so the text only shrinks.  Returns false on an unknown or malformed reference.
+static bool DecodeEntities(char* text, UINT32* length)
+{
+	char* amp = (char*)memchr(text, '&', *length);
+	if (amp == NULL)
+		return true;
+
+	char* end = text + *length;
+	char* out = amp;
+	const char* in = amp;
+	while (in < end)
+	{
+		if (*in != '&')
+		{
+			*out++ = *in++;
+			continue;
+		}
+
+		const char* semi = (const char*)memchr(in, ';', end - in);
+		if (semi == NULL)
+			return false;
+
+		const char* name = in + 1;
+		UINT32 nameLength = (UINT32)(semi - name);
+		if (nameLength > 0 && name[0] == '#')
+		{
+			UINT32 code = 0, digits = 0;
+			bool hex = nameLength > 1 && (name[1] == 'x' || name[1] == 'X');
+			for (const char* d = name + (hex ? 2 : 1); d < semi; ++d, ++digits)
+			{
+				int v;
+				if (*d >= '0' && *d <= '9')
+					v = *d - '0';
+				else if (hex && *d >= 'a' && *d <= 'f')
+					v = *d - 'a' + 10;
+				else if (hex && *d >= 'A' && *d <= 'F')
+					v = *d - 'A' + 10;
+				else
+					return false;
+				code = code * (hex ? 16 : 10) + v;
+				if (code > 0x10FFFF)
+					return false;
+			}
+			if (digits == 0 || code == 0)
+				return false;
+			out += EncodeUtf8(code, out);
+		}
+		else if (nameLength == 2 && memcmp(name, "lt", 2) == 0)
+			*out++ = '<';
+		else if (nameLength == 2 && memcmp(name, "gt", 2) == 0)
+			*out++ = '>';
+		else if (nameLength == 3 && memcmp(name, "amp", 3) == 0)
+			*out++ = '&';
+		else if (nameLength == 4 && memcmp(name, "quot", 4) == 0)
+			*out++ = '"';
+		else if (nameLength == 4 && memcmp(name, "apos", 4) == 0)
+			*out++ = '\'';
+		else
+			return false;
+
+		in = semi + 1;
+	}
+
+	*length = (UINT32)(out - text);
+	return true;
+}
+
+//------------------------------------------------------------------------------------------------------
+
+bool CompanionXmlSpan::Equals(const char* value) const
+{
+	return strlen(value) == Length && memcmp(Data, value, Length) == 0;
+}
+
+bool CompanionXmlSpan::EqualsNoCase(const char* value) const
+{
+	return strlen(value) == Length && strncasecmp(Data, value, Length) == 0;
+}
+
+bool CompanionXmlSpan::ToUInt32(UINT32* value) const
+{
+	UINT32 i = 0;
+	while (i < Length && IsSpace(Data[i]))
+		++i;
+
+	UINT32 result = 0, digits = 0;
+	for (; i < Length && Data[i] >= '0' && Data[i] <= '9'; ++i, ++digits)
+		result = result * 10 + (Data[i] - '0');
+
+	if (digits == 0)
+		return false;
+	*value = result;
+	return true;
+}
+
+//------------------------------------------------------------------------------------------------------
+
+CompanionXmlReader::CompanionXmlReader()
+{
+	Reset(NULL, 0, true);
+}
+
+void CompanionXmlReader::Reset(char* data, UINT32 length, bool final)
+{
+	_data = data;
+	_length = length;
+	_position = 0;
+	_discarded = 0;
+	_final = final;
+	_emptyElement = false;
+	_pendingEnd = false;
+	_failed = false;
+	_rootSeen = false;
+	_depth = 0;
+	_errorOffset = 0;
+	_name = CompanionXmlSpan();
+	_text = CompanionXmlSpan();
+	_attributeCount = 0;
+}
+
+void CompanionXmlReader::Extend(char* data, UINT32 length, bool final, UINT32 discarded)
+{
+	// An empty element's end tag is still to be reported under its name.
+	UINT32 nameOffset = (_pendingEnd && _data != NULL) ? (UINT32)(_name.Data - _data) : 0;
+
+	if (discarded > _position)
+		discarded = _position;
+
+	_data = data;
+	_length = length;
+	_final = final;
+	_position -= discarded;
+	_discarded += discarded;
+	_text = CompanionXmlSpan();
+	_attributeCount = 0;
+	_name = (_pendingEnd && nameOffset >= discarded) ? CompanionXmlSpan(data + nameOffset - discarded, _name.Length) : CompanionXmlSpan();
+}
+
+bool CompanionXmlReader::Attribute(const char* name, CompanionXmlSpan* value) const
+{
+	for (UINT32 i = 0; i < _attributeCount; ++i)
+	{
+		if (_attributes[i].Name.Equals(name))
+		{
+			*value = _attributes[i].Value;
+			return true;
+		}
+	}
+	return false;
+}
+
+CompanionXmlToken CompanionXmlReader::Next()
+{
+	if (_failed)
+		return CompanionXmlError;
+
+	_attributeCount = 0;
+	_emptyElement = false;
+	_text = CompanionXmlSpan();
+
+	if (_pendingEnd)
+	{
+		_pendingEnd = false;
+		--_depth;
+		return CompanionXmlEndElement;
+	}
+
+	// A UTF-8 byte order mark is not markup.
+	if (_position == 0 && _discarded == 0 && !_rootSeen)
+	{
+		int bom = MatchPrefix("\xEF\xBB\xBF");
+		if (bom < 0)
+			return CompanionXmlNeedMore;
+		if (bom > 0)
+			_position = 3;
+	}
+
+	for (;;)
+	{
+		if (_position >= _length)
+		{
+			if (!_final)
+				return CompanionXmlNeedMore;
+			if (_depth != 0 || !_rootSeen)
+				return Fail(_position);
+			return CompanionXmlEndDocument;
+		}
+
+		char* p = _data + _position;
+		UINT32 remaining = _length - _position;
+
+		if (*p != '<')
+		{
+			// Character data runs to the next tag; until that arrives it may not be complete.
+			const char* lt = (const char*)memchr(p, '<', remaining);
+			if (lt == NULL && !_final)
+				return CompanionXmlNeedMore;
+
+			UINT32 start = _position;
+			UINT32 length = lt ? (UINT32)(lt - p) : remaining;
+			_position += length;
+
+			UINT32 i = 0;
+			while (i < length && IsSpace(p[i]))
+				++i;
+			if (i == length)
+				continue;
+
+			if (_depth == 0 || !DecodeEntities(p, &length))
+				return Fail(start);
+
+			_text = CompanionXmlSpan(p, length);
+			return CompanionXmlText;
+		}
+
+		if (remaining < 2)
+			return _final ? Fail(_position) : CompanionXmlNeedMore;
+
+		if (p[1] == '/')
+		{
+			UINT32 end = FindTagEnd(_position + 2, false);
+			if (end == COMPANION_XML_NOT_FOUND)
+				return _final ? Fail(_position) : CompanionXmlNeedMore;
+			return ParseEndTag(end);
+		}
+
+		if (p[1] == '?')
+		{
+			UINT32 end = Find(_position + 2, "?>");
+			if (end == COMPANION_XML_NOT_FOUND)
+				return _final ? Fail(_position) : CompanionXmlNeedMore;
+			_position = end + 2;
+			continue;
+		}
+
+		if (p[1] == '!')
+		{
+			int comment = MatchPrefix("<!--");
+			int cdata = MatchPrefix("<![CDATA[");
+			if (comment < 0 || cdata < 0)
+				return _final ? Fail(_position) : CompanionXmlNeedMore;
+
+			if (comment > 0)
+			{
+				UINT32 end = Find(_position + 4, "-->");
+				if (end == COMPANION_XML_NOT_FOUND)
+					return _final ? Fail(_position) : CompanionXmlNeedMore;
+				_position = end + 3;
+				continue;
+			}
+
+			if (cdata > 0)
+			{
+				UINT32 start = _position + 9;
+				UINT32 end = Find(start, "]]>");
+				if (end == COMPANION_XML_NOT_FOUND)
+					return _final ? Fail(_position) : CompanionXmlNeedMore;
+				if (_depth == 0)
+					return Fail(_position);
+				_position = end + 3;
+				if (end == start)
+					continue;
+				_text = CompanionXmlSpan(_data + start, end - start);
+				return CompanionXmlText;
+			}
+
+			// DOCTYPE, possibly with an internal subset in brackets.
+			UINT32 end = FindTagEnd(_position + 2, true);
+			if (end == COMPANION_XML_NOT_FOUND)
+				return _final ? Fail(_position) : CompanionXmlNeedMore;
+			if (_rootSeen)
+				return Fail(_position);
+			_position = end + 1;
+			continue;
+		}
+
+		UINT32 end = FindTagEnd(_position + 1, false);
+		if (end == COMPANION_XML_NOT_FOUND)
+			return _final ? Fail(_position) : CompanionXmlNeedMore;
+		return ParseStartTag(end);
+	}
+}
+
+CompanionXmlToken CompanionXmlReader::ParseStartTag(UINT32 end)
+{
+	char* p = _data + _position + 1;
+	char* limit = _data + end;
+
+	if (limit > p && limit[-1] == '/')
+	{
+		_emptyElement = true;
+		--limit;
+	}
+
+	char* name = p;
+	while (p < limit && !IsNameEnd(*p))
+		++p;
+	if (p == name || (_rootSeen && _depth == 0) || _depth == COMPANION_XML_MAX_DEPTH)
+		return Fail(_position);
+
+	UINT32 nameLength = (UINT32)(p - name);
+	_openNames[_depth] = NameHash(name, nameLength);
+	_name = LocalName(name, nameLength);
+
+	_attributeCount = 0;
+	for (;;)
+	{
+		while (p < limit && IsSpace(*p))
+			++p;
+		if (p == limit)
+			break;
+
+		char* attrName = p;
+		while (p < limit && !IsNameEnd(*p))
+			++p;
+		UINT32 attrNameLength = (UINT32)(p - attrName);
+
+		while (p < limit && IsSpace(*p))
+			++p;
+		if (attrNameLength == 0 || p == limit || *p != '=')
+			return Fail((UINT32)(attrName - _data));
+		++p;
+		while (p < limit && IsSpace(*p))
+			++p;
+		if (p == limit || (*p != '"' && *p != '\''))
+			return Fail((UINT32)(attrName - _data));
+
+		char quote = *p++;
+		char* value = p;
+		char* close = (char*)memchr(value, quote, limit - value);
+		if (close == NULL)
+			return Fail((UINT32)(attrName - _data));
+		p = close + 1;
+
+		// Namespace declarations are consumed by namespace processing, not reported.
+		if ((attrNameLength == 5 && memcmp(attrName, "xmlns", 5) == 0)
+			|| (attrNameLength > 6 && memcmp(attrName, "xmlns:", 6) == 0))
+			continue;
+
+		UINT32 valueLength = (UINT32)(close - value);
+		if (_attributeCount == COMPANION_XML_MAX_ATTRIBUTES || !DecodeEntities(value, &valueLength))
+			return Fail((UINT32)(attrName - _data));
+
+		CompanionXmlAttribute& attribute = _attributes[_attributeCount++];
+		attribute.Name = LocalName(attrName, attrNameLength);
+		attribute.Value = CompanionXmlSpan(value, valueLength);
+	}
+
+	_rootSeen = true;
+	++_depth;
+	_pendingEnd = _emptyElement;
+	_position = end + 1;
+	return CompanionXmlStartElement;
+}
+
+CompanionXmlToken CompanionXmlReader::ParseEndTag(UINT32 end)
+{
+	char* name = _data + _position + 2;
+	char* p = name;
+	while (p < _data + end && !IsNameEnd(*p))
+		++p;
+	UINT32 nameLength = (UINT32)(p - name);
+	while (p < _data + end && IsSpace(*p))
+		++p;
+
+	if (nameLength == 0 || p != _data + end || _depth == 0 || _openNames[_depth - 1] != NameHash(name, nameLength))
+		return Fail(_position);
+
+	--_depth;
+	_name = LocalName(name, nameLength);
+	_position = end + 1;
+	return CompanionXmlEndElement;
+}
+
+CompanionXmlToken CompanionXmlReader::Fail(UINT32 offset)
+{
+	_failed = true;
+	_errorOffset = _discarded + offset;
+	return CompanionXmlError;
+}
+
+UINT32 CompanionXmlReader::Find(UINT32 from, const char* terminator) const
+{
+	UINT32 length = (UINT32)strlen(terminator);
+	while (from + length <= _length)
+	{
+		const char* first = (const char*)memchr(_data + from, terminator[0], _length - from - length + 1);
+		if (first == NULL)
+			break;
+		from = (UINT32)(first - _data);
+		if (memcmp(first, terminator, length) == 0)
+			return from;
+		++from;
+	}
+	return COMPANION_XML_NOT_FOUND;
+}
+
+UINT32 CompanionXmlReader::FindTagEnd(UINT32 from, bool brackets) const
+{
+	// '>' may appear inside a quoted attribute value, and inside a DOCTYPE's internal subset.
+	char quote = 0;
+	int depth = 0;
+	for (UINT32 i = from; i < _length; ++i)
+	{
+		char c = _data[i];
+		if (quote != 0)
+		{
+			if (c == quote)
+				quote = 0;
+		}
+		else if (c == '"' || c == '\'')
+			quote = c;
+		else if (brackets && c == '[')
+			++depth;
+		else if (brackets && c == ']')
+			--depth;
+		else if (c == '>' && depth <= 0)
+			return i;
+	}
+	return COMPANION_XML_NOT_FOUND;
+}
+
+// 1 if the input continues with prefix, 0 if it does not, -1 if there is not yet enough to tell.
+int CompanionXmlReader::MatchPrefix(const char* prefix) const
+{
+	UINT32 length = (UINT32)strlen(prefix);
+	UINT32 available = _length - _position;
+	UINT32 compare = available < length ? available : length;
+	if (memcmp(_data + _position, prefix, compare) != 0)
+		return 0;
+	return compare == length ? 1 : (_final ? 0 : -1);
+}
+
+//------------------------------------------------------------------------------------------------------
+
+/// <summary>
+/// Fire xml_done with the cid and seq of the <device> element, which is all a parse knows of its request.
+/// </summary>
+static COMPANION_RESULT ParseDone(const CompanionResponseFields& fields, UINT32 length, COMPANION_RESULT result)
+{
+#if COMPANION_PROBES_ENABLED
+	char cid[COMPANION_STATE_MAX_ID + 1];
+	UINT32 cidLength = fields.DeviceId.Length < COMPANION_STATE_MAX_ID ? fields.DeviceId.Length : COMPANION_STATE_MAX_ID;
+	memcpy(cid, fields.DeviceId.Data, cidLength);
+	cid[cidLength] = 0;
+	UINT32 seq = 0;
+	fields.Seq.ToUInt32(&seq);
+	COMPANION_PROBE4(xml_done, cid, seq, length, result);
+#else
+	(void)fields;
+	(void)length;
+#endif
+	return result;
+}
+
+COMPANION_RESULT ParseCompanionResponse(char* xml, UINT32 length, CompanionResponseFields* fields)
+{
+	COMPANION_PROBE3(xml_start, "", 0, length);
+	*fields = CompanionResponseFields();
+
+	CompanionXmlReader reader;
+	reader.Reset(xml, length, true);
+
+	for (;;)
+	{
+		switch (reader.Next())
+		{
+		case CompanionXmlStartElement:
+			if (reader.IsElement("response"))
+			{
+				reader.Attribute("status", &fields->Status);
+				reader.Attribute("usn", &fields->TargetUsn);
+				reader.Attribute("name", &fields->TargetName);
+				reader.Attribute("api", &fields->TargetApiVers);
+			}
+			else if (reader.IsElement("device"))
+			{
+				reader.Attribute("cid", &fields->DeviceId);
+				reader.Attribute("key", &fields->DeviceKey);
+				reader.Attribute("tags", &fields->Tags);
+				reader.Attribute("seq", &fields->Seq);
+			}
+			break;
+
+		case CompanionXmlEndDocument:
+			return ParseDone(*fields, length, COMPANION_OK);
+
+		case CompanionXmlError:
+		case CompanionXmlNeedMore:
+			return ParseDone(*fields, length, COMPANION_E_FORMAT);
+
+		default:
+			break;
+		}
+	}
+}
@@ -0,0 +1,183 @@
+//--------------------------------------------------------------------------
+// <copyright file="CompanionXml.h" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// In-place pull parser for companion XML responses.
+// </summary>
+//--------------------------------------------------------------------------
+
+/*
+ Using the companion XML reader:
+ MRPairingResponse hands each decoded response to NSXMLParser and copies the attributes it wants into
+ NSStrings.  CompanionXmlReader is a pull parser over the decoded buffer itself: Next() returns one token at
+ a time and names, attribute values and text are CompanionXmlSpans pointing into the buffer.  Entity and
+ character references are expanded in place (the result is never longer), so the buffer must be writable.
+ Nothing is allocated per element; an element may carry up to COMPANION_XML_MAX_ATTRIBUTES attributes and
+ elements may nest COMPANION_XML_MAX_DEPTH deep.
+
+ Element and attribute names are local names (any namespace prefix is dropped, as with
+ setShouldProcessNamespaces:) and xmlns declarations are not reported.  The XML declaration, processing
+ instructions, comments and a DOCTYPE are skipped; CDATA sections are returned as text; text consisting
+ only of white space is skipped.  The reader checks well-formedness only as far as it needs to tokenize:
+ end tags must match their start tags, but no DTD is read.
+
+ The reader works incrementally.  Reset with the bytes received so far and final = false; when Next()
+ returns CompanionXmlNeedMore, append to the buffer and call Extend with the new length.  The buffer may
+ move between calls because the reader keeps only offsets.  Bytes before Consumed() are no longer needed
+ once the spans of the last token have been used, and may be discarded by passing their count to Extend.
+
+ ParseCompanionResponse pulls the fields MRPairingResponse reads (and the status) out of a whole response.
+ */
+
+#ifndef COMPANIONXML_H
+#define COMPANIONXML_H
+
+#include "CompanionCodec.h"
+
+#include <string>
+
+#define COMPANION_XML_MAX_ATTRIBUTES    16
+#define COMPANION_XML_MAX_DEPTH         32
+
+/// <summary>
+/// A string inside the parsed buffer.  Not NUL-terminated.
+/// </summary>
+struct CompanionXmlSpan
+{
+	const char* Data;
+	UINT32      Length;
+
+	CompanionXmlSpan() : Data(""), Length(0) {}
+	CompanionXmlSpan(const char* data, UINT32 length) : Data(data), Length(length) {}
+
+	bool IsEmpty() const { return Length == 0; }
+	bool Equals(const char* value) const;
+	bool EqualsNoCase(const char* value) const;
+
+	/// <summary>
+	/// Parse a decimal number, as NSString integerValue does for seq.  False if there are no digits.
+	/// </summary>
+	bool ToUInt32(UINT32* value) const;
+
+	std::string ToString() const { return std::string(Data, Length); }
+};
+
+struct CompanionXmlAttribute
+{
+	CompanionXmlSpan Name;
+	CompanionXmlSpan Value;
+};
+
+enum CompanionXmlToken
+{
+	CompanionXmlNeedMore,       // the next token is incomplete; Extend the buffer
+	CompanionXmlStartElement,
+	CompanionXmlEndElement,     // also returned after the start of an empty element
+	CompanionXmlText,
+	CompanionXmlEndDocument,
+	CompanionXmlError
+};
+
+class CompanionXmlReader
+{
+public:
+
+	CompanionXmlReader();
+
+	/// <summary>
+	/// Start a new document.  final says whether data holds all of it.
+	/// </summary>
+	void Reset(char* data, UINT32 length, bool final = true);
+
+	/// <summary>
+	/// Continue the current document in data, which holds length bytes after the first discarded bytes of
+	/// the previous buffer were removed.  Invalidates all spans.
+	/// </summary>
+	void Extend(char* data, UINT32 length, bool final, UINT32 discarded = 0);
+
+	/// <summary>
+	/// Parse the next token.  The spans it sets are valid until the next call.
+	/// </summary>
+	CompanionXmlToken Next();
+
+	/// <summary>
+	/// Local name of the element just started or ended.
+	/// </summary>
+	const CompanionXmlSpan& Name() const { return _name; }
+
+	/// <summary>
+	/// Case-insensitive comparison of Name(), as MRPairingResponse matches elements.
+	/// </summary>
+	bool IsElement(const char* name) const { return _name.EqualsNoCase(name); }
+
+	bool IsEmptyElement() const { return _emptyElement; }
+	const CompanionXmlSpan& Text() const { return _text; }
+	UINT32 Depth() const { return _depth; }
+
+	UINT32 AttributeCount() const { return _attributeCount; }
+	const CompanionXmlAttribute& AttributeAt(UINT32 index) const { return _attributes[index]; }
+
+	/// <summary>
+	/// Value of the named attribute of the current start element.  Names are case-sensitive.
+	/// </summary>
+	bool Attribute(const char* name, CompanionXmlSpan* value) const;
+
+	/// <summary>
+	/// Bytes fully parsed.  They may be discarded once the last token's spans are no longer needed.
+	/// </summary>
+	UINT32 Consumed() const { return _position; }
+
+	/// <summary>
+	/// Offset of the malformed markup after CompanionXmlError, counted from the start of the document.
+	/// </summary>
+	UINT32 ErrorOffset() const { return _errorOffset; }
+
+private:
+
+	CompanionXmlToken ParseStartTag(UINT32 end);
+	CompanionXmlToken ParseEndTag(UINT32 end);
+	CompanionXmlToken Fail(UINT32 offset);
+	UINT32 Find(UINT32 from, const char* terminator) const;
+	UINT32 FindTagEnd(UINT32 from, bool brackets) const;
+	int MatchPrefix(const char* prefix) const;
+
+	char*                 _data;
+	UINT32                _length;
+	UINT32                _position;
+	UINT32                _discarded;         // bytes removed from the front by Extend
+	bool                  _final;
+	bool                  _emptyElement;
+	bool                  _pendingEnd;        // an empty element's end is due
+	bool                  _failed;
+	bool                  _rootSeen;
+	UINT32                _depth;
+	UINT32                _errorOffset;
+	UINT32                _openNames[COMPANION_XML_MAX_DEPTH];    // hash of each open element's name
+	CompanionXmlSpan      _name;
+	CompanionXmlSpan      _text;
+	UINT32                _attributeCount;
+	CompanionXmlAttribute _attributes[COMPANION_XML_MAX_ATTRIBUTES];
+};
+
+/// <summary>
+/// The fields of a pairing or hello response.  Empty when absent.
+/// </summary>
+struct CompanionResponseFields
+{
+	CompanionXmlSpan Status;            // <response status=...>
+	CompanionXmlSpan TargetUsn;         // <response usn=...>
+	CompanionXmlSpan TargetName;        // <response name=...>
+	CompanionXmlSpan TargetApiVers;     // <response api=...>
+	CompanionXmlSpan DeviceId;          // <device cid=...>
+	CompanionXmlSpan DeviceKey;         // <device key=...>
+	CompanionXmlSpan Tags;              // <device tags=...>
+	CompanionXmlSpan Seq;               // <device seq=...>
+};
+
+/// <summary>
+/// Parse a complete response in place.  COMPANION_E_FORMAT if it is not well formed.
+/// </summary>
+COMPANION_RESULT ParseCompanionResponse(char* xml, UINT32 length, CompanionResponseFields* fields);
+
+#endif
@@ -0,0 +1,726 @@
+//--------------------------------------------------------------------------
+// <copyright file="PairingStore.cpp" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// Memory-mapped, append-only pairing store with hashed lookup.
+// </summary>
+//--------------------------------------------------------------------------
+
+#include "PairingStore.h"
+
+#include <chrono>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static_assert(sizeof(PairingRecord) == PAIRING_RECORD_SIZE, "PairingRecord layout is part of the file format");
+
+#define PAIRING_STORE_MAGIC         0x4D525053      // "MRPS"
+#define PAIRING_RECORD_MAGIC        0x50524543      // "PREC"
+#define PAIRING_INDEX_MAGIC         0x4D525049      // "MRPI"
+#define PAIRING_INITIAL_CAPACITY    64
+#define PAIRING_INITIAL_BUCKETS     128
+
+// The store header occupies the first record slot, so records stay aligned to PAIRING_RECORD_SIZE.
+struct PairingStore::StoreHeader
+{
+	UINT32 Magic;
+	UINT32 Version;
+	UINT32 RecordSize;
+	UINT32 Reserved;
+	UINT64 StoreId;             // ties the index file to this store
+	UINT32 Crc;
+};
+
+struct PairingStore::IndexHeader
+{
+	UINT32 Magic;
+	UINT32 Version;
+	UINT32 Dirty;               // set while the slots are being changed
+	UINT32 Buckets;             // per index, a power of two
+	UINT64 StoreId;
+	UINT32 Covered;             // store records reflected in the slots
+	UINT32 LiveCount;
+	UINT32 UsedPairUid;         // occupied slots
+	UINT32 UsedUsn;
+	UINT32 Reserved[6];
+};
+
+#define PAIRING_INDEX_HEADER_SIZE   64      // sizeof(IndexHeader); the slot tables follow
+
+//------------------------------------------------------------------------------------------------------
+
+// Helper functions.
+
+static UINT32 RecordCrc(const PairingRecord& record)
+{
+	return CompanionCrc32((const BYTE*)&record, offsetof(PairingRecord, Crc));
+}
+
+static bool CopyField(char* field, size_t fieldSize, const std::string& value)
+{
+	if (value.length() >= fieldSize)
+		return false;
+	memset(field, 0, fieldSize);
+	memcpy(field, value.data(), value.length());
+	return true;
+}
+
+static std::string FieldString(const char* field, size_t fieldSize)
+{
+	return std::string(field, strnlen(field, fieldSize));
+}
+
+static bool FieldEquals(const char* field, size_t fieldSize, const std::string& value)
+{
+	return value.length() < fieldSize && strncmp(field, value.c_str(), fieldSize) == 0;
+}
+
+// Identifies one store file.  Every file a store is written to gets a new one, so an index built for
+// another file, including the one a compacted store replaced, is never taken for this one's.
+static UINT64 NewStoreId()
+{
+	return (UINT64)std::chrono::system_clock::now().time_since_epoch().count() ^ ((UINT64)getpid() << 32);
+}
+
+// Makes a rename in the directory holding path durable.
+static int SyncDirectory(const std::string& path)
+{
+	size_t slash = path.find_last_of('/');
+	std::string directory = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+	int fd = open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	int result = fsync(fd);
+	close(fd);
+	return result;
+}
+
+// msync wants page-aligned addresses.
+static int SyncRange(BYTE* base, size_t offset, size_t length)
+{
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	size_t start = offset & ~(page - 1);
+	return msync(base + start, offset + length - start, MS_SYNC);
+}
+
+//------------------------------------------------------------------------------------------------------
+
+CompanionPairingInfo PairingEntry::PairingInfo() const
+{
+	CompanionPairingInfo info;
+	info.TargetIPAddr = TargetIPAddr;
+	info.DeviceId = DeviceId;
+	info.DeviceKey = DeviceKey;
+	info.SeqNum = SeqNum;
+	return info;
+}
+
+//------------------------------------------------------------------------------------------------------
+
+PairingStore::PairingStore()
+	: _storeFd(-1), _store(NULL), _storeMapped(0), _capacity(0), _recordCount(0), _liveCount(0), _storeId(0), _nextSerial(1),
+	  _indexFd(-1), _index(NULL), _indexMapped(0), _buckets(0), _pairUidSlots(NULL), _usnSlots(NULL)
+{
+}
+
+PairingStore::~PairingStore()
+{
+	Close();
+}
+
+COMPANION_RESULT PairingStore::Open(const std::string& path)
+{
+	Close();
+	_path = path;
+
+	_storeFd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	struct stat st;
+	if (_storeFd < 0 || fstat(_storeFd, &st) != 0)
+	{
+		Close();
+		return COMPANION_FAIL;
+	}
+
+	if (st.st_size == 0)
+	{
+		// New store: a header and room for a few records.
+		StoreHeader header;
+		memset(&header, 0, sizeof(header));
+		header.Magic = PAIRING_STORE_MAGIC;
+		header.Version = PAIRING_STORE_VERSION;
+		header.RecordSize = PAIRING_RECORD_SIZE;
+		header.StoreId = NewStoreId();
+		header.Crc = CompanionCrc32((const BYTE*)&header, offsetof(StoreHeader, Crc));
+
+		BYTE block[PAIRING_RECORD_SIZE];
+		memset(block, 0, sizeof(block));
+		memcpy(block, &header, sizeof(header));
+		if (pwrite(_storeFd, block, sizeof(block), 0) != (ssize_t)sizeof(block)
+			|| ftruncate(_storeFd, (off_t)PAIRING_RECORD_SIZE * (PAIRING_INITIAL_CAPACITY + 1)) != 0
+			|| fsync(_storeFd) != 0)
+		{
+			Close();
+			return COMPANION_FAIL;
+		}
+		st.st_size = (off_t)PAIRING_RECORD_SIZE * (PAIRING_INITIAL_CAPACITY + 1);
+	}
+
+	if (st.st_size < PAIRING_RECORD_SIZE || MapStore((UINT32)(st.st_size / PAIRING_RECORD_SIZE - 1)) != COMPANION_OK)
+	{
+		Close();
+		return COMPANION_E_FORMAT;
+	}
+
+	const StoreHeader* header = (const StoreHeader*)_store;
+	if (header->Magic != PAIRING_STORE_MAGIC || header->Version != PAIRING_STORE_VERSION || header->RecordSize != PAIRING_RECORD_SIZE
+		|| header->Crc != CompanionCrc32((const BYTE*)header, offsetof(StoreHeader, Crc)))
+	{
+		Close();
+		return COMPANION_E_FORMAT;
+	}
+	_storeId = header->StoreId;
+
+	bool rebuilt = false;
+	if (OpenIndex(&rebuilt) != COMPANION_OK)
+	{
+		Close();
+		return COMPANION_FAIL;
+	}
+
+	// Records the index already covers were checked when they were indexed; only the tail is read.
+	IndexHeader* index = (IndexHeader*)_index;
+	_recordCount = index->Covered;
+	_liveCount = index->LiveCount;
+	while (_recordCount < _capacity)
+	{
+		const PairingRecord* record = RecordAt(_recordCount);
+		if (record->Magic != PAIRING_RECORD_MAGIC || record->Crc != RecordCrc(*record))
+			break;      // end of the log, or a write torn by a crash
+		if (IndexRecord(_recordCount++) != COMPANION_OK)
+		{
+			Close();
+			return COMPANION_FAIL;
+		}
+	}
+
+	_nextSerial = _recordCount != 0 ? RecordAt(_recordCount - 1)->Serial + 1 : 1;
+	return Sync();
+}
+
+void PairingStore::Close()
+{
+	if (_index != NULL)
+		Sync();
+	CloseIndex();
+	CloseStore();
+	_recordCount = 0;
+	_liveCount = 0;
+	_nextSerial = 1;
+}
+
+COMPANION_RESULT PairingStore::Add(const PairingEntry& entry)
+{
+	if (!IsOpen())
+		return COMPANION_FAIL;
+	if (FindByPairUid(entry.PairUid) != NULL || FindByUsn(entry.TargetUsn) != NULL)
+		return COMPANION_E_DUPLICATE;
+
+	PairingRecord record;
+	COMPANION_RESULT result = FromEntry(entry, &record);
+	if (result != COMPANION_OK)
+		return result;
+	return Append(record);
+}
+
+COMPANION_RESULT PairingStore::Update(const PairingEntry& entry)
+{
+	if (!IsOpen())
+		return COMPANION_FAIL;
+	if (FindByPairUid(entry.PairUid) == NULL)
+		return COMPANION_E_NOT_FOUND;
+
+	// Another pairing may not take over this USN.
+	const PairingRecord* other = FindByUsn(entry.TargetUsn);
+	if (other != NULL && !FieldEquals(other->PairUid, sizeof(other->PairUid), entry.PairUid))
+		return COMPANION_E_DUPLICATE;
+
+	PairingRecord record;
+	COMPANION_RESULT result = FromEntry(entry, &record);
+	if (result != COMPANION_OK)
+		return result;
+	return Append(record);
+}
+
+COMPANION_RESULT PairingStore::UpdateSeqNum(const std::string& pairUid, UINT32 seqNum)
+{
+	const PairingRecord* current = FindByPairUid(pairUid);
+	if (current == NULL)
+		return COMPANION_E_NOT_FOUND;
+	if (current->SeqNum == seqNum)
+		return COMPANION_OK;
+
+	PairingRecord record = *current;
+	record.SeqNum = seqNum;
+	return Append(record);
+}
+
+COMPANION_RESULT PairingStore::Remove(const std::string& pairUid)
+{
+	const PairingRecord* current = FindByPairUid(pairUid);
+	if (current == NULL)
+		return COMPANION_E_NOT_FOUND;
+
+	PairingRecord record = *current;
+	record.Flags |= PAIRING_FLAG_REMOVED;
+	return Append(record);
+}
+
+const PairingRecord* PairingStore::FindByPairUid(const std::string& pairUid) const
+{
+	if (_pairUidSlots == NULL)
+		return NULL;
+
+	INT32 slot = FindSlot(_pairUidSlots, HashKey(pairUid), pairUid, false);
+	if (_pairUidSlots[slot] == 0)
+		return NULL;
+
+	const PairingRecord* record = RecordAt(_pairUidSlots[slot] - 1);
+	return (record->Flags & PAIRING_FLAG_REMOVED) != 0 ? NULL : record;
+}
+
+const PairingRecord* PairingStore::FindByUsn(const std::string& targetUsn) const
+{
+	if (_usnSlots == NULL || targetUsn.empty())
+		return NULL;
+
+	INT32 slot = FindSlot(_usnSlots, HashKey(targetUsn), targetUsn, true);
+	if (_usnSlots[slot] == 0)
+		return NULL;
+
+	// The slot holds the last record written with this USN; that pairing may since have moved on.
+	UINT32 index = _usnSlots[slot] - 1;
+	const PairingRecord* record = RecordAt(index);
+	if ((record->Flags & PAIRING_FLAG_REMOVED) != 0 || !IsCurrent(index))
+		return NULL;
+	return record;
+}
+
+COMPANION_RESULT PairingStore::Get(const std::string& pairUid, PairingEntry* entry) const
+{
+	const PairingRecord* record = FindByPairUid(pairUid);
+	if (record == NULL)
+		return COMPANION_E_NOT_FOUND;
+	ToEntry(*record, entry);
+	return COMPANION_OK;
+}
+
+void PairingStore::ForEach(const std::function<void(const PairingRecord&)>& visit) const
+{
+	for (UINT32 i = 0; i < _recordCount; ++i)
+	{
+		const PairingRecord* record = RecordAt(i);
+		if ((record->Flags & PAIRING_FLAG_REMOVED) == 0 && IsCurrent(i))
+			visit(*record);
+	}
+}
+
+COMPANION_RESULT PairingStore::Compact()
+{
+	if (!IsOpen())
+		return COMPANION_FAIL;
+
+	// Write the live records to a new file and swap it in; a crash leaves either the old or the new store.
+	std::string temp = _path + ".compact";
+	int fd = open(temp.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0)
+		return COMPANION_FAIL;
+
+	UINT32 capacity = PAIRING_INITIAL_CAPACITY;
+	while (capacity < _liveCount * 2)
+		capacity *= 2;
+
+	BYTE block[PAIRING_RECORD_SIZE];
+	memcpy(block, _store, sizeof(block));
+	StoreHeader* header = (StoreHeader*)block;
+	header->StoreId = NewStoreId();
+	header->Crc = CompanionCrc32(block, offsetof(StoreHeader, Crc));
+
+	bool ok = pwrite(fd, block, sizeof(block), 0) == (ssize_t)sizeof(block);
+	off_t offset = PAIRING_RECORD_SIZE;
+	ForEach([&](const PairingRecord& record)
+	{
+		if (ok && pwrite(fd, &record, sizeof(record), offset) != (ssize_t)sizeof(record))
+			ok = false;
+		offset += sizeof(record);
+	});
+
+	ok = ok && ftruncate(fd, (off_t)PAIRING_RECORD_SIZE * (capacity + 1)) == 0 && fsync(fd) == 0;
+	close(fd);
+	if (!ok)
+	{
+		unlink(temp.c_str());
+		return COMPANION_FAIL;
+	}
+
+	// The old index goes first.  Should the rename not happen, Open rebuilds one for the old store; should
+	// it not be durable, the new store's id still matches no index.
+	std::string path = _path;
+	CloseIndex();
+	CloseStore();
+	unlink((path + ".idx").c_str());
+	if (rename(temp.c_str(), path.c_str()) != 0)
+	{
+		unlink(temp.c_str());
+		Open(path);
+		return COMPANION_FAIL;
+	}
+	SyncDirectory(path);
+	return Open(path);
+}
+
+COMPANION_RESULT PairingStore::Sync()
+{
+	if (_index == NULL)
+		return COMPANION_FAIL;
+
+	IndexHeader* header = (IndexHeader*)_index;
+	if (header->Dirty == 0)
+		return COMPANION_OK;
+
+	if (msync(_index, _indexMapped, MS_SYNC) != 0)
+		return COMPANION_FAIL;
+	header->Dirty = 0;
+	return SyncRange(_index, 0, sizeof(IndexHeader)) == 0 ? COMPANION_OK : COMPANION_FAIL;
+}
+
+void PairingStore::ToEntry(const PairingRecord& record, PairingEntry* entry)
+{
+	char text[GUID_AS_STR_LENGTH];
+	char key[COMPANION_KEY_LENGTH_IN_BYTES * 2 + 1];
+
+	entry->PairUid = FieldString(record.PairUid, sizeof(record.PairUid));
+
+	snprintf(text, sizeof(text), "%u.%u.%u.%u", record.TargetIPAddr[0], record.TargetIPAddr[1], record.TargetIPAddr[2], record.TargetIPAddr[3]);
+	entry->TargetIPAddr = text;
+
+	GuidToString(&record.DeviceId, text);
+	entry->DeviceId = text;
+
+	entry->DeviceKey.clear();
+	if ((record.Flags & PAIRING_FLAG_TEST_KEY) == 0)
+	{
+		for (int i = 0; i < COMPANION_KEY_LENGTH_IN_BYTES; ++i)
+			snprintf(key + i * 2, 3, "%02X", record.CompanionKey[i]);
+		entry->DeviceKey = key;
+	}
+
+	entry->TargetUsn = FieldString(record.TargetUsn, sizeof(record.TargetUsn));
+	entry->TargetName = FieldString(record.TargetName, sizeof(record.TargetName));
+	entry->TargetApiVers = FieldString(record.TargetApiVers, sizeof(record.TargetApiVers));
+	entry->Tags = FieldString(record.Tags, sizeof(record.Tags));
+	entry->SeqNum = record.SeqNum;
+}
+
+UINT64 PairingStore::HashKey(const std::string& key)
+{
+	// FNV-1a.
+	UINT64 hash = 0xcbf29ce484222325ULL;
+	for (size_t i = 0; i < key.length(); ++i)
+	{
+		hash ^= (BYTE)key[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+//------------------------------------------------------------------------------------------------------
+
+COMPANION_RESULT PairingStore::Append(const PairingRecord& source)
+{
+	if (_recordCount == _capacity)
+	{
+		UINT32 capacity = _capacity * 2;
+		if (ftruncate(_storeFd, (off_t)PAIRING_RECORD_SIZE * (capacity + 1)) != 0 || MapStore(capacity) != COMPANION_OK)
+			return COMPANION_FAIL;
+	}
+
+	PairingRecord record = source;
+	record.Magic = PAIRING_RECORD_MAGIC;
+	record.Serial = _nextSerial;
+	record.Crc = RecordCrc(record);
+
+	// The record only counts once it is on disk; until then a crash leaves a slot that fails its CRC.
+	size_t offset = (size_t)PAIRING_RECORD_SIZE * (_recordCount + 1);
+	memcpy(_store + offset, &record, sizeof(record));
+	if (SyncRange(_store, offset, sizeof(record)) != 0)
+		return COMPANION_FAIL;
+
+	++_nextSerial;
+	return IndexRecord(_recordCount++);
+}
+
+COMPANION_RESULT PairingStore::MapStore(UINT32 capacity)
+{
+	if (_store != NULL)
+		munmap(_store, _storeMapped);
+
+	_storeMapped = (size_t)PAIRING_RECORD_SIZE * (capacity + 1);
+	void* mapped = mmap(NULL, _storeMapped, PROT_READ | PROT_WRITE, MAP_SHARED, _storeFd, 0);
+	if (mapped == MAP_FAILED)
+	{
+		_store = NULL;
+		_storeMapped = 0;
+		_capacity = 0;
+		return COMPANION_FAIL;
+	}
+
+	_store = (BYTE*)mapped;
+	_capacity = capacity;
+	return COMPANION_OK;
+}
+
+COMPANION_RESULT PairingStore::OpenIndex(bool* rebuilt)
+{
+	*rebuilt = false;
+	std::string path = _path + ".idx";
+
+	_indexFd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	struct stat st;
+	if (_indexFd < 0 || fstat(_indexFd, &st) != 0)
+		return COMPANION_FAIL;
+
+	if ((size_t)st.st_size > PAIRING_INDEX_HEADER_SIZE)
+	{
+		void* mapped = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, _indexFd, 0);
+		if (mapped != MAP_FAILED)
+		{
+			_index = (BYTE*)mapped;
+			_indexMapped = (size_t)st.st_size;
+
+			const IndexHeader* header = (const IndexHeader*)_index;
+			UINT32 buckets = header->Buckets;
+			if (header->Magic == PAIRING_INDEX_MAGIC && header->Version == PAIRING_STORE_VERSION && header->Dirty == 0
+				&& header->StoreId == _storeId && header->Covered <= _capacity
+				&& buckets != 0 && (buckets & (buckets - 1)) == 0
+				&& _indexMapped == PAIRING_INDEX_HEADER_SIZE + (size_t)buckets * 2 * sizeof(UINT32))
+			{
+				_buckets = buckets;
+				_pairUidSlots = (UINT32*)(_index + PAIRING_INDEX_HEADER_SIZE);
+				_usnSlots = _pairUidSlots + buckets;
+				return COMPANION_OK;
+			}
+		}
+	}
+
+	// Missing, dirty or belonging to another store: start again from the store.
+	*rebuilt = true;
+	UINT32 buckets = PAIRING_INITIAL_BUCKETS;
+	while (buckets < _capacity)
+		buckets *= 2;
+	return CreateIndex(buckets);
+}
+
+COMPANION_RESULT PairingStore::CreateIndex(UINT32 buckets)
+{
+	if (_index != NULL)
+		munmap(_index, _indexMapped);
+	_index = NULL;
+	_pairUidSlots = NULL;
+	_usnSlots = NULL;
+
+	_indexMapped = PAIRING_INDEX_HEADER_SIZE + (size_t)buckets * 2 * sizeof(UINT32);
+	if (ftruncate(_indexFd, 0) != 0 || ftruncate(_indexFd, (off_t)_indexMapped) != 0)
+		return COMPANION_FAIL;
+
+	void* mapped = mmap(NULL, _indexMapped, PROT_READ | PROT_WRITE, MAP_SHARED, _indexFd, 0);
+	if (mapped == MAP_FAILED)
+		return COMPANION_FAIL;
+
+	_index = (BYTE*)mapped;
+	_buckets = buckets;
+	_pairUidSlots = (UINT32*)(_index + PAIRING_INDEX_HEADER_SIZE);
+	_usnSlots = _pairUidSlots + buckets;
+
+	IndexHeader* header = (IndexHeader*)_index;
+	header->Magic = PAIRING_INDEX_MAGIC;
+	header->Version = PAIRING_STORE_VERSION;
+	header->Dirty = 1;
+	header->Buckets = buckets;
+	header->StoreId = _storeId;
+	header->Covered = 0;
+	header->LiveCount = 0;
+	header->UsedPairUid = 0;
+	header->UsedUsn = 0;
+	return COMPANION_OK;
+}
+
+COMPANION_RESULT PairingStore::IndexRecord(UINT32 index)
+{
+	IndexHeader* header = (IndexHeader*)_index;
+
+	// Keep both tables at most half full; growing means indexing every record again.
+	if ((header->UsedPairUid + 1) * 2 > _buckets || (header->UsedUsn + 1) * 2 > _buckets)
+	{
+		UINT32 count = index;
+		if (CreateIndex(_buckets * 2) != COMPANION_OK)
+			return COMPANION_FAIL;
+		_liveCount = 0;
+		for (UINT32 i = 0; i < count; ++i)
+		{
+			if (IndexRecord(i) != COMPANION_OK)
+				return COMPANION_FAIL;
+		}
+		header = (IndexHeader*)_index;
+	}
+
+	MarkIndexDirty();
+
+	const PairingRecord* record = RecordAt(index);
+	bool removed = (record->Flags & PAIRING_FLAG_REMOVED) != 0;
+
+	std::string pairUid = FieldString(record->PairUid, sizeof(record->PairUid));
+	INT32 slot = FindSlot(_pairUidSlots, record->PairUidHash, pairUid, false);
+	if (_pairUidSlots[slot] == 0)
+		++header->UsedPairUid;
+	else if ((RecordAt(_pairUidSlots[slot] - 1)->Flags & PAIRING_FLAG_REMOVED) == 0)
+		--_liveCount;
+	_pairUidSlots[slot] = index + 1;
+	if (!removed)
+		++_liveCount;
+
+	std::string usn = FieldString(record->TargetUsn, sizeof(record->TargetUsn));
+	if (!usn.empty())
+	{
+		slot = FindSlot(_usnSlots, record->UsnHash, usn, true);
+		if (_usnSlots[slot] == 0)
+			++header->UsedUsn;
+		_usnSlots[slot] = index + 1;
+	}
+
+	header->Covered = index + 1;
+	header->LiveCount = _liveCount;
+	return COMPANION_OK;
+}
+
+void PairingStore::MarkIndexDirty()
+{
+	IndexHeader* header = (IndexHeader*)_index;
+	if (header->Dirty != 0)
+		return;
+
+	// Must reach the disk before any slot changes, so a crash part way through forces a rebuild.
+	header->Dirty = 1;
+	SyncRange(_index, 0, sizeof(IndexHeader));
+}
+
+bool PairingStore::IsCurrent(UINT32 index) const
+{
+	const PairingRecord* record = RecordAt(index);
+	INT32 slot = FindSlot(_pairUidSlots, record->PairUidHash, FieldString(record->PairUid, sizeof(record->PairUid)), false);
+	return _pairUidSlots[slot] == index + 1;
+}
+
+INT32 PairingStore::FindSlot(const UINT32* slots, UINT64 hash, const std::string& key, bool byUsn) const
+{
+	// Linear probing; the tables never hold more than half their buckets, so an empty slot always exists.
+	UINT32 mask = _buckets - 1;
+	for (UINT32 i = (UINT32)hash & mask; ; i = (i + 1) & mask)
+	{
+		if (slots[i] == 0)
+			return (INT32)i;
+
+		const PairingRecord* record = RecordAt(slots[i] - 1);
+		if (byUsn)
+		{
+			if (record->UsnHash == hash && FieldEquals(record->TargetUsn, sizeof(record->TargetUsn), key))
+				return (INT32)i;
+		}
+		else
+		{
+			if (record->PairUidHash == hash && FieldEquals(record->PairUid, sizeof(record->PairUid), key))
+				return (INT32)i;
+		}
+	}
+}
+
+const PairingRecord* PairingStore::RecordAt(UINT32 index) const
+{
+	return (const PairingRecord*)(_store + (size_t)PAIRING_RECORD_SIZE * (index + 1));
+}
+
+COMPANION_RESULT PairingStore::FromEntry(const PairingEntry& entry, PairingRecord* record) const
+{
+	memset(record, 0, sizeof(*record));
+
+	if (entry.PairUid.empty()
+		|| !CopyField(record->PairUid, sizeof(record->PairUid), entry.PairUid)
+		|| !CopyField(record->TargetUsn, sizeof(record->TargetUsn), entry.TargetUsn)
+		|| !CopyField(record->TargetName, sizeof(record->TargetName), entry.TargetName)
+		|| !CopyField(record->Tags, sizeof(record->Tags), entry.Tags)
+		|| !CopyField(record->TargetApiVers, sizeof(record->TargetApiVers), entry.TargetApiVers))
+		return COMPANION_E_FORMAT;
+
+	unsigned int q[4];
+	char c1, c2, c3;
+	if (sscanf(entry.TargetIPAddr.c_str(), "%u%c%u%c%u%c%u", q, &c1, q + 1, &c2, q + 2, &c3, q + 3) != 7
+		|| c1 != '.' || c2 != '.' || c3 != '.' || q[0] > 255 || q[1] > 255 || q[2] > 255 || q[3] > 255)
+		return COMPANION_E_FORMAT;
+	for (int i = 0; i < 4; ++i)
+		record->TargetIPAddr[i] = (BYTE)q[i];
+
+	if (GuidFromString(entry.DeviceId.c_str(), &record->DeviceId) != 0)
+		return COMPANION_E_FORMAT;
+
+	if (entry.DeviceKey.empty())
+	{
+		record->Flags |= PAIRING_FLAG_TEST_KEY;
+	}
+	else
+	{
+		if (entry.DeviceKey.length() != COMPANION_KEY_LENGTH_IN_BYTES * 2)
+			return COMPANION_E_FORMAT;
+		for (int i = 0; i < COMPANION_KEY_LENGTH_IN_BYTES; ++i)
+		{
+			if (hexToByte(entry.DeviceKey.c_str() + i * 2, &record->CompanionKey[i]) != 0)
+				return COMPANION_E_FORMAT;
+		}
+	}
+
+	record->SeqNum = entry.SeqNum;
+	record->PairUidHash = HashKey(entry.PairUid);
+	record->UsnHash = HashKey(entry.TargetUsn);
+	return COMPANION_OK;
+}
+
+void PairingStore::CloseIndex()
+{
+	if (_index != NULL)
+		munmap(_index, _indexMapped);
+	if (_indexFd >= 0)
+		close(_indexFd);
+	_index = NULL;
+	_indexMapped = 0;
+	_indexFd = -1;
+	_buckets = 0;
+	_pairUidSlots = NULL;
+	_usnSlots = NULL;
+}
+
+void PairingStore::CloseStore()
+{
+	if (_store != NULL)
+		munmap(_store, _storeMapped);
+	if (_storeFd >= 0)
+		close(_storeFd);
+	_store = NULL;
+	_storeMapped = 0;
+	_storeFd = -1;
+	_capacity = 0;
+}
@@ -0,0 +1,190 @@
+//--------------------------------------------------------------------------
+// <copyright file="PairingStore.h" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// Memory-mapped, append-only pairing store with hashed lookup.
+// </summary>
+//--------------------------------------------------------------------------
+
+/*
+ Using the pairing store:
+ MRPairing keeps pairings in an NSMutableDictionary archived with NSCoding, and pairingCompletion: finds
+ duplicates by comparing targetUsn against every pairing.  PairingStore keeps the same fields in fixed-size
+ binary records in one mapped file, so opening it reads nothing but the tail written since the last clean
+ close, and lookups by pairUid or USN are a hash probe.
+
+ The store file is a header followed by PairingRecords.  It is only ever appended to: an update writes a
+ new version of the record, a removal writes a tombstone, and each record carries a CRC so that a write
+ torn by a crash is recognized on the next Open and overwritten.  Compact rewrites only the live records,
+ into a new file with a new store id.
+
+ The hash indexes live in a second mapped file next to the store (path + ".idx").  It records how many
+ store records it covers; Open indexes only the records after that.  The index is marked dirty while it is
+ being changed, and a dirty or mismatched index is rebuilt from the store, which is always authoritative.
+
+ Records are read in place: FindByPairUid and FindByUsn return pointers into the mapping, valid until the
+ next call that writes.  The device id is kept as a binary GUID and reproduced by GuidToString (lower-case
+ hex).  Appends are synced one at a time, so sequence numbers should be written back occasionally rather
+ than after every request.  A store is not thread-safe; callers serialize access.
+ */
+
+#ifndef PAIRINGSTORE_H
+#define PAIRINGSTORE_H
+
+#include "CompanionCodec.h"
+
+#include <functional>
+#include <string>
+
+#define PAIRING_STORE_VERSION       1
+#define PAIRING_RECORD_SIZE         384
+
+#define PAIRING_FLAG_REMOVED        0x00000001      // tombstone: the pairUid no longer exists
+#define PAIRING_FLAG_TEST_KEY       0x00000002      // no device key; the enc=0 test pairing
+
+/// <summary>
+/// One pairing as stored on disk.  All strings are NUL-padded; longer values are rejected.
+/// </summary>
+struct PairingRecord
+{
+	UINT32 Magic;
+	UINT32 Flags;
+	UINT64 Serial;              // append order, from 1
+	UINT64 PairUidHash;
+	UINT64 UsnHash;
+	BYTE   TargetIPAddr[4];
+	UINT32 SeqNum;
+	GUID   DeviceId;
+	BYTE   CompanionKey[COMPANION_KEY_LENGTH_IN_BYTES];
+	char   PairUid[48];
+	char   TargetUsn[80];
+	char   TargetName[64];
+	char   Tags[96];
+	char   TargetApiVers[12];
+	UINT32 Reserved[4];
+	UINT32 Crc;                 // CRC-32 of everything above
+};
+
+/// <summary>
+/// A pairing in string form, as MRPairing holds it.
+/// </summary>
+struct PairingEntry
+{
+	std::string PairUid;
+	std::string TargetIPAddr;
+	std::string DeviceId;
+	std::string DeviceKey;      // 16 hex characters, or empty for the test pairing
+	std::string TargetUsn;
+	std::string TargetName;
+	std::string TargetApiVers;
+	std::string Tags;
+	UINT32      SeqNum;
+
+	PairingEntry() : SeqNum(0) {}
+
+	CompanionPairingInfo PairingInfo() const;
+};
+
+class PairingStore
+{
+public:
+
+	PairingStore();
+	~PairingStore();
+
+	/// <summary>
+	/// Open or create the store at path.
+	/// </summary>
+	COMPANION_RESULT Open(const std::string& path);
+
+	/// <summary>
+	/// Sync both files, mark the index clean and unmap.
+	/// </summary>
+	void Close();
+
+	bool IsOpen() const { return _storeFd >= 0; }
+
+	/// <summary>
+	/// Add a new pairing.  COMPANION_E_DUPLICATE if its pairUid or USN is already paired.
+	/// </summary>
+	COMPANION_RESULT Add(const PairingEntry& entry);
+
+	/// <summary>
+	/// Replace the pairing with the same pairUid.  COMPANION_E_NOT_FOUND if there is none.
+	/// </summary>
+	COMPANION_RESULT Update(const PairingEntry& entry);
+
+	COMPANION_RESULT UpdateSeqNum(const std::string& pairUid, UINT32 seqNum);
+
+	COMPANION_RESULT Remove(const std::string& pairUid);
+
+	/// <summary>
+	/// The live record for a pairUid or USN, or NULL.  Valid until the next write.
+	/// </summary>
+	const PairingRecord* FindByPairUid(const std::string& pairUid) const;
+	const PairingRecord* FindByUsn(const std::string& targetUsn) const;
+
+	COMPANION_RESULT Get(const std::string& pairUid, PairingEntry* entry) const;
+
+	/// <summary>
+	/// Call visit for every live pairing, in the order they were last written.
+	/// </summary>
+	void ForEach(const std::function<void(const PairingRecord&)>& visit) const;
+
+	/// <summary>
+	/// Rewrite the store with only the live records and rebuild the index.
+	/// </summary>
+	COMPANION_RESULT Compact();
+
+	/// <summary>
+	/// Flush the index and mark it clean.  The store itself is synced on every write.
+	/// </summary>
+	COMPANION_RESULT Sync();
+
+	UINT32 LiveCount() const { return _liveCount; }
+	UINT32 RecordCount() const { return _recordCount; }
+
+	static void ToEntry(const PairingRecord& record, PairingEntry* entry);
+	static UINT64 HashKey(const std::string& key);
+
+private:
+
+	PairingStore(const PairingStore&);
+	PairingStore& operator=(const PairingStore&);
+
+	struct StoreHeader;
+	struct IndexHeader;
+
+	COMPANION_RESULT Append(const PairingRecord& record);
+	COMPANION_RESULT MapStore(UINT32 capacity);
+	COMPANION_RESULT OpenIndex(bool* rebuilt);
+	COMPANION_RESULT CreateIndex(UINT32 buckets);
+	COMPANION_RESULT IndexRecord(UINT32 index);
+	void MarkIndexDirty();
+	bool IsCurrent(UINT32 index) const;
+	INT32 FindSlot(const UINT32* slots, UINT64 hash, const std::string& key, bool byUsn) const;
+	const PairingRecord* RecordAt(UINT32 index) const;
+	COMPANION_RESULT FromEntry(const PairingEntry& entry, PairingRecord* record) const;
+	void CloseIndex();
+	void CloseStore();
+
+	std::string _path;
+	int         _storeFd;
+	BYTE*       _store;             // header followed by records
+	size_t      _storeMapped;
+	UINT32      _capacity;          // records the mapping can hold
+	UINT32      _recordCount;       // valid records, live or not
+	UINT32      _liveCount;
+	UINT64      _storeId;
+	UINT64      _nextSerial;
+
+	int         _indexFd;
+	BYTE*       _index;
+	size_t      _indexMapped;
+	UINT32      _buckets;
+	UINT32*     _pairUidSlots;      // record index + 1, 0 when empty
+	UINT32*     _usnSlots;
+};
+
+#endif
@@ -0,0 +1,185 @@
+//--------------------------------------------------------------------------
+// <copyright file="RttEstimator.cpp" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// Per-STB round-trip estimates, adaptive timeouts and a retry budget.
+// </summary>
+//--------------------------------------------------------------------------
+
+#include "RttEstimator.h"
+
+#include <string.h>
+
+#define RTT_MAX_BACKOFF         4       // timeout doubles at most this many times
+#define RTT_TOKEN               1000000 // one retry, in budget units
+
+//------------------------------------------------------------------------------------------------------
+
+RttEstimator::RttEstimator(const RttOptions& options)
+	: _options(options), _srttUs(0), _rttvarUs(0), _samples(0), _backoff(0), _histogramTotal(0)
+{
+	if (_options.MinTimeoutMs == 0)
+		_options.MinTimeoutMs = 1;
+	if (_options.MaxTimeoutMs < _options.MinTimeoutMs)
+		_options.MaxTimeoutMs = _options.MinTimeoutMs;
+	if (_options.DecayEvery < 2)
+		_options.DecayEvery = 2;
+
+	memset(_histogram, 0, sizeof(_histogram));
+}
+
+void RttEstimator::AddSample(UINT64 rttUs)
+{
+	if (_samples == 0)
+	{
+		_srttUs = rttUs;
+		_rttvarUs = rttUs / 2;
+	}
+	else
+	{
+		// RTTVAR = 3/4 RTTVAR + 1/4 |SRTT - R|, then SRTT = 7/8 SRTT + 1/8 R.
+		UINT64 error = rttUs > _srttUs ? rttUs - _srttUs : _srttUs - rttUs;
+		_rttvarUs = (3 * _rttvarUs + error) / 4;
+		_srttUs = (7 * _srttUs + rttUs) / 8;
+	}
+
+	++_samples;
+	_backoff = 0;
+
+	++_histogram[BucketOf(rttUs)];
+	if (++_histogramTotal >= _options.DecayEvery)
+	{
+		_histogramTotal = 0;
+		for (UINT32 i = 0; i < RTT_HISTOGRAM_BUCKETS; ++i)
+		{
+			_histogram[i] /= 2;
+			_histogramTotal += _histogram[i];
+		}
+	}
+}
+
+void RttEstimator::Backoff()
+{
+	if (_backoff < RTT_MAX_BACKOFF)
+		++_backoff;
+}
+
+UINT64 RttEstimator::PercentileUs(UINT32 percentile) const
+{
+	if (_histogramTotal == 0)
+		return 0;
+	if (percentile > 100)
+		percentile = 100;
+
+	// The smallest bucket at or below which the requested share of samples lies.
+	UINT64 wanted = ((UINT64)_histogramTotal * percentile + 99) / 100;
+	if (wanted == 0)
+		wanted = 1;
+
+	UINT64 seen = 0;
+	for (UINT32 i = 0; i < RTT_HISTOGRAM_BUCKETS; ++i)
+	{
+		seen += _histogram[i];
+		if (seen >= wanted)
+			return BucketLimitUs(i);
+	}
+	return BucketLimitUs(RTT_HISTOGRAM_BUCKETS - 1);
+}
+
+UINT32 RttEstimator::TimeoutMs() const
+{
+	UINT64 timeoutUs;
+	if (!IsWarm())
+	{
+		timeoutUs = (UINT64)_options.InitialTimeoutMs * 1000;
+	}
+	else
+	{
+		timeoutUs = _srttUs + 4 * _rttvarUs;
+		UINT64 p99 = PercentileUs(99);
+		if (p99 > timeoutUs)
+			timeoutUs = p99;
+	}
+
+	timeoutUs <<= _backoff;
+
+	UINT64 timeoutMs = (timeoutUs + 999) / 1000;
+	if (timeoutMs < _options.MinTimeoutMs)
+		timeoutMs = _options.MinTimeoutMs;
+	if (timeoutMs > _options.MaxTimeoutMs)
+		timeoutMs = _options.MaxTimeoutMs;
+	return (UINT32)timeoutMs;
+}
+
+UINT32 RttEstimator::BucketOf(UINT64 us)
+{
+	// Bucket 0 holds everything under 64 us; after that each power of two is split into 4.
+	if (us < 64)
+		return 0;
+
+	UINT32 exponent = 63 - (UINT32)__builtin_clzll(us);
+	UINT32 bucket = 1 + 4 * (exponent - 6) + (UINT32)((us >> (exponent - 2)) & 3);
+	return bucket < RTT_HISTOGRAM_BUCKETS ? bucket : RTT_HISTOGRAM_BUCKETS - 1;
+}
+
+UINT64 RttEstimator::BucketLimitUs(UINT32 bucket)
+{
+	if (bucket == 0)
+		return 64;
+
+	UINT32 exponent = 6 + (bucket - 1) / 4;
+	UINT64 quarter = (bucket - 1) % 4;
+	return (4 + quarter + 1) << (exponent - 2);
+}
+
+//------------------------------------------------------------------------------------------------------
+
+RetryBudget::RetryBudget(const RetryBudgetOptions& options)
+	: _options(options), _balance(0), _refilledUs(0)
+{
+	if (_options.MaxTokens == 0)
+		_options.MaxTokens = 1;
+}
+
+void RetryBudget::Deposit(UINT64 nowUs)
+{
+	Refill(nowUs);
+	_balance += (UINT64)_options.Percent * (RTT_TOKEN / 100);
+
+	UINT64 cap = (UINT64)_options.MaxTokens * RTT_TOKEN;
+	if (_balance > cap)
+		_balance = cap;
+}
+
+bool RetryBudget::TryWithdraw(UINT64 nowUs)
+{
+	Refill(nowUs);
+	if (_balance < RTT_TOKEN)
+		return false;
+	_balance -= RTT_TOKEN;
+	return true;
+}
+
+UINT32 RetryBudget::Available(UINT64 nowUs)
+{
+	Refill(nowUs);
+	return (UINT32)(_balance / RTT_TOKEN);
+}
+
+void RetryBudget::Refill(UINT64 nowUs)
+{
+	if (_refilledUs == 0 || nowUs < _refilledUs)
+	{
+		_refilledUs = nowUs;
+		return;
+	}
+
+	// MinPerSecond tokens a second, one microsecond's worth at a time.
+	_balance += (nowUs - _refilledUs) * _options.MinPerSecond;
+	_refilledUs = nowUs;
+
+	UINT64 cap = (UINT64)_options.MaxTokens * RTT_TOKEN;
+	if (_balance > cap)
+		_balance = cap;
+}
@@ -0,0 +1,128 @@
+//--------------------------------------------------------------------------
+// <copyright file="RttEstimator.h" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// Per-STB round-trip estimates, adaptive timeouts and a retry budget.
+// </summary>
+//--------------------------------------------------------------------------
+
+/*
+ Using the RTT estimator:
+ MRCompanion waits a fixed 5000 ms for every request.  RttEstimator learns how quickly one STB actually
+ answers.  It keeps a smoothed RTT and mean deviation (the TCP retransmission timer of RFC 6298) and a
+ log-scaled histogram from which percentiles are read.  The histogram is halved every DecayEvery samples,
+ so the percentiles follow an STB whose latency drifts.
+
+ TimeoutMs() is the larger of SRTT + 4 * RTTVAR and the 99th percentile, clamped to [MinTimeoutMs,
+ MaxTimeoutMs]; until MinSamples answers have been seen it is InitialTimeoutMs.  Backoff() doubles the
+ timeout after a request times out, at most four times over, and the next sample clears it.
+
+ RetryBudget bounds hedged and retried requests so they cannot multiply load on an STB that is already
+ slow.  Every original request deposits Percent / 100 of a token, MinPerSecond tokens accrue regardless,
+ and each hedge or retry spends one whole token.
+
+ Neither class is thread-safe; CompanionClient uses them on its loop thread.
+ */
+
+#ifndef RTTESTIMATOR_H
+#define RTTESTIMATOR_H
+
+#include "CompanionCodec.h"
+
+#define RTT_HISTOGRAM_BUCKETS   80      // 4 per power of two from 64 us to 16 s
+
+struct RttOptions
+{
+	UINT32 InitialTimeoutMs;    // before MinSamples answers
+	UINT32 MinTimeoutMs;
+	UINT32 MaxTimeoutMs;
+	UINT32 MinSamples;
+	UINT32 DecayEvery;          // samples between halvings of the histogram
+
+	RttOptions() : InitialTimeoutMs(5000), MinTimeoutMs(250), MaxTimeoutMs(5000), MinSamples(8), DecayEvery(512) {}
+};
+
+class RttEstimator
+{
+public:
+
+	explicit RttEstimator(const RttOptions& options = RttOptions());
+
+	/// <summary>
+	/// Record the round trip of a request that was answered.
+	/// </summary>
+	void AddSample(UINT64 rttUs);
+
+	/// <summary>
+	/// A request timed out: double the timeout until the next sample.
+	/// </summary>
+	void Backoff();
+
+	/// <summary>
+	/// Upper bound of the histogram bucket holding the given percentile (1-100); 0 before any sample.
+	/// </summary>
+	UINT64 PercentileUs(UINT32 percentile) const;
+
+	UINT32 TimeoutMs() const;
+
+	UINT64 SmoothedUs() const { return _srttUs; }
+	UINT64 DeviationUs() const { return _rttvarUs; }
+	UINT64 Samples() const { return _samples; }
+	bool IsWarm() const { return _samples >= _options.MinSamples; }
+	const RttOptions& Options() const { return _options; }
+
+private:
+
+	static UINT32 BucketOf(UINT64 us);
+	static UINT64 BucketLimitUs(UINT32 bucket);
+
+	RttOptions _options;
+	UINT64     _srttUs;
+	UINT64     _rttvarUs;
+	UINT64     _samples;
+	UINT32     _backoff;
+	UINT32     _histogramTotal;
+	UINT32     _histogram[RTT_HISTOGRAM_BUCKETS];
+};
+
+struct RetryBudgetOptions
+{
+	UINT32 Percent;             // hedges and retries allowed per 100 requests
+	UINT32 MinPerSecond;        // allowed regardless of request volume
+	UINT32 MaxTokens;           // most that can be saved up
+
+	RetryBudgetOptions() : Percent(10), MinPerSecond(1), MaxTokens(10) {}
+};
+
+class RetryBudget
+{
+public:
+
+	explicit RetryBudget(const RetryBudgetOptions& options = RetryBudgetOptions());
+
+	/// <summary>
+	/// An original request was sent.
+	/// </summary>
+	void Deposit(UINT64 nowUs);
+
+	/// <summary>
+	/// Spend one token for a hedge or retry.  False if the budget is exhausted.
+	/// </summary>
+	bool TryWithdraw(UINT64 nowUs);
+
+	/// <summary>
+	/// Whole tokens available now.
+	/// </summary>
+	UINT32 Available(UINT64 nowUs);
+
+private:
+
+	void Refill(UINT64 nowUs);
+
+	RetryBudgetOptions _options;
+	UINT64             _balance;        // in millionths of a token
+	UINT64             _refilledUs;
+};
+
+#endif
@@ -0,0 +1,238 @@
+//--------------------------------------------------------------------------
+// <copyright file="SequenceWindow.cpp" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// Lock-free replay and window checks for received sequence numbers.
+// </summary>
+//--------------------------------------------------------------------------
+
+#include "SequenceWindow.h"
+
+#define SEQUENCE_BLOCK_SHIFT    6                       // 32 odd sequence numbers to a block
+#define SEQUENCE_BLOCK_MASK     0x03FFFFFFu             // block numbers are 26 bits
+#define SEQUENCE_NEWEST_VALID   (1ULL << 32)
+#define SEQUENCE_WORD_VALID     0x80000000u             // in the tag: the word has held a block
+
+// The window must fit in the ring, with a block to spare for the one the newest is filling.
+static_assert((COMPANION_SEQUENCE_WINDOW >> SEQUENCE_BLOCK_SHIFT) + 2 <= SEQUENCE_WINDOW_WORDS, "SEQUENCE_WINDOW_WORDS too small");
+static_assert((SEQUENCE_WINDOW_WORDS & (SEQUENCE_WINDOW_WORDS - 1)) == 0, "SEQUENCE_WINDOW_WORDS must be a power of two");
+
+//------------------------------------------------------------------------------------------------------
+
+/// <summary>
+/// The counter shard of the calling thread: threads take shards in turn, the first time they count.
+/// </summary>
+static UINT32 CounterShard()
+{
+	// Constant-initialized, so reading it costs no guard; 0 until the thread's first count.
+	static std::atomic<UINT32> next(0);
+	static thread_local UINT32 shard = 0;
+	if (shard == 0)
+		shard = next.fetch_add(1, std::memory_order_relaxed) % SEQUENCE_COUNTER_SHARDS + 1;
+	return shard - 1;
+}
+
+SequenceWindow::SequenceWindow()
+	: _newest(0)
+{
+	for (UINT32 i = 0; i < SEQUENCE_WINDOW_WORDS; ++i)
+		_words[i].store(0, std::memory_order_relaxed);
+}
+
+SequenceCheck SequenceWindow::Check(UINT32 seqNum)
+{
+	Counters& counters = _counters[CounterShard()];
+	bool outOfWindow = false;
+	bool advanced = Advance(seqNum, &outOfWindow, counters);
+	if (outOfWindow)
+	{
+		counters.OutOfWindow.fetch_add(1, std::memory_order_relaxed);
+		return SequenceOutOfWindow;
+	}
+
+	SequenceCheck result = Mark(seqNum, counters);
+	switch (result)
+	{
+	case SequenceAccepted:
+		counters.Accepted.fetch_add(1, std::memory_order_relaxed);
+		if (advanced)
+			counters.Advanced.fetch_add(1, std::memory_order_relaxed);
+		break;
+	case SequenceDuplicate:
+		counters.Duplicates.fetch_add(1, std::memory_order_relaxed);
+		break;
+	default:
+		counters.OutOfWindow.fetch_add(1, std::memory_order_relaxed);
+		break;
+	}
+	return result;
+}
+
+UINT32 SequenceWindow::Newest() const
+{
+	return (UINT32)_newest.load(std::memory_order_acquire);
+}
+
+void SequenceWindow::AddStats(SequenceWindowStats* stats) const
+{
+	for (UINT32 i = 0; i < SEQUENCE_COUNTER_SHARDS; ++i)
+	{
+		const Counters& counters = _counters[i];
+		stats->Accepted += counters.Accepted.load(std::memory_order_relaxed);
+		stats->Duplicates += counters.Duplicates.load(std::memory_order_relaxed);
+		stats->OutOfWindow += counters.OutOfWindow.load(std::memory_order_relaxed);
+		stats->Advanced += counters.Advanced.load(std::memory_order_relaxed);
+		stats->Retries += counters.Retries.load(std::memory_order_relaxed);
+	}
+}
+
+bool SequenceWindow::Advance(UINT32 seqNum, bool* outOfWindow, Counters& counters)
+{
+	UINT64 newest = _newest.load(std::memory_order_acquire);
+	for (;;)
+	{
+		if (newest != 0)
+		{
+			// The decryptResponse: rule: seqDelta is how far seqNum lags behind the newest.
+			INT32 seqDelta = (INT32)((UINT32)newest - seqNum);
+			if (seqDelta >= COMPANION_SEQUENCE_WINDOW)
+				*outOfWindow = true;
+			if (seqDelta >= 0)
+				return false;
+		}
+
+		if (_newest.compare_exchange_weak(newest, SEQUENCE_NEWEST_VALID | seqNum, std::memory_order_acq_rel, std::memory_order_acquire))
+			return true;
+		counters.Retries.fetch_add(1, std::memory_order_relaxed);
+	}
+}
+
+SequenceCheck SequenceWindow::Mark(UINT32 seqNum, Counters& counters)
+{
+	// The low bit of seqNum is dropped: an even sequence number is checked as the odd one above it.
+	UINT32 block = (seqNum >> SEQUENCE_BLOCK_SHIFT) & SEQUENCE_BLOCK_MASK;
+	UINT64 bit = 1ULL << ((seqNum >> 1) & 31);
+	std::atomic<UINT64>& word = _words[block & (SEQUENCE_WINDOW_WORDS - 1)];
+
+	UINT64 current = word.load(std::memory_order_acquire);
+	for (;;)
+	{
+		UINT32 tag = (UINT32)(current >> 32);
+		UINT64 desired;
+		if (tag == (SEQUENCE_WORD_VALID | block))
+		{
+			if ((current & bit) != 0)
+				return SequenceDuplicate;
+			desired = current | bit;
+		}
+		else
+		{
+			// Advance has already moved the newest to seqNum or past it, and every tag was the block of a
+			// sequence number no newer than the newest.  A tag among the ring's most recent blocks is
+			// therefore a newer block than ours, which has left the window; any other is stale.
+			UINT32 newestBlock = (Newest() >> SEQUENCE_BLOCK_SHIFT) & SEQUENCE_BLOCK_MASK;
+			if ((tag & SEQUENCE_WORD_VALID) != 0 && ((newestBlock - tag) & SEQUENCE_BLOCK_MASK) < SEQUENCE_WINDOW_WORDS)
+				return SequenceOutOfWindow;
+			desired = ((UINT64)(SEQUENCE_WORD_VALID | block) << 32) | bit;
+		}
+
+		if (word.compare_exchange_weak(current, desired, std::memory_order_acq_rel, std::memory_order_acquire))
+			return SequenceAccepted;
+		counters.Retries.fetch_add(1, std::memory_order_relaxed);
+	}
+}
+
+//------------------------------------------------------------------------------------------------------
+
+static UINT64 HashCid(const std::string& cid)
+{
+	// FNV-1a.
+	UINT64 hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < cid.length(); ++i)
+	{
+		hash ^= (BYTE)cid[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+SequenceWindowTable::SequenceWindowTable(UINT32 capacity)
+	: _slots(NULL), _mask(0), _windows(0), _tableFull(0)
+{
+	UINT32 size = 1;
+	while (size < capacity && size < 0x80000000u)
+		size <<= 1;
+
+	_slots = new std::atomic<Entry*>[size];
+	for (UINT32 i = 0; i < size; ++i)
+		_slots[i].store(NULL, std::memory_order_relaxed);
+	_mask = size - 1;
+}
+
+SequenceWindowTable::~SequenceWindowTable()
+{
+	for (UINT32 i = 0; i <= _mask; ++i)
+		delete _slots[i].load(std::memory_order_relaxed);
+	delete[] _slots;
+}
+
+SequenceCheck SequenceWindowTable::Check(const std::string& cid, UINT32 seqNum)
+{
+	SequenceWindow* window = Find(cid);
+	if (window == NULL)
+	{
+		_tableFull.fetch_add(1, std::memory_order_relaxed);
+		return SequenceTableFull;
+	}
+	return window->Check(seqNum);
+}
+
+SequenceWindow* SequenceWindowTable::Find(const std::string& cid)
+{
+	Entry* created = NULL;
+	UINT32 slot = (UINT32)HashCid(cid) & _mask;
+
+	// Linear probing over slots that, once claimed, never change.
+	for (UINT32 probe = 0; probe <= _mask; ++probe, slot = (slot + 1) & _mask)
+	{
+		Entry* entry = _slots[slot].load(std::memory_order_acquire);
+		if (entry == NULL)
+		{
+			if (created == NULL)
+			{
+				created = new Entry();
+				created->Cid = cid;
+			}
+			if (_slots[slot].compare_exchange_strong(entry, created, std::memory_order_acq_rel, std::memory_order_acquire))
+			{
+				_windows.fetch_add(1, std::memory_order_relaxed);
+				return &created->Window;
+			}
+			// Another thread claimed the slot first; entry is now its window, perhaps for this cid.
+		}
+
+		if (entry->Cid == cid)
+		{
+			delete created;
+			return &entry->Window;
+		}
+	}
+
+	delete created;
+	return NULL;
+}
+
+SequenceWindowStats SequenceWindowTable::Stats() const
+{
+	SequenceWindowStats stats;
+	for (UINT32 i = 0; i <= _mask; ++i)
+	{
+		Entry* entry = _slots[i].load(std::memory_order_acquire);
+		if (entry != NULL)
+			entry->Window.AddStats(&stats);
+	}
+	stats.Windows = _windows.load(std::memory_order_relaxed);
+	stats.TableFull = _tableFull.load(std::memory_order_relaxed);
+	return stats;
+}
@@ -0,0 +1,167 @@
+//--------------------------------------------------------------------------
+// <copyright file="SequenceWindow.h" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// Lock-free replay and window checks for received sequence numbers.
+// </summary>
+//--------------------------------------------------------------------------
+
+/*
+ Using sequence windows:
+ Every companion request carries seq=%08X and the same sequence number inside its signed hash.  A receiver
+ that verifies requests - a stand-in STB, or a gateway in front of many clients - must refuse a request it
+ has already seen, and one that lags so far behind the newest that it can no longer tell.  The window is
+ the one decryptResponse: uses in the other direction: COMPANION_SEQUENCE_WINDOW sequence numbers behind
+ the newest seen.
+
+    SequenceWindowTable windows;                // one window per cid
+    switch (windows.Check(cid, seqNum))
+    {
+    case SequenceAccepted:      ...             // new, and now remembered
+    case SequenceDuplicate:     ...             // seen before: a replay
+    case SequenceOutOfWindow:   ...             // too old to tell
+    }
+
+ A newer sequence number is always accepted and slides the window forward, as a client that resyncs to an
+ STB jumps ahead.  Sequence numbers are odd, so each one is a bit in a ring of SEQUENCE_WINDOW_WORDS 64-bit
+ words: 32 bits of bitmap and, above them, the number of the 32-sequence block the word holds, if any.
+ The bit is (seqNum >> 1) & 31, so an even sequence number shares the bit of the odd one above it: 2n is
+ a duplicate of 2n + 1 and the other way round.  Clients only send odd ones.
+ Check sets its bit with compare-and-swap; a word still holding an older block is taken over by the same
+ swap, so no thread ever clears bits another is setting and no thread waits for another.  The newest sequence number
+ is advanced the same way.  Threads checking different cids share nothing but the table's slots, which
+ are claimed once with compare-and-swap and never freed until the table is destroyed.  Each window is on
+ cache lines of its own (CacheAligned.h), and its counters are split into SEQUENCE_COUNTER_SHARDS shards,
+ each on its own line.  A thread always counts into the same shard, so counting does not take the window's
+ lines away from the other threads checking the same cid.
+
+ A request racing one far ahead of it may be accepted just before the window slides past it; it can never
+ be accepted twice.
+ */
+
+#ifndef SEQUENCEWINDOW_H
+#define SEQUENCEWINDOW_H
+
+#include "CacheAligned.h"
+#include "CompanionCodec.h"
+
+#include <atomic>
+#include <string>
+
+#define SEQUENCE_WINDOW_WORDS       32      // blocks of 32 odd sequence numbers; must cover the window
+#define SEQUENCE_TABLE_DEFAULT_SIZE 1024    // cids
+#define SEQUENCE_COUNTER_SHARDS     4       // copies of a window's counters, each on a cache line of its own
+
+enum SequenceCheck
+{
+	SequenceAccepted = 0,
+	SequenceDuplicate = 1,
+	SequenceOutOfWindow = 2,
+	SequenceTableFull = 3       // SequenceWindowTable only: no room for another cid
+};
+
+struct SequenceWindowStats
+{
+	UINT64 Accepted;
+	UINT64 Duplicates;
+	UINT64 OutOfWindow;
+	UINT64 Advanced;            // accepted sequence numbers that were the newest yet
+	UINT64 Retries;             // compare-and-swaps lost to another thread
+	UINT64 Windows;             // SequenceWindowTable only: cids seen
+	UINT64 TableFull;           // SequenceWindowTable only
+
+	SequenceWindowStats() : Accepted(0), Duplicates(0), OutOfWindow(0), Advanced(0), Retries(0), Windows(0), TableFull(0) {}
+};
+
+/// <summary>
+/// The window of one sender.  Thread-safe and lock-free.
+/// </summary>
+class alignas(CSPARVE64_CACHE_LINE_SIZE) SequenceWindow : public CacheAligned
+{
+public:
+
+	SequenceWindow();
+
+	/// <summary>
+	/// Accept seqNum if it is new and not COMPANION_SEQUENCE_WINDOW or more behind the newest.
+	/// </summary>
+	SequenceCheck Check(UINT32 seqNum);
+
+	/// <summary>
+	/// The newest sequence number accepted, or 0 before the first.
+	/// </summary>
+	UINT32 Newest() const;
+
+	/// <summary>
+	/// Adds this window's counters into stats.
+	/// </summary>
+	void AddStats(SequenceWindowStats* stats) const;
+
+private:
+
+	SequenceWindow(const SequenceWindow&);
+	SequenceWindow& operator=(const SequenceWindow&);
+
+	struct alignas(CSPARVE64_CACHE_LINE_SIZE) Counters
+	{
+		std::atomic<UINT64> Accepted;
+		std::atomic<UINT64> Duplicates;
+		std::atomic<UINT64> OutOfWindow;
+		std::atomic<UINT64> Advanced;
+		std::atomic<UINT64> Retries;
+
+		Counters() : Accepted(0), Duplicates(0), OutOfWindow(0), Advanced(0), Retries(0) {}
+	};
+
+	bool Advance(UINT32 seqNum, bool* outOfWindow, Counters& counters);
+	SequenceCheck Mark(UINT32 seqNum, Counters& counters);
+
+	std::atomic<UINT64> _newest;        // 1 << 32 | seqNum once the first has been accepted
+	std::atomic<UINT64> _words[SEQUENCE_WINDOW_WORDS];
+	Counters            _counters[SEQUENCE_COUNTER_SHARDS];
+};
+
+/// <summary>
+/// A SequenceWindow per cid, in a fixed-size lock-free hash table.
+/// </summary>
+class SequenceWindowTable
+{
+public:
+
+	/// <summary>
+	/// Room for capacity cids (rounded up to a power of two).
+	/// </summary>
+	explicit SequenceWindowTable(UINT32 capacity = SEQUENCE_TABLE_DEFAULT_SIZE);
+	~SequenceWindowTable();
+
+	SequenceCheck Check(const std::string& cid, UINT32 seqNum);
+
+	/// <summary>
+	/// The window of cid, created on first use.  NULL if the table is full.
+	/// </summary>
+	SequenceWindow* Find(const std::string& cid);
+
+	/// <summary>
+	/// The counters of every window, summed.
+	/// </summary>
+	SequenceWindowStats Stats() const;
+
+private:
+
+	SequenceWindowTable(const SequenceWindowTable&);
+	SequenceWindowTable& operator=(const SequenceWindowTable&);
+
+	struct alignas(CSPARVE64_CACHE_LINE_SIZE) Entry : public CacheAligned
+	{
+		std::string    Cid;
+		SequenceWindow Window;
+	};
+
+	std::atomic<Entry*>* _slots;
+	UINT32               _mask;
+	std::atomic<UINT64>  _windows;
+	std::atomic<UINT64>  _tableFull;
+};
+
+#endif
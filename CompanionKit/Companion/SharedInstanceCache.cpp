@@ -0,0 +1,444 @@
+//--------------------------------------------------------------------------
+// <copyright file="SharedInstanceCache.cpp" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// Derived CSParve64 instance state shared between processes in one mapping.
+// </summary>
+//--------------------------------------------------------------------------
+
+#include "SharedInstanceCache.h"
+
+#include <atomic>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SHARED_INSTANCE_MAGIC       0x43495343u     // "CSIC"
+#define SHARED_INSTANCE_HEADER_SIZE 128
+#define SHARED_INSTANCE_MAX_SPINS   1000            // reads of a slot being written before giving up on it
+
+/// <summary>
+/// The start of the segment.  Magic is stored last when the segment is laid out.
+/// </summary>
+struct SharedInstanceCache::Header
+{
+	std::atomic<UINT32> Magic;
+	UINT32              Version;
+	UINT32              Capacity;
+	UINT32              SlotSize;
+	std::atomic<UINT32> Entries;
+	std::atomic<UINT32> Processes;
+	std::atomic<UINT64> Hits;
+	std::atomic<UINT64> Misses;
+	std::atomic<UINT64> Inserts;
+	std::atomic<UINT64> Full;
+	std::atomic<UINT64> Retries;
+	std::atomic<UINT64> WriterTimeouts;
+	std::atomic<UINT64> WritersRecovered;
+	pthread_mutex_t     Writer;         // process-shared and, where supported, robust
+};
+
+/// <summary>
+/// One instance.  Sequence is odd while the slot is being written and Used is set once it holds one.
+/// </summary>
+struct SharedInstanceCache::Slot
+{
+	std::atomic<UINT32> Sequence;
+	UINT32              Used;
+	BYTE                Key[COMPANION_KEY_LENGTH_IN_BYTES];
+	GUID                Guid;
+	SharedInstance      Instance;
+};
+
+static_assert(sizeof(std::atomic<UINT64>) == sizeof(UINT64) && ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2, "shared counters must be lock-free");
+
+/// <summary>
+/// Holds flock on a descriptor for its lifetime.  flock belongs to the open file description, so this
+/// only excludes processes that opened the segment themselves; forked ones attach through OpenFd, which
+/// reopens it.
+/// </summary>
+class SegmentLock
+{
+public:
+
+	explicit SegmentLock(int fd) : _fd(fd)
+	{
+		while (flock(_fd, LOCK_EX) != 0 && errno == EINTR)
+			;
+	}
+
+	~SegmentLock() { flock(_fd, LOCK_UN); }
+
+private:
+
+	int _fd;
+};
+
+/// <summary>
+/// Holds the segment's writer mutex for its lifetime, if it can be had within
+/// SHARED_INSTANCE_WRITER_TIMEOUT_MS.  The mutex is robust, so one whose owner died is handed to the next
+/// writer with EOWNERDEAD rather than held forever, whatever has become of the owner's pid.
+/// </summary>
+class SegmentWriter
+{
+public:
+
+	explicit SegmentWriter(pthread_mutex_t* mutex) : _mutex(mutex), _held(false), _recovered(false)
+	{
+		// Inserts are short and rare; a waiter gives up the processor rather than spin on it.  Polled rather
+		// than pthread_mutex_timedlock, which not every platform has.
+		struct timespec start;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (UINT32 spin = 0; ; ++spin)
+		{
+			int result = pthread_mutex_trylock(_mutex);
+			if (result == 0)
+			{
+				_held = true;
+				break;
+			}
+#ifdef __linux__
+			if (result == EOWNERDEAD)
+			{
+				pthread_mutex_consistent(_mutex);
+				_held = true;
+				_recovered = true;
+				break;
+			}
+#endif
+			if (result != EBUSY)
+				break;
+
+			struct timespec now;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			long long elapsedMs = (long long)(now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+			if (elapsedMs >= SHARED_INSTANCE_WRITER_TIMEOUT_MS)
+				break;
+			if (spin < 64)
+				sched_yield();
+			else
+				usleep(100);
+		}
+	}
+
+	~SegmentWriter()
+	{
+		if (_held)
+			pthread_mutex_unlock(_mutex);
+	}
+
+	bool Held() const { return _held; }
+	bool Recovered() const { return _recovered; }
+
+private:
+
+	pthread_mutex_t* _mutex;
+	bool             _held;
+	bool             _recovered;
+};
+
+/// <summary>
+/// Set up the writer mutex of a segment being laid out.
+/// </summary>
+static bool InitWriterMutex(pthread_mutex_t* mutex)
+{
+	pthread_mutexattr_t attributes;
+	if (pthread_mutexattr_init(&attributes) != 0)
+		return false;
+	bool initialized = pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED) == 0
+#ifdef __linux__
+		&& pthread_mutexattr_setrobust(&attributes, PTHREAD_MUTEX_ROBUST) == 0
+#endif
+		&& pthread_mutex_init(mutex, &attributes) == 0;
+	pthread_mutexattr_destroy(&attributes);
+	return initialized;
+}
+
+//------------------------------------------------------------------------------------------------------
+
+SharedInstanceCache::SharedInstanceCache()
+	: _fd(-1), _header(NULL), _mapped(0), _mask(0)
+{
+}
+
+SharedInstanceCache::~SharedInstanceCache()
+{
+	Close();
+}
+
+COMPANION_RESULT SharedInstanceCache::Open(const std::string& path, UINT32 capacity)
+{
+	Close();
+
+	_fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (_fd < 0)
+		return COMPANION_FAIL;
+
+	COMPANION_RESULT result = Attach(capacity);
+	if (result != COMPANION_OK)
+		Close();
+	return result;
+}
+
+COMPANION_RESULT SharedInstanceCache::OpenAnonymous(UINT32 capacity)
+{
+	Close();
+
+#ifdef __linux__
+	// Not close-on-exec: the descriptor is meant to be inherited.
+	_fd = memfd_create("companion-instances", 0);
+#endif
+	if (_fd < 0)
+		return COMPANION_FAIL;
+
+	COMPANION_RESULT result = Attach(capacity);
+	if (result != COMPANION_OK)
+		Close();
+	return result;
+}
+
+COMPANION_RESULT SharedInstanceCache::OpenFd(int fd, UINT32 capacity)
+{
+	Close();
+
+#ifdef __linux__
+	// A descriptor of its own, not a duplicate sharing the file description (and so the flock) with
+	// whoever opened it.
+	char path[32];
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+	_fd = open(path, O_RDWR | O_CLOEXEC);
+#endif
+	if (_fd < 0)
+		_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	if (_fd < 0)
+		return COMPANION_FAIL;
+
+	COMPANION_RESULT result = Attach(capacity);
+	if (result != COMPANION_OK)
+		Close();
+	return result;
+}
+
+void SharedInstanceCache::Close()
+{
+	if (_header != NULL)
+	{
+		_header->Processes.fetch_sub(1, std::memory_order_relaxed);
+		munmap(_header, _mapped);
+		_header = NULL;
+		_mapped = 0;
+	}
+	if (_fd >= 0)
+	{
+		close(_fd);
+		_fd = -1;
+	}
+	_mask = 0;
+}
+
+COMPANION_RESULT SharedInstanceCache::Attach(UINT32 capacity)
+{
+	static_assert(sizeof(Header) <= SHARED_INSTANCE_HEADER_SIZE, "header too large");
+	static_assert(sizeof(Slot) <= SHARED_INSTANCE_SLOT_SIZE, "slot too large");
+
+	UINT32 slots = 1;
+	while (slots < capacity && slots < 0x01000000u)
+		slots <<= 1;
+
+	// Whoever finds the segment empty lays it out; the others wait for the lock and then see it done.
+	SegmentLock lock(_fd);
+
+	struct stat st;
+	if (fstat(_fd, &st) != 0)
+		return COMPANION_FAIL;
+
+	bool create = st.st_size == 0;
+	if (create)
+	{
+		st.st_size = (off_t)SHARED_INSTANCE_HEADER_SIZE + (off_t)slots * SHARED_INSTANCE_SLOT_SIZE;
+		if (ftruncate(_fd, st.st_size) != 0)
+			return COMPANION_FAIL;
+	}
+	if ((size_t)st.st_size < SHARED_INSTANCE_HEADER_SIZE + SHARED_INSTANCE_SLOT_SIZE)
+		return COMPANION_E_FORMAT;
+
+	void* mapped = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+	if (mapped == MAP_FAILED)
+		return COMPANION_FAIL;
+	_header = (Header*)mapped;
+	_mapped = (size_t)st.st_size;
+
+	if (create)
+	{
+		// ftruncate zeroed the segment, which is every slot empty and every counter 0.
+		if (!InitWriterMutex(&_header->Writer))
+		{
+			munmap(_header, _mapped);
+			_header = NULL;
+			_mapped = 0;
+			ftruncate(_fd, 0);
+			return COMPANION_FAIL;
+		}
+		_header->Version = SHARED_INSTANCE_VERSION;
+		_header->Capacity = slots;
+		_header->SlotSize = SHARED_INSTANCE_SLOT_SIZE;
+		_header->Magic.store(SHARED_INSTANCE_MAGIC, std::memory_order_release);
+	}
+
+	if (_header->Magic.load(std::memory_order_acquire) != SHARED_INSTANCE_MAGIC
+		|| _header->Version != SHARED_INSTANCE_VERSION
+		|| _header->SlotSize != SHARED_INSTANCE_SLOT_SIZE
+		|| _header->Capacity == 0 || (_header->Capacity & (_header->Capacity - 1)) != 0
+		|| _mapped < SHARED_INSTANCE_HEADER_SIZE + (size_t)_header->Capacity * SHARED_INSTANCE_SLOT_SIZE)
+	{
+		munmap(_header, _mapped);
+		_header = NULL;
+		_mapped = 0;
+		return COMPANION_E_FORMAT;
+	}
+
+	_mask = _header->Capacity - 1;
+	_header->Processes.fetch_add(1, std::memory_order_relaxed);
+	return COMPANION_OK;
+}
+
+SharedInstanceCache::Slot* SharedInstanceCache::SlotAt(UINT32 index) const
+{
+	return (Slot*)((BYTE*)_header + SHARED_INSTANCE_HEADER_SIZE + (size_t)index * SHARED_INSTANCE_SLOT_SIZE);
+}
+
+UINT32 SharedInstanceCache::Hash(const BYTE* key, const GUID& guid)
+{
+	// FNV-1a over the key and GUID.
+	UINT32 hash = 2166136261u;
+	for (int i = 0; i < COMPANION_KEY_LENGTH_IN_BYTES; ++i)
+		hash = (hash ^ key[i]) * 16777619u;
+	const BYTE* g = (const BYTE*)&guid;
+	for (size_t i = 0; i < sizeof(guid); ++i)
+		hash = (hash ^ g[i]) * 16777619u;
+	return hash;
+}
+
+bool SharedInstanceCache::Find(const BYTE* key, const GUID& guid, SharedInstance* instance)
+{
+	if (_header == NULL)
+		return false;
+
+	UINT32 index = Hash(key, guid) & _mask;
+	for (UINT32 probe = 0; probe <= _mask; ++probe, index = (index + 1) & _mask)
+	{
+		Slot* slot = SlotAt(index);
+
+		bool matched = false, used = false, stable = false;
+		for (UINT32 spin = 0; spin < SHARED_INSTANCE_MAX_SPINS && !stable; ++spin)
+		{
+			UINT32 before = slot->Sequence.load(std::memory_order_acquire);
+			if ((before & 1) == 0)
+			{
+				used = slot->Used != 0;
+				matched = used && memcmp(slot->Key, key, COMPANION_KEY_LENGTH_IN_BYTES) == 0 && memcmp(&slot->Guid, &guid, sizeof(guid)) == 0;
+				if (matched)
+					memcpy(instance, &slot->Instance, sizeof(*instance));
+
+				// The copy is only good if no writer started on the slot meanwhile.
+				std::atomic_thread_fence(std::memory_order_acquire);
+				stable = slot->Sequence.load(std::memory_order_relaxed) == before;
+			}
+			if (!stable)
+				_header->Retries.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		// Slots are never emptied, so the first empty one ends the probe; so does one a dead writer left.
+		if (!stable || !used)
+			break;
+		if (matched)
+		{
+			_header->Hits.fetch_add(1, std::memory_order_relaxed);
+			return true;
+		}
+	}
+
+	_header->Misses.fetch_add(1, std::memory_order_relaxed);
+	return false;
+}
+
+COMPANION_RESULT SharedInstanceCache::Insert(const BYTE* key, const GUID& guid, const SharedInstance& instance)
+{
+	if (_header == NULL)
+		return COMPANION_FAIL;
+
+	// The single writer.  While it is held no slot is being written, so an odd sequence is a dead writer's.
+	SegmentWriter writer(&_header->Writer);
+	if (!writer.Held())
+	{
+		_header->WriterTimeouts.fetch_add(1, std::memory_order_relaxed);
+		return COMPANION_FAIL;
+	}
+	if (writer.Recovered())
+		_header->WritersRecovered.fetch_add(1, std::memory_order_relaxed);
+
+	UINT32 index = Hash(key, guid) & _mask;
+	for (UINT32 probe = 0; probe <= _mask; ++probe, index = (index + 1) & _mask)
+	{
+		Slot* slot = SlotAt(index);
+		UINT32 sequence = slot->Sequence.load(std::memory_order_relaxed);
+		bool torn = (sequence & 1) != 0;
+		if (!torn && slot->Used != 0)
+		{
+			if (memcmp(slot->Key, key, COMPANION_KEY_LENGTH_IN_BYTES) == 0 && memcmp(&slot->Guid, &guid, sizeof(guid)) == 0)
+				return COMPANION_OK;
+			continue;
+		}
+
+		bool used = slot->Used != 0;
+		if (!torn)
+			slot->Sequence.store(++sequence, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		memcpy(slot->Key, key, COMPANION_KEY_LENGTH_IN_BYTES);
+		memcpy(&slot->Guid, &guid, sizeof(guid));
+		memcpy(&slot->Instance, &instance, sizeof(instance));
+		slot->Used = 1;
+		slot->Sequence.store(sequence + 1, std::memory_order_release);
+		if (!used)
+			_header->Entries.fetch_add(1, std::memory_order_relaxed);
+
+		_header->Inserts.fetch_add(1, std::memory_order_relaxed);
+		return COMPANION_OK;
+	}
+
+	_header->Full.fetch_add(1, std::memory_order_relaxed);
+	return COMPANION_FAIL;
+}
+
+SharedInstanceCacheStats SharedInstanceCache::Stats() const
+{
+	SharedInstanceCacheStats stats;
+	if (_header == NULL)
+		return stats;
+
+	stats.Capacity = _header->Capacity;
+	stats.Entries = _header->Entries.load(std::memory_order_relaxed);
+	stats.Processes = _header->Processes.load(std::memory_order_relaxed);
+	stats.Hits = _header->Hits.load(std::memory_order_relaxed);
+	stats.Misses = _header->Misses.load(std::memory_order_relaxed);
+	stats.Inserts = _header->Inserts.load(std::memory_order_relaxed);
+	stats.Full = _header->Full.load(std::memory_order_relaxed);
+	stats.WriterTimeouts = _header->WriterTimeouts.load(std::memory_order_relaxed);
+	stats.WritersRecovered = _header->WritersRecovered.load(std::memory_order_relaxed);
+	stats.Retries = _header->Retries.load(std::memory_order_relaxed);
+	// What the segment occupies, which is only the pages written so far.
+	struct stat st;
+	stats.SegmentBytes = fstat(_fd, &st) == 0 ? (UINT64)st.st_blocks * 512 : _mapped;
+	stats.PerProcessBytes = (UINT64)stats.Processes * stats.Entries * SHARED_INSTANCE_SLOT_SIZE;
+	stats.SavedBytes = (long long)stats.PerProcessBytes - (long long)stats.SegmentBytes;
+	return stats;
+}
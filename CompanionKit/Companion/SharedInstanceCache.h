@@ -0,0 +1,144 @@
+//--------------------------------------------------------------------------
+// <copyright file="SharedInstanceCache.h" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// Derived CSParve64 instance state shared between processes in one mapping.
+// </summary>
+//--------------------------------------------------------------------------
+
+/*
+ Using the shared instance cache:
+ CompanionCodec::Open spends most of its time in CSParve64_Create, whose CBC-MAC and modular inverses
+ depend only on the companion key and the GUID.  Worker processes serving the same STBs each repeat that
+ after every restart.  A SharedInstanceCache keeps the result - the CSParve64_ExportInstance state and the
+ context hash - in a segment every worker maps, so that any of them opens a pairing another has opened
+ with CSParve64_ImportInstance instead:
+
+    SharedInstanceCache instances;
+    instances.Open("/dev/shm/companion-instances");     // or OpenAnonymous() before forking the workers
+    codec.SetInstanceCache(&instances);                 // or CompanionClientOptions.InstanceCache
+    codec.Open(pairing);
+
+ The segment is a header and Capacity fixed-size slots, hashed by key and GUID with linear probing.  A slot
+ is written once and never changed or removed, so readers take no lock: each slot carries a sequence
+ number that is odd while it is being written, and a reader that sees it change under it tries again.
+ Inserts go through a single writer at a time, under a process-shared robust mutex in the header: when a
+ writer dies holding it, the next one is told so by the kernel and takes it over, and a slot the dead
+ writer left half-written is reclaimed by that insert.  An insert that cannot get the mutex within
+ SHARED_INSTANCE_WRITER_TIMEOUT_MS returns COMPANION_FAIL, and the pairing is opened without sharing.  The first process to open the segment lays it out under flock on the file, which is why
+ OpenFd reopens the descriptor rather than duplicate it.  When the table is full, further pairings are
+ opened the ordinary way and not shared.
+
+ The instance state is key material: the file is created 0600 and the anonymous segment is only
+ reachable through its descriptor.  ImportInstance checks the state against the CompanionConfig keys, so
+ a damaged slot or one written under another configuration falls back to CSParve64_Create.
+
+ Stats reports what the segment saves against each process caching the same instances itself: every
+ attached process would hold every entry, where the segment holds each once.  The process count is kept
+ in the segment and is not corrected for processes that died without calling Close.
+ */
+
+#ifndef SHAREDINSTANCECACHE_H
+#define SHAREDINSTANCECACHE_H
+
+#include "CompanionCodec.h"
+
+#include <string>
+
+#define SHARED_INSTANCE_VERSION             3
+#define SHARED_INSTANCE_WRITER_TIMEOUT_MS   1000    // longest an insert waits for another writer
+#define SHARED_INSTANCE_DEFAULT_CAPACITY    4096    // slots; rounded up to a power of two
+#define SHARED_INSTANCE_SLOT_SIZE           128
+
+/// <summary>
+/// What a slot holds: enough for CSParve64_ImportInstance.
+/// </summary>
+struct SharedInstance
+{
+	BYTE   State[CSPARVE64_INSTANCE_STATE_SIZE];
+	UINT32 HiHash;
+	UINT32 LoHash;
+};
+
+struct SharedInstanceCacheStats
+{
+	UINT32    Capacity;
+	UINT32    Entries;
+	UINT32    Processes;         // attached, as far as the segment knows
+	UINT64    Hits;              // all processes
+	UINT64    Misses;
+	UINT64    Inserts;
+	UINT64    Full;              // inserts refused for want of a slot
+	UINT64    WriterTimeouts;    // inserts abandoned after waiting SHARED_INSTANCE_WRITER_TIMEOUT_MS
+	UINT64    WritersRecovered;  // inserts that took the mutex over from a writer that had died
+	UINT64    Retries;           // reads repeated because a slot was being written
+	UINT64    SegmentBytes;      // allocated to the segment: the pages touched, not its size
+	UINT64    PerProcessBytes;   // the same entries cached in every attached process
+	long long SavedBytes;        // PerProcessBytes - SegmentBytes
+
+	SharedInstanceCacheStats() : Capacity(0), Entries(0), Processes(0), Hits(0), Misses(0), Inserts(0), Full(0), WriterTimeouts(0), WritersRecovered(0), Retries(0),
+		SegmentBytes(0), PerProcessBytes(0), SavedBytes(0) {}
+};
+
+class SharedInstanceCache
+{
+public:
+
+	SharedInstanceCache();
+	~SharedInstanceCache();
+
+	/// <summary>
+	/// Map the segment at path, creating it with capacity slots if it does not exist.  An existing
+	/// segment keeps its own capacity.  COMPANION_E_FORMAT if path holds something else.
+	/// </summary>
+	COMPANION_RESULT Open(const std::string& path, UINT32 capacity = SHARED_INSTANCE_DEFAULT_CAPACITY);
+
+	/// <summary>
+	/// Create an unnamed segment (memfd) for processes forked after this call, which attach with OpenFd(Fd()).
+	/// </summary>
+	COMPANION_RESULT OpenAnonymous(UINT32 capacity = SHARED_INSTANCE_DEFAULT_CAPACITY);
+
+	/// <summary>
+	/// Map the segment open on fd, laying it out if it is empty.  The descriptor is reopened, or duplicated
+	/// where that is not possible.
+	/// </summary>
+	COMPANION_RESULT OpenFd(int fd, UINT32 capacity = SHARED_INSTANCE_DEFAULT_CAPACITY);
+
+	void Close();
+
+	bool IsOpen() const { return _header != NULL; }
+	int Fd() const { return _fd; }
+
+	/// <summary>
+	/// Copy the instance derived from key and guid.  False if no process has inserted it.
+	/// </summary>
+	bool Find(const BYTE* key, const GUID& guid, SharedInstance* instance);
+
+	/// <summary>
+	/// Share an instance.  Inserting one that is already there does nothing.  COMPANION_FAIL when full, or
+	/// when another writer holds the segment for longer than SHARED_INSTANCE_WRITER_TIMEOUT_MS.
+	/// </summary>
+	COMPANION_RESULT Insert(const BYTE* key, const GUID& guid, const SharedInstance& instance);
+
+	SharedInstanceCacheStats Stats() const;
+
+private:
+
+	SharedInstanceCache(const SharedInstanceCache&);
+	SharedInstanceCache& operator=(const SharedInstanceCache&);
+
+	struct Header;
+	struct Slot;
+
+	COMPANION_RESULT Attach(UINT32 capacity);
+	Slot* SlotAt(UINT32 index) const;
+	static UINT32 Hash(const BYTE* key, const GUID& guid);
+
+	int     _fd;
+	Header* _header;
+	size_t  _mapped;
+	UINT32  _mask;
+};
+
+#endif
@@ -0,0 +1,484 @@
+//--------------------------------------------------------------------------
+// <copyright file="SsdpDiscovery.cpp" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// SSDP discovery of STBs and re-resolution of their addresses.
+// </summary>
+//--------------------------------------------------------------------------
+
+#include "SsdpDiscovery.h"
+
+#include <arpa/inet.h>
+#include <chrono>
+#include <ifaddrs.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <unordered_set>
+
+#define SSDP_MULTICAST_TTL          2
+
+static UINT64 NowUs()
+{
+	return (UINT64)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static bool StartsWithNoCase(const char* data, UINT32 length, const char* prefix)
+{
+	size_t prefixLength = strlen(prefix);
+	return length >= prefixLength && strncasecmp(data, prefix, prefixLength) == 0;
+}
+
+/// <summary>
+/// The IPv4 host of an http:// LOCATION, or empty.
+/// </summary>
+static std::string LocationHost(const SsdpField& location)
+{
+	const char* end = location.Data + location.Length;
+	const char* host = location.Data;
+	if (StartsWithNoCase(host, location.Length, "http://"))
+		host += 7;
+
+	const char* hostEnd = host;
+	while (hostEnd < end && *hostEnd != ':' && *hostEnd != '/')
+		++hostEnd;
+
+	std::string address(host, hostEnd);
+	struct in_addr parsed;
+	return inet_pton(AF_INET, address.c_str(), &parsed) == 1 ? address : std::string();
+}
+
+//------------------------------------------------------------------------------------------------------
+
+bool SsdpField::EqualsNoCase(const char* value) const
+{
+	return strlen(value) == Length && strncasecmp(Data, value, Length) == 0;
+}
+
+COMPANION_RESULT SsdpParse(const char* data, UINT32 length, SsdpMessage* message)
+{
+	*message = SsdpMessage();
+
+	const char* end = data + length;
+	const char* line = data;
+	const char* lineEnd = (const char*)memchr(line, '\n', length);
+	if (lineEnd == NULL)
+		return COMPANION_E_FORMAT;
+
+	UINT32 lineLength = (UINT32)(lineEnd - line);
+	if (StartsWithNoCase(line, lineLength, "HTTP/1.1 200") || StartsWithNoCase(line, lineLength, "HTTP/1.0 200"))
+		message->Kind = SsdpSearchResponse;
+	else if (StartsWithNoCase(line, lineLength, "NOTIFY * "))
+		message->Kind = SsdpNotify;
+	else if (StartsWithNoCase(line, lineLength, "M-SEARCH * "))
+		message->Kind = SsdpSearch;
+	else
+		return COMPANION_E_FORMAT;
+
+	for (line = lineEnd + 1; line < end; line = lineEnd + 1)
+	{
+		lineEnd = (const char*)memchr(line, '\n', end - line);
+		if (lineEnd == NULL)
+			lineEnd = end;
+
+		// Lines end in CRLF, but a bare LF is tolerated; an empty line ends the headers.
+		const char* valueEnd = lineEnd;
+		if (valueEnd > line && valueEnd[-1] == '\r')
+			--valueEnd;
+		if (valueEnd == line)
+			break;
+
+		const char* colon = (const char*)memchr(line, ':', valueEnd - line);
+		if (colon == NULL)
+			return COMPANION_E_FORMAT;
+
+		const char* value = colon + 1;
+		while (value < valueEnd && (*value == ' ' || *value == '\t'))
+			++value;
+		while (valueEnd > value && (valueEnd[-1] == ' ' || valueEnd[-1] == '\t'))
+			--valueEnd;
+
+		SsdpField field;
+		field.Data = value;
+		field.Length = (UINT32)(valueEnd - value);
+
+		SsdpField name;
+		name.Data = line;
+		name.Length = (UINT32)(colon - line);
+
+		if (name.EqualsNoCase("USN"))
+			message->Usn = field;
+		else if (name.EqualsNoCase("LOCATION"))
+			message->Location = field;
+		else if (name.EqualsNoCase("ST") || name.EqualsNoCase("NT"))
+			message->Target = field;
+		else if (name.EqualsNoCase("NTS"))
+			message->NotifyType = field;
+		else if (name.EqualsNoCase("MAN"))
+			message->Man = field;
+		else if (name.EqualsNoCase("MX"))
+			message->Mx = (UINT32)strtoul(std::string(field.Data, field.Length).c_str(), NULL, 10);
+		else if (name.EqualsNoCase("CACHE-CONTROL"))
+		{
+			// max-age = seconds, possibly among other directives
+			for (const char* p = field.Data; p + 7 <= valueEnd; ++p)
+			{
+				if (strncasecmp(p, "max-age", 7) != 0)
+					continue;
+				p += 7;
+				while (p < valueEnd && (*p == ' ' || *p == '='))
+					++p;
+				message->MaxAgeSeconds = (UINT32)strtoul(std::string(p, valueEnd).c_str(), NULL, 10);
+				break;
+			}
+		}
+
+		if (lineEnd == end)
+			break;
+	}
+
+	return COMPANION_OK;
+}
+
+std::string SsdpDeviceKey(const std::string& usn)
+{
+	size_t separator = usn.find("::");
+	return separator == std::string::npos ? usn : usn.substr(0, separator);
+}
+
+//------------------------------------------------------------------------------------------------------
+
+bool SsdpCache::Update(const std::string& usn, const std::string& address, const std::string& location, UINT32 maxAgeSeconds, UINT64 nowUs)
+{
+	std::lock_guard<std::mutex> guard(_lock);
+
+	SsdpCacheEntry& entry = _entries[SsdpDeviceKey(usn)];
+	bool moved = !entry.Address.empty() && entry.Address != address;
+	entry.Address = address;
+	entry.Location = location;
+	entry.SeenUs = nowUs;
+	entry.ExpiresUs = nowUs + (UINT64)maxAgeSeconds * 1000000;
+	return moved;
+}
+
+bool SsdpCache::Find(const std::string& usn, UINT64 nowUs, std::string* address) const
+{
+	std::lock_guard<std::mutex> guard(_lock);
+
+	std::unordered_map<std::string, SsdpCacheEntry>::const_iterator it = _entries.find(SsdpDeviceKey(usn));
+	if (it == _entries.end() || it->second.ExpiresUs <= nowUs)
+		return false;
+	*address = it->second.Address;
+	return true;
+}
+
+void SsdpCache::Remove(const std::string& usn)
+{
+	std::lock_guard<std::mutex> guard(_lock);
+	_entries.erase(SsdpDeviceKey(usn));
+}
+
+size_t SsdpCache::Expire(UINT64 nowUs)
+{
+	std::lock_guard<std::mutex> guard(_lock);
+
+	size_t expired = 0;
+	for (std::unordered_map<std::string, SsdpCacheEntry>::iterator it = _entries.begin(); it != _entries.end();)
+	{
+		if (it->second.ExpiresUs <= nowUs)
+		{
+			it = _entries.erase(it);
+			++expired;
+		}
+		else
+		{
+			++it;
+		}
+	}
+	return expired;
+}
+
+size_t SsdpCache::Size() const
+{
+	std::lock_guard<std::mutex> guard(_lock);
+	return _entries.size();
+}
+
+//------------------------------------------------------------------------------------------------------
+
+SsdpDiscovery::SsdpDiscovery(const SsdpOptions& options)
+	: _options(options), _stopping(false)
+{
+	char search[512];
+	snprintf(search, sizeof(search), "M-SEARCH * HTTP/1.1\r\nHOST: %s:%u\r\nMAN: \"ssdp:discover\"\r\nMX: %u\r\nST: %s\r\n\r\n",
+		_options.MulticastAddress.c_str(), (unsigned)_options.Port, _options.MxSeconds, _options.SearchTarget.c_str());
+	_search = search;
+}
+
+SsdpDiscovery::~SsdpDiscovery()
+{
+	{
+		std::lock_guard<std::mutex> guard(_lock);
+		_stopping = true;
+	}
+	_wake.notify_all();
+	if (_resolver.joinable())
+		_resolver.join();
+}
+
+std::vector<std::string> SsdpDiscovery::MulticastInterfaces()
+{
+	std::vector<std::string> addresses;
+
+	struct ifaddrs* interfaces = NULL;
+	if (getifaddrs(&interfaces) != 0)
+		return addresses;
+
+	for (struct ifaddrs* i = interfaces; i != NULL; i = i->ifa_next)
+	{
+		if (i->ifa_addr == NULL || i->ifa_addr->sa_family != AF_INET)
+			continue;
+		if ((i->ifa_flags & IFF_UP) == 0 || (i->ifa_flags & IFF_MULTICAST) == 0 || (i->ifa_flags & IFF_LOOPBACK) != 0)
+			continue;
+
+		char address[INET_ADDRSTRLEN];
+		if (inet_ntop(AF_INET, &((struct sockaddr_in*)i->ifa_addr)->sin_addr, address, sizeof(address)) != NULL)
+			addresses.push_back(address);
+	}
+
+	freeifaddrs(interfaces);
+	return addresses;
+}
+
+UINT32 SsdpDiscovery::Search(UINT32 timeoutMs)
+{
+	return RunSearch(timeoutMs, std::string(), NULL);
+}
+
+COMPANION_RESULT SsdpDiscovery::Resolve(const std::string& usn, UINT32 timeoutMs, std::string* address)
+{
+	std::string found;
+	RunSearch(timeoutMs, SsdpDeviceKey(usn), &found);
+
+	std::lock_guard<std::mutex> guard(_lock);
+	if (found.empty())
+	{
+		++_stats.Unresolved;
+		return COMPANION_E_NOT_FOUND;
+	}
+
+	++_stats.Resolved;
+	*address = found;
+	return COMPANION_OK;
+}
+
+UINT32 SsdpDiscovery::RunSearch(UINT32 timeoutMs, const std::string& wantedKey, std::string* address)
+{
+	struct sockaddr_in group = {};
+	group.sin_family = AF_INET;
+	group.sin_port = htons(_options.Port);
+	if (inet_pton(AF_INET, _options.MulticastAddress.c_str(), &group.sin_addr) != 1)
+		return 0;
+
+	// One socket per interface, so the search goes out of all of them at the same moment.
+	std::vector<std::string> interfaces = _options.Interfaces.empty() ? MulticastInterfaces() : _options.Interfaces;
+	std::vector<struct pollfd> sockets;
+	for (size_t i = 0; i < interfaces.size(); ++i)
+	{
+		struct sockaddr_in local = {};
+		local.sin_family = AF_INET;
+		if (inet_pton(AF_INET, interfaces[i].c_str(), &local.sin_addr) != 1)
+			continue;
+
+		int fd = socket(AF_INET, SOCK_DGRAM, 0);
+		if (fd < 0)
+			continue;
+
+		unsigned char ttl = SSDP_MULTICAST_TTL, loop = 1;
+		if (bind(fd, (struct sockaddr*)&local, sizeof(local)) != 0
+			|| setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &local.sin_addr, sizeof(local.sin_addr)) != 0
+			|| setsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) != 0
+			|| setsockopt(fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) != 0)
+		{
+			close(fd);
+			continue;
+		}
+
+		struct pollfd entry = {};
+		entry.fd = fd;
+		entry.events = POLLIN;
+		sockets.push_back(entry);
+	}
+
+	std::unordered_set<std::string> answered;
+	UINT64 startUs = NowUs();
+	UINT64 deadlineUs = startUs + (UINT64)timeoutMs * 1000;
+	UINT64 nextSendUs = startUs;
+	UINT32 sends = 0;
+	bool found = false;
+	char buffer[SSDP_MAX_MESSAGE];
+
+	while (!sockets.empty() && !found)
+	{
+		UINT64 nowUs = NowUs();
+		if (sends <= _options.Retransmits && nowUs >= nextSendUs)
+		{
+			for (size_t i = 0; i < sockets.size(); ++i)
+				sendto(sockets[i].fd, _search.data(), _search.length(), 0, (struct sockaddr*)&group, sizeof(group));
+			++sends;
+			nextSendUs = nowUs + (UINT64)_options.RetransmitMs * 1000;
+
+			std::lock_guard<std::mutex> guard(_lock);
+			++_stats.Searches;
+		}
+		if (nowUs >= deadlineUs)
+			break;
+
+		UINT64 wakeUs = (sends <= _options.Retransmits && nextSendUs < deadlineUs) ? nextSendUs : deadlineUs;
+		int waitMs = (int)((wakeUs - nowUs + 999) / 1000);
+		if (poll(&sockets[0], (nfds_t)sockets.size(), waitMs) <= 0)
+			continue;
+
+		for (size_t i = 0; i < sockets.size() && !found; ++i)
+		{
+			if ((sockets[i].revents & POLLIN) == 0)
+				continue;
+
+			for (;;)
+			{
+				struct sockaddr_in sender = {};
+				socklen_t senderLength = sizeof(sender);
+				ssize_t received = recvfrom(sockets[i].fd, buffer, sizeof(buffer), MSG_DONTWAIT, (struct sockaddr*)&sender, &senderLength);
+				if (received <= 0)
+					break;
+
+				SsdpMessage message;
+				if (SsdpParse(buffer, (UINT32)received, &message) != COMPANION_OK)
+				{
+					std::lock_guard<std::mutex> guard(_lock);
+					++_stats.Malformed;
+					continue;
+				}
+				if (message.Kind != SsdpSearchResponse || message.Usn.IsEmpty())
+					continue;
+
+				std::string usn = message.Usn.ToString();
+				std::string host = LocationHost(message.Location);
+				if (host.empty())
+				{
+					char source[INET_ADDRSTRLEN];
+					host = inet_ntop(AF_INET, &sender.sin_addr, source, sizeof(source)) != NULL ? source : "";
+				}
+
+				UINT32 maxAge = message.MaxAgeSeconds != 0 ? message.MaxAgeSeconds : _options.DefaultMaxAgeSeconds;
+				bool moved = _cache.Update(usn, host, message.Location.ToString(), maxAge, NowUs());
+				{
+					std::lock_guard<std::mutex> guard(_lock);
+					++_stats.Answers;
+					if (moved)
+						++_stats.AddressChanges;
+				}
+
+				std::string key = SsdpDeviceKey(usn);
+				answered.insert(key);
+				if (!wantedKey.empty() && key == wantedKey)
+				{
+					*address = host;
+					found = true;
+					break;
+				}
+			}
+		}
+	}
+
+	for (size_t i = 0; i < sockets.size(); ++i)
+		close(sockets[i].fd);
+	return (UINT32)answered.size();
+}
+
+void SsdpDiscovery::ResolveAsync(const std::string& usn, Resolved done)
+{
+	std::string key = SsdpDeviceKey(usn);
+	{
+		std::lock_guard<std::mutex> guard(_lock);
+		if (!_stopping)
+		{
+			std::map<std::string, std::pair<std::string, std::vector<Resolved> > >::iterator it = _pending.find(key);
+			if (it != _pending.end())
+			{
+				it->second.second.push_back(done);
+				++_stats.Merged;
+				return;
+			}
+
+			_pending[key] = std::make_pair(usn, std::vector<Resolved>(1, done));
+			_queue.push_back(key);
+			if (!_resolver.joinable())
+				_resolver = std::thread(&SsdpDiscovery::RunResolver, this);
+			_wake.notify_one();
+			return;
+		}
+	}
+
+	if (done)
+		done(usn, COMPANION_E_CANCELLED, std::string());
+}
+
+void SsdpDiscovery::RunResolver()
+{
+	std::unique_lock<std::mutex> guard(_lock);
+	for (;;)
+	{
+		_wake.wait(guard, [this]() { return _stopping || !_queue.empty(); });
+		if (_stopping)
+			break;
+
+		std::string key = _queue.front();
+		_queue.pop_front();
+		std::string usn = _pending[key].first;
+		guard.unlock();
+
+		std::string address;
+		COMPANION_RESULT result = Resolve(usn, _options.ResolveTimeoutMs, &address);
+
+		guard.lock();
+		std::vector<Resolved> callbacks;
+		callbacks.swap(_pending[key].second);
+		_pending.erase(key);
+		guard.unlock();
+
+		for (size_t i = 0; i < callbacks.size(); ++i)
+		{
+			if (callbacks[i])
+				callbacks[i](usn, result, address);
+		}
+		guard.lock();
+	}
+
+	std::map<std::string, std::pair<std::string, std::vector<Resolved> > > pending;
+	pending.swap(_pending);
+	_queue.clear();
+	guard.unlock();
+
+	for (std::map<std::string, std::pair<std::string, std::vector<Resolved> > >::iterator it = pending.begin(); it != pending.end(); ++it)
+	{
+		for (size_t i = 0; i < it->second.second.size(); ++i)
+		{
+			if (it->second.second[i])
+				it->second.second[i](it->second.first, COMPANION_E_CANCELLED, std::string());
+		}
+	}
+}
+
+SsdpStats SsdpDiscovery::Stats() const
+{
+	std::lock_guard<std::mutex> guard(_lock);
+	return _stats;
+}
@@ -0,0 +1,219 @@
+//--------------------------------------------------------------------------
+// <copyright file="SsdpDiscovery.h" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// SSDP discovery of STBs and re-resolution of their addresses.
+// </summary>
+//--------------------------------------------------------------------------
+
+/*
+ Using SSDP discovery:
+ MRPairing stores the STB's address at pairing time and notes that it could change, in which case SSDP
+ would be needed to find it again.  SsdpDiscovery is that search.  Search() sends one M-SEARCH from every
+ interface at once and collects the answers until the timeout; Resolve() stops as soon as the wanted device
+ has answered.  Answers are parsed in the receive buffer (SsdpParse) and each device's address is kept in
+ an SsdpCache until its CACHE-CONTROL max-age runs out.
+
+ Devices are identified by USN, the value pairing stores as targetUsn.  Only the part before "::" (the
+ device UDN) is compared, so a device that answers for several search targets is one entry.  The address
+ is the host of its LOCATION header, or the sender of the answer if there is none.
+
+ ResolveAsync runs Resolve on a background thread and calls back there.  Requests for a device already
+ being resolved share the search.  CompanionClient uses it to find an STB again after its requests fail.
+
+ By default every up, multicast-capable IPv4 interface is searched; Interfaces restricts that (for
+ instance to 127.0.0.1, to test against a responder on the same machine).  The cache is thread-safe;
+ Search and Resolve may run on several threads at once.
+ */
+
+#ifndef SSDPDISCOVERY_H
+#define SSDPDISCOVERY_H
+
+#include "CompanionCodec.h"
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#define SSDP_MULTICAST_ADDRESS      "239.255.255.250"
+#define SSDP_PORT                   1900
+#define SSDP_MAX_MESSAGE            2048
+
+/// <summary>
+/// A header value inside a received message.  Not NUL-terminated.
+/// </summary>
+struct SsdpField
+{
+	const char* Data;
+	UINT32      Length;
+
+	SsdpField() : Data(""), Length(0) {}
+
+	bool IsEmpty() const { return Length == 0; }
+	bool EqualsNoCase(const char* value) const;
+	std::string ToString() const { return std::string(Data, Length); }
+};
+
+enum SsdpMessageKind
+{
+	SsdpSearchResponse,         // HTTP/1.1 200 OK to an M-SEARCH
+	SsdpNotify,                 // NOTIFY * (ssdp:alive or ssdp:byebye)
+	SsdpSearch                  // M-SEARCH *
+};
+
+struct SsdpMessage
+{
+	SsdpMessageKind Kind;
+	SsdpField       Usn;
+	SsdpField       Location;
+	SsdpField       Target;         // ST, or NT for NOTIFY
+	SsdpField       NotifyType;     // NTS
+	SsdpField       Man;
+	UINT32          MaxAgeSeconds;  // from CACHE-CONTROL; 0 if absent
+	UINT32          Mx;             // MX of an M-SEARCH
+
+	SsdpMessage() : Kind(SsdpSearchResponse), MaxAgeSeconds(0), Mx(0) {}
+};
+
+/// <summary>
+/// Parse a datagram in place.  COMPANION_E_FORMAT if it is not an SSDP message.
+/// </summary>
+COMPANION_RESULT SsdpParse(const char* data, UINT32 length, SsdpMessage* message);
+
+/// <summary>
+/// The device part of a USN: everything before "::".
+/// </summary>
+std::string SsdpDeviceKey(const std::string& usn);
+
+struct SsdpCacheEntry
+{
+	std::string Address;
+	std::string Location;
+	UINT64      SeenUs;
+	UINT64      ExpiresUs;
+};
+
+class SsdpCache
+{
+public:
+
+	/// <summary>
+	/// Record an answer.  Returns true if the device is new or its address changed.
+	/// </summary>
+	bool Update(const std::string& usn, const std::string& address, const std::string& location, UINT32 maxAgeSeconds, UINT64 nowUs);
+
+	/// <summary>
+	/// Address of a device whose entry has not expired.
+	/// </summary>
+	bool Find(const std::string& usn, UINT64 nowUs, std::string* address) const;
+
+	void Remove(const std::string& usn);
+
+	/// <summary>
+	/// Drop expired entries; returns how many.
+	/// </summary>
+	size_t Expire(UINT64 nowUs);
+
+	size_t Size() const;
+
+private:
+
+	mutable std::mutex                              _lock;
+	std::unordered_map<std::string, SsdpCacheEntry> _entries;   // by SsdpDeviceKey
+};
+
+struct SsdpOptions
+{
+	std::string              SearchTarget;          // ST of the M-SEARCH
+	std::string              MulticastAddress;
+	UINT16                   Port;
+	std::vector<std::string> Interfaces;            // IPv4 addresses to search from; empty for all
+	UINT32                   MxSeconds;             // how long devices may wait before answering
+	UINT32                   Retransmits;           // extra copies of the M-SEARCH, UDP being lossy
+	UINT32                   RetransmitMs;          // between copies
+	UINT32                   DefaultMaxAgeSeconds;  // for answers without CACHE-CONTROL
+	UINT32                   ResolveTimeoutMs;      // for ResolveAsync
+
+	SsdpOptions() : SearchTarget("upnp:rootdevice"), MulticastAddress(SSDP_MULTICAST_ADDRESS), Port(SSDP_PORT), MxSeconds(1),
+		Retransmits(2), RetransmitMs(250), DefaultMaxAgeSeconds(1800), ResolveTimeoutMs(3000) {}
+};
+
+struct SsdpStats
+{
+	UINT64 Searches;
+	UINT64 Answers;
+	UINT64 Malformed;
+	UINT64 AddressChanges;
+	UINT64 Resolved;
+	UINT64 Unresolved;
+	UINT64 Merged;          // ResolveAsync calls that joined a search already pending
+
+	SsdpStats() : Searches(0), Answers(0), Malformed(0), AddressChanges(0), Resolved(0), Unresolved(0), Merged(0) {}
+};
+
+class SsdpDiscovery
+{
+public:
+
+	typedef std::function<void(const std::string& usn, COMPANION_RESULT result, const std::string& address)> Resolved;
+
+	explicit SsdpDiscovery(const SsdpOptions& options = SsdpOptions());
+
+	/// <summary>
+	/// Stops the background thread; callbacks still queued are called with COMPANION_E_CANCELLED.
+	/// </summary>
+	~SsdpDiscovery();
+
+	/// <summary>
+	/// Search every interface for timeoutMs.  Returns the number of devices that answered.
+	/// </summary>
+	UINT32 Search(UINT32 timeoutMs);
+
+	/// <summary>
+	/// Search until the device answers.  COMPANION_E_NOT_FOUND if it does not within timeoutMs.
+	/// </summary>
+	COMPANION_RESULT Resolve(const std::string& usn, UINT32 timeoutMs, std::string* address);
+
+	/// <summary>
+	/// Resolve on the background thread and call done there.  Safe to call from any thread.
+	/// </summary>
+	void ResolveAsync(const std::string& usn, Resolved done);
+
+	SsdpCache& Cache() { return _cache; }
+	const SsdpOptions& Options() const { return _options; }
+	SsdpStats Stats() const;
+
+	/// <summary>
+	/// IPv4 addresses of the interfaces searched by default.
+	/// </summary>
+	static std::vector<std::string> MulticastInterfaces();
+
+private:
+
+	SsdpDiscovery(const SsdpDiscovery&);
+	SsdpDiscovery& operator=(const SsdpDiscovery&);
+
+	UINT32 RunSearch(UINT32 timeoutMs, const std::string& wantedKey, std::string* address);
+	void RunResolver();
+
+	SsdpOptions                                  _options;
+	SsdpCache                                    _cache;
+	std::string                                  _search;       // the M-SEARCH datagram
+
+	mutable std::mutex                           _lock;
+	std::condition_variable                      _wake;
+	std::deque<std::string>                      _queue;        // device keys to resolve
+	std::map<std::string, std::pair<std::string, std::vector<Resolved> > > _pending;   // key -> usn, callbacks
+	bool                                         _stopping;
+	std::thread                                  _resolver;     // started by the first ResolveAsync
+	SsdpStats                                    _stats;
+};
+
+#endif
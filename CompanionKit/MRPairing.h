@@ -17,8 +17,6 @@ typedef unsigned int           UINT32;
 typedef unsigned long long int UINT64;
 
 static void   UInt32ToBytes(UINT32 n, BYTE* data);
-static void   UInt64ToBytes(UINT64 n, BYTE* dest);
-static UINT32 BytesToUInt32(BYTE* data);
 
 #define pairDeviceId @"E7AAEC8C-F035-488a-AB39-C9A40547459F"
 #define testDeviceId @"AB72527A-582D-4d6d-98DD-3DDCD4E00EC4"
@@ -44,12 +42,6 @@ static UINT32 BytesToUInt32(BYTE* data);
     NSString* _cbUid;           // Callback uid
     id returnTarget;            // webview
     SEL returnMessage;          // methods in webview
-    
-@private
-    BytePtr   _companionKey;    // Working values for encryption.
-    UINT64    _contextHash;
-    void*     _boxContext;
-    void*     _impContext;
 }
 
 @property (nonatomic, retain)    NSString* targetIPAddr;
@@ -77,9 +69,6 @@ static UINT32 BytesToUInt32(BYTE* data);
 - (NSMutableURLRequest*)encryptRequest:(NSString*)request;
 - (BOOL)decryptResponse:(NSMutableData*)response Headers:(NSDictionary*)headers;
 
-- (BytePtr)makeCompanionKey;
-- (void)formatSignature:(BytePtr)signature SequenceNumber:(uint)seqNum Length:(uint)len;
-
 - (void)pairingCompletion:(NSData*)xmlData;
 - (void)resultParsing:(NSData *)xmlData;
 - (void)resultParsingFail:(NSData *)xmlData;
@@ -0,0 +1,117 @@
+//--------------------------------------------------------------------------
+// <copyright file="CSParve64Tests.cpp" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// Tests that the small-message path encrypts exactly as the general BV4 path does.
+// </summary>
+//--------------------------------------------------------------------------
+
+#include "CompanionTest.h"
+#include "CompanionConfig.h"
+
+#include <string.h>
+#include <vector>
+
+#define TEST_MAX_MESSAGE    128
+
+static const BYTE TestParveKey[8] = { 0x01, 0x23, 0x45, 0x67, 0x89, 0xAB, 0xCD, 0xEF };
+static const BYTE TestParveData[16] = { 0x7A, 0x52, 0x72, 0xAB, 0x2D, 0x58, 0x6D, 0x4D, 0x98, 0xDD, 0x3D, 0xDC, 0xD4, 0xE0, 0x0E, 0xC5 };
+
+/// <summary>
+/// A context and instance whose messages up to smallMessageSize bytes take the small-message path.
+/// </summary>
+struct TestParve
+{
+	void* Context;
+	void* Instance;
+
+	explicit TestParve(UINT32 smallMessageSize) : Context(NULL), Instance(NULL)
+	{
+		UINT32 hi, lo;
+		if (CSParve64_OpenContext(&Context, CompanionConfig, CompanionSBox) != CSPARVE64_OK
+			|| CSParve64_SetSmallMessageSize(Context, smallMessageSize) != CSPARVE64_OK
+			|| CSParve64_Create(Context, TestParveKey, TestParveData, sizeof(TestParveData), &hi, &lo, &Instance) != CSPARVE64_OK)
+			Instance = NULL;
+	}
+
+	~TestParve()
+	{
+		if (Instance != NULL)
+			CSParve64_Destroy(Instance);
+		if (Context != NULL)
+			CSParve64_CloseContext(Context);
+	}
+
+	bool Encode(std::vector<BYTE>& data, UINT64* mac) const
+	{
+		UINT32 hi, lo;
+		bool encoded = CSParve64_Encode(Instance, &data[0], (UINT32)data.size(), &hi, &lo) == CSPARVE64_OK;
+		*mac = ((UINT64)hi << 32) | lo;
+		return encoded;
+	}
+
+	bool Decode(std::vector<BYTE>& data, UINT64* mac) const
+	{
+		UINT32 hi, lo;
+		bool decoded = CSParve64_Decode(Instance, &data[0], (UINT32)data.size(), &hi, &lo) == CSPARVE64_OK;
+		*mac = ((UINT64)hi << 32) | lo;
+		return decoded;
+	}
+};
+
+static std::vector<BYTE> TestMessage(UINT32 length, UINT32 seed)
+{
+	std::vector<BYTE> message(length);
+	for (UINT32 i = 0; i < length; ++i)
+	{
+		seed = seed * 1103515245u + 12345u;
+		message[i] = (BYTE)(seed >> 16);
+	}
+	return message;
+}
+
+COMPANION_TEST(ParveSmallPathMatchesGeneralPath)
+{
+	// Threshold 0 sends every message through BV4Key, RC4Fill and BV4Crypt; the others put those up to
+	// their threshold through BV4CryptSmall instead.  Every one must produce the same bytes and MAC.
+	TestParve general(0);
+	TestParve byDefault(CSPARVE64_SMALL_MESSAGE_SIZE);
+	TestParve lower(24);
+	TestParve always(TEST_MAX_MESSAGE);
+	const TestParve* thresholds[] = { &byDefault, &lower, &always };
+	REQUIRE(general.Instance != NULL);
+	for (size_t t = 0; t < sizeof(thresholds) / sizeof(thresholds[0]); ++t)
+		REQUIRE(thresholds[t]->Instance != NULL);
+
+	for (UINT32 length = 8; length <= TEST_MAX_MESSAGE; length += 8)
+	{
+		for (UINT32 seed = 1; seed <= 3; ++seed)
+		{
+			std::vector<BYTE> plain = TestMessage(length, seed * 7919 + length);
+			std::vector<BYTE> expected = plain;
+			UINT64 expectedMac = 0;
+			REQUIRE(general.Encode(expected, &expectedMac));
+
+			for (size_t t = 0; t < sizeof(thresholds) / sizeof(thresholds[0]); ++t)
+			{
+				std::vector<BYTE> actual = plain;
+				UINT64 actualMac = 0;
+				REQUIRE(thresholds[t]->Encode(actual, &actualMac));
+				CHECK(actual == expected);
+				CHECK_EQUAL(expectedMac, actualMac);
+
+				// Each decodes what the other encoded.
+				UINT64 mac = 0;
+				std::vector<BYTE> decoded = expected;
+				REQUIRE(thresholds[t]->Decode(decoded, &mac));
+				CHECK(decoded == plain);
+				CHECK_EQUAL(expectedMac, mac);
+
+				REQUIRE(general.Decode(actual, &mac));
+				CHECK(actual == plain);
+				CHECK_EQUAL(expectedMac, mac);
+			}
+		}
+	}
+}
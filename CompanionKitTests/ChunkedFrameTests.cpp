@@ -0,0 +1,329 @@
+//--------------------------------------------------------------------------
+// <copyright file="ChunkedFrameTests.cpp" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// Tests of chunked framing: streams fed in any split, chunks moved between positions or streams, oversize
+// frames, and non-blocking decoding on a pool.
+// </summary>
+//--------------------------------------------------------------------------
+
+#include "CompanionTest.h"
+#include "ChunkedFrame.h"
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string.h>
+#include <vector>
+
+#define TEST_STREAM_ID      1001
+#define TEST_CHUNK_SIZE     512
+
+static CompanionPairingInfo TestChunkPairing()
+{
+	CompanionPairingInfo pairing;
+	pairing.TargetIPAddr = "192.168.1.20";
+	pairing.DeviceId = "AB72527A-582D-4d6d-98DD-3DDCD4E00EC5";
+	pairing.DeviceKey = "0123456789ABCDEF";
+	pairing.SeqNum = TEST_STREAM_ID;
+	return pairing;
+}
+
+static std::vector<BYTE> TestPayload(size_t length)
+{
+	std::vector<BYTE> payload(length);
+	for (size_t i = 0; i < length; ++i)
+		payload[i] = (BYTE)(i * 7 + i / 251);
+	return payload;
+}
+
+/// <summary>
+/// Collects what a reader delivers and checks that it arrives in order with the last flag only at the end.
+/// </summary>
+struct TestChunkSink
+{
+	std::vector<BYTE> Received;
+	UINT32            Chunks;
+	bool              SawLast;
+	bool              OutOfOrder;
+
+	TestChunkSink() : Chunks(0), SawLast(false), OutOfOrder(false) {}
+
+	ChunkedFrameReader::ChunkHandler Handler()
+	{
+		return [this](UINT32 index, const BYTE* payload, UINT32 length, bool last)
+		{
+			if (index != Chunks++ || SawLast)
+				OutOfOrder = true;
+			Received.insert(Received.end(), payload, payload + length);
+			SawLast = last;
+			return COMPANION_OK;
+		};
+	}
+};
+
+/// <summary>
+/// The frames of an encoded stream, one per chunk, so that tests can rearrange them.
+/// </summary>
+static std::vector<std::vector<BYTE> > SplitFrames(const std::vector<BYTE>& stream)
+{
+	std::vector<std::vector<BYTE> > frames;
+	size_t offset = 0;
+	while (offset + COMPANION_CHUNK_PREFIX_SIZE <= stream.size())
+	{
+		size_t length = COMPANION_CHUNK_PREFIX_SIZE + (((size_t)stream[offset] << 24) | ((size_t)stream[offset + 1] << 16)
+			| ((size_t)stream[offset + 2] << 8) | stream[offset + 3]);
+		frames.push_back(std::vector<BYTE>(stream.begin() + offset, stream.begin() + offset + length));
+		offset += length;
+	}
+	return frames;
+}
+
+static void WriteUInt32(UINT32 value, BYTE* p)
+{
+	p[0] = (BYTE)(value >> 24);
+	p[1] = (BYTE)(value >> 16);
+	p[2] = (BYTE)(value >> 8);
+	p[3] = (BYTE)value;
+}
+
+static COMPANION_RESULT FeedFrames(ChunkedFrameReader& reader, const std::vector<std::vector<BYTE> >& frames)
+{
+	for (size_t i = 0; i < frames.size(); ++i)
+	{
+		COMPANION_RESULT result = reader.Feed(&frames[i][0], frames[i].size());
+		if (result != COMPANION_OK)
+			return result;
+	}
+	return reader.Finish();
+}
+
+COMPANION_TEST(ChunkedReadsAnySplit)
+{
+	CompanionCodec codec;
+	REQUIRE(codec.Open(TestChunkPairing()) == COMPANION_OK);
+	ChunkedFrameWriter writer(codec, TEST_STREAM_ID, TEST_CHUNK_SIZE);
+	CompanionWorkerPool pool(2);
+
+	// Empty, shorter than a chunk, exactly whole chunks, and a partial last chunk.
+	const size_t lengths[] = { 0, 1, TEST_CHUNK_SIZE, 4 * TEST_CHUNK_SIZE, 9 * TEST_CHUNK_SIZE + 77 };
+	UINT32 random = 12345;
+	for (size_t n = 0; n < sizeof(lengths) / sizeof(lengths[0]); ++n)
+	{
+		std::vector<BYTE> payload = TestPayload(lengths[n]);
+		std::vector<BYTE> stream;
+		REQUIRE(writer.Encode(payload.empty() ? NULL : &payload[0], payload.size(), &stream, &pool) == COMPANION_OK);
+		CHECK_EQUAL(writer.EncodedLength(payload.size()), stream.size());
+
+		std::vector<BYTE> serial;
+		REQUIRE(writer.Encode(payload.empty() ? NULL : &payload[0], payload.size(), &serial) == COMPANION_OK);
+		CHECK(serial == stream);
+
+		for (int pass = 0; pass < 2; ++pass)
+		{
+			ChunkedFrameOptions options;
+			options.MaxChunkSize = TEST_CHUNK_SIZE;
+			options.MaxPendingChunks = 3;
+			options.Pool = pass == 0 ? NULL : &pool;
+			TestChunkSink sink;
+			ChunkedFrameReader reader(codec, TEST_STREAM_ID, sink.Handler(), options);
+
+			// Splits from a single byte to more than a frame, so prefixes and frames break anywhere.
+			size_t offset = 0;
+			COMPANION_RESULT result = COMPANION_OK;
+			while (result == COMPANION_OK && offset < stream.size())
+			{
+				random = random * 1103515245u + 12345u;
+				size_t take = 1 + (random >> 16) % (TEST_CHUNK_SIZE + 100);
+				if (take > stream.size() - offset)
+					take = stream.size() - offset;
+				result = reader.Feed(&stream[offset], take);
+				offset += take;
+			}
+			CHECK_EQUAL(COMPANION_OK, result);
+			CHECK_EQUAL(COMPANION_OK, reader.Finish());
+			CHECK(reader.IsComplete());
+			CHECK(reader.IsIdle());
+			CHECK(sink.SawLast);
+			CHECK(!sink.OutOfOrder);
+			CHECK(sink.Received == payload);
+			CHECK_EQUAL(writer.ChunkCount(payload.size()), reader.ChunksDelivered());
+			// The window, and the frame being received while Feed waits for room in it.
+			CHECK(reader.PeakBufferedBytes() <= (size_t)(options.MaxPendingChunks + 1) * ChunkedFrameWriter::FrameLength(TEST_CHUNK_SIZE));
+		}
+	}
+}
+
+COMPANION_TEST(ChunkedRefusesReorderedChunk)
+{
+	CompanionCodec codec;
+	REQUIRE(codec.Open(TestChunkPairing()) == COMPANION_OK);
+	ChunkedFrameWriter writer(codec, TEST_STREAM_ID, TEST_CHUNK_SIZE);
+	std::vector<BYTE> payload = TestPayload(4 * TEST_CHUNK_SIZE);
+	std::vector<BYTE> stream;
+	REQUIRE(writer.Encode(&payload[0], payload.size(), &stream) == COMPANION_OK);
+	std::vector<std::vector<BYTE> > frames = SplitFrames(stream);
+	REQUIRE(frames.size() == 4);
+
+	std::vector<std::vector<BYTE> > swapped = frames;
+	swapped[1].swap(swapped[2]);
+	TestChunkSink sink;
+	ChunkedFrameReader reader(codec, TEST_STREAM_ID, sink.Handler());
+	CHECK_EQUAL(COMPANION_E_FORMAT, FeedFrames(reader, swapped));
+	CHECK_EQUAL(1u, sink.Chunks);
+	CHECK(!reader.IsComplete());
+
+	// A repeated chunk, and a stream that stops before its last chunk.
+	std::vector<std::vector<BYTE> > repeated = frames;
+	repeated[2] = frames[1];
+	TestChunkSink repeatedSink;
+	ChunkedFrameReader repeatedReader(codec, TEST_STREAM_ID, repeatedSink.Handler());
+	CHECK_EQUAL(COMPANION_E_FORMAT, FeedFrames(repeatedReader, repeated));
+
+	frames.pop_back();
+	TestChunkSink shortSink;
+	ChunkedFrameReader shortReader(codec, TEST_STREAM_ID, shortSink.Handler());
+	CHECK_EQUAL(COMPANION_E_FORMAT, FeedFrames(shortReader, frames));
+	CHECK_EQUAL(3u, shortSink.Chunks);
+}
+
+COMPANION_TEST(ChunkedRefusesChunkFromAnotherStream)
+{
+	CompanionCodec codec;
+	REQUIRE(codec.Open(TestChunkPairing()) == COMPANION_OK);
+	std::vector<BYTE> payload = TestPayload(3 * TEST_CHUNK_SIZE);
+	std::vector<BYTE> ours;
+	std::vector<BYTE> theirs;
+	REQUIRE(ChunkedFrameWriter(codec, TEST_STREAM_ID, TEST_CHUNK_SIZE).Encode(&payload[0], payload.size(), &ours) == COMPANION_OK);
+	REQUIRE(ChunkedFrameWriter(codec, TEST_STREAM_ID + 2, TEST_CHUNK_SIZE).Encode(&payload[0], payload.size(), &theirs) == COMPANION_OK);
+
+	// Same position, same length and the same payload: only the stream id inside the encoded header differs.
+	std::vector<std::vector<BYTE> > frames = SplitFrames(ours);
+	REQUIRE(frames.size() == 3);
+	frames[1] = SplitFrames(theirs)[1];
+	TestChunkSink sink;
+	ChunkedFrameReader reader(codec, TEST_STREAM_ID, sink.Handler());
+	CHECK_EQUAL(COMPANION_E_FORMAT, FeedFrames(reader, frames));
+	CHECK_EQUAL(1u, sink.Chunks);
+
+	// A chunk encoded for another STB fails the context hash.
+	CompanionCodec other;
+	CompanionPairingInfo pairing = TestChunkPairing();
+	pairing.DeviceKey = "FEDCBA9876543210";
+	REQUIRE(other.Open(pairing) == COMPANION_OK);
+	std::vector<BYTE> foreign;
+	REQUIRE(ChunkedFrameWriter(other, TEST_STREAM_ID, TEST_CHUNK_SIZE).Encode(&payload[0], payload.size(), &foreign) == COMPANION_OK);
+	frames = SplitFrames(ours);
+	frames[1] = SplitFrames(foreign)[1];
+	TestChunkSink foreignSink;
+	ChunkedFrameReader foreignReader(codec, TEST_STREAM_ID, foreignSink.Handler());
+	CHECK_EQUAL(COMPANION_E_SIGNATURE, FeedFrames(foreignReader, frames));
+	CHECK_EQUAL(1u, foreignSink.Chunks);
+}
+
+COMPANION_TEST(ChunkedRefusesOversizeFrame)
+{
+	CompanionCodec codec;
+	REQUIRE(codec.Open(TestChunkPairing()) == COMPANION_OK);
+	ChunkedFrameOptions options;
+	options.MaxChunkSize = TEST_CHUNK_SIZE;
+
+	// The length prefix alone is enough to refuse a frame, before any of it is buffered.
+	BYTE prefix[COMPANION_CHUNK_PREFIX_SIZE];
+	UINT32 oversize = ChunkedFrameWriter::FrameLength(TEST_CHUNK_SIZE + 8) - COMPANION_CHUNK_PREFIX_SIZE;
+	WriteUInt32(oversize, prefix);
+	TestChunkSink sink;
+	ChunkedFrameReader reader(codec, TEST_STREAM_ID, sink.Handler(), options);
+	CHECK_EQUAL(COMPANION_E_FORMAT, reader.Feed(prefix, sizeof(prefix)));
+	CHECK_EQUAL(0u, (UINT32)reader.PeakBufferedBytes());
+	CHECK_EQUAL(COMPANION_E_FORMAT, reader.Feed(prefix, 1));
+	CHECK_EQUAL(COMPANION_E_FORMAT, reader.Finish());
+
+	// So is one too short to hold a header and hash, or not a whole number of blocks.
+	UINT32 bad[] = { 0, COMPANION_CHUNK_HEADER_SIZE, COMPANION_CHUNK_HEADER_SIZE + COMPANION_HASH_SIZE + 4, 0xFFFFFFF8 };
+	for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); ++i)
+	{
+		WriteUInt32(bad[i], prefix);
+		ChunkedFrameReader badReader(codec, TEST_STREAM_ID, sink.Handler(), options);
+		CHECK_EQUAL(COMPANION_E_FORMAT, badReader.Feed(prefix, sizeof(prefix)));
+		CHECK_EQUAL(0u, (UINT32)badReader.PeakBufferedBytes());
+	}
+
+	// A frame of exactly MaxChunkSize is read.
+	std::vector<BYTE> payload = TestPayload(TEST_CHUNK_SIZE);
+	std::vector<BYTE> stream;
+	REQUIRE(ChunkedFrameWriter(codec, TEST_STREAM_ID, TEST_CHUNK_SIZE).Encode(&payload[0], payload.size(), &stream) == COMPANION_OK);
+	TestChunkSink whole;
+	ChunkedFrameReader wholeReader(codec, TEST_STREAM_ID, whole.Handler(), options);
+	CHECK_EQUAL(COMPANION_OK, wholeReader.Feed(&stream[0], stream.size()));
+	CHECK_EQUAL(COMPANION_OK, wholeReader.Finish());
+	CHECK(whole.Received == payload);
+
+	// Nothing may follow the last chunk.
+	ChunkedFrameReader trailingReader(codec, TEST_STREAM_ID, sink.Handler(), options);
+	CHECK_EQUAL(COMPANION_OK, trailingReader.Feed(&stream[0], stream.size()));
+	CHECK_EQUAL(COMPANION_E_FORMAT, trailingReader.Feed(&stream[0], stream.size()));
+}
+
+COMPANION_TEST(ChunkedPollsWithPool)
+{
+	// The way an event loop reads: Feed never blocks, reading stops while IsFull, and Decoded says when to Poll.
+	std::shared_ptr<CompanionCodec> codec = std::make_shared<CompanionCodec>();
+	REQUIRE(codec->Open(TestChunkPairing()) == COMPANION_OK);
+	std::vector<BYTE> payload = TestPayload(40 * TEST_CHUNK_SIZE + 3);
+	std::vector<BYTE> stream;
+	REQUIRE(ChunkedFrameWriter(*codec, TEST_STREAM_ID, TEST_CHUNK_SIZE).Encode(&payload[0], payload.size(), &stream) == COMPANION_OK);
+	std::vector<std::vector<BYTE> > frames = SplitFrames(stream);
+
+	std::mutex lock;
+	std::condition_variable signalled;
+	UINT32 decoded = 0;
+	CompanionWorkerPool pool(2);
+	ChunkedFrameOptions options;
+	options.MaxPendingChunks = 2;
+	options.Pool = &pool;
+	options.Decoded = [&lock, &signalled, &decoded]()
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		++decoded;
+		signalled.notify_all();
+	};
+
+	// The reader keeps the codec it was given; the caller's reference can go.
+	TestChunkSink sink;
+	ChunkedFrameReader reader(std::shared_ptr<const CompanionCodec>(codec), TEST_STREAM_ID, sink.Handler(), options);
+	codec.reset();
+
+	UINT32 seen = 0;
+	UINT32 paused = 0;
+	size_t next = 0;
+	COMPANION_RESULT result = COMPANION_OK;
+	while (result == COMPANION_OK && (next < frames.size() || !reader.IsIdle()))
+	{
+		if (next < frames.size() && !reader.IsFull())
+		{
+			result = reader.Feed(&frames[next][0], frames[next].size());
+			++next;
+			continue;
+		}
+
+		if (reader.IsFull())
+			++paused;
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			while (decoded == seen)
+				signalled.wait(guard);
+			seen = decoded;
+		}
+		result = reader.Poll();
+	}
+
+	CHECK_EQUAL(COMPANION_OK, result);
+	CHECK_EQUAL(COMPANION_OK, reader.Finish());
+	CHECK(sink.Received == payload);
+	CHECK(!sink.OutOfOrder);
+	CHECK_EQUAL((UINT32)frames.size(), reader.ChunksDelivered());
+	CHECK(paused > 0);
+	CHECK(reader.PeakBufferedBytes() <= 2 * (size_t)ChunkedFrameWriter::FrameLength(TEST_CHUNK_SIZE));
+}
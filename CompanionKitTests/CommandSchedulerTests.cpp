@@ -0,0 +1,194 @@
+//--------------------------------------------------------------------------
+// <copyright file="CommandSchedulerTests.cpp" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// Tests of command priorities, key-repeat coalescing and deadlines.
+// </summary>
+//--------------------------------------------------------------------------
+
+#include "CompanionTest.h"
+#include "CommandScheduler.h"
+
+#include <chrono>
+#include <thread>
+#include <vector>
+
+/// <summary>
+/// Collects what a scheduler dispatches.  Nothing completes until the test says so.
+/// </summary>
+struct SchedulerSink
+{
+	std::vector<Command> Commands;
+
+	CommandScheduler::Sink Callback()
+	{
+		return [this](Command& command) { Commands.push_back(command); };
+	}
+};
+
+static CommandSchedulerOptions SchedulerOptions(UINT32 maxOutstanding, UINT32 coalesceWindowMs)
+{
+	CommandSchedulerOptions options;
+	options.MaxOutstanding = maxOutstanding;
+	options.CoalesceWindowMs = coalesceWindowMs;
+	options.DefaultDeadlineMs = 0;
+	return options;
+}
+
+COMPANION_TEST(SchedulerClassifiesKeys)
+{
+	bool repeatable = true;
+	CHECK_EQUAL(CommandPriorityCritical, CommandScheduler::Classify("op=key&k=power", &repeatable));
+	CHECK(!repeatable);
+	CHECK_EQUAL(CommandPriorityTransport, CommandScheduler::Classify("op=key&k=pause", &repeatable));
+	CHECK(!repeatable);
+	CHECK_EQUAL(CommandPriorityNavigation, CommandScheduler::Classify("op=key&k=volup", &repeatable));
+	CHECK(repeatable);
+	CHECK_EQUAL(CommandPriorityNavigation, CommandScheduler::Classify("op=key&k=CHDOWN&seq=1", &repeatable));
+	CHECK(repeatable);
+
+	// Only the whole key name counts, and only in a key request.
+	CHECK_EQUAL(CommandPriorityNavigation, CommandScheduler::Classify("op=key&k=powerx", &repeatable));
+	CHECK(!repeatable);
+	CHECK_EQUAL(CommandPriorityNavigation, CommandScheduler::Classify("op=keys&k=volup", &repeatable));
+	CHECK(!repeatable);
+	CHECK_EQUAL(CommandPriorityNavigation, CommandScheduler::Classify("op=hello", &repeatable));
+}
+
+COMPANION_TEST(SchedulerCoalescesRepeatsAtTail)
+{
+	SchedulerSink sink;
+	CommandScheduler scheduler(SchedulerOptions(1, 10000), sink.Callback());
+
+	scheduler.Submit("op=key&k=volup");
+	scheduler.Submit("op=key&k=volup");
+	scheduler.Submit("op=key&k=volup");
+	scheduler.Pump();
+
+	REQUIRE(sink.Commands.size() == 1);
+	CHECK(sink.Commands[0].Request == "op=key&k=volup");
+	CHECK_EQUAL(2u, sink.Commands[0].Coalesced);
+
+	CommandSchedulerStats stats = scheduler.Stats();
+	CHECK_EQUAL(3u, stats.Submitted);
+	CHECK_EQUAL(1u, stats.Dispatched);
+	CHECK_EQUAL(2u, stats.Coalesced);
+	CHECK_EQUAL(0u, stats.QueueDepth);
+	CHECK_EQUAL(1u, stats.Outstanding);
+}
+
+COMPANION_TEST(SchedulerKeepsRunsApartAcrossOtherKeys)
+{
+	SchedulerSink sink;
+	CommandScheduler scheduler(SchedulerOptions(1, 10000), sink.Callback());
+
+	// A different key in between ends the run; so does a different repeating key.
+	scheduler.Submit("op=key&k=volup");
+	scheduler.Submit("op=key&k=volup");
+	scheduler.Submit("op=key&k=down");
+	scheduler.Submit("op=key&k=volup");
+	scheduler.Submit("op=key&k=voldown");
+	scheduler.Pump();
+
+	for (int i = 0; i < 4; ++i)
+		scheduler.Completed();
+
+	REQUIRE(sink.Commands.size() == 4);
+	CHECK(sink.Commands[0].Request == "op=key&k=volup");
+	CHECK_EQUAL(1u, sink.Commands[0].Coalesced);
+	CHECK(sink.Commands[1].Request == "op=key&k=down");
+	CHECK_EQUAL(0u, sink.Commands[1].Coalesced);
+	CHECK(sink.Commands[2].Request == "op=key&k=volup");
+	CHECK_EQUAL(0u, sink.Commands[2].Coalesced);
+	CHECK(sink.Commands[3].Request == "op=key&k=voldown");
+	CHECK_EQUAL(1u, scheduler.Stats().Coalesced);
+}
+
+COMPANION_TEST(SchedulerDoesNotCoalesceOutsideWindow)
+{
+	SchedulerSink sink;
+	CommandScheduler scheduler(SchedulerOptions(2, 1), sink.Callback());
+
+	scheduler.Submit("op=key&k=chup");
+	std::this_thread::sleep_for(std::chrono::milliseconds(5));
+	scheduler.Submit("op=key&k=chup");
+	scheduler.Pump();
+
+	REQUIRE(sink.Commands.size() == 2);
+	CHECK_EQUAL(0u, sink.Commands[0].Coalesced);
+	CHECK_EQUAL(0u, sink.Commands[1].Coalesced);
+	CHECK_EQUAL(0u, scheduler.Stats().Coalesced);
+}
+
+COMPANION_TEST(SchedulerNeverCoalescesOrdinaryKeys)
+{
+	SchedulerSink sink;
+	CommandScheduler scheduler(SchedulerOptions(4, 10000), sink.Callback());
+
+	// Typed digits are separate presses, however quickly they come.
+	scheduler.Submit("op=key&k=1");
+	scheduler.Submit("op=key&k=1");
+	scheduler.Submit("op=key&k=1");
+	scheduler.Pump();
+
+	CHECK_EQUAL(3u, sink.Commands.size());
+	CHECK_EQUAL(0u, scheduler.Stats().Coalesced);
+}
+
+COMPANION_TEST(SchedulerDispatchesByPriority)
+{
+	SchedulerSink sink;
+	CommandScheduler scheduler(SchedulerOptions(1, 10000), sink.Callback());
+
+	scheduler.Submit("op=info");
+	scheduler.Submit("op=key&k=up");
+	scheduler.Submit("op=key&k=play");
+	scheduler.Submit("op=key&k=power");
+	scheduler.Submit("op=info", CommandPriorityBackground, false);
+	scheduler.Pump();
+
+	REQUIRE(sink.Commands.size() == 1);
+	CHECK(sink.Commands[0].Request == "op=key&k=power");
+
+	scheduler.Completed();
+	scheduler.Completed();
+	scheduler.Completed();
+	scheduler.Completed();
+
+	REQUIRE(sink.Commands.size() == 5);
+	CHECK(sink.Commands[1].Request == "op=key&k=play");
+	CHECK(sink.Commands[2].Request == "op=info");
+	CHECK(sink.Commands[3].Request == "op=key&k=up");
+	CHECK_EQUAL(CommandPriorityBackground, sink.Commands[4].Priority);
+}
+
+COMPANION_TEST(SchedulerDropsExpiredCommands)
+{
+	SchedulerSink sink;
+	CommandScheduler scheduler(SchedulerOptions(1, 10000), sink.Callback());
+
+	scheduler.Submit("op=key&k=up", CommandPriorityNavigation, false, 1);
+	scheduler.Submit("op=key&k=down", CommandPriorityNavigation, false, 60000);
+	std::this_thread::sleep_for(std::chrono::milliseconds(5));
+	scheduler.Pump();
+
+	REQUIRE(sink.Commands.size() == 1);
+	CHECK(sink.Commands[0].Request == "op=key&k=down");
+	CHECK_EQUAL(1u, scheduler.Stats().DroppedExpired);
+}
+
+COMPANION_TEST(SchedulerWakesOncePerPump)
+{
+	SchedulerSink sink;
+	int wakes = 0;
+	CommandScheduler scheduler(SchedulerOptions(4, 10000), sink.Callback(), [&wakes]() { ++wakes; });
+
+	scheduler.Submit("op=key&k=up");
+	scheduler.Submit("op=key&k=down");
+	CHECK_EQUAL(1, wakes);
+
+	scheduler.Pump();
+	scheduler.Submit("op=key&k=left");
+	CHECK_EQUAL(2, wakes);
+}
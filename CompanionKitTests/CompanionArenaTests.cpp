@@ -0,0 +1,214 @@
+//--------------------------------------------------------------------------
+// <copyright file="CompanionArenaTests.cpp" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// Tests of the companion arena and its pool: Reserve, Extend, Reset after an overflow, and a steady state without the heap.
+// </summary>
+//--------------------------------------------------------------------------
+
+#include "CompanionTest.h"
+#include "CompanionArena.h"
+
+#include <memory>
+#include <string.h>
+
+static void Fill(void* data, size_t length, BYTE seed)
+{
+	for (size_t i = 0; i < length; ++i)
+		((BYTE*)data)[i] = (BYTE)(seed + i);
+}
+
+static bool IsFilled(const void* data, size_t length, BYTE seed)
+{
+	for (size_t i = 0; i < length; ++i)
+		if (((const BYTE*)data)[i] != (BYTE)(seed + i))
+			return false;
+	return true;
+}
+
+COMPANION_TEST(ArenaReserveBeforeAndAfterFirstAllocation)
+{
+	CompanionArena arena(64);
+	CHECK_EQUAL((size_t)64, arena.Capacity());
+	CHECK_EQUAL((UINT64)1, arena.Stats().HeapAllocations);
+
+	// Before anything is allocated the block itself is replaced by a larger one.
+	REQUIRE(arena.Reserve(1000));
+	CHECK(arena.Capacity() >= 1000);
+	CHECK_EQUAL((UINT64)2, arena.Stats().HeapAllocations);
+	CHECK_EQUAL((UINT64)0, arena.Stats().Overflows);
+
+	void* request = arena.Allocate(1000);
+	REQUIRE(request != NULL);
+	Fill(request, 1000, 1);
+	CHECK_EQUAL((UINT64)0, arena.Stats().Overflows);
+
+	// Reserving what already fits costs nothing.
+	size_t capacity = arena.Capacity();
+	REQUIRE(arena.Reserve(capacity - arena.Used()));
+	CHECK_EQUAL((UINT64)2, arena.Stats().HeapAllocations);
+
+	// After it, the block stays where it is and an overflow block takes what does not fit.
+	REQUIRE(arena.Reserve(5000));
+	CHECK_EQUAL(capacity, arena.Capacity());
+	CHECK_EQUAL((UINT64)3, arena.Stats().HeapAllocations);
+	CHECK_EQUAL((UINT64)1, arena.Stats().Overflows);
+
+	void* response = arena.Allocate(5000);
+	REQUIRE(response != NULL);
+	Fill(response, 5000, 2);
+	CHECK_EQUAL((UINT64)1, arena.Stats().Overflows);
+	CHECK(IsFilled(request, 1000, 1));
+	CHECK(IsFilled(response, 5000, 2));
+	CHECK_EQUAL((size_t)6000, arena.Used());
+}
+
+COMPANION_TEST(ArenaExtendsInPlaceAndByCopying)
+{
+	CompanionArena arena(256);
+	BYTE* head = (BYTE*)arena.Allocate(16);
+	REQUIRE(head != NULL);
+	Fill(head, 16, 3);
+
+	// The last allocation grows where it is.
+	CHECK(arena.Extend(head, 16, 64) == head);
+	CHECK_EQUAL((size_t)64, arena.Used());
+	Fill(head, 64, 3);
+
+	// Shrinking, or growing within the alignment, is a no-op.
+	CHECK(arena.Extend(head, 64, 32) == head);
+	CHECK(arena.Extend(head, 60, 64) == head);
+	CHECK_EQUAL((size_t)64, arena.Used());
+
+	// Once something follows it, growing copies.
+	BYTE* body = (BYTE*)arena.Allocate(8);
+	REQUIRE(body != NULL);
+	Fill(body, 8, 4);
+	BYTE* grown = (BYTE*)arena.Extend(head, 64, 128);
+	REQUIRE(grown != NULL);
+	CHECK(grown != head);
+	CHECK(grown == body + 8);
+	CHECK(IsFilled(grown, 64, 3));
+	CHECK(IsFilled(body, 8, 4));
+	CHECK_EQUAL((size_t)(64 + 8 + 128), arena.Used());
+	CHECK_EQUAL((UINT64)0, arena.Stats().Overflows);
+
+	// The last allocation that no longer fits its block is copied into an overflow block.
+	BYTE* overflowed = (BYTE*)arena.Extend(grown, 128, 4096);
+	REQUIRE(overflowed != NULL);
+	CHECK(overflowed != grown);
+	CHECK(IsFilled(overflowed, 64, 3));
+	CHECK_EQUAL((UINT64)1, arena.Stats().Overflows);
+}
+
+COMPANION_TEST(ArenaResetGrowsBlockAfterOverflow)
+{
+	const size_t sizes[] = { 100, 1000, 2000, 40 };
+	CompanionArena arena(128);
+	size_t used = 0;
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+	{
+		void* data = arena.Allocate(sizes[i]);
+		REQUIRE(data != NULL);
+		Fill(data, sizes[i], (BYTE)i);
+		used = arena.Used();
+	}
+	CHECK(arena.Stats().Overflows > 0);
+	CHECK_EQUAL((size_t)128, arena.Capacity());
+
+	arena.Reset();
+	CHECK_EQUAL((size_t)0, arena.Used());
+	CHECK(arena.Capacity() >= used);
+	CHECK_EQUAL((UINT64)used, arena.Stats().HighWater);
+	CHECK_EQUAL((UINT64)1, arena.Stats().Resets);
+
+	// The same round trip again fits the block: no overflow and nothing from the heap.
+	CompanionArenaStats before = arena.Stats();
+	for (int round = 0; round < 3; ++round)
+	{
+		for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+		{
+			void* data = arena.Allocate(sizes[i]);
+			REQUIRE(data != NULL);
+			Fill(data, sizes[i], (BYTE)i);
+		}
+		CHECK_EQUAL(used, arena.Used());
+		arena.Reset();
+	}
+	CHECK_EQUAL(before.HeapAllocations, arena.Stats().HeapAllocations);
+	CHECK_EQUAL(before.Overflows, arena.Stats().Overflows);
+
+	// A reset without an overflow leaves the block alone.
+	size_t capacity = arena.Capacity();
+	REQUIRE(arena.Allocate(8) != NULL);
+	arena.Reset();
+	CHECK_EQUAL(capacity, arena.Capacity());
+}
+
+/// <summary>
+/// One round trip the way a client makes it: the request reserved and written up front, then the response
+/// reserved from its Content-Length and received a chunk at a time into one growing buffer.
+/// </summary>
+static bool TestRoundTrip(CompanionArena* arena, size_t request, size_t response)
+{
+	if (arena == NULL || arena->Allocate(request) == NULL || arena->Allocate(256) == NULL)
+		return false;
+	if (!arena->Reserve(response))
+		return false;
+
+	BYTE* body = NULL;
+	size_t received = 0;
+	while (received < response)
+	{
+		size_t chunk = response - received < 1500 ? response - received : 1500;
+		body = (BYTE*)arena->Extend(body, received, received + chunk);
+		if (body == NULL)
+			return false;
+		Fill(body + received, chunk, (BYTE)received);
+		received += chunk;
+	}
+	return true;
+}
+
+COMPANION_TEST(ArenaPoolStopsCallingHeapInSteadyState)
+{
+	// Two requests in flight at a time, with request and response sizes that come round again.
+	const size_t requests[] = { 96, 300, 1200, 64, 5000 };
+	const size_t responses[] = { 200, 9000, 700, 30000, 128 };
+	const size_t count = sizeof(requests) / sizeof(requests[0]);
+	std::shared_ptr<CompanionArenaPool> pool = std::make_shared<CompanionArenaPool>(1024);
+
+	for (size_t round = 0; round < 2 * count; ++round)
+	{
+		CompanionArenaLease first(pool, requests[round % count]);
+		CompanionArenaLease second(pool, requests[(round + 1) % count]);
+		REQUIRE(TestRoundTrip(first.Get(), requests[round % count], responses[round % count]));
+		REQUIRE(TestRoundTrip(second.Get(), requests[(round + 1) % count], responses[(round + 1) % count]));
+	}
+	CompanionArenaStats warm = pool->Stats();
+	CHECK(warm.Overflows > 0);
+	CHECK_EQUAL((size_t)2, pool->Count());
+
+	for (size_t round = 0; round < 20 * count; ++round)
+	{
+		CompanionArenaLease first(pool, requests[round % count]);
+		CompanionArenaLease second(pool, requests[(round + 1) % count]);
+		REQUIRE(TestRoundTrip(first.Get(), requests[round % count], responses[round % count]));
+		REQUIRE(TestRoundTrip(second.Get(), requests[(round + 1) % count], responses[(round + 1) % count]));
+	}
+	CompanionArenaStats steady = pool->Stats();
+	CHECK_EQUAL((UINT64)0, steady.HeapAllocations - warm.HeapAllocations);
+	CHECK_EQUAL((UINT64)0, steady.Overflows - warm.Overflows);
+	CHECK(steady.Allocations > warm.Allocations);
+	CHECK_EQUAL(warm.Resets + 2 * 20 * count, steady.Resets);
+	CHECK_EQUAL((size_t)2, pool->Count());
+
+	// A lease released early hands its arena straight to the next one.
+	CompanionArenaLease lease(pool, 64);
+	CompanionArena* arena = lease.Get();
+	lease.Release();
+	CHECK(lease.Get() == NULL);
+	CompanionArenaLease next(pool, 64);
+	CHECK(next.Get() == arena);
+}
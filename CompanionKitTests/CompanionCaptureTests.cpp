@@ -0,0 +1,232 @@
+//--------------------------------------------------------------------------
+// <copyright file="CompanionCaptureTests.cpp" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// Tests of capture writing, reading, seeking and recovery of unclosed captures.
+// </summary>
+//--------------------------------------------------------------------------
+
+#include "CompanionTest.h"
+#include "CompanionCapture.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+#define TEST_CAPTURE_RECORDS    300
+
+/// <summary>
+/// The contents of record i, rebuilt on demand so that what is read back can be compared with it.
+/// </summary>
+struct TestCaptureRecord
+{
+	std::string       Cid;
+	std::vector<BYTE> Cipher;
+	std::string       Plain;
+	CaptureRecordView View;
+
+	explicit TestCaptureRecord(UINT32 i)
+	{
+		char cid[64];
+		snprintf(cid, sizeof(cid), "ab72527a-582d-4d6d-98dd-%012x", i % 7);
+		Cid = cid;
+
+		// Mostly small messages, with the occasional one larger than a block.
+		Cipher.resize(i % 50 == 49 ? 9000 : 16 + (i * 37) % 400);
+		for (size_t n = 0; n < Cipher.size(); ++n)
+			Cipher[n] = (BYTE)(i * 31 + n);
+		if (i % 3 == 0)
+			Plain = std::string("op=key&k=") + (char)('a' + i % 26);
+
+		View.Kind = i % 2 == 0 ? CaptureRequest : CaptureResponse;
+		View.Flags = Plain.empty() ? 0 : CAPTURE_FLAG_PLAINTEXT;
+		View.TimestampUs = 1000000ULL + 1000ULL * i;
+		View.TargetAddr[0] = 10;
+		View.TargetAddr[1] = 0;
+		View.TargetAddr[2] = (BYTE)(i / 200);
+		View.TargetAddr[3] = (BYTE)(i % 200 + 1);
+		View.SeqNum = 1001 + 2 * i;
+		View.SignedLength = (UINT32)Cipher.size();
+		View.SignatureHash = 0x9E3779B97F4A7C15ULL * (i + 1);
+		View.Cid = Cid.data();
+		View.CidLength = (UINT32)Cid.length();
+		View.Cipher = &Cipher[0];
+		View.CipherLength = (UINT32)Cipher.size();
+		View.Plain = Plain.data();
+		View.PlainLength = (UINT32)Plain.length();
+	}
+};
+
+static bool SameRecord(const CaptureRecordView& expected, const CaptureRecordView& actual)
+{
+	return expected.Kind == actual.Kind
+		&& expected.Flags == actual.Flags
+		&& expected.TimestampUs == actual.TimestampUs
+		&& memcmp(expected.TargetAddr, actual.TargetAddr, sizeof(expected.TargetAddr)) == 0
+		&& expected.SeqNum == actual.SeqNum
+		&& expected.SignedLength == actual.SignedLength
+		&& expected.SignatureHash == actual.SignatureHash
+		&& expected.CidString() == actual.CidString()
+		&& expected.CipherLength == actual.CipherLength
+		&& memcmp(expected.Cipher, actual.Cipher, expected.CipherLength) == 0
+		&& expected.PlainLength == actual.PlainLength
+		&& memcmp(expected.Plain, actual.Plain, expected.PlainLength) == 0;
+}
+
+static COMPANION_RESULT WriteTestCapture(CaptureWriter& writer, const std::string& path)
+{
+	COMPANION_RESULT result = writer.Open(path, 4096);
+	for (UINT32 i = 0; result == COMPANION_OK && i < TEST_CAPTURE_RECORDS; ++i)
+		result = writer.Append(TestCaptureRecord(i).View);
+	return result;
+}
+
+static bool CopyFile(const std::string& from, const std::string& to, long truncateBy)
+{
+	FILE* in = fopen(from.c_str(), "rb");
+	if (in == NULL)
+		return false;
+	std::vector<char> bytes;
+	char buffer[4096];
+	size_t read;
+	while ((read = fread(buffer, 1, sizeof(buffer), in)) > 0)
+		bytes.insert(bytes.end(), buffer, buffer + read);
+	fclose(in);
+	if ((long)bytes.size() <= truncateBy)
+		return false;
+	bytes.resize(bytes.size() - truncateBy);
+
+	FILE* out = fopen(to.c_str(), "wb");
+	if (out == NULL)
+		return false;
+	bool written = fwrite(&bytes[0], 1, bytes.size(), out) == bytes.size();
+	return fclose(out) == 0 && written;
+}
+
+COMPANION_TEST(CaptureReadsBackClosedCapture)
+{
+	std::string path = TestPath("closed.cap");
+	{
+		CaptureWriter writer;
+		REQUIRE(WriteTestCapture(writer, path) == COMPANION_OK);
+		CHECK_EQUAL((UINT64)TEST_CAPTURE_RECORDS, writer.Records());
+		CHECK_EQUAL(COMPANION_OK, writer.Close());
+	}
+
+	CaptureReader reader;
+	REQUIRE(reader.Open(path) == COMPANION_OK);
+	CHECK(reader.HasIndex());
+	CHECK_EQUAL((UINT64)TEST_CAPTURE_RECORDS, reader.Records());
+	CHECK(reader.Blocks() > 10);
+	CHECK_EQUAL(1000000u, reader.FirstUs());
+	CHECK_EQUAL(1000000u + 1000u * (TEST_CAPTURE_RECORDS - 1), reader.LastUs());
+
+	CapturePosition position;
+	CaptureRecordView record;
+	UINT32 count = 0;
+	while (reader.Next(&position, &record))
+	{
+		if (!SameRecord(TestCaptureRecord(count).View, record))
+		{
+			CHECK(!"record read back differs");
+			break;
+		}
+		++count;
+	}
+	CHECK_EQUAL((UINT32)TEST_CAPTURE_RECORDS, count);
+
+	position = CapturePosition();
+	REQUIRE(reader.Next(&position, &record));
+	CHECK(record.HasPlain());
+	CHECK(record.TargetIPAddr() == "10.0.0.1");
+}
+
+COMPANION_TEST(CaptureSeeksByTime)
+{
+	std::string path = TestPath("seek.cap");
+	{
+		CaptureWriter writer;
+		REQUIRE(WriteTestCapture(writer, path) == COMPANION_OK);
+	}
+
+	CaptureReader reader;
+	REQUIRE(reader.Open(path) == COMPANION_OK);
+
+	UINT32 targets[] = { 0, 1, 57, 58, 149, 150, TEST_CAPTURE_RECORDS - 1 };
+	for (size_t t = 0; t < sizeof(targets) / sizeof(targets[0]); ++t)
+	{
+		UINT32 i = targets[t];
+		CaptureRecordView record;
+
+		// Exactly on a record, and just after the one before it.
+		CapturePosition position = reader.Seek(1000000ULL + 1000ULL * i);
+		REQUIRE(reader.Next(&position, &record));
+		CHECK_EQUAL(1001 + 2 * i, record.SeqNum);
+
+		position = reader.Seek(1000000ULL + 1000ULL * i - 500);
+		REQUIRE(reader.Next(&position, &record));
+		CHECK_EQUAL(1001 + 2 * i, record.SeqNum);
+	}
+
+	CaptureRecordView record;
+	CapturePosition position = reader.Seek(0);
+	CHECK(reader.Next(&position, &record) && record.SeqNum == 1001);
+	position = reader.Seek(1000000ULL + 1000ULL * TEST_CAPTURE_RECORDS);
+	CHECK(!reader.Next(&position, &record));
+}
+
+COMPANION_TEST(CaptureRecoversUnclosedCapture)
+{
+	// Copy the capture while its writer is still open, as a crash would leave it: flushed blocks and no index.
+	std::string path = TestPath("open.cap");
+	std::string crashed = TestPath("crashed.cap");
+	std::string torn = TestPath("torn.cap");
+	CaptureWriter writer;
+	REQUIRE(WriteTestCapture(writer, path) == COMPANION_OK);
+	REQUIRE(writer.Flush() == COMPANION_OK);
+	REQUIRE(CopyFile(path, crashed, 0));
+	REQUIRE(CopyFile(path, torn, 5));
+	writer.Close();
+
+	CaptureReader reader;
+	REQUIRE(reader.Open(crashed) == COMPANION_OK);
+	CHECK(!reader.HasIndex());
+	CHECK_EQUAL((UINT64)TEST_CAPTURE_RECORDS, reader.Records());
+
+	// A torn last block is dropped whole; every record before it reads back intact.
+	CaptureReader tornReader;
+	REQUIRE(tornReader.Open(torn) == COMPANION_OK);
+	CHECK(!tornReader.HasIndex());
+	CHECK(tornReader.Records() > 0);
+	CHECK(tornReader.Records() < (UINT64)TEST_CAPTURE_RECORDS);
+	CHECK_EQUAL(reader.Blocks() - 1, tornReader.Blocks());
+
+	CapturePosition position;
+	CaptureRecordView record;
+	UINT32 count = 0;
+	while (tornReader.Next(&position, &record))
+	{
+		if (!SameRecord(TestCaptureRecord(count).View, record))
+		{
+			CHECK(!"record read back differs");
+			break;
+		}
+		++count;
+	}
+	CHECK_EQUAL(tornReader.Records(), (UINT64)count);
+}
+
+COMPANION_TEST(CaptureRefusesOtherFiles)
+{
+	std::string path = TestPath("not.cap");
+	FILE* file = fopen(path.c_str(), "wb");
+	REQUIRE(file != NULL);
+	fputs("<response status=\"ok\"/>\n", file);
+	fclose(file);
+
+	CaptureReader reader;
+	CHECK_EQUAL(COMPANION_E_FORMAT, reader.Open(path));
+	CHECK(reader.Open(TestPath("missing.cap")) != COMPANION_OK);
+}
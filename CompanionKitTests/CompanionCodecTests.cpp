@@ -0,0 +1,315 @@
+//--------------------------------------------------------------------------
+// <copyright file="CompanionCodecTests.cpp" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// Tests of companion body encoding, signatures and sequence numbers.
+// </summary>
+//--------------------------------------------------------------------------
+
+#include "CompanionTest.h"
+#include "CompanionCodec.h"
+#include "CompanionConfig.h"
+
+#include <ctype.h>
+#include <string.h>
+#include <vector>
+
+#define TEST_TARGET_IP      "192.168.1.20"
+#define TEST_DEVICE_ID      "AB72527A-582D-4d6d-98DD-3DDCD4E00EC5"
+#define TEST_DEVICE_KEY     "0123456789ABCDEF"
+#define TEST_SIGNATURE_HASH "4F1DE2A99E8AE503"     // of seq 0x3E9, length 0x18 under the values above
+
+static CompanionPairingInfo TestPairingInfo(const char* targetIPAddr = TEST_TARGET_IP)
+{
+	CompanionPairingInfo pairing;
+	pairing.TargetIPAddr = targetIPAddr;
+	pairing.DeviceId = TEST_DEVICE_ID;
+	pairing.DeviceKey = TEST_DEVICE_KEY;
+	pairing.SeqNum = 1001;
+	return pairing;
+}
+
+COMPANION_TEST(CodecRoundTrip)
+{
+	CompanionCodec sender;
+	CompanionCodec receiver;
+	REQUIRE(sender.Open(TestPairingInfo()) == COMPANION_OK);
+	REQUIRE(receiver.Open(TestPairingInfo()) == COMPANION_OK);
+	CHECK(!sender.IsTestPairing());
+	CHECK(sender.ContextHash() != 0);
+	CHECK_EQUAL(sender.ContextHash(), receiver.ContextHash());
+
+	// Every padding, from an empty command to several blocks.
+	std::string plain;
+	for (UINT32 length = 0; length <= 80; ++length)
+	{
+		UINT32 bodyLength = CompanionCodec::EncodedLength(length);
+		CHECK_EQUAL(0u, bodyLength % 8);
+		CHECK(bodyLength >= length + COMPANION_OVERHEAD_SIZE && bodyLength < length + COMPANION_OVERHEAD_SIZE + 8);
+
+		std::vector<BYTE> body(bodyLength);
+		REQUIRE(sender.EncodeBody(plain.data(), length, &body[0], bodyLength) == COMPANION_OK);
+		CHECK(length < 8 || memcmp(&body[COMPANION_ORIG_LENGTH_SIZE], plain.data(), length) != 0);
+
+		UINT32 plainLength = 0;
+		REQUIRE(receiver.DecodeBody(&body[0], bodyLength, &plainLength) == COMPANION_OK);
+		CHECK_EQUAL(length, plainLength);
+		CHECK(memcmp(&body[COMPANION_ORIG_LENGTH_SIZE], plain.data(), length) == 0);
+
+		plain += (char)('a' + length % 26);
+	}
+
+	// A body of the wrong size is refused rather than overrun.
+	BYTE small[8];
+	CHECK_EQUAL(COMPANION_FAIL, sender.EncodeBody("op=info", 7, small, sizeof(small)));
+}
+
+/// <summary>
+/// Lay out a body as EncodeBody does, but with the given length and trailing hash, and encode it.
+/// </summary>
+static void EncodeTestBody(const CompanionCodec& codec, const char* plain, UINT32 origLen, UINT64 hash, std::vector<BYTE>* body)
+{
+	UINT32 length = (UINT32)strlen(plain);
+	body->assign(CompanionCodec::EncodedLength(length), 0);
+	BYTE* p = &(*body)[0];
+	for (int i = 0; i < 4; ++i)
+		p[i] = (BYTE)(origLen >> (24 - 8 * i));
+	memcpy(p + COMPANION_ORIG_LENGTH_SIZE, plain, length);
+	for (int i = 0; i < COMPANION_HASH_SIZE; ++i)
+		p[body->size() - COMPANION_HASH_SIZE + i] = (BYTE)(hash >> (56 - 8 * i));
+	REQUIRE(codec.EncodeBlock(p, (UINT32)body->size()) == COMPANION_OK);
+}
+
+COMPANION_TEST(CodecDecodeBodyChecksTrailingHash)
+{
+	CompanionCodec codec;
+	REQUIRE(codec.Open(TestPairingInfo()) == COMPANION_OK);
+	const char* plain = "op=key&k=chup&repeat=1";
+	UINT32 length = (UINT32)strlen(plain);
+	UINT32 plainLength = 0;
+
+	// The layout EncodeBody writes decodes; the same body with a wrong hash does not.
+	std::vector<BYTE> body;
+	EncodeTestBody(codec, plain, length, codec.ContextHash(), &body);
+	REQUIRE(codec.DecodeBody(&body[0], (UINT32)body.size(), &plainLength) == COMPANION_OK);
+	CHECK_EQUAL(length, plainLength);
+
+	EncodeTestBody(codec, plain, length, codec.ContextHash() ^ 1, &body);
+	CHECK_EQUAL(COMPANION_E_SIGNATURE, codec.DecodeBody(&body[0], (UINT32)body.size(), &plainLength));
+	EncodeTestBody(codec, plain, length, 0, &body);
+	CHECK_EQUAL(COMPANION_E_SIGNATURE, codec.DecodeBody(&body[0], (UINT32)body.size(), &plainLength));
+
+	// Any ciphertext byte flipped scrambles the hash.
+	std::vector<BYTE> encoded(CompanionCodec::EncodedLength(length));
+	REQUIRE(codec.EncodeBody(plain, length, &encoded[0], (UINT32)encoded.size()) == COMPANION_OK);
+	for (size_t i = 0; i < encoded.size(); ++i)
+	{
+		std::vector<BYTE> flipped = encoded;
+		flipped[i] ^= 0x01;
+		if (codec.DecodeBody(&flipped[0], (UINT32)flipped.size(), &plainLength) != COMPANION_E_SIGNATURE)
+		{
+			CHECK(!"a flipped byte was accepted");
+			break;
+		}
+	}
+
+	// A body encoded under another pairing.
+	CompanionPairingInfo pairing = TestPairingInfo();
+	pairing.DeviceKey = "FEDCBA9876543210";
+	CompanionCodec other;
+	REQUIRE(other.Open(pairing) == COMPANION_OK);
+	std::vector<BYTE> foreign(encoded.size());
+	REQUIRE(other.EncodeBody(plain, length, &foreign[0], (UINT32)foreign.size()) == COMPANION_OK);
+	CHECK_EQUAL(COMPANION_E_SIGNATURE, codec.DecodeBody(&foreign[0], (UINT32)foreign.size(), &plainLength));
+
+	// A good hash with a length that runs into it, and a body too short to hold either.
+	EncodeTestBody(codec, plain, (UINT32)body.size() - COMPANION_OVERHEAD_SIZE + 1, codec.ContextHash(), &body);
+	CHECK_EQUAL(COMPANION_E_FORMAT, codec.DecodeBody(&body[0], (UINT32)body.size(), &plainLength));
+	BYTE shortBody[8] = { 0 };
+	CHECK_EQUAL(COMPANION_E_FORMAT, codec.DecodeBody(shortBody, sizeof(shortBody), &plainLength));
+}
+
+COMPANION_TEST(CodecEncodesRequest)
+{
+	CompanionCodec codec;
+	REQUIRE(codec.Open(TestPairingInfo()) == COMPANION_OK);
+
+	const char* plain = "op=key&k=volup";
+	CompanionRequest request;
+	REQUIRE(codec.EncodeRequest(plain, (UINT32)strlen(plain), 0x3E9, &request) == COMPANION_OK);
+	CHECK_EQUAL(0x3E9u, request.SeqNum);
+	CHECK_EQUAL((size_t)CompanionCodec::EncodedLength((UINT32)strlen(plain)), request.Body.size());
+
+	char signature[COMPANION_SIGNATURE_CHARS + 1];
+	REQUIRE(codec.Sign(0x3E9, (UINT32)request.Body.size(), signature) == COMPANION_OK);
+	CHECK(request.Query == std::string("/companion?hash=") + signature + "&cid=" TEST_DEVICE_ID "&seq=000003E9");
+
+	UINT32 plainLength = 0;
+	REQUIRE(codec.DecodeBody(&request.Body[0], (UINT32)request.Body.size(), &plainLength) == COMPANION_OK);
+	CHECK(std::string((const char*)&request.Body[COMPANION_ORIG_LENGTH_SIZE], plainLength) == plain);
+}
+
+COMPANION_TEST(CodecTestPairingIsPlaintext)
+{
+	CompanionPairingInfo pairing = TestPairingInfo();
+	pairing.DeviceKey.clear();
+	CompanionCodec codec;
+	REQUIRE(codec.Open(pairing) == COMPANION_OK);
+	CHECK(codec.IsTestPairing());
+
+	CompanionRequest request;
+	REQUIRE(codec.EncodeRequest("op=info", 7, 5, &request) == COMPANION_OK);
+	CHECK(std::string(request.Body.begin(), request.Body.end()) == "op=info");
+	CHECK(request.Query == "/companion?enc=0&cid=" COMPANION_TEST_DEVICE_ID);
+
+	char signature[COMPANION_SIGNATURE_CHARS + 1];
+	CHECK_EQUAL(COMPANION_FAIL, codec.Sign(5, 8, signature));
+}
+
+COMPANION_TEST(CodecRefusesBadPairing)
+{
+	CompanionCodec codec;
+	CHECK_EQUAL(COMPANION_FAIL, codec.Open(TestPairingInfo("192.168.1")));
+	CHECK_EQUAL(COMPANION_FAIL, codec.Open(TestPairingInfo("192.168.1.256")));
+
+	CompanionPairingInfo pairing = TestPairingInfo();
+	pairing.DeviceKey = "0123456789ABCDEG";
+	CHECK_EQUAL(COMPANION_FAIL, codec.Open(pairing));
+	pairing.DeviceKey = "0123456789ABCD";
+	CHECK_EQUAL(COMPANION_FAIL, codec.Open(pairing));
+
+	pairing = TestPairingInfo();
+	pairing.DeviceId = "not-a-guid";
+	CHECK_EQUAL(COMPANION_FAIL, codec.Open(pairing));
+	CHECK(!codec.IsOpen());
+
+	// When pairing, the 8-character key shown on the TV is used twice over.
+	pairing = TestPairingInfo();
+	pairing.DeviceId = COMPANION_PAIR_DEVICE_ID;
+	pairing.DeviceKey = "01234567";
+	CHECK_EQUAL(COMPANION_OK, codec.Open(pairing));
+}
+
+COMPANION_TEST(CodecSignsKnownVector)
+{
+	CompanionCodec codec;
+	REQUIRE(codec.Open(TestPairingInfo()) == COMPANION_OK);
+
+	// The signed block is seq and length big-endian, the four address bytes and the first four GUID bytes.
+	BYTE key[COMPANION_KEY_LENGTH_IN_BYTES] = { 0x01, 0x23, 0x45, 0x67, 0x89, 0xAB, 0xCD, 0xEF };
+	GUID guid;
+	REQUIRE(GuidFromString(TEST_DEVICE_ID, &guid) == 0);
+	BYTE block[COMPANION_SIGNATURE_SIZE] = { 0x00, 0x00, 0x03, 0xE9, 0x00, 0x00, 0x00, 0x18, 192, 168, 1, 20 };
+	memcpy(block + 12, &guid, 4);
+
+	void* context = NULL;
+	REQUIRE(CSParve64_OpenContext(&context, CompanionConfig, CompanionSBox) == CSPARVE64_OK);
+	UINT32 hi = 0, lo = 0;
+	CHECK_EQUAL(CSPARVE64_OK, CSParve64_ComputeHash(context, key, block, sizeof(block), &hi, &lo));
+	CSParve64_CloseContext(context);
+
+	UINT64 hash = 0;
+	REQUIRE(codec.SignatureHash(0x3E9, 0x18, &hash) == COMPANION_OK);
+	CHECK_EQUAL((((UINT64)hi) << 32) | lo, hash);
+
+	char signature[COMPANION_SIGNATURE_CHARS + 1];
+	REQUIRE(codec.Sign(0x3E9, 0x18, signature) == COMPANION_OK);
+	CHECK_EQUAL(std::string("000003E900000018" TEST_SIGNATURE_HASH), std::string(signature));
+}
+
+COMPANION_TEST(CodecVerifiesSignature)
+{
+	CompanionCodec codec;
+	REQUIRE(codec.Open(TestPairingInfo()) == COMPANION_OK);
+
+	char signature[COMPANION_SIGNATURE_CHARS + 1];
+	REQUIRE(codec.Sign(0x3E9, 0x18, signature) == COMPANION_OK);
+
+	UINT32 seqNum = 0, length = 0;
+	CHECK_EQUAL(COMPANION_OK, codec.Verify(signature, COMPANION_SIGNATURE_CHARS, &seqNum, &length));
+	CHECK_EQUAL(0x3E9u, seqNum);
+	CHECK_EQUAL(0x18u, length);
+
+	// Lower-case hex is the same signature.
+	std::string lower = signature;
+	for (size_t i = 0; i < lower.length(); ++i)
+		lower[i] = (char)tolower((unsigned char)lower[i]);
+	CHECK_EQUAL(COMPANION_OK, codec.Verify(lower.c_str(), (UINT32)lower.length(), &seqNum, &length));
+
+	// Another sequence number or length under the same hash.
+	std::string tampered = signature;
+	tampered[7] = '8';
+	CHECK_EQUAL(COMPANION_E_SIGNATURE, codec.Verify(tampered.c_str(), (UINT32)tampered.length(), &seqNum, &length));
+	tampered = signature;
+	tampered[15] = '0';
+	CHECK_EQUAL(COMPANION_E_SIGNATURE, codec.Verify(tampered.c_str(), (UINT32)tampered.length(), &seqNum, &length));
+	tampered = signature;
+	tampered[31] = tampered[31] == '0' ? '1' : '0';
+	CHECK_EQUAL(COMPANION_E_SIGNATURE, codec.Verify(tampered.c_str(), (UINT32)tampered.length(), &seqNum, &length));
+
+	// Signed for another STB.
+	CompanionCodec other;
+	REQUIRE(other.Open(TestPairingInfo("192.168.1.21")) == COMPANION_OK);
+	CHECK_EQUAL(COMPANION_E_SIGNATURE, other.Verify(signature, COMPANION_SIGNATURE_CHARS, &seqNum, &length));
+
+	// Malformed.
+	CHECK_EQUAL(COMPANION_E_SIGNATURE, codec.Verify(signature, COMPANION_SIGNATURE_CHARS - 1, &seqNum, &length));
+	CHECK_EQUAL(COMPANION_E_SIGNATURE, codec.Verify(NULL, 0, &seqNum, &length));
+	tampered = signature;
+	tampered[20] = 'x';
+	CHECK_EQUAL(COMPANION_E_SIGNATURE, codec.Verify(tampered.c_str(), (UINT32)tampered.length(), &seqNum, &length));
+}
+
+COMPANION_TEST(SequenceAdvancesByTwoAndWraps)
+{
+	CompanionSequence sequence(1000);
+	CHECK_EQUAL(1003u, sequence.Next());
+	CHECK_EQUAL(1005u, sequence.Next());
+
+	CompanionSequence wrapping(0xFFFFFFFBu);
+	CHECK_EQUAL(0xFFFFFFFDu, wrapping.Next());
+	CHECK_EQUAL(0xFFFFFFFFu, wrapping.Next());
+	CHECK_EQUAL(1u, wrapping.Next());
+	CHECK_EQUAL(3u, wrapping.Next());
+
+	// The window spans the wrap.
+	CHECK(wrapping.InWindow(3));
+	CHECK(wrapping.InWindow(0xFFFFFFFDu));
+	CHECK(!wrapping.InWindow(5));
+	CHECK(!wrapping.InWindow(3 - COMPANION_SEQUENCE_WINDOW));
+}
+
+COMPANION_TEST(SequenceAcceptsAsDecryptResponse)
+{
+	CompanionSequence sequence(5001);
+
+	// Behind us but in the window: nothing changes.
+	CHECK(!sequence.Accept(5001));
+	CHECK(!sequence.Accept(4003));
+	CHECK_EQUAL(5001u, sequence.Current());
+
+	// Ahead of us: resync, made odd.
+	CHECK(sequence.Accept(6000));
+	CHECK_EQUAL(6001u, sequence.Current());
+
+	// Way behind: the STB restarted, so resync backwards too.
+	CHECK(sequence.Accept(6001 - COMPANION_SEQUENCE_WINDOW));
+	CHECK_EQUAL(6001u - COMPANION_SEQUENCE_WINDOW, sequence.Current());
+
+	// Ahead across the wrap.
+	CompanionSequence wrapping(0xFFFFFFF1u);
+	CHECK(wrapping.Accept(5));
+	CHECK_EQUAL(5u, wrapping.Current());
+	CHECK(!wrapping.Accept(0xFFFFFFF1u));
+
+	// AcceptForward never moves back, however far behind.
+	CompanionSequence forward(5001);
+	CHECK(!forward.AcceptForward(1));
+	CHECK(!forward.AcceptForward(4999));
+	CHECK(forward.AcceptForward(5003));
+	CHECK_EQUAL(5003u, forward.Current());
+	CompanionSequence forwardWrapping(0xFFFFFFFFu);
+	CHECK(forwardWrapping.AcceptForward(1));
+	CHECK_EQUAL(1u, forwardWrapping.Current());
+}
@@ -0,0 +1,244 @@
+//--------------------------------------------------------------------------
+// <copyright file="CompanionStateTests.cpp" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// Tests of codec saved state and CSParve64 instance export and import: round trips, and the blobs each must refuse.
+// </summary>
+//--------------------------------------------------------------------------
+
+#include "CompanionTest.h"
+#include "CompanionCodec.h"
+#include "CompanionConfig.h"
+
+#include <string.h>
+#include <vector>
+
+#define TEST_STATE_SEQ          1001
+#define TEST_STATE_INSTANCE     40      // where SaveState puts the CSParve64 instance state
+
+// CSParve64 instance state layout: [4 magic][4 C][4 D][4 E][4 a][4 b][4 c][4 d][4 e][4 invA][4 invC][4 invE]...
+#define TEST_INSTANCE_A         16
+#define TEST_INSTANCE_INV_A     36
+
+static const BYTE TestInstanceKey[8] = { 0x01, 0x23, 0x45, 0x67, 0x89, 0xAB, 0xCD, 0xEF };
+
+static CompanionPairingInfo TestStatePairing()
+{
+	CompanionPairingInfo pairing;
+	pairing.TargetIPAddr = "192.168.1.20";
+	pairing.DeviceId = "AB72527A-582D-4d6d-98DD-3DDCD4E00EC5";
+	pairing.DeviceKey = "0123456789ABCDEF";
+	pairing.SeqNum = TEST_STATE_SEQ;
+	return pairing;
+}
+
+static void WriteUInt32(UINT32 value, BYTE* p)
+{
+	p[0] = (BYTE)(value >> 24);
+	p[1] = (BYTE)(value >> 16);
+	p[2] = (BYTE)(value >> 8);
+	p[3] = (BYTE)value;
+}
+
+static UINT32 ReadUInt32(const BYTE* p)
+{
+	return ((UINT32)p[0] << 24) | ((UINT32)p[1] << 16) | ((UINT32)p[2] << 8) | p[3];
+}
+
+/// <summary>
+/// Rewrite the trailing CRC after a test has edited the blob, so that only the check it aims at can fail.
+/// </summary>
+static void ResealState(std::vector<BYTE>& state)
+{
+	WriteUInt32(CompanionCrc32(&state[0], state.size() - 4), &state[state.size() - 4]);
+}
+
+static COMPANION_RESULT RestoreTestState(const std::vector<BYTE>& state)
+{
+	CompanionCodec codec;
+	UINT32 seqNum = 0;
+	return codec.RestoreState(&state[0], state.size(), &seqNum);
+}
+
+/// <summary>
+/// Export an instance created from config, with the test key over data.
+/// </summary>
+static bool ExportTestInstance(const UINT32* config, const BYTE* data, UINT32 length, BYTE* state)
+{
+	void* context = NULL;
+	void* instance = NULL;
+	UINT32 hi, lo;
+	bool exported = CSParve64_OpenContext(&context, config, CompanionSBox) == CSPARVE64_OK
+		&& CSParve64_Create(context, TestInstanceKey, data, length, &hi, &lo, &instance) == CSPARVE64_OK
+		&& CSParve64_ExportInstance(instance, state, CSPARVE64_INSTANCE_STATE_SIZE) == CSPARVE64_OK;
+	if (instance != NULL)
+		CSParve64_Destroy(instance);
+	if (context != NULL)
+		CSParve64_CloseContext(context);
+	return exported;
+}
+
+static bool ImportsUnderCompanionConfig(const BYTE* state)
+{
+	void* context = NULL;
+	void* instance = NULL;
+	UINT32 hi, lo;
+	if (CSParve64_OpenContext(&context, CompanionConfig, CompanionSBox) != CSPARVE64_OK)
+		return false;
+	bool imported = CSParve64_ImportInstance(context, state, CSPARVE64_INSTANCE_STATE_SIZE, &hi, &lo, &instance) == CSPARVE64_OK;
+	if (instance != NULL)
+		CSParve64_Destroy(instance);
+	CSParve64_CloseContext(context);
+	return imported;
+}
+
+COMPANION_TEST(StateRoundTripEncodesIdentically)
+{
+	CompanionCodec original;
+	REQUIRE(original.Open(TestStatePairing()) == COMPANION_OK);
+	std::vector<BYTE> state;
+	REQUIRE(original.SaveState(TEST_STATE_SEQ + 6, &state) == COMPANION_OK);
+	CHECK(state.size() <= COMPANION_STATE_MAX_SIZE);
+
+	CompanionCodec restored;
+	UINT32 seqNum = 0;
+	REQUIRE(restored.RestoreState(&state[0], state.size(), &seqNum) == COMPANION_OK);
+	CHECK_EQUAL((UINT32)(TEST_STATE_SEQ + 6), seqNum);
+	CHECK(restored.IsOpen());
+	CHECK(!restored.IsTestPairing());
+	CHECK_EQUAL(original.ContextHash(), restored.ContextHash());
+
+	// The restored codec must produce the very bytes the original does, and read what it writes.
+	const char plain[] = "op=key&k=power&repeat=1&device=living-room";
+	UINT32 bodyLength = CompanionCodec::EncodedLength(sizeof(plain) - 1);
+	std::vector<BYTE> expected(bodyLength);
+	std::vector<BYTE> actual(bodyLength);
+	REQUIRE(original.EncodeBody(plain, sizeof(plain) - 1, &expected[0], bodyLength) == COMPANION_OK);
+	REQUIRE(restored.EncodeBody(plain, sizeof(plain) - 1, &actual[0], bodyLength) == COMPANION_OK);
+	CHECK(expected == actual);
+
+	UINT32 plainLength = 0;
+	REQUIRE(original.DecodeBody(&actual[0], bodyLength, &plainLength) == COMPANION_OK);
+	CHECK_EQUAL((UINT32)(sizeof(plain) - 1), plainLength);
+	CHECK(memcmp(&actual[COMPANION_ORIG_LENGTH_SIZE], plain, plainLength) == 0);
+	UINT64 expectedHash = 0;
+	UINT64 actualHash = 0;
+	CHECK_EQUAL(COMPANION_OK, original.SignatureHash(TEST_STATE_SEQ, bodyLength, &expectedHash));
+	CHECK_EQUAL(COMPANION_OK, restored.SignatureHash(TEST_STATE_SEQ, bodyLength, &actualHash));
+	CHECK_EQUAL(expectedHash, actualHash);
+
+	// Saving the restored codec gives back the same blob.
+	std::vector<BYTE> saved;
+	REQUIRE(restored.SaveState(TEST_STATE_SEQ + 6, &saved) == COMPANION_OK);
+	CHECK(state == saved);
+}
+
+COMPANION_TEST(StateRefusesDamagedBlobs)
+{
+	CompanionCodec codec;
+	REQUIRE(codec.Open(TestStatePairing()) == COMPANION_OK);
+	std::vector<BYTE> state;
+	REQUIRE(codec.SaveState(TEST_STATE_SEQ, &state) == COMPANION_OK);
+	REQUIRE(RestoreTestState(state) == COMPANION_OK);
+
+	// Any byte flipped, the CRC's own included, fails the CRC.
+	for (size_t i = 0; i < state.size(); ++i)
+	{
+		std::vector<BYTE> flipped = state;
+		flipped[i] ^= 0x10;
+		if (RestoreTestState(flipped) != COMPANION_E_FORMAT)
+		{
+			CHECK(!"a flipped byte was accepted");
+			break;
+		}
+	}
+
+	std::vector<BYTE> magic = state;
+	magic[0] = 'X';
+	ResealState(magic);
+	CHECK_EQUAL(COMPANION_E_FORMAT, RestoreTestState(magic));
+
+	std::vector<BYTE> version = state;
+	WriteUInt32(ReadUInt32(&version[4]) + 0x10000, &version[4]);
+	ResealState(version);
+	CHECK_EQUAL(COMPANION_E_FORMAT, RestoreTestState(version));
+
+	std::vector<BYTE> truncated(state.begin(), state.end() - 1);
+	CHECK_EQUAL(COMPANION_E_FORMAT, RestoreTestState(truncated));
+
+	// A failed restore leaves the codec closed.
+	CompanionCodec restored;
+	UINT32 seqNum = 0;
+	REQUIRE(restored.Open(TestStatePairing()) == COMPANION_OK);
+	CHECK_EQUAL(COMPANION_E_FORMAT, restored.RestoreState(&magic[0], magic.size(), &seqNum));
+	CHECK(!restored.IsOpen());
+}
+
+COMPANION_TEST(StateRefusesAnotherConfig)
+{
+	CompanionCodec codec;
+	REQUIRE(codec.Open(TestStatePairing()) == COMPANION_OK);
+	std::vector<BYTE> state;
+	REQUIRE(codec.SaveState(TEST_STATE_SEQ, &state) == COMPANION_OK);
+
+	// An instance saved by a build whose Key1 differs, sealed with a good CRC, must not be imported.
+	UINT32 config[COMPANION_CONFIG_LENGTH];
+	memcpy(config, CompanionConfig, sizeof(config));
+	config[1] ^= 0x00010000;
+	BYTE data[16];
+	memcpy(data, &state[16], sizeof(data));
+	REQUIRE(ExportTestInstance(config, data, sizeof(data), &state[TEST_STATE_INSTANCE]));
+	ResealState(state);
+	CHECK_EQUAL(COMPANION_E_FORMAT, RestoreTestState(state));
+	CHECK(!ImportsUnderCompanionConfig(&state[TEST_STATE_INSTANCE]));
+
+	// The same data under CompanionConfig is accepted.
+	REQUIRE(ExportTestInstance(CompanionConfig, data, sizeof(data), &state[TEST_STATE_INSTANCE]));
+	CHECK(ImportsUnderCompanionConfig(&state[TEST_STATE_INSTANCE]));
+}
+
+COMPANION_TEST(ImportRefusesBadKeys)
+{
+	const BYTE data[16] = { 'c', 'o', 'm', 'p', 'a', 'n', 'i', 'o', 'n', '-', 's', 't', 'a', 't', 'e', 's' };
+	BYTE state[CSPARVE64_INSTANCE_STATE_SIZE];
+	REQUIRE(ExportTestInstance(CompanionConfig, data, sizeof(data), state));
+	REQUIRE(ImportsUnderCompanionConfig(state));
+
+	// Init only makes odd multipliers; an even one has no inverse.
+	BYTE even[CSPARVE64_INSTANCE_STATE_SIZE];
+	memcpy(even, state, sizeof(even));
+	even[TEST_INSTANCE_A + 3] &= 0xFE;
+	CHECK(!ImportsUnderCompanionConfig(even));
+
+	// An odd multiplier with an inverse that does not match it.
+	BYTE inverse[CSPARVE64_INSTANCE_STATE_SIZE];
+	memcpy(inverse, state, sizeof(inverse));
+	inverse[TEST_INSTANCE_INV_A + 3] ^= 0x04;
+	CHECK(!ImportsUnderCompanionConfig(inverse));
+
+	BYTE magic[CSPARVE64_INSTANCE_STATE_SIZE];
+	memcpy(magic, state, sizeof(magic));
+	magic[0] ^= 0xFF;
+	CHECK(!ImportsUnderCompanionConfig(magic));
+
+	// The codec refuses the same instances inside an otherwise good blob.
+	CompanionCodec codec;
+	REQUIRE(codec.Open(TestStatePairing()) == COMPANION_OK);
+	std::vector<BYTE> blob;
+	REQUIRE(codec.SaveState(TEST_STATE_SEQ, &blob) == COMPANION_OK);
+	memcpy(&blob[TEST_STATE_INSTANCE], even, sizeof(even));
+	ResealState(blob);
+	CHECK_EQUAL(COMPANION_E_FORMAT, RestoreTestState(blob));
+	memcpy(&blob[TEST_STATE_INSTANCE], inverse, sizeof(inverse));
+	ResealState(blob);
+	CHECK_EQUAL(COMPANION_E_FORMAT, RestoreTestState(blob));
+
+	void* context = NULL;
+	void* instance = NULL;
+	UINT32 hi, lo;
+	REQUIRE(CSParve64_OpenContext(&context, CompanionConfig, CompanionSBox) == CSPARVE64_OK);
+	CHECK(CSParve64_ImportInstance(context, state, CSPARVE64_INSTANCE_STATE_SIZE - 1, &hi, &lo, &instance) != CSPARVE64_OK);
+	CHECK(instance == NULL);
+	CSParve64_CloseContext(context);
+}
@@ -0,0 +1,103 @@
+//--------------------------------------------------------------------------
+// <copyright file="CompanionTest.cpp" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// Runs the registered CompanionKit tests.
+// </summary>
+//--------------------------------------------------------------------------
+
+#include "CompanionTest.h"
+
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+struct CompanionTestCase
+{
+	const char*           Name;
+	CompanionTestFunction Function;
+};
+
+// Registration runs during static initialization, in no particular order across files, so the list is
+// created on first use.
+static std::vector<CompanionTestCase>& Tests()
+{
+	static std::vector<CompanionTestCase> tests;
+	return tests;
+}
+
+static int         Failures = 0;
+static std::string ScratchDirectory;
+
+int CompanionTestRegister(const char* name, CompanionTestFunction function)
+{
+	CompanionTestCase test = { name, function };
+	Tests().push_back(test);
+	return (int)Tests().size();
+}
+
+void CompanionTestFail(const char* file, int line, const char* expression)
+{
+	fprintf(stderr, "  %s:%d: CHECK(%s) failed\n", file, line, expression);
+	++Failures;
+}
+
+std::string TestPath(const char* name)
+{
+	if (ScratchDirectory.empty())
+	{
+		const char* tmp = getenv("TMPDIR");
+		std::string pattern = std::string(tmp != NULL && tmp[0] != '\0' ? tmp : "/tmp") + "/CompanionKitTests.XXXXXX";
+		std::vector<char> buffer(pattern.begin(), pattern.end());
+		buffer.push_back('\0');
+		if (mkdtemp(&buffer[0]) == NULL)
+		{
+			perror("CompanionKitTests: mkdtemp");
+			exit(2);
+		}
+		ScratchDirectory = &buffer[0];
+	}
+	return ScratchDirectory + "/" + name;
+}
+
+static int RemoveEntry(const char* path, const struct stat*, int, struct FTW*)
+{
+	return remove(path);
+}
+
+int main(int argc, char** argv)
+{
+	const char* filter = argc > 1 ? argv[1] : NULL;
+
+	int run = 0;
+	int failed = 0;
+	for (size_t i = 0; i < Tests().size(); ++i)
+	{
+		const CompanionTestCase& test = Tests()[i];
+		if (filter != NULL && strstr(test.Name, filter) == NULL)
+			continue;
+
+		int before = Failures;
+		test.Function();
+		++run;
+		if (Failures != before)
+		{
+			fprintf(stderr, "FAIL %s\n", test.Name);
+			++failed;
+		}
+		else
+		{
+			printf("ok   %s\n", test.Name);
+		}
+	}
+
+	if (!ScratchDirectory.empty())
+		nftw(ScratchDirectory.c_str(), RemoveEntry, 16, FTW_DEPTH | FTW_PHYS);
+
+	printf("%d tests, %d failed\n", run, failed);
+	return failed == 0 && run > 0 ? 0 : 1;
+}
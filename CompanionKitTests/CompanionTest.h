@@ -0,0 +1,63 @@
+//--------------------------------------------------------------------------
+// <copyright file="CompanionTest.h" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// Minimal test registration and assertions for the CompanionKit tests.
+// </summary>
+//--------------------------------------------------------------------------
+
+/*
+ Using the CompanionKit tests:
+ A test is a function defined with COMPANION_TEST(name), which registers it before main runs:
+
+    COMPANION_TEST(SequenceWindowRefusesReplay)
+    {
+        SequenceWindow window;
+        CHECK_EQUAL(SequenceAccepted, window.Check(3));
+        CHECK_EQUAL(SequenceDuplicate, window.Check(3));
+    }
+
+ CHECK and CHECK_EQUAL record a failure with its file and line and let the test go on; REQUIRE returns from
+ the test.  CompanionKitTests runs every test, or only those whose names contain its first argument, and
+ exits nonzero if any check failed.  TestPath names a file in a directory of its own that is removed when
+ the run ends, for tests that need files on disk.
+ */
+
+#ifndef COMPANIONTEST_H
+#define COMPANIONTEST_H
+
+#include <string>
+
+typedef void (*CompanionTestFunction)();
+
+/// <summary>
+/// Add a test to the run.  Returns a value only so that registration can initialize a static.
+/// </summary>
+int CompanionTestRegister(const char* name, CompanionTestFunction function);
+
+/// <summary>
+/// Record a failed check in the running test.
+/// </summary>
+void CompanionTestFail(const char* file, int line, const char* expression);
+
+/// <summary>
+/// A path in the run's scratch directory.
+/// </summary>
+std::string TestPath(const char* name);
+
+#define COMPANION_TEST(name) \
+	static void name(); \
+	static int name##Registered = CompanionTestRegister(#name, name); \
+	static void name()
+
+#define CHECK(expression) \
+	do { if (!(expression)) CompanionTestFail(__FILE__, __LINE__, #expression); } while (0)
+
+#define CHECK_EQUAL(expected, actual) \
+	do { if (!((expected) == (actual))) CompanionTestFail(__FILE__, __LINE__, #expected " == " #actual); } while (0)
+
+#define REQUIRE(expression) \
+	do { if (!(expression)) { CompanionTestFail(__FILE__, __LINE__, #expression); return; } } while (0)
+
+#endif
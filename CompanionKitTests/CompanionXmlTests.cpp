@@ -0,0 +1,175 @@
+//--------------------------------------------------------------------------
+// <copyright file="CompanionXmlTests.cpp" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// Tests of the in-place XML pull parser and response field extraction.
+// </summary>
+//--------------------------------------------------------------------------
+
+#include "CompanionTest.h"
+#include "CompanionXml.h"
+
+#include <string.h>
+#include <vector>
+
+/// <summary>
+/// The tokens of a document, written as <name>, </name> and [text], up to the first NeedMore, Error or
+/// EndDocument, which is written as ?, ! or $.
+/// </summary>
+static std::string Tokens(CompanionXmlReader& reader)
+{
+	std::string tokens;
+	for (;;)
+	{
+		switch (reader.Next())
+		{
+		case CompanionXmlStartElement:
+			tokens += "<" + reader.Name().ToString() + ">";
+			break;
+		case CompanionXmlEndElement:
+			tokens += "</" + reader.Name().ToString() + ">";
+			break;
+		case CompanionXmlText:
+			tokens += "[" + reader.Text().ToString() + "]";
+			break;
+		case CompanionXmlNeedMore:
+			return tokens + "?";
+		case CompanionXmlEndDocument:
+			return tokens + "$";
+		case CompanionXmlError:
+			return tokens + "!";
+		}
+	}
+}
+
+static std::string Tokens(const char* xml)
+{
+	std::vector<char> buffer(xml, xml + strlen(xml));
+	CompanionXmlReader reader;
+	reader.Reset(buffer.empty() ? NULL : &buffer[0], (UINT32)buffer.size(), true);
+	return Tokens(reader);
+}
+
+COMPANION_TEST(XmlReaderTokenizes)
+{
+	CHECK(Tokens("<a><b>x</b><c/></a>") == "<a><b>[x]</b><c></c></a>$");
+	CHECK(Tokens("<?xml version=\"1.0\"?>\n<!-- note -->\n<a>\n  <b/>\n</a>\n") == "<a><b></b></a>$");
+	CHECK(Tokens("<a><![CDATA[<not> & markup]]></a>") == "<a>[<not> & markup]</a>$");
+	CHECK(Tokens("<a>1 &lt; 2 &amp;&amp; &#65;&#x42;</a>") == "<a>[1 < 2 && AB]</a>$");
+	CHECK(Tokens("<m:a xmlns:m=\"urn:x\"><m:b/></m:a>") == "<a><b></b></a>$");
+}
+
+COMPANION_TEST(XmlReaderRefusesMalformed)
+{
+	CHECK(Tokens("<a><b></a></b>") == "<a><b>!");
+	CHECK(Tokens("<a></b>") == "<a>!");
+	CHECK(Tokens("<a>") == "<a>!");
+	CHECK(Tokens("<a/><b/>") == "<a></a>!");
+	CHECK(Tokens("<a>&bogus;</a>") == "<a>!");
+
+	char xml[] = "<response><device cid=\"1\"</response>";
+	CompanionXmlReader reader;
+	reader.Reset(xml, (UINT32)strlen(xml), true);
+	CHECK_EQUAL(CompanionXmlStartElement, reader.Next());
+	CHECK_EQUAL(CompanionXmlError, reader.Next());
+	CHECK(reader.ErrorOffset() >= 10 && reader.ErrorOffset() < strlen(xml));
+}
+
+COMPANION_TEST(XmlReaderReadsAttributes)
+{
+	char xml[] = "<response status='ok' name=\"Tom &amp; Jerry\" api=\"2\"><x:device x:cid=\"c1\"/></response>";
+	CompanionXmlReader reader;
+	reader.Reset(xml, (UINT32)strlen(xml), true);
+
+	REQUIRE(reader.Next() == CompanionXmlStartElement);
+	CHECK(reader.IsElement("RESPONSE"));
+	CHECK_EQUAL(1u, reader.Depth());
+	CHECK_EQUAL(3u, reader.AttributeCount());
+
+	CompanionXmlSpan value;
+	CHECK(reader.Attribute("status", &value) && value.Equals("ok"));
+	CHECK(reader.Attribute("name", &value) && value.ToString() == "Tom & Jerry");
+	CHECK(!reader.Attribute("Status", &value));
+	CHECK(!reader.Attribute("usn", &value));
+
+	REQUIRE(reader.Next() == CompanionXmlStartElement);
+	CHECK(reader.Name().Equals("device"));
+	CHECK(reader.IsEmptyElement());
+	CHECK_EQUAL(2u, reader.Depth());
+	CHECK(reader.Attribute("cid", &value) && value.Equals("c1"));
+
+	CHECK_EQUAL(CompanionXmlEndElement, reader.Next());
+	CHECK_EQUAL(CompanionXmlEndElement, reader.Next());
+	CHECK_EQUAL(CompanionXmlEndDocument, reader.Next());
+}
+
+COMPANION_TEST(XmlReaderParsesIncrementally)
+{
+	// Feed the document a few bytes at a time, discarding what has been consumed whenever more is needed.
+	const std::string xml = "<?xml version=\"1.0\"?><response status=\"ok\"><device cid=\"abc\" seq=\"1001\"/>"
+		"<note>a &amp; b</note><!-- end --></response>";
+
+	for (size_t step = 1; step <= 16; step += 5)
+	{
+		std::string buffer;
+		size_t fed = 0;
+		std::string tokens;
+		CompanionXmlReader reader;
+		buffer.assign(xml, 0, step);
+		fed = step;
+		reader.Reset(&buffer[0], (UINT32)buffer.size(), false);
+
+		for (;;)
+		{
+			std::string more = Tokens(reader);
+			tokens += more.substr(0, more.size() - 1);
+			if (more[more.size() - 1] != '?')
+			{
+				tokens += more[more.size() - 1];
+				break;
+			}
+
+			UINT32 discarded = reader.Consumed();
+			buffer.erase(0, discarded);
+			buffer.append(xml, fed, step);
+			fed += step;
+			reader.Extend(&buffer[0], (UINT32)buffer.size(), fed >= xml.size(), discarded);
+		}
+		CHECK(tokens == "<response><device></device><note>[a & b]</note></response>$");
+	}
+}
+
+COMPANION_TEST(XmlParsesCompanionResponse)
+{
+	char xml[] =
+		"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+		"<response status=\"ok\" usn=\"uuid:stb-1\" name=\"Living room\" api=\"1\">\n"
+		"  <device cid=\"ab72527a-582d-4d6d-98dd-000000000001\" key=\"0123456789abcdef\" tags=\"tv\" seq=\"1001\"/>\n"
+		"</response>\n";
+
+	CompanionResponseFields fields;
+	REQUIRE(ParseCompanionResponse(xml, (UINT32)strlen(xml), &fields) == COMPANION_OK);
+	CHECK(fields.Status.Equals("ok"));
+	CHECK(fields.TargetUsn.Equals("uuid:stb-1"));
+	CHECK(fields.TargetName.Equals("Living room"));
+	CHECK(fields.TargetApiVers.Equals("1"));
+	CHECK(fields.DeviceId.Equals("ab72527a-582d-4d6d-98dd-000000000001"));
+	CHECK(fields.DeviceKey.Equals("0123456789abcdef"));
+	CHECK(fields.Tags.Equals("tv"));
+
+	UINT32 seq = 0;
+	CHECK(fields.Seq.ToUInt32(&seq));
+	CHECK_EQUAL(1001u, seq);
+
+	char hello[] = "<response status=\"ok\"/>";
+	REQUIRE(ParseCompanionResponse(hello, (UINT32)strlen(hello), &fields) == COMPANION_OK);
+	CHECK(fields.Status.Equals("ok"));
+	CHECK(fields.DeviceId.IsEmpty());
+	CHECK(!fields.Seq.ToUInt32(&seq));
+
+	char truncated[] = "<response status=\"ok\"><device cid=\"c\"";
+	CHECK_EQUAL(COMPANION_E_FORMAT, ParseCompanionResponse(truncated, (UINT32)strlen(truncated), &fields));
+	char mismatched[] = "<response><device></response>";
+	CHECK_EQUAL(COMPANION_E_FORMAT, ParseCompanionResponse(mismatched, (UINT32)strlen(mismatched), &fields));
+}
@@ -0,0 +1,246 @@
+//--------------------------------------------------------------------------
+// <copyright file="PairingStoreTests.cpp" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// Tests of pairing store lookups and recovery from crashes and stale indexes.
+// </summary>
+//--------------------------------------------------------------------------
+
+#include "CompanionTest.h"
+#include "PairingStore.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+static PairingEntry TestPairing(int i)
+{
+	char text[64];
+	PairingEntry entry;
+	snprintf(text, sizeof(text), "pair-%d", i);
+	entry.PairUid = text;
+	snprintf(text, sizeof(text), "uuid:stb-%d", i);
+	entry.TargetUsn = text;
+	snprintf(text, sizeof(text), "10.0.%d.%d", i / 200, i % 200 + 1);
+	entry.TargetIPAddr = text;
+	snprintf(text, sizeof(text), "ab72527a-582d-4d6d-98dd-%012x", i);
+	entry.DeviceId = text;
+	entry.DeviceKey = "0123456789ABCDEF";
+	entry.TargetName = "Living room";
+	entry.TargetApiVers = "1";
+	entry.Tags = "tv";
+	entry.SeqNum = 1001 + 2 * i;
+	return entry;
+}
+
+static std::vector<BYTE> ReadFile(const std::string& path)
+{
+	std::vector<BYTE> bytes;
+	FILE* file = fopen(path.c_str(), "rb");
+	if (file == NULL)
+		return bytes;
+	BYTE buffer[4096];
+	size_t read;
+	while ((read = fread(buffer, 1, sizeof(buffer), file)) > 0)
+		bytes.insert(bytes.end(), buffer, buffer + read);
+	fclose(file);
+	return bytes;
+}
+
+static bool WriteFile(const std::string& path, const std::vector<BYTE>& bytes)
+{
+	FILE* file = fopen(path.c_str(), "wb");
+	if (file == NULL)
+		return false;
+	bool written = bytes.empty() || fwrite(&bytes[0], 1, bytes.size(), file) == bytes.size();
+	return fclose(file) == 0 && written;
+}
+
+/// <summary>
+/// Offset in the store file of the record holding pairUid, or 0.
+/// </summary>
+static size_t FindRecord(const std::vector<BYTE>& store, const std::string& pairUid)
+{
+	for (size_t offset = PAIRING_RECORD_SIZE; offset + PAIRING_RECORD_SIZE <= store.size(); offset += PAIRING_RECORD_SIZE)
+	{
+		const PairingRecord* record = (const PairingRecord*)&store[offset];
+		if (strncmp(record->PairUid, pairUid.c_str(), sizeof(record->PairUid)) == 0)
+			return offset;
+	}
+	return 0;
+}
+
+COMPANION_TEST(PairingStoreRoundTrip)
+{
+	std::string path = TestPath("roundtrip.pairs");
+	{
+		PairingStore store;
+		REQUIRE(store.Open(path) == COMPANION_OK);
+		for (int i = 0; i < 3; ++i)
+			CHECK_EQUAL(COMPANION_OK, store.Add(TestPairing(i)));
+		CHECK_EQUAL(COMPANION_E_DUPLICATE, store.Add(TestPairing(1)));
+		CHECK_EQUAL(COMPANION_OK, store.UpdateSeqNum("pair-1", 5001));
+		CHECK_EQUAL(COMPANION_OK, store.Remove("pair-2"));
+		CHECK_EQUAL(COMPANION_E_NOT_FOUND, store.Remove("pair-9"));
+		store.Close();
+	}
+
+	PairingStore store;
+	REQUIRE(store.Open(path) == COMPANION_OK);
+	CHECK_EQUAL(2u, store.LiveCount());
+
+	PairingEntry entry;
+	REQUIRE(store.Get("pair-1", &entry) == COMPANION_OK);
+	CHECK(entry.TargetUsn == "uuid:stb-1");
+	CHECK(entry.TargetIPAddr == "10.0.0.2");
+	CHECK(entry.DeviceId == "ab72527a-582d-4d6d-98dd-000000000001");
+	CHECK(entry.DeviceKey == "0123456789ABCDEF");
+	CHECK_EQUAL(5001u, entry.SeqNum);
+	CHECK(store.FindByUsn("uuid:stb-0") != NULL);
+	CHECK(store.FindByPairUid("pair-2") == NULL);
+	CHECK(store.FindByUsn("uuid:stb-2") == NULL);
+}
+
+COMPANION_TEST(PairingStoreIndexesRecordsWrittenAfterIndex)
+{
+	// A crash after an append but before the index was synced leaves an index that covers fewer records
+	// than the store holds.  Open must index the rest.
+	std::string path = TestPath("tail.pairs");
+	std::vector<BYTE> oldIndex;
+	{
+		PairingStore store;
+		REQUIRE(store.Open(path) == COMPANION_OK);
+		CHECK_EQUAL(COMPANION_OK, store.Add(TestPairing(0)));
+		CHECK_EQUAL(COMPANION_OK, store.Add(TestPairing(1)));
+		store.Close();
+		oldIndex = ReadFile(path + ".idx");
+
+		REQUIRE(store.Open(path) == COMPANION_OK);
+		CHECK_EQUAL(COMPANION_OK, store.Add(TestPairing(2)));
+		CHECK_EQUAL(COMPANION_OK, store.Remove("pair-0"));
+		store.Close();
+	}
+	REQUIRE(!oldIndex.empty());
+	REQUIRE(WriteFile(path + ".idx", oldIndex));
+
+	PairingStore store;
+	REQUIRE(store.Open(path) == COMPANION_OK);
+	CHECK_EQUAL(2u, store.LiveCount());
+	CHECK(store.FindByPairUid("pair-0") == NULL);
+	CHECK(store.FindByPairUid("pair-1") != NULL);
+	CHECK(store.FindByPairUid("pair-2") != NULL);
+	CHECK(store.FindByUsn("uuid:stb-2") != NULL);
+}
+
+COMPANION_TEST(PairingStoreOverwritesTornRecord)
+{
+	std::string path = TestPath("torn.pairs");
+	{
+		PairingStore store;
+		REQUIRE(store.Open(path) == COMPANION_OK);
+		for (int i = 0; i < 3; ++i)
+			CHECK_EQUAL(COMPANION_OK, store.Add(TestPairing(i)));
+		store.Close();
+	}
+
+	// Tear the last record as a crash mid-write would, and lose the index with it.
+	std::vector<BYTE> bytes = ReadFile(path);
+	size_t offset = FindRecord(bytes, "pair-2");
+	REQUIRE(offset != 0);
+	memset(&bytes[offset + PAIRING_RECORD_SIZE / 2], 0, PAIRING_RECORD_SIZE / 2);
+	REQUIRE(WriteFile(path, bytes));
+	REQUIRE(unlink((path + ".idx").c_str()) == 0);
+
+	{
+		PairingStore store;
+		REQUIRE(store.Open(path) == COMPANION_OK);
+		CHECK_EQUAL(2u, store.RecordCount());
+		CHECK_EQUAL(2u, store.LiveCount());
+		CHECK(store.FindByPairUid("pair-2") == NULL);
+
+		// The next append goes where the torn record was.
+		CHECK_EQUAL(COMPANION_OK, store.Add(TestPairing(3)));
+		CHECK_EQUAL(3u, store.RecordCount());
+		store.Close();
+	}
+
+	PairingStore store;
+	REQUIRE(store.Open(path) == COMPANION_OK);
+	CHECK_EQUAL(3u, store.LiveCount());
+	CHECK(store.FindByPairUid("pair-0") != NULL);
+	CHECK(store.FindByPairUid("pair-1") != NULL);
+	CHECK(store.FindByPairUid("pair-3") != NULL);
+	CHECK_EQUAL(offset, FindRecord(ReadFile(path), "pair-3"));
+}
+
+COMPANION_TEST(PairingStoreRebuildsDamagedIndex)
+{
+	std::string path = TestPath("damaged.pairs");
+	{
+		PairingStore store;
+		REQUIRE(store.Open(path) == COMPANION_OK);
+		for (int i = 0; i < 10; ++i)
+			CHECK_EQUAL(COMPANION_OK, store.Add(TestPairing(i)));
+		store.Close();
+	}
+
+	std::vector<BYTE> index = ReadFile(path + ".idx");
+	REQUIRE(index.size() > 64);
+	for (size_t i = 0; i < index.size(); i += 7)
+		index[i] ^= 0x5A;
+	REQUIRE(WriteFile(path + ".idx", index));
+
+	PairingStore store;
+	REQUIRE(store.Open(path) == COMPANION_OK);
+	CHECK_EQUAL(10u, store.LiveCount());
+	for (int i = 0; i < 10; ++i)
+	{
+		PairingEntry expected = TestPairing(i);
+		const PairingRecord* record = store.FindByUsn(expected.TargetUsn);
+		REQUIRE(record != NULL);
+		CHECK(expected.PairUid == record->PairUid);
+	}
+}
+
+COMPANION_TEST(PairingStoreIgnoresIndexFromBeforeCompact)
+{
+	// An index left from before Compact covers a different file; trusting it would find the wrong records.
+	std::string path = TestPath("compact.pairs");
+	std::vector<BYTE> oldIndex;
+	{
+		PairingStore store;
+		REQUIRE(store.Open(path) == COMPANION_OK);
+		for (int i = 0; i < 40; ++i)
+			CHECK_EQUAL(COMPANION_OK, store.Add(TestPairing(i)));
+		for (int i = 0; i < 40; i += 4)
+			CHECK_EQUAL(COMPANION_OK, store.Remove(TestPairing(i).PairUid));
+		store.Sync();
+		oldIndex = ReadFile(path + ".idx");
+
+		CHECK_EQUAL(COMPANION_OK, store.Compact());
+		CHECK_EQUAL(30u, store.RecordCount());
+		store.Close();
+	}
+	REQUIRE(!oldIndex.empty());
+	REQUIRE(WriteFile(path + ".idx", oldIndex));
+
+	PairingStore store;
+	REQUIRE(store.Open(path) == COMPANION_OK);
+	CHECK_EQUAL(30u, store.LiveCount());
+	for (int i = 0; i < 40; ++i)
+	{
+		PairingEntry expected = TestPairing(i);
+		const PairingRecord* record = store.FindByPairUid(expected.PairUid);
+		if (i % 4 == 0)
+		{
+			CHECK(record == NULL);
+			continue;
+		}
+		REQUIRE(record != NULL);
+		CHECK(expected.TargetUsn == record->TargetUsn);
+	}
+}
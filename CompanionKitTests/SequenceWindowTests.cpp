@@ -0,0 +1,139 @@
+//--------------------------------------------------------------------------
+// <copyright file="SequenceWindowTests.cpp" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// Tests of replay and window checks on received sequence numbers.
+// </summary>
+//--------------------------------------------------------------------------
+
+#include "CompanionTest.h"
+#include "SequenceWindow.h"
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+COMPANION_TEST(SequenceWindowRefusesReplay)
+{
+	SequenceWindow window;
+	CHECK_EQUAL(0u, window.Newest());
+	CHECK_EQUAL(SequenceAccepted, window.Check(1001));
+	CHECK_EQUAL(SequenceDuplicate, window.Check(1001));
+	CHECK_EQUAL(SequenceAccepted, window.Check(1003));
+	CHECK_EQUAL(1003u, window.Newest());
+
+	// Older but still in the window, and not seen: accepted once.
+	CHECK_EQUAL(SequenceAccepted, window.Check(999));
+	CHECK_EQUAL(SequenceDuplicate, window.Check(999));
+	CHECK_EQUAL(1003u, window.Newest());
+}
+
+COMPANION_TEST(SequenceWindowRefusesTooOld)
+{
+	SequenceWindow window;
+	CHECK_EQUAL(SequenceAccepted, window.Check(5001));
+
+	// COMPANION_SEQUENCE_WINDOW behind the newest is out; one odd number less is in.
+	CHECK_EQUAL(SequenceOutOfWindow, window.Check(5001 - COMPANION_SEQUENCE_WINDOW));
+	CHECK_EQUAL(SequenceOutOfWindow, window.Check(5001 - COMPANION_SEQUENCE_WINDOW - 2));
+	CHECK_EQUAL(SequenceAccepted, window.Check(5001 - COMPANION_SEQUENCE_WINDOW + 2));
+}
+
+COMPANION_TEST(SequenceWindowSlidesForward)
+{
+	SequenceWindow window;
+	CHECK_EQUAL(SequenceAccepted, window.Check(101));
+
+	// A client resyncing to the STB jumps far ahead; the old numbers fall out of the window.
+	CHECK_EQUAL(SequenceAccepted, window.Check(100001));
+	CHECK_EQUAL(100001u, window.Newest());
+	CHECK_EQUAL(SequenceOutOfWindow, window.Check(103));
+
+	// Every number of a long run, then every one again.
+	for (UINT32 seq = 100003; seq < 104001; seq += 2)
+		CHECK_EQUAL(SequenceAccepted, window.Check(seq));
+	for (UINT32 seq = 104001 - COMPANION_SEQUENCE_WINDOW + 2; seq < 104001; seq += 2)
+		CHECK_EQUAL(SequenceDuplicate, window.Check(seq));
+
+	SequenceWindowStats stats;
+	window.AddStats(&stats);
+	CHECK_EQUAL(2001u, stats.Accepted);
+	CHECK_EQUAL(2001u, stats.Advanced);
+	CHECK_EQUAL((UINT64)(COMPANION_SEQUENCE_WINDOW / 2 - 1), stats.Duplicates);
+	CHECK_EQUAL(1u, stats.OutOfWindow);
+}
+
+COMPANION_TEST(SequenceWindowEvenSharesOddBit)
+{
+	// The bit is (seqNum >> 1) & 31: 2n and 2n + 1 are the same sequence number to the window.
+	SequenceWindow window;
+	CHECK_EQUAL(SequenceAccepted, window.Check(2001));
+	CHECK_EQUAL(SequenceDuplicate, window.Check(2000));
+	CHECK_EQUAL(SequenceAccepted, window.Check(2002));
+	CHECK_EQUAL(SequenceDuplicate, window.Check(2003));
+}
+
+COMPANION_TEST(SequenceWindowTableKeepsCidsApart)
+{
+	SequenceWindowTable table(2);
+	CHECK_EQUAL(SequenceAccepted, table.Check("cid-a", 11));
+	CHECK_EQUAL(SequenceAccepted, table.Check("cid-b", 11));
+	CHECK_EQUAL(SequenceDuplicate, table.Check("cid-a", 11));
+	CHECK_EQUAL(SequenceTableFull, table.Check("cid-c", 11));
+	CHECK(table.Find("cid-a") == table.Find("cid-a"));
+	CHECK(table.Find("cid-a") != table.Find("cid-b"));
+
+	SequenceWindowStats stats = table.Stats();
+	CHECK_EQUAL(2u, stats.Windows);
+	CHECK_EQUAL(2u, stats.Accepted);
+	CHECK_EQUAL(1u, stats.Duplicates);
+	CHECK_EQUAL(1u, stats.TableFull);
+}
+
+COMPANION_TEST(SequenceWindowAcceptsEachOnceAcrossThreads)
+{
+	// Threads race over the same numbers, each out of order; every number is accepted by exactly one.
+	const int threads = 4;
+	const UINT32 first = 7001;
+	const UINT32 count = 20000;
+	SequenceWindowTable table(16);
+	std::vector<std::atomic<int> > accepted(count);
+	for (UINT32 i = 0; i < count; ++i)
+		accepted[i].store(0);
+
+	std::vector<std::thread> workers;
+	for (int t = 0; t < threads; ++t)
+	{
+		workers.push_back(std::thread([&table, &accepted, t]() {
+			for (UINT32 i = 0; i < count; ++i)
+			{
+				// Swap neighbours differently on each thread, staying well inside the window.
+				UINT32 n = (i & ~7u) | ((i ^ (UINT32)t) & 7u);
+				if (table.Check("shared", first + 2 * n) == SequenceAccepted)
+					accepted[n].fetch_add(1);
+			}
+		}));
+	}
+	for (size_t t = 0; t < workers.size(); ++t)
+		workers[t].join();
+
+	int twice = 0;
+	int never = 0;
+	for (UINT32 i = 0; i < count; ++i)
+	{
+		int times = accepted[i].load();
+		if (times > 1)
+			++twice;
+		else if (times == 0)
+			++never;
+	}
+	CHECK_EQUAL(0, twice);
+
+	// A number can only be missed by falling out of the window, which neighbour swaps never do.
+	CHECK_EQUAL(0, never);
+
+	SequenceWindowStats stats = table.Stats();
+	CHECK_EQUAL((UINT64)count, stats.Accepted);
+	CHECK_EQUAL((UINT64)count * (threads - 1), stats.Duplicates + stats.OutOfWindow);
+}
@@ -0,0 +1,309 @@
+//--------------------------------------------------------------------------
+// <copyright file="SharedInstanceCacheTests.cpp" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// Tests of the shared instance segment: sharing, a full table, readers racing the writer, and writers that die or stall.
+// </summary>
+//--------------------------------------------------------------------------
+
+#include "CompanionTest.h"
+#include "SharedInstanceCache.h"
+
+#include <atomic>
+#include <signal.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+/// <summary>
+/// A key and GUID for pairing k.
+/// </summary>
+static void TestKey(UINT32 k, BYTE* key, GUID* guid)
+{
+	for (int i = 0; i < COMPANION_KEY_LENGTH_IN_BYTES; ++i)
+		key[i] = (BYTE)(k >> (8 * (i % 4))) ^ (BYTE)i;
+	for (size_t i = 0; i < sizeof(guid->Data); ++i)
+		guid->Data[i] = (BYTE)(k * 13 + i);
+}
+
+/// <summary>
+/// Instance state derived from k throughout, so that a slot mixing two writes is detected.
+/// </summary>
+static SharedInstance TestInstance(UINT32 k)
+{
+	SharedInstance instance;
+	for (size_t i = 0; i < sizeof(instance.State); ++i)
+		instance.State[i] = (BYTE)(k * 7 + i);
+	instance.HiHash = k;
+	instance.LoHash = ~k;
+	return instance;
+}
+
+static bool IsTestInstance(UINT32 k, const SharedInstance& instance)
+{
+	SharedInstance expected = TestInstance(k);
+	return memcmp(&expected, &instance, sizeof(expected)) == 0;
+}
+
+static COMPANION_RESULT InsertTestInstance(SharedInstanceCache& cache, UINT32 k)
+{
+	BYTE key[COMPANION_KEY_LENGTH_IN_BYTES];
+	GUID guid;
+	TestKey(k, key, &guid);
+	return cache.Insert(key, guid, TestInstance(k));
+}
+
+/// <summary>
+/// 1 if k is found intact, 0 if it is not there, -1 if it is found damaged.
+/// </summary>
+static int FindTestInstance(SharedInstanceCache& cache, UINT32 k)
+{
+	BYTE key[COMPANION_KEY_LENGTH_IN_BYTES];
+	GUID guid;
+	TestKey(k, key, &guid);
+	SharedInstance instance;
+	if (!cache.Find(key, guid, &instance))
+		return 0;
+	return IsTestInstance(k, instance) ? 1 : -1;
+}
+
+COMPANION_TEST(SharedInstanceRoundTrip)
+{
+	SharedInstanceCache cache;
+	REQUIRE(cache.OpenAnonymous(64) == COMPANION_OK);
+	CHECK_EQUAL(0, FindTestInstance(cache, 1));
+	CHECK_EQUAL(COMPANION_OK, InsertTestInstance(cache, 1));
+	CHECK_EQUAL(COMPANION_OK, InsertTestInstance(cache, 1));
+	CHECK_EQUAL(COMPANION_OK, InsertTestInstance(cache, 2));
+	CHECK_EQUAL(1, FindTestInstance(cache, 1));
+	CHECK_EQUAL(1, FindTestInstance(cache, 2));
+	CHECK_EQUAL(0, FindTestInstance(cache, 3));
+
+	SharedInstanceCacheStats stats = cache.Stats();
+	CHECK_EQUAL(64u, stats.Capacity);
+	CHECK_EQUAL(2u, stats.Entries);
+	CHECK_EQUAL(2u, stats.Inserts);
+	CHECK_EQUAL(2u, stats.Hits);
+	CHECK_EQUAL(2u, stats.Misses);
+}
+
+COMPANION_TEST(SharedInstanceSharesByPath)
+{
+	std::string path = TestPath("instances");
+	SharedInstanceCache first;
+	SharedInstanceCache second;
+	REQUIRE(first.Open(path, 16) == COMPANION_OK);
+	REQUIRE(second.Open(path, 1024) == COMPANION_OK);
+
+	// The segment keeps the capacity it was laid out with.
+	CHECK_EQUAL(16u, second.Stats().Capacity);
+	CHECK_EQUAL(2u, second.Stats().Processes);
+
+	CHECK_EQUAL(COMPANION_OK, InsertTestInstance(first, 5));
+	CHECK_EQUAL(1, FindTestInstance(second, 5));
+	CHECK_EQUAL(COMPANION_OK, InsertTestInstance(second, 6));
+	CHECK_EQUAL(1, FindTestInstance(first, 6));
+
+	first.Close();
+	second.Close();
+
+	SharedInstanceCache reopened;
+	REQUIRE(reopened.Open(path) == COMPANION_OK);
+	CHECK_EQUAL(1, FindTestInstance(reopened, 5));
+	CHECK_EQUAL(1, FindTestInstance(reopened, 6));
+
+	FILE* file = fopen(TestPath("not-instances").c_str(), "wb");
+	REQUIRE(file != NULL);
+	fputs("not a segment, but long enough to be mistaken for a header if nobody checked the magic", file);
+	fclose(file);
+	SharedInstanceCache other;
+	CHECK_EQUAL(COMPANION_E_FORMAT, other.Open(TestPath("not-instances")));
+}
+
+COMPANION_TEST(SharedInstanceRefusesWhenFull)
+{
+	SharedInstanceCache cache;
+	REQUIRE(cache.OpenAnonymous(8) == COMPANION_OK);
+	for (UINT32 k = 0; k < 8; ++k)
+		CHECK_EQUAL(COMPANION_OK, InsertTestInstance(cache, k));
+	CHECK_EQUAL(COMPANION_FAIL, InsertTestInstance(cache, 8));
+
+	// Already there is not an insert, even when full.
+	CHECK_EQUAL(COMPANION_OK, InsertTestInstance(cache, 3));
+	for (UINT32 k = 0; k < 8; ++k)
+		CHECK_EQUAL(1, FindTestInstance(cache, k));
+	CHECK_EQUAL(0, FindTestInstance(cache, 8));
+
+	SharedInstanceCacheStats stats = cache.Stats();
+	CHECK_EQUAL(8u, stats.Entries);
+	CHECK_EQUAL(1u, stats.Full);
+}
+
+COMPANION_TEST(SharedInstanceReadersNeverSeeTornSlots)
+{
+	// Readers hammer the slots the writer is filling; every hit must be the whole instance.
+	const UINT32 count = 4096;
+	SharedInstanceCache cache;
+	REQUIRE(cache.OpenAnonymous(count) == COMPANION_OK);
+
+	std::atomic<bool> writing(true);
+	std::atomic<int> torn(0);
+	std::vector<std::thread> readers;
+	for (int t = 0; t < 3; ++t)
+	{
+		readers.push_back(std::thread([&cache, &writing, &torn, t]() {
+			UINT32 k = (UINT32)t;
+			do
+			{
+				k = (k * 1103515245u + 12345u) % count;
+				if (FindTestInstance(cache, k) < 0)
+					torn.fetch_add(1);
+			} while (writing.load());
+		}));
+	}
+
+	int failed = 0;
+	for (UINT32 k = 0; k < count; ++k)
+	{
+		if (InsertTestInstance(cache, k) != COMPANION_OK)
+			++failed;
+		if (k % 64 == 0)
+			std::this_thread::yield();
+	}
+	writing.store(false);
+	for (size_t t = 0; t < readers.size(); ++t)
+		readers[t].join();
+
+	CHECK_EQUAL(0, failed);
+	CHECK_EQUAL(0, torn.load());
+	for (UINT32 k = 0; k < count; ++k)
+		CHECK_EQUAL(1, FindTestInstance(cache, k));
+}
+
+COMPANION_TEST(SharedInstanceSharesWithForkedWorker)
+{
+	// A worker forked after OpenAnonymous attaches through the descriptor and inserts while the parent reads.
+	const UINT32 count = 512;
+	SharedInstanceCache cache;
+	REQUIRE(cache.OpenAnonymous(1024) == COMPANION_OK);
+
+	pid_t child = fork();
+	REQUIRE(child >= 0);
+	if (child == 0)
+	{
+		SharedInstanceCache worker;
+		int status = worker.OpenFd(cache.Fd()) == COMPANION_OK ? 0 : 1;
+		for (UINT32 k = 0; status == 0 && k < count; ++k)
+			if (InsertTestInstance(worker, k) != COMPANION_OK)
+				status = 2;
+		_exit(status);
+	}
+
+	int torn = 0;
+	int status = 0;
+	while (waitpid(child, &status, WNOHANG) == 0)
+	{
+		for (UINT32 k = 0; k < count; ++k)
+			if (FindTestInstance(cache, k) < 0)
+				++torn;
+	}
+	CHECK(WIFEXITED(status));
+	CHECK_EQUAL(0, WEXITSTATUS(status));
+	CHECK_EQUAL(0, torn);
+	for (UINT32 k = 0; k < count; ++k)
+		CHECK_EQUAL(1, FindTestInstance(cache, k));
+	CHECK_EQUAL((UINT32)count, cache.Stats().Entries);
+}
+
+/// <summary>
+/// Fork a worker that inserts the same few instances over and over, so that it holds the writer mutex
+/// much of the time.
+/// </summary>
+static pid_t ForkBusyWriter(SharedInstanceCache& cache)
+{
+	pid_t child = fork();
+	if (child == 0)
+	{
+		SharedInstanceCache worker;
+		if (worker.OpenFd(cache.Fd()) != COMPANION_OK)
+			_exit(1);
+		for (UINT32 k = 0; ; k = (k + 1) % 16)
+			InsertTestInstance(worker, k);
+	}
+	return child;
+}
+
+COMPANION_TEST(SharedInstanceRecoversFromDeadWriter)
+{
+	// Writers killed at random, often while holding the mutex; the next insert must neither hang nor fail.
+	SharedInstanceCache cache;
+	REQUIRE(cache.OpenAnonymous(256) == COMPANION_OK);
+
+	for (UINT32 round = 0; round < 20; ++round)
+	{
+		pid_t child = ForkBusyWriter(cache);
+		REQUIRE(child > 0);
+		usleep(500 + 300 * round);
+		kill(child, SIGKILL);
+		waitpid(child, NULL, 0);
+
+		CHECK_EQUAL(COMPANION_OK, InsertTestInstance(cache, 100 + round));
+		for (UINT32 k = 0; k <= 100 + round; ++k)
+		{
+			if (FindTestInstance(cache, k) < 0)
+			{
+				CHECK(!"a slot was left damaged");
+				break;
+			}
+		}
+	}
+
+	SharedInstanceCacheStats stats = cache.Stats();
+	CHECK_EQUAL(0u, (UINT32)stats.WriterTimeouts);
+	CHECK(stats.WritersRecovered > 0);
+	for (UINT32 round = 0; round < 20; ++round)
+		CHECK_EQUAL(1, FindTestInstance(cache, 100 + round));
+}
+
+COMPANION_TEST(SharedInstanceGivesUpOnStuckWriter)
+{
+	// A writer stopped while holding the mutex makes inserts fail after the bounded wait, not hang.
+	SharedInstanceCache cache;
+	REQUIRE(cache.OpenAnonymous(256) == COMPANION_OK);
+	pid_t child = ForkBusyWriter(cache);
+	REQUIRE(child > 0);
+	usleep(2000);
+
+	bool gaveUp = false;
+	for (UINT32 attempt = 0; attempt < 50 && !gaveUp; ++attempt)
+	{
+		kill(child, SIGSTOP);
+		waitpid(child, NULL, WUNTRACED);
+		struct timespec start, end;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		COMPANION_RESULT result = InsertTestInstance(cache, 1000 + attempt);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		kill(child, SIGCONT);
+
+		long long elapsedMs = (long long)(end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+		if (result != COMPANION_OK)
+		{
+			gaveUp = true;
+			CHECK(elapsedMs >= SHARED_INSTANCE_WRITER_TIMEOUT_MS);
+			CHECK(elapsedMs < 10 * SHARED_INSTANCE_WRITER_TIMEOUT_MS);
+			CHECK_EQUAL(0, FindTestInstance(cache, 1000 + attempt));
+		}
+		usleep(200);
+	}
+	kill(child, SIGKILL);
+	waitpid(child, NULL, 0);
+
+	CHECK(gaveUp);
+	CHECK(cache.Stats().WriterTimeouts > 0);
+	CHECK_EQUAL(COMPANION_OK, InsertTestInstance(cache, 2000));
+	CHECK_EQUAL(1, FindTestInstance(cache, 2000));
+}
@@ -0,0 +1,698 @@
+//--------------------------------------------------------------------------
+// <copyright file="CompanionClient.cpp" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// Asynchronous companion client with pipelined in-flight requests.
+// </summary>
+//--------------------------------------------------------------------------
+
+#include "CompanionClient.h"
+
+#include <arpa/inet.h>
+
+// Sequence numbers advance by 2, so at most half the window can be outstanding at once.
+static const UINT32 MaxWindowInFlight = COMPANION_SEQUENCE_WINDOW / 2 - 1;
+
+CompanionClient::CompanionClient(EventLoop& loop, const CompanionPairingInfo& pairing, const CompanionClientOptions& options)
+	: _loop(loop), _pairing(pairing), _options(options), _codec(std::make_shared<CompanionCodec>()), _sequence(pairing.SeqNum), _nextConnection(0),
+	  _budget(options.RetryBudget), _rediscovering(false), _lifetime(std::make_shared<bool>(true)), _arenas(std::make_shared<CompanionArenaPool>()), _responseSize(0)
+{
+	if (_options.Connections == 0)
+		_options.Connections = 1;
+	if (_options.PipelineDepth == 0)
+		_options.PipelineDepth = 1;
+	if (_options.MaxInFlight == 0)
+		_options.MaxInFlight = 1;
+	if (_options.MaxInFlight > MaxWindowInFlight)
+		_options.MaxInFlight = MaxWindowInFlight;
+
+	// TimeoutMs is where an STB that has not answered yet starts, and the ceiling for one that has.
+	RttOptions rtt;
+	rtt.InitialTimeoutMs = _options.TimeoutMs;
+	rtt.MaxTimeoutMs = _options.TimeoutMs;
+	rtt.MinTimeoutMs = _options.MinTimeoutMs < _options.TimeoutMs ? _options.MinTimeoutMs : _options.TimeoutMs;
+	_rtt = RttEstimator(rtt);
+
+	for (UINT32 i = 0; i < _options.Connections; ++i)
+		_connections.push_back(HttpConnection::Create(_loop, _pairing.TargetIPAddr, _options.Port, _options.Transport));
+}
+
+CompanionClient::~CompanionClient()
+{
+	Shutdown();
+}
+
+COMPANION_RESULT CompanionClient::Open()
+{
+	std::shared_ptr<CompanionCodec> codec = NewCodec();
+	COMPANION_RESULT result = codec->Open(_pairing);
+	SetCodec(codec);
+	return result;
+}
+
+COMPANION_RESULT CompanionClient::Open(const std::vector<BYTE>& state)
+{
+	std::shared_ptr<CompanionCodec> codec = NewCodec();
+
+	UINT32 seqNum = 0;
+	if (state.empty()
+		|| codec->RestoreState(&state[0], state.size(), &seqNum) != COMPANION_OK
+		|| codec->TargetIPAddr() != _pairing.TargetIPAddr
+		|| codec->DeviceId() != (_pairing.DeviceKey.empty() ? std::string(COMPANION_TEST_DEVICE_ID) : _pairing.DeviceId))
+	{
+		COMPANION_RESULT result = codec->Open(_pairing);
+		SetCodec(codec);
+		return result;
+	}
+
+	SetCodec(codec);
+	_sequence.AcceptForward(seqNum);
+	return COMPANION_OK;
+}
+
+std::shared_ptr<CompanionCodec> CompanionClient::NewCodec() const
+{
+	std::shared_ptr<CompanionCodec> codec = std::make_shared<CompanionCodec>();
+	codec->EnableCache(_options.Cache);
+	codec->SetRecorder(_options.Recorder);
+	codec->SetInstanceCache(_options.InstanceCache);
+	return codec;
+}
+
+std::shared_ptr<CompanionCodec> CompanionClient::CurrentCodec() const
+{
+	std::lock_guard<std::mutex> guard(_codecLock);
+	return _codec;
+}
+
+void CompanionClient::SetCodec(std::shared_ptr<CompanionCodec> codec)
+{
+	// Whoever still holds the old codec keeps it; the last of them frees it, outside the lock.
+	std::lock_guard<std::mutex> guard(_codecLock);
+	_codec.swap(codec);
+}
+
+void CompanionClient::SendAsync(std::string request, Completion done, bool idempotent)
+{
+	Operation op;
+	op.Request = std::move(request);
+	op.Done = std::move(done);
+	op.Idempotent = idempotent;
+
+	// Always go through the queue so that done never runs inside the caller (or inside await_suspend).
+	std::shared_ptr<Operation> shared = std::make_shared<Operation>(std::move(op));
+	_loop.Post([this, shared]() { Enqueue(std::move(*shared)); });
+}
+
+void CompanionClient::SendStreamAsync(std::string request, ChunkHandler onChunk, Completion done)
+{
+	Operation op;
+	op.Request = std::move(request);
+	op.Done = std::move(done);
+	op.OnChunk = std::move(onChunk);
+
+	std::shared_ptr<Operation> shared = std::make_shared<Operation>(std::move(op));
+	_loop.Post([this, shared]() { Enqueue(std::move(*shared)); });
+}
+
+COMPANION_RESULT CompanionClient::Encode(const std::string& request, CompanionRequest* encoded)
+{
+	return CurrentCodec()->EncodeRequest(request.data(), (UINT32)request.length(), _sequence.Next(), encoded);
+}
+
+void CompanionClient::SendEncodedAsync(std::string request, CompanionRequest encoded, Completion done, bool idempotent)
+{
+	Operation op;
+	op.Request = std::move(request);
+	op.Encoded = std::move(encoded);
+	op.Done = std::move(done);
+	op.Idempotent = idempotent;
+
+	std::shared_ptr<Operation> shared = std::make_shared<Operation>(std::move(op));
+	_loop.Post([this, shared]() { Enqueue(std::move(*shared)); });
+}
+
+void CompanionClient::Shutdown()
+{
+	while (!_queue.empty())
+	{
+		Operation op = std::move(_queue.front());
+		_queue.pop_front();
+		CompanionResponse response;
+		response.Result = COMPANION_E_CANCELLED;
+		Complete(op, response);
+	}
+
+	// Aborting a connection completes its in-flight requests through OnResponse.
+	for (size_t i = 0; i < _connections.size(); ++i)
+		_connections[i]->Abort(COMPANION_E_CANCELLED);
+}
+
+void CompanionClient::Enqueue(Operation op)
+{
+	if (!_codec->IsOpen())
+	{
+		Fail(std::move(op), COMPANION_FAIL);
+		return;
+	}
+
+	_queue.push_back(std::move(op));
+	Pump();
+}
+
+void CompanionClient::Pump()
+{
+	while (!_queue.empty() && _inflight.size() < _options.MaxInFlight && WindowAllowsNext())
+	{
+		HttpConnection* connection = PickConnection();
+		if (connection == NULL)
+			break;
+
+		Operation op = std::move(_queue.front());
+		_queue.pop_front();
+		Dispatch(std::move(op), connection);
+	}
+}
+
+bool CompanionClient::WindowAllowsNext() const
+{
+	if (_inflight.empty())
+		return true;
+
+	// The next number is at most Current() + 2; the oldest outstanding response must still be accepted.
+	INT32 spread = (INT32)(_sequence.Current() + 2 - _inflight.front().SeqNum);
+	return spread < COMPANION_SEQUENCE_WINDOW;
+}
+
+HttpConnection* CompanionClient::PickConnection()
+{
+	// Round robin over connections that still have room in their pipeline.
+	for (size_t i = 0; i < _connections.size(); ++i)
+	{
+		HttpConnection* connection = _connections[(_nextConnection + i) % _connections.size()].get();
+		if (connection->Outstanding() < _options.PipelineDepth)
+		{
+			_nextConnection = (_nextConnection + i + 1) % _connections.size();
+			return connection;
+		}
+	}
+	return NULL;
+}
+
+HttpConnection* CompanionClient::PickIdleConnection(HttpConnection* exclude)
+{
+	for (size_t i = 0; i < _connections.size(); ++i)
+	{
+		HttpConnection* connection = _connections[(_nextConnection + i) % _connections.size()].get();
+		if (connection != exclude && connection->Outstanding() == 0)
+			return connection;
+	}
+	return NULL;
+}
+
+UINT32 CompanionClient::AttemptTimeoutMs() const
+{
+	return _options.AdaptiveTimeout ? _rtt.TimeoutMs() : _options.TimeoutMs;
+}
+
+void CompanionClient::Dispatch(Operation op, HttpConnection* connection)
+{
+	_budget.Deposit(EventLoop::NowUs());
+
+	// A streamed response has already been handed out in part, so it cannot be raced.
+	if (!op.Idempotent || op.OnChunk)
+	{
+		COMPANION_RESULT result = SendAttempt(&op, NULL, connection);
+		if (result != COMPANION_OK)
+			Fail(std::move(op), result);
+		return;
+	}
+
+	std::shared_ptr<Attempts> group = std::make_shared<Attempts>();
+	group->Op = std::move(op);
+	group->StartUs = EventLoop::NowUs();
+	group->FirstConnection = connection;
+
+	COMPANION_RESULT result = SendAttempt(NULL, group, connection);
+	if (result != COMPANION_OK)
+	{
+		Fail(std::move(group->Op), result);
+		return;
+	}
+
+	// Until the STB has answered a few times the percentile says nothing, so nothing is hedged.
+	if (_options.HedgePercentile != 0 && _rtt.IsWarm())
+	{
+		UINT64 delayMs = (_rtt.PercentileUs(_options.HedgePercentile) + 999) / 1000;
+		if (delayMs < _options.HedgeMinDelayMs)
+			delayMs = _options.HedgeMinDelayMs;
+		group->HedgeTimerId = _loop.AddTimer((UINT32)delayMs, [this, group]() { OnHedge(group); });
+	}
+}
+
+COMPANION_RESULT CompanionClient::SendAttempt(Operation* op, const std::shared_ptr<Attempts>& group, HttpConnection* connection)
+{
+	Operation& source = group ? group->Op : *op;
+
+	// Room for the query, body and head of the request and a response like the last one.
+	size_t requestSize = source.Encoded.Query.empty() ? CompanionCodec::EncodedLength((UINT32)source.Request.length())
+		: source.Encoded.Query.length() + source.Encoded.Body.size();
+	CompanionArenaLease arena(_arenas, requestSize + 384 + _pairing.TargetIPAddr.length() + _responseSize);
+	if (arena.Get() == NULL)
+		return COMPANION_FAIL;
+
+	CompanionEnvelope envelope;
+	if (!source.Encoded.Query.empty())
+	{
+		// Encoded ahead of time; the envelope is copied into the arena like one encoded there.
+		const CompanionRequest& encoded = source.Encoded;
+		envelope.Query = (const char*)arena.Get()->Copy(encoded.Query.c_str(), encoded.Query.length() + 1);
+		envelope.Body = (BYTE*)arena.Get()->Copy(encoded.Body.data(), encoded.Body.size());
+		envelope.BodyLength = (UINT32)encoded.Body.size();
+		envelope.SeqNum = encoded.SeqNum;
+		source.Encoded = CompanionRequest();
+		if (envelope.Query == NULL || envelope.Body == NULL)
+			return COMPANION_FAIL;
+	}
+	else
+	{
+		COMPANION_RESULT result = _codec->EncodeRequest(source.Request.data(), (UINT32)source.Request.length(), _sequence.Next(), arena.Get(), &envelope);
+		if (result != COMPANION_OK)
+			return result;
+	}
+	UINT32 seqNum = envelope.SeqNum;
+
+	HttpRequest http;
+	http.Head = HttpPostHead(arena.Get(), _pairing.TargetIPAddr, _options.Port, envelope.Query, envelope.BodyLength, &http.HeadLength);
+	if (http.Head == NULL)
+		return COMPANION_FAIL;
+	http.Body = envelope.Body;
+	http.BodyLength = envelope.BodyLength;
+	http.Arena = std::move(arena);
+	http.Cid = _pairing.DeviceId.c_str();
+	http.SeqNum = seqNum;
+
+	std::shared_ptr<Stream> chunked;
+	if (op != NULL && op->OnChunk && !_codec->IsTestPairing())
+	{
+		chunked = std::make_shared<Stream>();
+		ChunkHandler onChunk = op->OnChunk;
+		http.OnBody = [this, chunked, connection, seqNum, onChunk](HttpResponse& head, const BYTE* data, size_t length)
+		{
+			return OnStreamBody(chunked, connection, seqNum, onChunk, head, data, length);
+		};
+	}
+
+	Inflight inflight;
+	if (op != NULL)
+		inflight.Op = std::move(*op);
+	inflight.Group = group;
+	inflight.Attempt = 0;
+	if (group)
+	{
+		inflight.Attempt = group->Sent++;
+		++group->Outstanding;
+	}
+	inflight.Chunked = chunked;
+	inflight.SeqNum = seqNum;
+	inflight.TimerId = 0;
+	inflight.SentUs = EventLoop::NowUs();
+	inflight.Connection = connection;
+	InflightRef ref = _inflight.insert(_inflight.end(), std::move(inflight));
+
+	ref->TimerId = _loop.AddTimer(AttemptTimeoutMs(), [this, ref]() { OnTimeout(ref); });
+	++_stats.Sent;
+
+	connection->Submit(std::move(http), [this, ref](COMPANION_RESULT httpResult, HttpResponse& response)
+	{
+		OnResponse(ref, httpResult, response);
+	});
+	return COMPANION_OK;
+}
+
+void CompanionClient::OnHedge(std::shared_ptr<Attempts> group)
+{
+	group->HedgeTimerId = 0;
+	if (group->Completed)
+		return;
+
+	// A hedge that would wait behind other requests is no faster than the original.
+	HttpConnection* connection = NULL;
+	if (_inflight.size() < _options.MaxInFlight && WindowAllowsNext())
+		connection = PickIdleConnection(group->FirstConnection);
+	if (connection == NULL || !_budget.TryWithdraw(EventLoop::NowUs()))
+	{
+		++_stats.Suppressed;
+		return;
+	}
+
+	if (SendAttempt(NULL, group, connection) == COMPANION_OK)
+		++_stats.Hedges;
+}
+
+void CompanionClient::OnTimeout(InflightRef ref)
+{
+	ref->TimerId = 0;
+	++_stats.Timeouts;
+	_rtt.Backoff();
+
+	// Responses on a connection arrive in request order, so the only way to drop one request is to drop
+	// the connection.  Everything pipelined behind it fails too.
+	ref->Connection->Abort(COMPANION_E_TIMEOUT);
+}
+
+bool CompanionClient::OnStreamBody(const std::shared_ptr<Stream>& chunked, HttpConnection* connection, UINT32 seqNum, const ChunkHandler& onChunk, HttpResponse& http, const BYTE* data, size_t length)
+{
+	Stream& stream = *chunked;
+	if (!stream.Reader)
+	{
+		// Anything other than a successful chunked response is buffered and handled by OnResponse.
+		if (http.Status < 200 || http.Status > 299 || !http.HeaderIs(COMPANION_ENCODING_HEADER, COMPANION_CHUNKED_ENCODING_VALUE))
+			return http.AppendBody(data, length);
+
+		// The signature is in the head, so a forged response is rejected before any chunk is decoded.
+		size_t signatureLength = 0;
+		const char* signature = http.Header(COMPANION_SIGNATURE_HEADER, &signatureLength);
+		UINT32 rspLen = 0;
+		stream.Result = signature == NULL ? COMPANION_E_SIGNATURE
+			: _codec->Verify(signature, (UINT32)signatureLength, &stream.RspSeq, &rspLen);
+		if (stream.Result != COMPANION_OK)
+			return false;
+
+		ChunkedFrameOptions options;
+		options.Pool = _options.DecodePool;
+		options.MaxPendingChunks = _options.MaxPendingChunks;
+		if (options.Pool != NULL)
+		{
+			// Runs on a worker: the chunk is delivered on the loop, if the stream is still wanted by then.
+			EventLoop* loop = &_loop;
+			std::weak_ptr<bool> lifetime = _lifetime;
+			std::weak_ptr<Stream> weak = chunked;
+			options.Decoded = [this, loop, lifetime, weak]()
+			{
+				loop->Post([this, lifetime, weak]()
+				{
+					std::shared_ptr<Stream> decoded = weak.lock();
+					if (!lifetime.expired() && decoded)
+						OnStreamDecoded(decoded);
+				});
+			};
+		}
+		stream.Connection = connection;
+		stream.Reader.reset(new ChunkedFrameReader(std::shared_ptr<const CompanionCodec>(_codec), seqNum, [onChunk](UINT32, const BYTE* payload, UINT32 payloadLength, bool last)
+		{
+			return onChunk(payload, payloadLength, last);
+		}, options));
+	}
+
+	stream.Result = stream.Reader->Feed(data, length);
+	if (stream.Result != COMPANION_OK)
+		return false;
+
+	// Backpressure without blocking the loop: the peer waits in TCP until a chunk has been decoded.
+	if (stream.Reader->IsFull() && !stream.Paused)
+	{
+		stream.Paused = true;
+		connection->PauseReading();
+	}
+	return true;
+}
+
+void CompanionClient::OnStreamDecoded(const std::shared_ptr<Stream>& stream)
+{
+	if (!stream->Reader)
+		return;     // abandoned
+	if (stream->Result == COMPANION_OK)
+		stream->Result = stream->Reader->Poll();
+
+	if (stream->Paused && stream->Connection != NULL && stream->Result == COMPANION_OK && !stream->Reader->IsFull())
+	{
+		stream->Paused = false;
+		stream->Connection->ResumeReading();
+	}
+
+	if (stream->Finished)
+	{
+		if (stream->Result != COMPANION_OK || stream->Reader->IsIdle())
+		{
+			std::function<void()> finished = std::move(stream->Finished);
+			stream->Finished = nullptr;
+			finished();
+		}
+	}
+	else if (stream->Result != COMPANION_OK && stream->Connection != NULL)
+	{
+		// As when Feed rejects a chunk: the rest of the body is not wanted.  OnResponse reports why.
+		stream->Connection->Abort(COMPANION_E_CONNECTION);
+	}
+}
+
+void CompanionClient::OnResponse(InflightRef ref, COMPANION_RESULT result, HttpResponse& http)
+{
+	if (ref->TimerId != 0)
+		_loop.CancelTimer(ref->TimerId);
+	ref->TimerId = 0;
+
+	// The body is all in, or never will be; the connection goes on to the next response.
+	if (ref->Chunked && ref->Chunked->Connection != NULL)
+	{
+		if (ref->Chunked->Paused)
+			ref->Chunked->Connection->ResumeReading();
+		ref->Chunked->Paused = false;
+		ref->Chunked->Connection = NULL;
+	}
+
+	CompanionResponse response;
+	response.SeqNum = ref->SeqNum;
+	response.HttpStatus = http.Status;
+	response.LatencyUs = EventLoop::NowUs() - ref->SentUs;
+
+	bool lastOutstanding = _inflight.size() == 1;
+	char* decoded = NULL;
+	UINT32 decodedLength = 0;
+	if (result == COMPANION_OK)
+		_responseSize = http.HeadLength + http.BodyLength;
+
+	if (result == COMPANION_OK && (http.Status < 200 || http.Status > 299))
+		result = COMPANION_E_HTTP;
+
+	// A rejected chunk drops the connection; report why rather than the connection error.
+	if (ref->Chunked && ref->Chunked->Result != COMPANION_OK)
+		result = ref->Chunked->Result;
+
+	if (result == COMPANION_OK && ref->Chunked && ref->Chunked->Reader)
+	{
+		result = ref->Chunked->Reader->Poll();
+		if (result == COMPANION_OK && !ref->Chunked->Reader->IsIdle())
+		{
+			// Chunks are still being decoded.  The response is completed from OnStreamDecoded once they
+			// are, with what it needs of the head; the rest of it goes with the request's arena.
+			HttpResponse held;
+			held.Status = http.Status;
+			held.HeadLength = http.HeadLength;
+			held.BodyLength = http.BodyLength;
+			ref->Chunked->Finished = [this, ref, held]() mutable
+			{
+				OnResponse(ref, COMPANION_OK, held);
+			};
+			return;
+		}
+		if (result == COMPANION_OK)
+			result = ref->Chunked->Reader->Finish();
+		response.RspSeq = ref->Chunked->RspSeq;
+		if (result == COMPANION_OK)
+		{
+			if (lastOutstanding)
+				_sequence.Accept(response.RspSeq);
+			else
+				_sequence.AcceptForward(response.RspSeq);
+		}
+	}
+	else if (result == COMPANION_OK && http.BodyLength != 0 && !_codec->IsTestPairing())
+	{
+		size_t signatureLength = 0;
+		const char* signature = http.Header(COMPANION_SIGNATURE_HEADER, &signatureLength);
+		UINT32 rspLen = 0;
+		if (signature == NULL)
+			result = COMPANION_E_SIGNATURE;
+		else if (http.HeaderIs(COMPANION_ENCODING_HEADER, COMPANION_ENCODING_VALUE))
+			result = _codec->DecryptResponseInPlace(signature, (UINT32)signatureLength, http.Body, (UINT32)http.BodyLength, &response.RspSeq, &decoded, &decodedLength);
+		else if ((result = _codec->Verify(signature, (UINT32)signatureLength, &response.RspSeq, &rspLen)) == COMPANION_OK)
+		{
+			decoded = (char*)http.Body;
+			decodedLength = (UINT32)http.BodyLength;
+		}
+
+		// RspSeq is only set by a verified signature.  Only the last outstanding response may pull the
+		// sequence backwards; otherwise it would invalidate requests still in flight.
+		if (response.RspSeq != 0)
+		{
+			if (lastOutstanding)
+				_sequence.Accept(response.RspSeq);
+			else
+				_sequence.AcceptForward(response.RspSeq);
+		}
+	}
+	else if (result == COMPANION_OK)
+	{
+		decoded = (char*)http.Body;
+		decodedLength = (UINT32)http.BodyLength;
+	}
+
+	if (result == COMPANION_OK && decoded != NULL)
+	{
+		response.Decoded = decoded;
+		response.DecodedLength = decodedLength;
+		if (!_options.ArenaResponses)
+			response.Body.assign(decoded, decodedLength);
+	}
+	response.Result = result;
+
+	// An STB that has taken a new DHCP lease stops answering at the old address.
+	if ((result == COMPANION_E_CONNECTION || result == COMPANION_E_TIMEOUT) && ref->Connection->Host() == _pairing.TargetIPAddr)
+		Rediscover();
+
+	// Streamed responses take as long as their data does, which says nothing about the STB.
+	if (result == COMPANION_OK && !ref->Chunked)
+		_rtt.AddSample(response.LatencyUs);
+
+	// A stream abandoned with chunks still on the pool is destroyed there, where waiting for them blocks nothing.
+	// The reader shares the codec, so it may outlive the client.
+	if (ref->Chunked && ref->Chunked->Reader && !ref->Chunked->Reader->IsIdle() && _options.DecodePool != NULL)
+	{
+		ChunkedFrameReader* reader = ref->Chunked->Reader.release();
+		_options.DecodePool->Post([reader]() { delete reader; });
+	}
+
+	std::shared_ptr<Attempts> group = std::move(ref->Group);
+	UINT32 attempt = ref->Attempt;
+	Operation op = std::move(ref->Op);
+	_inflight.erase(ref);
+
+	if (group)
+		OnAttemptDone(group, attempt, response);
+	else
+		Complete(op, response);
+	Pump();
+}
+
+void CompanionClient::OnAttemptDone(const std::shared_ptr<Attempts>& group, UINT32 attempt, CompanionResponse& response)
+{
+	--group->Outstanding;
+	if (group->Completed)
+		return;
+
+	// A failure only counts once no other attempt can still answer.
+	if (response.Result != COMPANION_OK && group->Outstanding > 0)
+		return;
+
+	if ((response.Result == COMPANION_E_TIMEOUT || response.Result == COMPANION_E_CONNECTION) && !group->Retried)
+	{
+		group->Retried = true;
+
+		HttpConnection* connection = NULL;
+		if (_inflight.size() < _options.MaxInFlight && WindowAllowsNext())
+			connection = PickConnection();
+		if (connection != NULL && _budget.TryWithdraw(EventLoop::NowUs()))
+		{
+			if (SendAttempt(NULL, group, connection) == COMPANION_OK)
+			{
+				++_stats.Retries;
+				return;
+			}
+		}
+		else
+		{
+			++_stats.Suppressed;
+		}
+	}
+
+	group->Completed = true;
+	if (group->HedgeTimerId != 0)
+	{
+		_loop.CancelTimer(group->HedgeTimerId);
+		group->HedgeTimerId = 0;
+	}
+
+	if (response.Result == COMPANION_OK && attempt != 0 && !group->Retried)
+		++_stats.HedgeWins;
+
+	response.LatencyUs = EventLoop::NowUs() - group->StartUs;
+	Complete(group->Op, response);
+}
+
+void CompanionClient::Rediscover()
+{
+	if (_options.Discovery == NULL || _options.TargetUsn.empty() || _rediscovering)
+		return;
+
+	_rediscovering = true;
+	++_stats.Rediscoveries;
+
+	EventLoop* loop = &_loop;
+	std::weak_ptr<bool> lifetime = _lifetime;
+	_options.Discovery->ResolveAsync(_options.TargetUsn, [this, loop, lifetime](const std::string&, COMPANION_RESULT result, const std::string& address)
+	{
+		loop->Post([this, lifetime, result, address]()
+		{
+			if (lifetime.expired())
+				return;
+
+			_rediscovering = false;
+			if (result == COMPANION_OK && address != _pairing.TargetIPAddr)
+				Retarget(address);
+		});
+	});
+}
+
+COMPANION_RESULT CompanionClient::Retarget(const std::string& address)
+{
+	struct in_addr parsed;
+	if (inet_pton(AF_INET, address.c_str(), &parsed) != 1)
+		return COMPANION_FAIL;
+
+	// The signature hash covers the STB's address, so the codec is rederived for the new one.  It is built
+	// apart from the one in use, which other threads may be encoding or decoding with until it is replaced.
+	CompanionPairingInfo pairing = _pairing;
+	pairing.TargetIPAddr = address;
+	pairing.SeqNum = _sequence.Current();
+	std::shared_ptr<CompanionCodec> codec = NewCodec();
+	COMPANION_RESULT result = codec->Open(pairing);
+	if (result != COMPANION_OK)
+		return result;
+	SetCodec(codec);
+	_pairing.TargetIPAddr = address;
+
+	std::vector<std::unique_ptr<HttpConnection>> old;
+	old.swap(_connections);
+	for (size_t i = 0; i < old.size(); ++i)
+		_connections.push_back(HttpConnection::Create(_loop, address, _options.Port, _options.Transport));
+	_nextConnection = 0;
+	++_stats.Retargets;
+
+	// What was in flight fails; idempotent requests are retried, now at the new address.
+	for (size_t i = 0; i < old.size(); ++i)
+		old[i]->Abort(COMPANION_E_CONNECTION);
+
+	Pump();
+	return COMPANION_OK;
+}
+
+void CompanionClient::Complete(Operation& op, CompanionResponse& response)
+{
+	if (op.Done)
+		op.Done(response);
+}
+
+void CompanionClient::Fail(Operation op, COMPANION_RESULT result)
+{
+	// Failures found while queueing are still reported asynchronously.
+	std::shared_ptr<Operation> shared = std::make_shared<Operation>(std::move(op));
+	_loop.Post([this, shared, result]()
+	{
+		CompanionResponse response;
+		response.Result = result;
+		Complete(*shared, response);
+	});
+}
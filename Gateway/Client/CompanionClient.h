@@ -0,0 +1,353 @@
+//--------------------------------------------------------------------------
+// <copyright file="CompanionClient.h" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// Asynchronous companion client with pipelined in-flight requests.
+// </summary>
+//--------------------------------------------------------------------------
+
+/*
+ Using the companion client:
+ MRCompanion allows one outstanding request per object.  CompanionClient keeps several requests to one STB
+ in flight over a small pool of HTTP connections and completes each one on the event loop thread:
+
+    CompanionTask<void> ChannelUp(CompanionClient& stb)
+    {
+        CompanionResponse r = co_await stb.Send("op=key&k=chup");
+        ...
+    }
+    Spawn(loop, ChannelUp(stb));
+
+ Requests are queued in order and encoded on the loop thread when they are dispatched, which is also when
+ their sequence number is assigned.  A request is only dispatched if its sequence number would leave every
+ outstanding request inside the COMPANION_SEQUENCE_WINDOW that decryptResponse: accepts, so responses to
+ older requests never force a resync.  Responses are matched to requests by connection order.
+ Non-coroutine callers (for instance the UI thread) use SendAsync, which may be called from any thread.
+ Large responses (guide data, recording lists) may be sent by the STB in chunked frames (ChunkedFrame.h).
+ SendStreamAsync decodes those as they arrive, on DecodePool if one is given, and hands each payload to
+ its chunk handler in order, so neither latency nor memory grows with the size of the response.  The loop
+ never waits for the pool: while MaxPendingChunks frames are being decoded the connection stops reading,
+ and each decoded chunk is posted back to the loop, which delivers it and reads on.
+
+ With AdaptiveTimeout each request's timeout comes from the STB's measured round trips (RttEstimator.h)
+ instead of TimeoutMs, which becomes the ceiling.  Requests that are safe to repeat (op=hello, or any sent
+ with idempotent = true) may be hedged: once HedgePercentile of recent answers would have arrived, a copy
+ is sent with a fresh sequence number on another idle connection and whichever answer comes first completes
+ the request.  An idempotent request that fails on a dropped or timed-out connection is retried once.
+ Hedges and retries are drawn from a RetryBudget, so a slow STB is never sent more than RetryBudgetPercent
+ extra requests (plus a small reserve).  Chunked responses are never hedged.
+
+ An STB may take a new address with a new DHCP lease.  Given a Discovery and the pairing's TargetUsn, a
+ request that fails at the current address starts an SSDP re-resolution (SsdpDiscovery.h); if the STB is
+ found elsewhere the client retargets its codec and connections there.  The discovery must be destroyed
+ before the loop.
+
+ Each attempt's bytes live in one arena from a pool (CompanionArena.h): the query and body are encoded into
+ it, the HTTP head is written after them, the response head and body are received into it and the body is
+ decoded where it lies.  The arena goes back to the pool when the attempt completes, so once the pool has
+ grown to the traffic a round trip's bytes cost no heap allocation.  Decoded points at the decoded response
+ there, for the completion to parse in place (ParseCompanionResponse); with ArenaResponses it is not also
+ copied into Body.  ArenaStats reports what the arenas did.
+ */
+
+#ifndef COMPANIONCLIENT_H
+#define COMPANIONCLIENT_H
+
+#include "ChunkedFrame.h"
+#include "CompanionArena.h"
+#include "CompanionCodec.h"
+#include "CompanionTask.h"
+#include "EventLoop.h"
+#include "HttpConnection.h"
+#include "RttEstimator.h"
+#include "SsdpDiscovery.h"
+
+#include <coroutine>
+#include <deque>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct CompanionClientOptions
+{
+	UINT32 Connections;     // pooled connections to the STB
+	UINT32 PipelineDepth;   // requests written back to back on one connection
+	UINT32 MaxInFlight;     // requests outstanding for the STB; clamped to the sequence window
+	UINT32 TimeoutMs;       // per request, as MRCompanion _timeout
+	UINT16 Port;
+	CompanionCacheOptions Cache;    // body and response memoization, off by default
+	CompanionWorkerPool*  DecodePool;       // decodes chunked responses; NULL decodes on the loop thread
+	UINT32                MaxPendingChunks; // chunked frames buffered per response
+	bool                  AdaptiveTimeout;  // derive timeouts from measured RTT, with TimeoutMs as the ceiling
+	UINT32                MinTimeoutMs;     // floor for adaptive timeouts
+	UINT32                HedgePercentile;  // hedge idempotent requests after this RTT percentile; 0 disables
+	UINT32                HedgeMinDelayMs;  // never hedge sooner than this
+	RetryBudgetOptions    RetryBudget;      // limits hedges and retries together
+	SsdpDiscovery*        Discovery;        // finds the STB again when it stops answering; NULL disables
+	std::string           TargetUsn;        // the pairing's targetUsn, for Discovery
+	CompanionRecorder*    Recorder;         // sees the codec's traffic; NULL for none
+	SharedInstanceCache*  InstanceCache;    // derived instances shared with other processes; NULL for none
+	NetTransport          Transport;        // socket I/O of the connections; io_uring falls back to epoll
+	bool                  ArenaResponses;   // leave Body empty; the decoded response is only in Decoded
+
+	CompanionClientOptions() : Connections(4), PipelineDepth(1), MaxInFlight(8), TimeoutMs(5000), Port(COMPANION_PORT), DecodePool(NULL), MaxPendingChunks(4),
+		AdaptiveTimeout(false), MinTimeoutMs(250), HedgePercentile(0), HedgeMinDelayMs(10), Discovery(NULL), Recorder(NULL), InstanceCache(NULL),
+		Transport(NetTransportEpoll), ArenaResponses(false) {}
+};
+
+struct CompanionResponse
+{
+	COMPANION_RESULT Result;
+	int              HttpStatus;
+	UINT32           SeqNum;        // sequence number the request was sent with
+	UINT32           RspSeq;        // sequence number carried by the response signature
+	std::string      Body;          // decoded response, usually XML
+	char*            Decoded;       // the same in the attempt's arena, until the completion returns (or a co_await suspends)
+	UINT32           DecodedLength;
+	UINT64           LatencyUs;     // from dispatch to completion
+
+	CompanionResponse() : Result(COMPANION_FAIL), HttpStatus(0), SeqNum(0), RspSeq(0), Decoded(NULL), DecodedLength(0), LatencyUs(0) {}
+};
+
+struct CompanionClientStats
+{
+	UINT64 Sent;                // attempts written, including hedges and retries
+	UINT64 Timeouts;
+	UINT64 Hedges;
+	UINT64 HedgeWins;           // requests completed by their hedge rather than the original
+	UINT64 Retries;
+	UINT64 Suppressed;          // hedges or retries skipped for want of budget, window or an idle connection
+	UINT64 Rediscoveries;       // SSDP re-resolutions started
+	UINT64 Retargets;           // address changes
+
+	CompanionClientStats() : Sent(0), Timeouts(0), Hedges(0), HedgeWins(0), Retries(0), Suppressed(0), Rediscoveries(0), Retargets(0) {}
+};
+
+class CompanionClient
+{
+public:
+
+	typedef std::function<void(CompanionResponse&)> Completion;
+	typedef std::function<COMPANION_RESULT(const BYTE* payload, UINT32 length, bool last)> ChunkHandler;
+
+	CompanionClient(EventLoop& loop, const CompanionPairingInfo& pairing, const CompanionClientOptions& options = CompanionClientOptions());
+	~CompanionClient();
+
+	/// <summary>
+	/// Derive the encryption state.  May be called from any thread before the first request.
+	/// </summary>
+	COMPANION_RESULT Open();
+
+	/// <summary>
+	/// Open from state saved by SaveState, falling back to Open() if it is damaged or belongs to another
+	/// STB.  The saved sequence number replaces the pairing's when it is ahead.
+	/// </summary>
+	COMPANION_RESULT Open(const std::vector<BYTE>& state);
+
+	/// <summary>
+	/// Save the codec state and current sequence number for a later Open(state).
+	/// </summary>
+	COMPANION_RESULT SaveState(std::vector<BYTE>* state) const { return CurrentCodec()->SaveState(_sequence.Current(), state); }
+
+	/// <summary>
+	/// Awaitable returned by Send.  The awaiting coroutine resumes on the loop thread.
+	/// </summary>
+	class SendAwaiter
+	{
+	public:
+
+		SendAwaiter(CompanionClient& client, std::string request) : _client(client), _request(std::move(request)) {}
+
+		bool await_ready() const noexcept { return false; }
+
+		void await_suspend(std::coroutine_handle<> awaiting)
+		{
+			_client.SendAsync(std::move(_request), [this, awaiting](CompanionResponse& response)
+			{
+				_response = std::move(response);
+				awaiting.resume();
+			});
+		}
+
+		CompanionResponse await_resume() { return std::move(_response); }
+
+	private:
+
+		CompanionClient&  _client;
+		std::string       _request;
+		CompanionResponse _response;
+	};
+
+	/// <summary>
+	/// co_await client.Send("op=...")
+	/// </summary>
+	SendAwaiter Send(std::string request) { return SendAwaiter(*this, std::move(request)); }
+
+	/// <summary>
+	/// Queue a request and call done on the loop thread when it completes.  Safe to call from any thread.
+	/// done is never called before SendAsync returns.  Whether it may be hedged is decided by IsIdempotent.
+	/// </summary>
+	void SendAsync(std::string request, Completion done)
+	{
+		bool idempotent = IsIdempotent(request);
+		SendAsync(std::move(request), std::move(done), idempotent);
+	}
+
+	/// <summary>
+	/// As above, stating whether the request may safely be sent more than once.
+	/// </summary>
+	void SendAsync(std::string request, Completion done, bool idempotent);
+
+	/// <summary>
+	/// Like SendAsync, but a chunked response is handed to onChunk on the loop thread as it is decoded and
+	/// the response Body stays empty.  Responses that are not chunked are completed as by SendAsync.
+	/// </summary>
+	void SendStreamAsync(std::string request, ChunkHandler onChunk, Completion done);
+
+	/// <summary>
+	/// Encode a request on the calling thread, taking the next sequence number, for SendEncodedAsync.
+	/// Safe to call from any thread once Open has returned.
+	/// </summary>
+	COMPANION_RESULT Encode(const std::string& request, CompanionRequest* encoded);
+
+	/// <summary>
+	/// Like SendAsync, for a request already encoded by Encode.  Hedges and retries re-encode request.
+	/// </summary>
+	void SendEncodedAsync(std::string request, CompanionRequest encoded, Completion done, bool idempotent = false);
+
+	/// <summary>
+	/// Fail everything queued or in flight with COMPANION_E_CANCELLED.  Must be called on the loop thread.
+	/// </summary>
+	void Shutdown();
+
+	/// <summary>
+	/// CompanionCodec::IsIdempotent: true for requests that only read STB state.
+	/// </summary>
+	static bool IsIdempotent(const std::string& request) { return CompanionCodec::IsIdempotent(request); }
+
+	/// <summary>
+	/// Move to a new STB address: rederive the codec and fail what is in flight at the old one.  Must be
+	/// called on the loop thread.  The new codec replaces the old one only once it is open; Encode calls
+	/// and stream readers already holding the old one finish with it.
+	/// </summary>
+	COMPANION_RESULT Retarget(const std::string& address);
+
+	const std::string& TargetAddress() const { return _pairing.TargetIPAddr; }
+
+	EventLoop& Loop() { return _loop; }
+	std::shared_ptr<const CompanionCodec> Codec() const { return CurrentCodec(); }
+	CompanionSequence& Sequence() { return _sequence; }
+	const CompanionClientOptions& Options() const { return _options; }
+
+	size_t Queued() const { return _queue.size(); }
+	size_t InFlight() const { return _inflight.size(); }
+
+	// The following must be called on the loop thread.
+	const RttEstimator& Rtt() const { return _rtt; }
+	const CompanionClientStats& Stats() const { return _stats; }
+	CompanionArenaStats ArenaStats() const { return _arenas->Stats(); }
+
+private:
+
+	CompanionClient(const CompanionClient&) = delete;
+	CompanionClient& operator=(const CompanionClient&) = delete;
+
+	struct Operation
+	{
+		std::string  Request;
+		Completion   Done;
+		ChunkHandler OnChunk;
+		CompanionRequest Encoded;   // when encoded ahead of dispatch; used by the first attempt only
+		bool         Idempotent;
+
+		Operation() : Idempotent(false) {}
+	};
+
+	/// <summary>
+	/// An idempotent operation and the attempts made for it.  The first good answer completes it.
+	/// </summary>
+	struct Attempts
+	{
+		Operation       Op;
+		UINT32          Outstanding;        // attempts in flight
+		UINT32          Sent;               // attempts made, so the next one's number
+		UINT64          HedgeTimerId;
+		UINT64          StartUs;            // when the original was sent
+		HttpConnection* FirstConnection;    // the hedge goes elsewhere
+		bool            Retried;
+		bool            Completed;          // answers to the other attempts are dropped
+
+		Attempts() : Outstanding(0), Sent(0), HedgeTimerId(0), StartUs(0), FirstConnection(NULL), Retried(false), Completed(false) {}
+	};
+
+	struct Stream
+	{
+		std::unique_ptr<ChunkedFrameReader> Reader;     // created once the head shows a chunked response
+		COMPANION_RESULT                    Result;     // why the body was rejected, if it was
+		UINT32                              RspSeq;
+		HttpConnection*                     Connection; // receiving the body; NULL once it is all in
+		bool                                Paused;     // Connection stopped reading for this stream
+		std::function<void()>               Finished;   // the response, held until its last chunk is decoded
+
+		Stream() : Result(COMPANION_OK), RspSeq(0), Connection(NULL), Paused(false) {}
+	};
+
+	struct Inflight
+	{
+		Operation               Op;
+		UINT32                  SeqNum;
+		UINT64                  TimerId;
+		UINT64                  SentUs;
+		HttpConnection*         Connection;
+		std::shared_ptr<Stream> Chunked;
+		std::shared_ptr<Attempts> Group;    // set for idempotent operations, whose Op is kept there
+		UINT32                  Attempt;    // 0 for the original request
+	};
+
+	typedef std::list<Inflight>::iterator InflightRef;
+
+	std::shared_ptr<CompanionCodec> NewCodec() const;
+	std::shared_ptr<CompanionCodec> CurrentCodec() const;
+	void SetCodec(std::shared_ptr<CompanionCodec> codec);
+	void Enqueue(Operation op);
+	void Pump();
+	bool WindowAllowsNext() const;
+	HttpConnection* PickConnection();
+	void Dispatch(Operation op, HttpConnection* connection);
+	COMPANION_RESULT SendAttempt(Operation* op, const std::shared_ptr<Attempts>& group, HttpConnection* connection);
+	void OnHedge(std::shared_ptr<Attempts> group);
+	HttpConnection* PickIdleConnection(HttpConnection* exclude);
+	UINT32 AttemptTimeoutMs() const;
+	void OnResponse(InflightRef ref, COMPANION_RESULT result, HttpResponse& http);
+	void OnAttemptDone(const std::shared_ptr<Attempts>& group, UINT32 attempt, CompanionResponse& response);
+	void OnTimeout(InflightRef ref);
+	bool OnStreamBody(const std::shared_ptr<Stream>& stream, HttpConnection* connection, UINT32 seqNum, const ChunkHandler& onChunk, HttpResponse& http, const BYTE* data, size_t length);
+	void OnStreamDecoded(const std::shared_ptr<Stream>& stream);
+	void Rediscover();
+	void Complete(Operation& op, CompanionResponse& response);
+	void Fail(Operation op, COMPANION_RESULT result);
+
+	EventLoop&                                   _loop;
+	CompanionPairingInfo                         _pairing;
+	CompanionClientOptions                       _options;
+	std::shared_ptr<CompanionCodec>              _codec;         // replaced by Retarget; shared with stream readers
+	mutable std::mutex                           _codecLock;     // held to replace _codec, and by other threads to copy it
+	CompanionSequence                            _sequence;
+	std::deque<Operation>                        _queue;
+	std::list<Inflight>                          _inflight;      // in dispatch order, so front() is the oldest
+	std::vector<std::unique_ptr<HttpConnection>> _connections;
+	size_t                                       _nextConnection;
+	RttEstimator                                 _rtt;
+	RetryBudget                                  _budget;
+	CompanionClientStats                         _stats;
+	bool                                         _rediscovering;
+	std::shared_ptr<bool>                        _lifetime;      // lets discovery callbacks outlive the client
+	std::shared_ptr<CompanionArenaPool>          _arenas;        // shared with requests still being sent
+	size_t                                       _responseSize;  // head and body of the last response, to size arenas
+};
+
+#endif
@@ -0,0 +1,246 @@
+//--------------------------------------------------------------------------
+// <copyright file="CompanionFanout.cpp" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// Sends one command to many STBs at once.
+// </summary>
+//--------------------------------------------------------------------------
+
+#include "CompanionFanout.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+
+struct CompanionFanout::Round
+{
+	std::string                   Request;
+	Completion                    Done;
+	UINT64                        StartUs;
+	std::vector<CompanionRequest> Encoded;
+	std::vector<COMPANION_RESULT> EncodeResults;
+	std::atomic<size_t>           Encoding;       // targets still being encoded
+	std::vector<bool>             Answered;
+	size_t                        Outstanding;    // targets not yet answered
+	UINT64                        TimerId;
+	bool                          Finished;
+	CompanionFanoutResult         Result;
+
+	Round() : StartUs(0), Encoding(0), Outstanding(0), TimerId(0), Finished(false) {}
+};
+
+CompanionFanout::CompanionFanout(EventLoop& loop, const std::vector<CompanionPairingInfo>& pairings, const CompanionFanoutOptions& options)
+	: _loop(loop), _options(options), _pendingEncodes(0), _lifetime(std::make_shared<bool>(true))
+{
+	for (size_t i = 0; i < pairings.size(); ++i)
+		_clients.push_back(std::unique_ptr<CompanionClient>(new CompanionClient(_loop, pairings[i], _options.Client)));
+}
+
+CompanionFanout::~CompanionFanout()
+{
+	// Workers encoding for a round use the clients; they must be done before the clients go.
+	WaitForEncodes();
+}
+
+COMPANION_RESULT CompanionFanout::Open()
+{
+	std::vector<COMPANION_RESULT> results(_clients.size(), COMPANION_OK);
+
+	if (_options.EncodePool == NULL)
+	{
+		for (size_t i = 0; i < _clients.size(); ++i)
+			results[i] = _clients[i]->Open();
+	}
+	else
+	{
+		std::mutex lock;
+		std::condition_variable opened;
+		size_t remaining = _clients.size();
+
+		for (size_t i = 0; i < _clients.size(); ++i)
+		{
+			_options.EncodePool->Post([this, i, &results, &lock, &opened, &remaining]()
+			{
+				results[i] = _clients[i]->Open();
+				std::lock_guard<std::mutex> guard(lock);
+				if (--remaining == 0)
+					opened.notify_one();
+			});
+		}
+
+		std::unique_lock<std::mutex> guard(lock);
+		opened.wait(guard, [&remaining]() { return remaining == 0; });
+	}
+
+	for (size_t i = 0; i < results.size(); ++i)
+	{
+		if (results[i] != COMPANION_OK)
+			return results[i];
+	}
+	return COMPANION_OK;
+}
+
+void CompanionFanout::SendAsync(std::string request, Completion done)
+{
+	RoundRef round = std::make_shared<Round>();
+	round->Request = std::move(request);
+	round->Done = std::move(done);
+	round->StartUs = EventLoop::NowUs();
+	round->Encoded.resize(_clients.size());
+	round->EncodeResults.resize(_clients.size(), COMPANION_OK);
+	round->Answered.resize(_clients.size(), false);
+	round->Outstanding = _clients.size();
+	round->Result.Responses.resize(_clients.size());
+	round->Result.AnsweredUs.resize(_clients.size(), 0);
+
+	std::weak_ptr<bool> lifetime = _lifetime;
+	if (_clients.empty())
+	{
+		_loop.Post([this, lifetime, round]()
+		{
+			if (!lifetime.expired())
+				Finish(round);
+		});
+		return;
+	}
+
+	if (_options.EncodePool == NULL)
+	{
+		for (size_t i = 0; i < _clients.size(); ++i)
+			round->EncodeResults[i] = _clients[i]->Encode(round->Request, &round->Encoded[i]);
+		round->Result.EncodeUs = EventLoop::NowUs() - round->StartUs;
+		_loop.Post([this, lifetime, round]()
+		{
+			if (!lifetime.expired())
+				Dispatch(round);
+		});
+		return;
+	}
+
+	// Counted before they are posted, so that WaitForEncodes cannot miss one.
+	round->Encoding.store(_clients.size(), std::memory_order_relaxed);
+	{
+		std::lock_guard<std::mutex> guard(_encodeLock);
+		_pendingEncodes += _clients.size();
+	}
+	for (size_t i = 0; i < _clients.size(); ++i)
+	{
+		_options.EncodePool->Post([this, round, i]()
+		{
+			Encode(round, i);
+			// Notified under the lock: once it is released, the fan-out may be destroyed.
+			std::lock_guard<std::mutex> guard(_encodeLock);
+			if (--_pendingEncodes == 0)
+				_encoded.notify_all();
+		});
+	}
+}
+
+void CompanionFanout::Encode(RoundRef round, size_t index)
+{
+	round->EncodeResults[index] = _clients[index]->Encode(round->Request, &round->Encoded[index]);
+
+	// The last target encoded hands the round to the loop; the counter orders the other workers' writes.
+	if (round->Encoding.fetch_sub(1, std::memory_order_acq_rel) == 1)
+	{
+		round->Result.EncodeUs = EventLoop::NowUs() - round->StartUs;
+		std::weak_ptr<bool> lifetime = _lifetime;
+		_loop.Post([this, lifetime, round]()
+		{
+			if (!lifetime.expired())
+				Dispatch(round);
+		});
+	}
+}
+
+void CompanionFanout::WaitForEncodes()
+{
+	std::unique_lock<std::mutex> guard(_encodeLock);
+	_encoded.wait(guard, [this]() { return _pendingEncodes == 0; });
+}
+
+void CompanionFanout::Dispatch(RoundRef round)
+{
+	UINT32 deadlineMs = _options.DeadlineMs;
+	UINT64 elapsedMs = (EventLoop::NowUs() - round->StartUs) / 1000;
+	deadlineMs = elapsedMs < deadlineMs ? deadlineMs - (UINT32)elapsedMs : 0;
+	std::weak_ptr<bool> lifetime = _lifetime;
+	round->TimerId = _loop.AddTimer(deadlineMs, [this, lifetime, round]()
+	{
+		round->TimerId = 0;
+		if (!lifetime.expired())
+			Finish(round);
+	});
+
+	for (size_t i = 0; i < _clients.size(); ++i)
+	{
+		if (round->EncodeResults[i] != COMPANION_OK)
+		{
+			CompanionResponse response;
+			response.Result = round->EncodeResults[i];
+			OnAnswer(round, i, response);
+			continue;
+		}
+
+		_clients[i]->SendEncodedAsync(round->Request, std::move(round->Encoded[i]), [this, round, i](CompanionResponse& response)
+		{
+			OnAnswer(round, i, response);
+		}, CompanionClient::IsIdempotent(round->Request));
+	}
+	round->Encoded.clear();
+}
+
+void CompanionFanout::OnAnswer(RoundRef round, size_t index, CompanionResponse& response)
+{
+	if (round->Finished || round->Answered[index])
+		return;
+
+	round->Answered[index] = true;
+	if (response.Result == COMPANION_OK)
+		round->Result.AnsweredUs[index] = EventLoop::NowUs() - round->StartUs;
+	round->Result.Responses[index] = std::move(response);
+
+	if (--round->Outstanding == 0)
+		Finish(round);
+}
+
+void CompanionFanout::Finish(RoundRef round)
+{
+	if (round->Finished)
+		return;
+	round->Finished = true;
+
+	if (round->TimerId != 0)
+		_loop.CancelTimer(round->TimerId);
+
+	CompanionFanoutResult& result = round->Result;
+	for (size_t i = 0; i < result.Responses.size(); ++i)
+	{
+		if (!round->Answered[i])
+			result.Responses[i].Result = COMPANION_E_TIMEOUT;
+
+		if (result.Responses[i].Result != COMPANION_OK)
+		{
+			++result.Failed;
+			continue;
+		}
+
+		UINT64 answeredUs = result.AnsweredUs[i];
+		if (result.Succeeded == 0 || answeredUs < result.FirstUs)
+			result.FirstUs = answeredUs;
+		if (answeredUs > result.LastUs)
+			result.LastUs = answeredUs;
+		++result.Succeeded;
+	}
+
+	if (round->Done)
+		round->Done(result);
+}
+
+void CompanionFanout::Shutdown()
+{
+	WaitForEncodes();
+	for (size_t i = 0; i < _clients.size(); ++i)
+		_clients[i]->Shutdown();
+}
@@ -0,0 +1,128 @@
+//--------------------------------------------------------------------------
+// <copyright file="CompanionFanout.h" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// Sends one command to many STBs at once.
+// </summary>
+//--------------------------------------------------------------------------
+
+/*
+ Using the fan-out:
+ Whole-home commands (power off, pause, tune) go to every STB in the home.  Sending them pairing by pairing
+ makes the last box react a full encode and round trip per box after the first.  CompanionFanout keeps a
+ CompanionClient per pairing, each with its own codec instance and sequence number, and sends one command
+ to all of them together:
+
+    CompanionFanout home(loop, pairings, options);
+    home.Open();
+    home.SendAsync("op=key&k=power", [](CompanionFanoutResult& result)
+    {
+        // result.Responses[i] belongs to pairings[i]; result.SpreadUs() is last minus first answer
+    });
+
+ The command is encoded for every target first, in parallel on EncodePool when one is given, and only then
+ are the requests handed to the clients in one pass on the loop thread, so the STBs see them as close
+ together as the network allows.  Targets that have not answered when DeadlineMs expires are reported as
+ COMPANION_E_TIMEOUT and the result is delivered; their requests still complete, unseen, on the clients.
+
+ Shutdown and the destructor wait for targets still being encoded on EncodePool, and work the fan-out has
+ posted to the loop is dropped once it is destroyed.  Destroy it on the loop thread, after Shutdown.
+ */
+
+#ifndef COMPANIONFANOUT_H
+#define COMPANIONFANOUT_H
+
+#include "CompanionClient.h"
+#include "CompanionWorkerPool.h"
+
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct CompanionFanoutOptions
+{
+	CompanionClientOptions Client;      // for every target's client
+	CompanionWorkerPool*   EncodePool;  // opens and encodes for the targets in parallel; NULL uses the calling thread
+	UINT32                 DeadlineMs;  // for the whole fan-out, from SendAsync
+
+	CompanionFanoutOptions() : EncodePool(NULL), DeadlineMs(3000) {}
+};
+
+struct CompanionFanoutResult
+{
+	std::vector<CompanionResponse> Responses;   // in pairing order
+	std::vector<UINT64>            AnsweredUs;  // from SendAsync to each successful answer; 0 if none
+	UINT32                         Succeeded;
+	UINT32                         Failed;      // including targets past the deadline
+	UINT64                         EncodeUs;    // from SendAsync until every target was encoded
+	UINT64                         FirstUs;     // earliest successful answer, from SendAsync
+	UINT64                         LastUs;      // latest successful answer, from SendAsync
+
+	CompanionFanoutResult() : Succeeded(0), Failed(0), EncodeUs(0), FirstUs(0), LastUs(0) {}
+
+	/// <summary>
+	/// How long after the first STB answered the last one did.
+	/// </summary>
+	UINT64 SpreadUs() const { return LastUs - FirstUs; }
+};
+
+class CompanionFanout
+{
+public:
+
+	typedef std::function<void(CompanionFanoutResult&)> Completion;
+
+	CompanionFanout(EventLoop& loop, const std::vector<CompanionPairingInfo>& pairings, const CompanionFanoutOptions& options = CompanionFanoutOptions());
+
+	/// <summary>
+	/// Waits for targets still being encoded on EncodePool.
+	/// </summary>
+	~CompanionFanout();
+
+	/// <summary>
+	/// Open every target.  Returns the first failure; targets that did not open fail every command.
+	/// </summary>
+	COMPANION_RESULT Open();
+
+	/// <summary>
+	/// Send request to every target and call done on the loop thread with all results.  Safe to call from
+	/// any thread.
+	/// </summary>
+	void SendAsync(std::string request, Completion done);
+
+	/// <summary>
+	/// Wait for pending encodes and shut down every target's client.  Must be called on the loop thread.
+	/// </summary>
+	void Shutdown();
+
+	size_t Targets() const { return _clients.size(); }
+	CompanionClient& Target(size_t index) { return *_clients[index]; }
+
+private:
+
+	CompanionFanout(const CompanionFanout&) = delete;
+	CompanionFanout& operator=(const CompanionFanout&) = delete;
+
+	struct Round;
+	typedef std::shared_ptr<Round> RoundRef;
+
+	void Encode(RoundRef round, size_t index);
+	void WaitForEncodes();
+	void Dispatch(RoundRef round);
+	void OnAnswer(RoundRef round, size_t index, CompanionResponse& response);
+	void Finish(RoundRef round);
+
+	EventLoop&                                    _loop;
+	CompanionFanoutOptions                        _options;
+	std::vector<std::unique_ptr<CompanionClient>> _clients;
+	std::mutex                                    _encodeLock;
+	std::condition_variable                       _encoded;
+	size_t                                        _pendingEncodes;    // Encode tasks posted to EncodePool and not yet done
+	std::shared_ptr<bool>                         _lifetime;          // lets loop callbacks outlive the fan-out
+};
+
+#endif
@@ -0,0 +1,80 @@
+//--------------------------------------------------------------------------
+// <copyright file="CompanionRemote.cpp" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// Remote-control front end: schedules key commands in front of a companion client.
+// </summary>
+//--------------------------------------------------------------------------
+
+#include "CompanionRemote.h"
+
+// A dispatched command whose presses are in flight.
+struct CompanionRemote::Presses
+{
+	Command           Item;
+	UINT32            Remaining;
+	CompanionResponse Response;     // the first failure, or else the latest answer
+};
+
+CompanionRemote::CompanionRemote(CompanionClient& client, const CommandSchedulerOptions& options)
+	: _client(client),
+	  _scheduler(options,
+	             [this](Command& command) { OnCommand(command); },
+	             [this]() { _client.Loop().Post([this]() { _scheduler.Pump(); }); }),
+	  _presses(0), _requests(0)
+{
+}
+
+void CompanionRemote::Press(const std::string& request)
+{
+	_scheduler.Submit(request);
+}
+
+void CompanionRemote::Submit(const std::string& request, CommandPriority priority, bool repeatable, UINT32 deadlineMs)
+{
+	_scheduler.Submit(request, priority, repeatable, deadlineMs);
+}
+
+CompanionRemoteStats CompanionRemote::Stats() const
+{
+	CompanionRemoteStats stats;
+	stats.Scheduler = _scheduler.Stats();
+	stats.Presses = _presses.load(std::memory_order_relaxed);
+	stats.Requests = _requests.load(std::memory_order_relaxed);
+	stats.RequestsSaved = stats.Presses > stats.Requests ? stats.Presses - stats.Requests : 0;
+	return stats;
+}
+
+void CompanionRemote::OnCommand(Command& command)
+{
+	// The scheduler already limits what is outstanding, so the client queue stays short and priority holds.
+	// Every press goes to the client now, so the repeats are pipelined instead of each waiting a round trip.
+	std::shared_ptr<Presses> presses = std::make_shared<Presses>();
+	presses->Item = command;
+	presses->Remaining = command.Coalesced + 1;
+	presses->Response.Result = COMPANION_OK;
+	_presses.fetch_add(presses->Remaining, std::memory_order_relaxed);
+
+	UINT32 count = presses->Remaining;
+	for (UINT32 i = 0; i < count; ++i)
+	{
+		_requests.fetch_add(1, std::memory_order_relaxed);
+		_client.SendAsync(command.Request, [this, presses](CompanionResponse& response)
+		{
+			OnPress(presses, response);
+		}, command.Idempotent);
+	}
+}
+
+void CompanionRemote::OnPress(const std::shared_ptr<Presses>& presses, CompanionResponse& response)
+{
+	if (presses->Response.Result == COMPANION_OK)
+		presses->Response = std::move(response);
+	if (--presses->Remaining != 0)
+		return;
+
+	if (_observer)
+		_observer(presses->Item, presses->Response);
+	_scheduler.Completed();
+}
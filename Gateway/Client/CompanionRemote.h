@@ -0,0 +1,94 @@
+//--------------------------------------------------------------------------
+// <copyright file="CompanionRemote.h" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// Remote-control front end: schedules key commands in front of a companion client.
+// </summary>
+//--------------------------------------------------------------------------
+
+/*
+ Using the remote:
+ Held volume and channel keys produce a burst of identical requests.  Sent straight to CompanionClient they
+ queue behind slow responses; CompanionRemote passes them through a CommandScheduler first, so power and
+ stop overtake navigation, repeats inside the coalescing window travel as one command and commands that
+ waited past their deadline are dropped instead of being sent late.  The protocol has no repeat count, so a
+ command that absorbed repeats still costs one request per press, so that the STB steps as far as the keys
+ were pressed.  Those requests are handed to the client together, to be pipelined, and the command
+ completes when the last of them has answered.  Coalescing therefore saves scheduler slots and round trips
+ rather than requests; Stats reports the requests actually sent and saved.
+
+    CompanionRemote remote(stb);
+    remote.Press("op=key&k=volup");     // any thread
+
+ The remote must outlive the commands it has dispatched; destroy it after the client's Shutdown.
+ */
+
+#ifndef COMPANIONREMOTE_H
+#define COMPANIONREMOTE_H
+
+#include "CommandScheduler.h"
+#include "CompanionClient.h"
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+
+struct CompanionRemoteStats
+{
+	CommandSchedulerStats Scheduler;
+	UINT64                Presses;          // carried by dispatched commands, including coalesced repeats
+	UINT64                Requests;         // sent to the client for them
+	UINT64                RequestsSaved;    // presses that did not need a request of their own
+
+	CompanionRemoteStats() : Presses(0), Requests(0), RequestsSaved(0) {}
+};
+
+class CompanionRemote
+{
+public:
+
+	typedef std::function<void(const Command&, CompanionResponse&)> Observer;
+
+	CompanionRemote(CompanionClient& client, const CommandSchedulerOptions& options = CommandSchedulerOptions());
+
+	/// <summary>
+	/// Queue a request, classified by CommandScheduler::Classify.  Safe to call from any thread.
+	/// </summary>
+	void Press(const std::string& request);
+
+	/// <summary>
+	/// Queue a request with an explicit priority.  Safe to call from any thread.
+	/// </summary>
+	void Submit(const std::string& request, CommandPriority priority, bool repeatable, UINT32 deadlineMs = 0);
+
+	/// <summary>
+	/// Called on the loop thread for every command that was sent once all its presses have answered, with
+	/// the first failed response, or the last response if none failed.
+	/// </summary>
+	void SetObserver(Observer observer) { _observer = observer; }
+
+	/// <summary>
+	/// Safe to call from any thread.
+	/// </summary>
+	CompanionRemoteStats Stats() const;
+
+private:
+
+	CompanionRemote(const CompanionRemote&) = delete;
+	CompanionRemote& operator=(const CompanionRemote&) = delete;
+
+	struct Presses;
+
+	void OnCommand(Command& command);
+	void OnPress(const std::shared_ptr<Presses>& presses, CompanionResponse& response);
+
+	CompanionClient&    _client;
+	CommandScheduler    _scheduler;
+	Observer            _observer;
+	std::atomic<UINT64> _presses;
+	std::atomic<UINT64> _requests;
+};
+
+#endif
@@ -0,0 +1,159 @@
+//--------------------------------------------------------------------------
+// <copyright file="CompanionTask.h" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// Minimal C++20 coroutine task used by the companion client.
+// </summary>
+//--------------------------------------------------------------------------
+
+/*
+ A CompanionTask<T> is lazy: it starts when it is awaited, or when it is handed to Spawn.
+ Awaiting a task resumes the awaiting coroutine with symmetric transfer once the task completes,
+ so chains of co_await do not grow the stack.  Spawn starts a task detached on an event loop
+ thread; the task frame frees itself when it finishes.
+ */
+
+#ifndef COMPANIONTASK_H
+#define COMPANIONTASK_H
+
+#include "EventLoop.h"
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <utility>
+
+template <typename T> class CompanionTask;
+
+namespace CompanionTaskDetail
+{
+	struct FinalAwaiter
+	{
+		bool await_ready() const noexcept { return false; }
+
+		template <typename Promise>
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept
+		{
+			Promise& promise = handle.promise();
+			if (promise.Continuation)
+				return promise.Continuation;
+			if (promise.Detached)
+				handle.destroy();
+			return std::noop_coroutine();
+		}
+
+		void await_resume() const noexcept {}
+	};
+
+	struct PromiseBase
+	{
+		std::coroutine_handle<> Continuation;
+		bool                    Detached = false;
+
+		std::suspend_always initial_suspend() const noexcept { return {}; }
+		FinalAwaiter final_suspend() const noexcept { return {}; }
+		void unhandled_exception() { std::terminate(); }
+	};
+}
+
+template <typename T>
+class CompanionTask
+{
+public:
+
+	struct promise_type : CompanionTaskDetail::PromiseBase
+	{
+		std::optional<T> Value;
+
+		CompanionTask get_return_object() { return CompanionTask(std::coroutine_handle<promise_type>::from_promise(*this)); }
+		template <typename U> void return_value(U&& value) { Value.emplace(std::forward<U>(value)); }
+	};
+
+	CompanionTask(CompanionTask&& other) noexcept : _handle(std::exchange(other._handle, nullptr)) {}
+	~CompanionTask() { if (_handle) _handle.destroy(); }
+
+	bool await_ready() const noexcept { return !_handle || _handle.done(); }
+
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+	{
+		_handle.promise().Continuation = awaiting;
+		return _handle;
+	}
+
+	T await_resume() { return std::move(*_handle.promise().Value); }
+
+	/// <summary>
+	/// Give up ownership so that the frame frees itself at completion, and start it.
+	/// </summary>
+	void Detach()
+	{
+		std::coroutine_handle<promise_type> handle = std::exchange(_handle, nullptr);
+		handle.promise().Detached = true;
+		handle.resume();
+	}
+
+private:
+
+	explicit CompanionTask(std::coroutine_handle<promise_type> handle) : _handle(handle) {}
+	CompanionTask(const CompanionTask&) = delete;
+	CompanionTask& operator=(const CompanionTask&) = delete;
+
+	std::coroutine_handle<promise_type> _handle;
+};
+
+template <>
+class CompanionTask<void>
+{
+public:
+
+	struct promise_type : CompanionTaskDetail::PromiseBase
+	{
+		CompanionTask get_return_object() { return CompanionTask(std::coroutine_handle<promise_type>::from_promise(*this)); }
+		void return_void() {}
+	};
+
+	CompanionTask(CompanionTask&& other) noexcept : _handle(std::exchange(other._handle, nullptr)) {}
+	~CompanionTask() { if (_handle) _handle.destroy(); }
+
+	bool await_ready() const noexcept { return !_handle || _handle.done(); }
+
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+	{
+		_handle.promise().Continuation = awaiting;
+		return _handle;
+	}
+
+	void await_resume() {}
+
+	void Detach()
+	{
+		std::coroutine_handle<promise_type> handle = std::exchange(_handle, nullptr);
+		handle.promise().Detached = true;
+		handle.resume();
+	}
+
+private:
+
+	explicit CompanionTask(std::coroutine_handle<promise_type> handle) : _handle(handle) {}
+	CompanionTask(const CompanionTask&) = delete;
+	CompanionTask& operator=(const CompanionTask&) = delete;
+
+	std::coroutine_handle<promise_type> _handle;
+};
+
+/// <summary>
+/// Start a task detached on the loop thread.  Safe to call from any thread.
+/// </summary>
+template <typename T>
+void Spawn(EventLoop& loop, CompanionTask<T> task)
+{
+	CompanionTask<T>* moved = new CompanionTask<T>(std::move(task));
+	loop.Post([moved]()
+	{
+		moved->Detach();
+		delete moved;
+	});
+}
+
+#endif
@@ -0,0 +1,597 @@
+//--------------------------------------------------------------------------
+// <copyright file="CompanionDaemon.cpp" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// Local command API that shares one companion session per STB between processes.
+// </summary>
+//--------------------------------------------------------------------------
+
+#include "CompanionDaemon.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static const size_t ReadChunkSize = 16384;
+static const size_t MaxHeadLength = 16384;
+static const size_t MaxBodyLength = 65536;
+
+static const UINT32 BucketBoundsMs[LatencyHistogram::BucketCount - 1] = { 1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 10000 };
+
+static void AppendFormat(std::string& out, const char* format, ...)
+{
+	char line[512];
+	va_list args;
+	va_start(args, format);
+	int length = vsnprintf(line, sizeof(line), format, args);
+	va_end(args);
+	if (length > 0)
+		out.append(line, (size_t)length < sizeof(line) ? (size_t)length : sizeof(line) - 1);
+}
+
+static std::string Reply(int status, const char* reason, const char* contentType, const std::string& body, const std::string& extraHeaders = std::string())
+{
+	std::string reply;
+	AppendFormat(reply, "HTTP/1.1 %d %s\r\nContent-Length: %zu\r\nContent-Type: %s\r\n", status, reason, body.length(), contentType);
+	reply += extraHeaders;
+	reply += "\r\n";
+	reply += body;
+	return reply;
+}
+
+static std::string ErrorReply(int status, const char* reason)
+{
+	return Reply(status, reason, "text/plain", std::string(reason) + "\n");
+}
+
+/// <summary>
+/// The local answer to a request the STB client completed.
+/// </summary>
+static std::string StbReply(const CompanionResponse& response)
+{
+	std::string headers;
+	if (response.Result == COMPANION_OK)
+	{
+		AppendFormat(headers, "X-Companion-Seq: %u\r\nX-Companion-Latency-Us: %llu\r\n", response.SeqNum, (unsigned long long)response.LatencyUs);
+		return Reply(200, "OK", "text/xml", response.Body, headers);
+	}
+
+	AppendFormat(headers, "X-Companion-Result: %ld\r\n", (long)response.Result);
+	if (response.HttpStatus != 0)
+		AppendFormat(headers, "X-Companion-Http-Status: %d\r\n", response.HttpStatus);
+
+	std::string body;
+	AppendFormat(body, "companion result %ld\n", (long)response.Result);
+	switch (response.Result)
+	{
+	case COMPANION_E_TIMEOUT:
+		return Reply(504, "Gateway Timeout", "text/plain", body, headers);
+	case COMPANION_E_CANCELLED:
+		return Reply(503, "Service Unavailable", "text/plain", body, headers);
+	default:
+		return Reply(502, "Bad Gateway", "text/plain", body, headers);
+	}
+}
+
+//------------------------------------------------------------------------------------------------------
+
+LatencyHistogram::LatencyHistogram() : _count(0), _sumUs(0)
+{
+	memset(_buckets, 0, sizeof(_buckets));
+}
+
+void LatencyHistogram::Add(UINT64 latencyUs)
+{
+	size_t i = 0;
+	while (i < BucketCount - 1 && latencyUs > (UINT64)BucketBoundsMs[i] * 1000)
+		++i;
+	++_buckets[i];
+	++_count;
+	_sumUs += latencyUs;
+}
+
+UINT32 LatencyHistogram::BoundMs(size_t i)
+{
+	return i < BucketCount - 1 ? BucketBoundsMs[i] : 0;
+}
+
+UINT32 LatencyHistogram::PercentileMs(UINT32 percentile) const
+{
+	if (_count == 0)
+		return 0;
+
+	UINT64 wanted = (_count * percentile + 99) / 100;
+	UINT64 seen = 0;
+	for (size_t i = 0; i < BucketCount - 1; ++i)
+	{
+		seen += _buckets[i];
+		if (seen >= wanted)
+			return BucketBoundsMs[i];
+	}
+	return BucketBoundsMs[BucketCount - 2];
+}
+
+//------------------------------------------------------------------------------------------------------
+
+CompanionDaemon::CompanionDaemon(EventLoop& loop, const CompanionDaemonOptions& options)
+	: _loop(loop), _options(options), _unixFd(-1), _tcpFd(-1), _port(0), _startUs(EventLoop::NowUs())
+{
+}
+
+CompanionDaemon::~CompanionDaemon()
+{
+	Stop();
+}
+
+COMPANION_RESULT CompanionDaemon::AddStb(const std::string& name, const CompanionPairingInfo& pairing, const std::string& targetUsn)
+{
+	// Names appear in paths and metric labels unescaped.
+	if (name.empty() || name.find_first_of("/?\"\\ \t\r\n") != std::string::npos)
+		return COMPANION_FAIL;
+	if (_stbs.find(name) != _stbs.end())
+		return COMPANION_E_DUPLICATE;
+
+	CompanionClientOptions clientOptions = _options.Client;
+	if (!targetUsn.empty())
+		clientOptions.TargetUsn = targetUsn;
+	else
+		clientOptions.Discovery = NULL;
+
+	std::unique_ptr<CompanionClient> client(new CompanionClient(_loop, pairing, clientOptions));
+	COMPANION_RESULT result = client->Open();
+	if (result != COMPANION_OK)
+		return result;
+
+	_stbs[name].Client = std::move(client);
+	return COMPANION_OK;
+}
+
+COMPANION_RESULT CompanionDaemon::Start()
+{
+	if (!_options.SocketPath.empty())
+	{
+		struct sockaddr_un addr = {};
+		addr.sun_family = AF_UNIX;
+		if (_options.SocketPath.length() >= sizeof(addr.sun_path))
+			return COMPANION_E_CONNECTION;
+		memcpy(addr.sun_path, _options.SocketPath.c_str(), _options.SocketPath.length() + 1);
+
+		// A socket left behind by an earlier run; anything else at the path is not ours to remove.
+		struct stat existing;
+		if (lstat(addr.sun_path, &existing) == 0 && S_ISSOCK(existing.st_mode))
+			unlink(addr.sun_path);
+
+		_unixFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (Listen(_unixFd, (struct sockaddr*)&addr, sizeof(addr)) != COMPANION_OK)
+		{
+			_unixFd = -1;
+			return COMPANION_E_CONNECTION;
+		}
+		chmod(addr.sun_path, 0660);
+	}
+
+	if (_options.ListenPort != 0)
+	{
+		struct sockaddr_in addr = {};
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(_options.ListenPort);
+		if (inet_pton(AF_INET, _options.ListenAddress.c_str(), &addr.sin_addr) != 1)
+			return COMPANION_E_CONNECTION;
+
+		_tcpFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		int one = 1;
+		if (_tcpFd >= 0)
+			setsockopt(_tcpFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (Listen(_tcpFd, (struct sockaddr*)&addr, sizeof(addr)) != COMPANION_OK)
+		{
+			_tcpFd = -1;
+			return COMPANION_E_CONNECTION;
+		}
+
+		socklen_t length = sizeof(addr);
+		getsockname(_tcpFd, (struct sockaddr*)&addr, &length);
+		_port = ntohs(addr.sin_port);
+	}
+
+	_startUs = EventLoop::NowUs();
+	return COMPANION_OK;
+}
+
+COMPANION_RESULT CompanionDaemon::Listen(int fd, const struct sockaddr* addr, socklen_t length)
+{
+	if (fd < 0)
+		return COMPANION_E_CONNECTION;
+
+	if (bind(fd, addr, length) != 0
+		|| listen(fd, 128) != 0
+		|| !_loop.Watch(fd, EPOLLIN, [this, fd](UINT32) { OnAccept(fd); }))
+	{
+		close(fd);
+		return COMPANION_E_CONNECTION;
+	}
+	return COMPANION_OK;
+}
+
+void CompanionDaemon::Stop()
+{
+	if (_unixFd >= 0)
+	{
+		_loop.Unwatch(_unixFd);
+		close(_unixFd);
+		_unixFd = -1;
+		unlink(_options.SocketPath.c_str());
+	}
+	if (_tcpFd >= 0)
+	{
+		_loop.Unwatch(_tcpFd);
+		close(_tcpFd);
+		_tcpFd = -1;
+	}
+
+	std::unordered_map<int, ConnectionRef> connections;
+	connections.swap(_connections);
+	for (std::unordered_map<int, ConnectionRef>::iterator it = connections.begin(); it != connections.end(); ++it)
+		Close(it->second);
+
+	// Their completions find the connections closed and only count.
+	for (std::map<std::string, StbEntry>::iterator it = _stbs.begin(); it != _stbs.end(); ++it)
+		it->second.Client->Shutdown();
+}
+
+CompanionClient* CompanionDaemon::Stb(const std::string& name)
+{
+	std::map<std::string, StbEntry>::iterator it = _stbs.find(name);
+	return it != _stbs.end() ? it->second.Client.get() : NULL;
+}
+
+const CompanionStbMetrics* CompanionDaemon::Metrics(const std::string& name) const
+{
+	std::map<std::string, StbEntry>::const_iterator it = _stbs.find(name);
+	return it != _stbs.end() ? &it->second.Metrics : NULL;
+}
+
+void CompanionDaemon::OnAccept(int listenFd)
+{
+	for (;;)
+	{
+		int fd = accept4(listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+
+		if (_connections.size() >= _options.MaxConnections)
+		{
+			++_stats.Refused;
+			close(fd);
+			continue;
+		}
+
+		ConnectionRef connection = std::make_shared<Connection>();
+		connection->Fd = fd;
+		if (!_loop.Watch(fd, EPOLLIN | EPOLLRDHUP, [this, connection](UINT32 events) { OnEvents(connection, events); }))
+		{
+			close(fd);
+			continue;
+		}
+
+		_connections[fd] = connection;
+		++_stats.Connections;
+	}
+}
+
+void CompanionDaemon::OnEvents(ConnectionRef connection, UINT32 events)
+{
+	if ((events & EPOLLOUT) && connection->Fd >= 0)
+		Flush(connection);
+
+	if ((events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) && connection->Fd >= 0 && !OnReadable(connection))
+	{
+		_connections.erase(connection->Fd);
+		Close(connection);
+	}
+}
+
+bool CompanionDaemon::OnReadable(ConnectionRef connection)
+{
+	char buffer[ReadChunkSize];
+	for (;;)
+	{
+		ssize_t received = recv(connection->Fd, buffer, sizeof(buffer), 0);
+		if (received < 0)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		if (received == 0)
+			return false;
+
+		// Requests are taken as they arrive, so In never holds more than the one not yet complete, and a
+		// head over MaxHeadLength is refused before any more is read.
+		connection->In.append(buffer, (size_t)received);
+		bool complete = true;
+		while (complete)
+		{
+			if (!TakeRequest(connection, &complete))
+				return false;
+		}
+		if (connection->Fd < 0)
+			break;
+	}
+	return true;
+}
+
+bool CompanionDaemon::TakeRequest(ConnectionRef connection, bool* complete)
+{
+	*complete = false;
+
+	std::string& in = connection->In;
+	HttpRequestHead head;
+	bool headComplete = false;
+	if (!ParseHttpRequestHead(in.data(), in.length(), MaxHeadLength, MaxBodyLength, &head, &headComplete))
+	{
+		++_stats.BadRequests;
+		return false;
+	}
+	if (!headComplete || in.length() < head.HeadLength + head.ContentLength)
+		return true;
+
+	std::string method = in.substr(0, head.MethodLength);
+	std::string target = in.substr(head.TargetOffset, head.TargetLength);
+	std::string body = in.substr(head.HeadLength, head.ContentLength);
+	in.erase(0, head.HeadLength + head.ContentLength);
+
+	OnRequest(connection, method, target, body);
+	*complete = connection->Fd >= 0;
+	return true;
+}
+
+void CompanionDaemon::OnRequest(ConnectionRef connection, const std::string& method, const std::string& target, std::string& body)
+{
+	++_stats.Requests;
+
+	// Reserve the answer's place first: the STB's answer may come after those to later requests.
+	UINT64 answerId = connection->FrontId + connection->Answers.size();
+	Answer answer;
+	answer.Ready = false;
+	connection->Answers.push_back(std::move(answer));
+
+	std::string path = target.substr(0, target.find('?'));
+	if (path == "/metrics" || path == "/stb" || path == "/stb/")
+	{
+		if (method != "GET")
+		{
+			SetAnswer(connection, answerId, ErrorReply(405, "Method Not Allowed"));
+			return;
+		}
+		SetAnswer(connection, answerId, path == "/metrics" ? Reply(200, "OK", "text/plain; version=0.0.4", FormatMetrics()) : Reply(200, "OK", "text/plain", ListStbs()));
+		return;
+	}
+
+	if (path.compare(0, 5, "/stb/") == 0)
+	{
+		if (method != "POST")
+		{
+			SetAnswer(connection, answerId, ErrorReply(405, "Method Not Allowed"));
+			return;
+		}
+		OnStbRequest(connection, answerId, path.substr(5), body);
+		return;
+	}
+
+	++_stats.BadRequests;
+	SetAnswer(connection, answerId, ErrorReply(404, "Not Found"));
+}
+
+void CompanionDaemon::OnStbRequest(ConnectionRef connection, UINT64 answerId, const std::string& name, std::string& body)
+{
+	std::map<std::string, StbEntry>::iterator it = _stbs.find(name);
+	if (it == _stbs.end())
+	{
+		SetAnswer(connection, answerId, ErrorReply(404, "Not Found"));
+		return;
+	}
+	if (body.empty())
+	{
+		++_stats.BadRequests;
+		SetAnswer(connection, answerId, ErrorReply(400, "Bad Request"));
+		return;
+	}
+
+	StbEntry* entry = &it->second;
+	if (entry->Client->Queued() >= _options.MaxQueuedPerStb)
+	{
+		++entry->Metrics.Rejected;
+		SetAnswer(connection, answerId, ErrorReply(503, "Service Unavailable"));
+		return;
+	}
+
+	++entry->Metrics.Requests;
+	entry->Metrics.BytesIn += body.length();
+
+	// std::map entries do not move, and Stop completes everything before the daemon goes away.
+	UINT64 arrivedUs = EventLoop::NowUs();
+	entry->Client->SendAsync(std::move(body), [this, connection, answerId, entry, arrivedUs](CompanionResponse& response)
+	{
+		CompanionStbMetrics& metrics = entry->Metrics;
+		if (response.Result == COMPANION_OK)
+		{
+			++metrics.Succeeded;
+			metrics.BytesOut += response.Body.length();
+			metrics.Latency.Add(EventLoop::NowUs() - arrivedUs);
+		}
+		else if (response.Result == COMPANION_E_TIMEOUT)
+			++metrics.TimedOut;
+		else
+			++metrics.Failed;
+
+		if (connection->Fd >= 0)
+			SetAnswer(connection, answerId, StbReply(response));
+	});
+}
+
+std::string CompanionDaemon::ListStbs() const
+{
+	std::string list;
+	for (std::map<std::string, StbEntry>::const_iterator it = _stbs.begin(); it != _stbs.end(); ++it)
+	{
+		const CompanionClient& client = *it->second.Client;
+		const LatencyHistogram& latency = it->second.Metrics.Latency;
+		AppendFormat(list, "%s %s inflight=%zu queued=%zu p50<=%ums p99<=%ums\n", it->first.c_str(), client.TargetAddress().c_str(),
+			client.InFlight(), client.Queued(), latency.PercentileMs(50), latency.PercentileMs(99));
+	}
+	return list;
+}
+
+std::string CompanionDaemon::FormatMetrics() const
+{
+	struct Counter
+	{
+		const char* Name;
+		const char* Help;
+		UINT64 CompanionStbMetrics::* Field;
+	};
+	static const Counter Counters[] =
+	{
+		{ "companion_requests_total", "Requests accepted for the STB.", &CompanionStbMetrics::Requests },
+		{ "companion_succeeded_total", "Requests the STB answered.", &CompanionStbMetrics::Succeeded },
+		{ "companion_timeouts_total", "Requests that timed out.", &CompanionStbMetrics::TimedOut },
+		{ "companion_failed_total", "Requests that failed otherwise.", &CompanionStbMetrics::Failed },
+		{ "companion_rejected_total", "Requests refused because the STB queue was full.", &CompanionStbMetrics::Rejected },
+		{ "companion_request_bytes_total", "Plain request bytes.", &CompanionStbMetrics::BytesIn },
+		{ "companion_response_bytes_total", "Decoded response bytes.", &CompanionStbMetrics::BytesOut },
+	};
+
+	std::string out;
+	for (size_t c = 0; c < sizeof(Counters) / sizeof(Counters[0]); ++c)
+	{
+		AppendFormat(out, "# HELP %s %s\n# TYPE %s counter\n", Counters[c].Name, Counters[c].Help, Counters[c].Name);
+		for (std::map<std::string, StbEntry>::const_iterator it = _stbs.begin(); it != _stbs.end(); ++it)
+			AppendFormat(out, "%s{stb=\"%s\"} %llu\n", Counters[c].Name, it->first.c_str(), (unsigned long long)(it->second.Metrics.*Counters[c].Field));
+	}
+
+	out += "# HELP companion_request_duration_seconds Time from arrival to answer of successful requests.\n"
+		"# TYPE companion_request_duration_seconds histogram\n";
+	for (std::map<std::string, StbEntry>::const_iterator it = _stbs.begin(); it != _stbs.end(); ++it)
+	{
+		const LatencyHistogram& latency = it->second.Metrics.Latency;
+		UINT64 cumulative = 0;
+		for (size_t i = 0; i < LatencyHistogram::BucketCount; ++i)
+		{
+			cumulative += latency.Bucket(i);
+			if (i < LatencyHistogram::BucketCount - 1)
+				AppendFormat(out, "companion_request_duration_seconds_bucket{stb=\"%s\",le=\"%g\"} %llu\n", it->first.c_str(),
+					LatencyHistogram::BoundMs(i) / 1000.0, (unsigned long long)cumulative);
+			else
+				AppendFormat(out, "companion_request_duration_seconds_bucket{stb=\"%s\",le=\"+Inf\"} %llu\n", it->first.c_str(), (unsigned long long)cumulative);
+		}
+		AppendFormat(out, "companion_request_duration_seconds_sum{stb=\"%s\"} %.6f\n", it->first.c_str(), latency.SumUs() / 1e6);
+		AppendFormat(out, "companion_request_duration_seconds_count{stb=\"%s\"} %llu\n", it->first.c_str(), (unsigned long long)latency.Count());
+	}
+
+	out += "# HELP companion_inflight Requests sent to the STB and not yet answered.\n# TYPE companion_inflight gauge\n";
+	for (std::map<std::string, StbEntry>::const_iterator it = _stbs.begin(); it != _stbs.end(); ++it)
+		AppendFormat(out, "companion_inflight{stb=\"%s\"} %zu\n", it->first.c_str(), it->second.Client->InFlight());
+
+	out += "# HELP companion_queued Requests waiting for the sequence window or a connection.\n# TYPE companion_queued gauge\n";
+	for (std::map<std::string, StbEntry>::const_iterator it = _stbs.begin(); it != _stbs.end(); ++it)
+		AppendFormat(out, "companion_queued{stb=\"%s\"} %zu\n", it->first.c_str(), it->second.Client->Queued());
+
+	out += "# HELP companion_sequence Current sequence number.\n# TYPE companion_sequence gauge\n";
+	for (std::map<std::string, StbEntry>::const_iterator it = _stbs.begin(); it != _stbs.end(); ++it)
+		AppendFormat(out, "companion_sequence{stb=\"%s\"} %u\n", it->first.c_str(), it->second.Client->Sequence().Current());
+
+	out += "# HELP companion_attempts_total Requests written to the STB, including hedges and retries.\n# TYPE companion_attempts_total counter\n";
+	for (std::map<std::string, StbEntry>::const_iterator it = _stbs.begin(); it != _stbs.end(); ++it)
+	{
+		const CompanionClientStats& stats = it->second.Client->Stats();
+		AppendFormat(out, "companion_attempts_total{stb=\"%s\",kind=\"all\"} %llu\n", it->first.c_str(), (unsigned long long)stats.Sent);
+		AppendFormat(out, "companion_attempts_total{stb=\"%s\",kind=\"hedge\"} %llu\n", it->first.c_str(), (unsigned long long)stats.Hedges);
+		AppendFormat(out, "companion_attempts_total{stb=\"%s\",kind=\"retry\"} %llu\n", it->first.c_str(), (unsigned long long)stats.Retries);
+	}
+
+	AppendFormat(out, "# HELP companion_daemon_connections_total Local connections accepted.\n# TYPE companion_daemon_connections_total counter\n"
+		"companion_daemon_connections_total %llu\n", (unsigned long long)_stats.Connections);
+	AppendFormat(out, "# HELP companion_daemon_connections Local connections open.\n# TYPE companion_daemon_connections gauge\n"
+		"companion_daemon_connections %zu\n", _connections.size());
+	AppendFormat(out, "# HELP companion_daemon_requests_total API requests of every kind.\n# TYPE companion_daemon_requests_total counter\n"
+		"companion_daemon_requests_total %llu\n", (unsigned long long)_stats.Requests);
+	AppendFormat(out, "# HELP companion_daemon_bad_requests_total Malformed or unknown API requests.\n# TYPE companion_daemon_bad_requests_total counter\n"
+		"companion_daemon_bad_requests_total %llu\n", (unsigned long long)_stats.BadRequests);
+	AppendFormat(out, "# HELP companion_daemon_uptime_seconds Time since Start.\n# TYPE companion_daemon_uptime_seconds gauge\n"
+		"companion_daemon_uptime_seconds %.3f\n", (EventLoop::NowUs() - _startUs) / 1e6);
+	return out;
+}
+
+void CompanionDaemon::SetAnswer(ConnectionRef connection, UINT64 answerId, std::string bytes)
+{
+	Answer& answer = connection->Answers[answerId - connection->FrontId];
+	answer.Bytes = std::move(bytes);
+	answer.Ready = true;
+
+	// Answers go out in request order, so a ready one may still wait for those ahead of it.
+	while (!connection->Answers.empty() && connection->Answers.front().Ready)
+	{
+		connection->Out += connection->Answers.front().Bytes;
+		connection->Answers.pop_front();
+		++connection->FrontId;
+	}
+	Flush(connection);
+}
+
+void CompanionDaemon::Flush(ConnectionRef connection)
+{
+	while (connection->OutOffset < connection->Out.length())
+	{
+		ssize_t written = send(connection->Fd, connection->Out.data() + connection->OutOffset, connection->Out.length() - connection->OutOffset, MSG_NOSIGNAL);
+		if (written < 0)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			if (errno == EINTR)
+				continue;
+			_connections.erase(connection->Fd);
+			Close(connection);
+			return;
+		}
+		connection->OutOffset += (size_t)written;
+	}
+
+	if (connection->OutOffset == connection->Out.length())
+	{
+		connection->Out.clear();
+		connection->OutOffset = 0;
+	}
+
+	UINT32 events = EPOLLIN | EPOLLRDHUP;
+	if (!connection->Out.empty())
+		events |= EPOLLOUT;
+	_loop.Modify(connection->Fd, events);
+}
+
+void CompanionDaemon::Close(ConnectionRef connection)
+{
+	if (connection->Fd < 0)
+		return;
+
+	_loop.Unwatch(connection->Fd);
+	close(connection->Fd);
+	connection->Fd = -1;
+	connection->Answers.clear();
+	connection->Out.clear();
+}
@@ -0,0 +1,208 @@
+//--------------------------------------------------------------------------
+// <copyright file="CompanionDaemon.h" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// Local command API that shares one companion session per STB between processes.
+// </summary>
+//--------------------------------------------------------------------------
+
+/*
+ Using the companion daemon:
+ Every process that drives an STB through its own MRPairing/MRCompanion derives its own encryption state
+ and counts its own sequence numbers, so two of them on one STB push each other out of the sequence window.
+ CompanionDaemon owns one CompanionClient per STB - one CSParve64 state, one sequence, one connection
+ pool - and lets any number of local processes share it over HTTP/1.1 on a Unix socket (and optionally a
+ loopback TCP port):
+
+    POST /stb/<name>        body is the plain request, e.g. op=key&k=pause; the answer is the STB's
+                            decoded response, with its sequence number in X-Companion-Seq
+    GET  /stb               one line per STB: name, address, in flight, queued
+    GET  /metrics           counters and latency histograms in the Prometheus text format
+
+ A local connection may pipeline requests; their answers come back in request order.  Requests from all
+ connections go into the STB's client queue and are pipelined onto its connections as the sequence window
+ allows, so a burst from one process and a trickle from another share the STB fairly in arrival order.
+ Failures map onto HTTP statuses: 504 for a timeout, 502 for a connection or protocol failure, 503 when
+ more than MaxQueuedPerStb requests are already waiting, 404 for an STB the daemon does not know.
+
+ Everything runs on one EventLoop; the daemon must be started, used and stopped on its thread.  The STBs'
+ sequence numbers are the daemon's to persist (see companiond.cpp).
+ */
+
+#ifndef COMPANIONDAEMON_H
+#define COMPANIONDAEMON_H
+
+#include "CompanionClient.h"
+#include "EventLoop.h"
+
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#define COMPANION_DAEMON_SOCKET     "/run/companiond.sock"
+
+struct CompanionDaemonOptions
+{
+	std::string            SocketPath;          // Unix socket; empty disables
+	std::string            ListenAddress;       // TCP address, for processes that cannot use the socket
+	UINT16                 ListenPort;          // 0 disables TCP
+	UINT32                 MaxQueuedPerStb;     // waiting requests per STB before 503
+	UINT32                 MaxConnections;      // local connections
+	CompanionClientOptions Client;              // for every STB
+
+	CompanionDaemonOptions() : SocketPath(COMPANION_DAEMON_SOCKET), ListenAddress("127.0.0.1"), ListenPort(0), MaxQueuedPerStb(256), MaxConnections(256) {}
+};
+
+/// <summary>
+/// Cumulative latency histogram with fixed millisecond buckets.
+/// </summary>
+class LatencyHistogram
+{
+public:
+
+	static const size_t BucketCount = 14;
+
+	LatencyHistogram();
+
+	void Add(UINT64 latencyUs);
+
+	/// <summary>
+	/// Upper bound of bucket i in milliseconds; the last bucket has none.
+	/// </summary>
+	static UINT32 BoundMs(size_t i);
+
+	/// <summary>
+	/// Smallest bucket bound covering percentile of the samples, in milliseconds.
+	/// </summary>
+	UINT32 PercentileMs(UINT32 percentile) const;
+
+	UINT64 Count() const { return _count; }
+	UINT64 SumUs() const { return _sumUs; }
+	UINT64 Bucket(size_t i) const { return _buckets[i]; }
+
+private:
+
+	UINT64 _buckets[BucketCount];
+	UINT64 _count;
+	UINT64 _sumUs;
+};
+
+struct CompanionStbMetrics
+{
+	UINT64           Requests;
+	UINT64           Succeeded;
+	UINT64           TimedOut;
+	UINT64           Failed;            // any other failure
+	UINT64           Rejected;          // refused with 503 because the queue was full
+	UINT64           BytesIn;           // plain request bytes
+	UINT64           BytesOut;          // decoded response bytes
+	LatencyHistogram Latency;           // of successful requests, from arrival to answer
+
+	CompanionStbMetrics() : Requests(0), Succeeded(0), TimedOut(0), Failed(0), Rejected(0), BytesIn(0), BytesOut(0) {}
+};
+
+struct CompanionDaemonStats
+{
+	UINT64 Connections;         // accepted
+	UINT64 Requests;            // API requests of every kind
+	UINT64 BadRequests;
+	UINT64 Refused;             // connections over MaxConnections
+
+	CompanionDaemonStats() : Connections(0), Requests(0), BadRequests(0), Refused(0) {}
+};
+
+class CompanionDaemon
+{
+public:
+
+	CompanionDaemon(EventLoop& loop, const CompanionDaemonOptions& options = CompanionDaemonOptions());
+	~CompanionDaemon();
+
+	/// <summary>
+	/// Open a client for the STB, reached as /stb/name.  COMPANION_E_DUPLICATE if the name is taken.
+	/// </summary>
+	COMPANION_RESULT AddStb(const std::string& name, const CompanionPairingInfo& pairing, const std::string& targetUsn = std::string());
+
+	/// <summary>
+	/// Start listening on the socket and port.
+	/// </summary>
+	COMPANION_RESULT Start();
+
+	/// <summary>
+	/// Stop listening, close local connections and fail what the STBs still owe them.
+	/// </summary>
+	void Stop();
+
+	/// <summary>
+	/// The client serving an STB, or NULL.
+	/// </summary>
+	CompanionClient* Stb(const std::string& name);
+
+	const CompanionStbMetrics* Metrics(const std::string& name) const;
+	const CompanionDaemonStats& Stats() const { return _stats; }
+	UINT16 Port() const { return _port; }
+
+	/// <summary>
+	/// The /metrics page.
+	/// </summary>
+	std::string FormatMetrics() const;
+
+private:
+
+	CompanionDaemon(const CompanionDaemon&) = delete;
+	CompanionDaemon& operator=(const CompanionDaemon&) = delete;
+
+	struct StbEntry
+	{
+		std::unique_ptr<CompanionClient> Client;
+		CompanionStbMetrics              Metrics;
+	};
+
+	struct Answer
+	{
+		std::string Bytes;      // complete HTTP response
+		bool        Ready;
+	};
+
+	struct Connection
+	{
+		int                Fd;
+		std::string        In;
+		std::string        Out;
+		size_t             OutOffset;
+		std::deque<Answer> Answers;     // in request order
+		UINT64             FrontId;     // id of Answers.front()
+
+		Connection() : Fd(-1), OutOffset(0), FrontId(0) {}
+	};
+
+	typedef std::shared_ptr<Connection> ConnectionRef;
+
+	COMPANION_RESULT Listen(int fd, const struct sockaddr* addr, socklen_t length);
+	void OnAccept(int listenFd);
+	void OnEvents(ConnectionRef connection, UINT32 events);
+	bool OnReadable(ConnectionRef connection);
+	bool TakeRequest(ConnectionRef connection, bool* complete);
+	void OnRequest(ConnectionRef connection, const std::string& method, const std::string& target, std::string& body);
+	void OnStbRequest(ConnectionRef connection, UINT64 answerId, const std::string& name, std::string& body);
+	std::string ListStbs() const;
+	void SetAnswer(ConnectionRef connection, UINT64 answerId, std::string bytes);
+	void Flush(ConnectionRef connection);
+	void Close(ConnectionRef connection);
+
+	EventLoop&                                 _loop;
+	CompanionDaemonOptions                     _options;
+	std::map<std::string, StbEntry>            _stbs;          // sorted, so /stb and /metrics list in name order
+	int                                        _unixFd;
+	int                                        _tcpFd;
+	UINT16                                     _port;
+	UINT64                                     _startUs;
+	std::unordered_map<int, ConnectionRef>     _connections;
+	CompanionDaemonStats                       _stats;
+};
+
+#endif
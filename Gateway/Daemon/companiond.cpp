@@ -0,0 +1,250 @@
+//--------------------------------------------------------------------------
+// <copyright file="companiond.cpp" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// Companion gateway daemon: serves every paired STB to local processes.
+// </summary>
+//--------------------------------------------------------------------------
+
+/*
+ Using companiond:
+    companiond -f pairings [-s socket] [-l port] [-P stbport] [-c connections] [-d depth] [-t timeoutms]
+               [-w seconds] [-D 1] [-r capture] [-R 0] [-I instances] [-U 1]
+
+ Opens the PairingStore at pairings and serves each live pairing as /stb/<pairUid> through CompanionDaemon,
+ on the Unix socket (default /run/companiond.sock; -s "" disables it) and, with -l, on 127.0.0.1:port:
+
+    curl --unix-socket /run/companiond.sock -d 'op=key&k=pause' http://stb/stb/<pairUid>
+    curl --unix-socket /run/companiond.sock http://stb/metrics
+
+ Every -w seconds (default 10) and on exit, sequence numbers and addresses that changed are written back to
+ the store, which is then the daemon's alone.  After a crash up to -w seconds of sequence numbers are
+ reused; the first answer from the STB brings the sequence forward again, as decryptResponse: does.
+ -D 1 finds STBs that stop answering again over SSDP by their USN.  -r records all traffic into a capture
+ for CompanionReplay (CompanionCapture.h), flushed along with the write-back; -R 0 leaves the plaintext out
+ of it.  -I shares derived CSParve64 instances with other daemons through the segment at instances
+ (SharedInstanceCache.h, e.g. /dev/shm/companion-instances), so a restart or another worker skips
+ CSParve64_Create for STBs already opened; the memory this saves is logged at start and exit.  -U 1 talks
+ to the STBs over io_uring (IoUring.h) instead of epoll, where the kernel allows.  SIGINT or SIGTERM stops
+ the daemon.
+ */
+
+#include "CompanionCapture.h"
+#include "CompanionDaemon.h"
+#include "PairingStore.h"
+#include "SharedInstanceCache.h"
+
+#include <memory>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+struct DaemonMainOptions
+{
+	std::string            StorePath;
+	UINT32                 WritebackSeconds;
+	bool                   Rediscover;
+	std::string            CapturePath;
+	bool                   CapturePlaintext;
+	std::string            InstancesPath;
+	CompanionDaemonOptions Daemon;
+
+	DaemonMainOptions() : WritebackSeconds(10), Rediscover(false), CapturePlaintext(true) {}
+};
+
+static EventLoop* RunningLoop = NULL;
+
+static void OnSignal(int)
+{
+	// Stop only stores a flag and writes the loop's eventfd.
+	if (RunningLoop != NULL)
+		RunningLoop->Stop();
+}
+
+static void Usage()
+{
+	fprintf(stderr, "usage: companiond -f pairings [-s socket] [-l port] [-P stbport] [-c connections] [-d depth] [-t timeoutms]\n"
+		"                  [-w seconds] [-D 1] [-r capture] [-R 0] [-I instances] [-U 1]\n");
+}
+
+static int ParseArguments(int argc, char** argv, DaemonMainOptions* options)
+{
+	for (int i = 1; i < argc; ++i)
+	{
+		if (i + 1 >= argc)
+			return -1;
+
+		std::string arg = argv[i];
+		std::string value = argv[++i];
+		UINT32 number = (UINT32)strtoul(value.c_str(), NULL, 10);
+		if (arg == "-f")
+			options->StorePath = value;
+		else if (arg == "-s")
+			options->Daemon.SocketPath = value;
+		else if (arg == "-l")
+			options->Daemon.ListenPort = (UINT16)number;
+		else if (arg == "-P")
+			options->Daemon.Client.Port = (UINT16)number;
+		else if (arg == "-c")
+			options->Daemon.Client.Connections = number;
+		else if (arg == "-d")
+			options->Daemon.Client.PipelineDepth = number;
+		else if (arg == "-t")
+			options->Daemon.Client.TimeoutMs = number;
+		else if (arg == "-w")
+			options->WritebackSeconds = number;
+		else if (arg == "-D")
+			options->Rediscover = number != 0;
+		else if (arg == "-r")
+			options->CapturePath = value;
+		else if (arg == "-R")
+			options->CapturePlaintext = number != 0;
+		else if (arg == "-I")
+			options->InstancesPath = value;
+		else if (arg == "-U")
+			options->Daemon.Client.Transport = number != 0 ? NetTransportUring : NetTransportEpoll;
+		else
+			return -1;
+	}
+
+	bool listens = !options->Daemon.SocketPath.empty() || options->Daemon.ListenPort != 0;
+	return (options->StorePath.empty() || !listens || options->Daemon.Client.Connections == 0 || options->WritebackSeconds == 0) ? -1 : 0;
+}
+
+/// <summary>
+/// Write back the sequence numbers and addresses that moved since the last call.
+/// </summary>
+static void Writeback(PairingStore& store, CompanionDaemon& daemon, const std::vector<std::string>& names)
+{
+	for (size_t i = 0; i < names.size(); ++i)
+	{
+		PairingEntry entry;
+		CompanionClient* client = daemon.Stb(names[i]);
+		if (client == NULL || store.Get(names[i], &entry) != COMPANION_OK)
+			continue;
+
+		UINT32 seqNum = client->Sequence().Current();
+		if (entry.TargetIPAddr != client->TargetAddress())
+		{
+			entry.TargetIPAddr = client->TargetAddress();
+			entry.SeqNum = seqNum;
+			store.Update(entry);
+		}
+		else if (entry.SeqNum != seqNum)
+			store.UpdateSeqNum(names[i], seqNum);
+	}
+	store.Sync();
+}
+
+static void ReportInstances(const SharedInstanceCache& instances)
+{
+	SharedInstanceCacheStats stats = instances.Stats();
+	fprintf(stderr, "companiond: %u shared instances, %u processes, %llu hits, %llu misses; %lld bytes saved over per-process caches\n",
+		stats.Entries, stats.Processes, (unsigned long long)stats.Hits, (unsigned long long)stats.Misses, stats.SavedBytes);
+}
+
+int main(int argc, char** argv)
+{
+	DaemonMainOptions options;
+	if (ParseArguments(argc, argv, &options) != 0)
+	{
+		Usage();
+		return 2;
+	}
+
+	PairingStore store;
+	if (store.Open(options.StorePath) != COMPANION_OK)
+	{
+		fprintf(stderr, "companiond: cannot open %s\n", options.StorePath.c_str());
+		return 1;
+	}
+
+	CaptureWriter capture;
+	CaptureRecorder recorder(capture, options.CapturePlaintext);
+	if (!options.CapturePath.empty())
+	{
+		if (capture.Open(options.CapturePath) != COMPANION_OK)
+		{
+			fprintf(stderr, "companiond: cannot create %s\n", options.CapturePath.c_str());
+			return 1;
+		}
+		options.Daemon.Client.Recorder = &recorder;
+	}
+
+	SharedInstanceCache instances;
+	if (!options.InstancesPath.empty())
+	{
+		if (instances.Open(options.InstancesPath) != COMPANION_OK)
+		{
+			fprintf(stderr, "companiond: cannot map %s\n", options.InstancesPath.c_str());
+			return 1;
+		}
+		options.Daemon.Client.InstanceCache = &instances;
+	}
+
+	EventLoop loop;
+	std::unique_ptr<SsdpDiscovery> discovery(options.Rediscover ? new SsdpDiscovery() : NULL);
+	options.Daemon.Client.Discovery = discovery.get();
+
+	std::unique_ptr<CompanionDaemon> daemon(new CompanionDaemon(loop, options.Daemon));
+	std::vector<std::string> names;
+	store.ForEach([&](const PairingRecord& record)
+	{
+		PairingEntry entry;
+		PairingStore::ToEntry(record, &entry);
+		COMPANION_RESULT result = daemon->AddStb(entry.PairUid, entry.PairingInfo(), entry.TargetUsn);
+		if (result != COMPANION_OK)
+		{
+			fprintf(stderr, "companiond: skipping %s (%ld)\n", entry.PairUid.c_str(), (long)result);
+			return;
+		}
+		names.push_back(entry.PairUid);
+	});
+
+	if (daemon->Start() != COMPANION_OK)
+	{
+		fprintf(stderr, "companiond: cannot listen on %s\n", options.Daemon.SocketPath.c_str());
+		return 1;
+	}
+
+	fprintf(stderr, "companiond: %zu STBs", names.size());
+	if (!options.Daemon.SocketPath.empty())
+		fprintf(stderr, " on %s", options.Daemon.SocketPath.c_str());
+	if (daemon->Port() != 0)
+		fprintf(stderr, " on %s:%u", options.Daemon.ListenAddress.c_str(), (unsigned)daemon->Port());
+	fprintf(stderr, "\n");
+	if (instances.IsOpen())
+		ReportInstances(instances);
+
+	std::function<void()> writeback = [&]()
+	{
+		Writeback(store, *daemon, names);
+		if (capture.IsOpen())
+			capture.Flush();
+		loop.AddTimer(options.WritebackSeconds * 1000, writeback);
+	};
+	loop.AddTimer(options.WritebackSeconds * 1000, writeback);
+
+	RunningLoop = &loop;
+	struct sigaction action = {};
+	action.sa_handler = OnSignal;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	loop.Run();
+
+	RunningLoop = NULL;
+	daemon->Stop();
+	Writeback(store, *daemon, names);
+	daemon.reset();
+	discovery.reset();
+	store.Close();
+	capture.Close();
+	if (instances.IsOpen())
+		ReportInstances(instances);
+	return 0;
+}
@@ -0,0 +1,230 @@
+//--------------------------------------------------------------------------
+// <copyright file="EventLoop.cpp" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// Single-threaded epoll event loop with cross-thread posting and timers.
+// </summary>
+//--------------------------------------------------------------------------
+
+#include "EventLoop.h"
+#include "IoUring.h"
+
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+static const int MaxEventsPerWait = 64;
+
+EventLoop::EventLoop()
+	: _stopping(false), _nextTimerId(1), _uringTried(false)
+{
+	_epollFd = epoll_create1(EPOLL_CLOEXEC);
+	_wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	struct epoll_event ev = {};
+	ev.events = EPOLLIN;
+	ev.data.fd = _wakeFd;
+	epoll_ctl(_epollFd, EPOLL_CTL_ADD, _wakeFd, &ev);
+
+	_loopThreadId = std::this_thread::get_id();
+}
+
+EventLoop::~EventLoop()
+{
+	Stop();
+	Join();
+	_uring.reset();
+	close(_wakeFd);
+	close(_epollFd);
+}
+
+void EventLoop::Start()
+{
+	_thread = std::thread([this]() { Run(); });
+}
+
+void EventLoop::Run()
+{
+	_loopThreadId = std::this_thread::get_id();
+
+	struct epoll_event events[MaxEventsPerWait];
+	while (!_stopping.load(std::memory_order_acquire))
+	{
+		// Everything the handlers queued on the ring goes to the kernel in one call.
+		if (_uring)
+			_uring->Submit();
+
+		int count = epoll_wait(_epollFd, events, MaxEventsPerWait, NextTimeoutMs());
+		if (count < 0 && errno != EINTR)
+			break;
+
+		for (int i = 0; i < count; ++i)
+		{
+			int fd = events[i].data.fd;
+			if (fd == _wakeFd)
+			{
+				UINT64 value;
+				while (read(_wakeFd, &value, sizeof(value)) > 0)
+					;
+				continue;
+			}
+
+			// Look up on every event: an earlier handler in this batch may have unwatched the descriptor.
+			std::unordered_map<int, IoHandler>::iterator it = _handlers.find(fd);
+			if (it != _handlers.end())
+			{
+				IoHandler handler = it->second;
+				handler(events[i].events);
+			}
+		}
+
+		RunTimers();
+		RunPosted();
+	}
+
+	// Drain anything posted while stopping so that completions are not lost.
+	RunPosted();
+}
+
+void EventLoop::Stop()
+{
+	_stopping.store(true, std::memory_order_release);
+	Wake();
+}
+
+void EventLoop::Join()
+{
+	if (_thread.joinable() && _thread.get_id() != std::this_thread::get_id())
+		_thread.join();
+}
+
+void EventLoop::Post(Task task)
+{
+	{
+		std::lock_guard<std::mutex> guard(_postedLock);
+		_posted.push_back(std::move(task));
+	}
+	Wake();
+}
+
+void EventLoop::Dispatch(Task task)
+{
+	if (InLoopThread())
+		task();
+	else
+		Post(std::move(task));
+}
+
+bool EventLoop::InLoopThread() const
+{
+	return _loopThreadId == std::this_thread::get_id();
+}
+
+bool EventLoop::Watch(int fd, UINT32 events, IoHandler handler)
+{
+	struct epoll_event ev = {};
+	ev.events = events;
+	ev.data.fd = fd;
+	if (epoll_ctl(_epollFd, EPOLL_CTL_ADD, fd, &ev) != 0)
+		return false;
+	_handlers[fd] = std::move(handler);
+	return true;
+}
+
+bool EventLoop::Modify(int fd, UINT32 events)
+{
+	struct epoll_event ev = {};
+	ev.events = events;
+	ev.data.fd = fd;
+	return epoll_ctl(_epollFd, EPOLL_CTL_MOD, fd, &ev) == 0;
+}
+
+void EventLoop::Unwatch(int fd)
+{
+	epoll_ctl(_epollFd, EPOLL_CTL_DEL, fd, NULL);
+	_handlers.erase(fd);
+}
+
+UINT64 EventLoop::AddTimer(UINT32 delayMs, Task task)
+{
+	UINT64 timerId = _nextTimerId++;
+	UINT64 deadline = NowUs() + (UINT64)delayMs * 1000;
+	_timers[std::make_pair(deadline, timerId)] = std::move(task);
+	_timerDeadlines[timerId] = deadline;
+	return timerId;
+}
+
+void EventLoop::CancelTimer(UINT64 timerId)
+{
+	std::unordered_map<UINT64, UINT64>::iterator it = _timerDeadlines.find(timerId);
+	if (it == _timerDeadlines.end())
+		return;
+	_timers.erase(std::make_pair(it->second, timerId));
+	_timerDeadlines.erase(it);
+}
+
+IoUring* EventLoop::Uring()
+{
+	if (!_uringTried)
+	{
+		_uringTried = true;
+		std::unique_ptr<IoUring> ring(new IoUring());
+		IoUring* reaper = ring.get();
+		if (IoUring::Supported() && ring->Open() == COMPANION_OK && Watch(ring->Fd(), EPOLLIN, [reaper](UINT32) { reaper->Reap(); }))
+			_uring = std::move(ring);
+	}
+	return _uring.get();
+}
+
+UINT64 EventLoop::NowUs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (UINT64)ts.tv_sec * 1000000 + (UINT64)ts.tv_nsec / 1000;
+}
+
+void EventLoop::Wake()
+{
+	UINT64 one = 1;
+	ssize_t written = write(_wakeFd, &one, sizeof(one));
+	(void)written;
+}
+
+void EventLoop::RunPosted()
+{
+	std::vector<Task> posted;
+	{
+		std::lock_guard<std::mutex> guard(_postedLock);
+		posted.swap(_posted);
+	}
+	for (size_t i = 0; i < posted.size(); ++i)
+		posted[i]();
+}
+
+void EventLoop::RunTimers()
+{
+	UINT64 now = NowUs();
+	while (!_timers.empty() && _timers.begin()->first.first <= now)
+	{
+		std::map<std::pair<UINT64, UINT64>, Task>::iterator it = _timers.begin();
+		Task task = std::move(it->second);
+		_timerDeadlines.erase(it->first.second);
+		_timers.erase(it);
+		task();
+	}
+}
+
+int EventLoop::NextTimeoutMs() const
+{
+	if (_timers.empty())
+		return -1;
+
+	UINT64 now = NowUs();
+	UINT64 deadline = _timers.begin()->first.first;
+	if (deadline <= now)
+		return 0;
+	return (int)((deadline - now + 999) / 1000);
+}
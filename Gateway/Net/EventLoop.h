@@ -0,0 +1,130 @@
+//--------------------------------------------------------------------------
+// <copyright file="EventLoop.h" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// Single-threaded epoll event loop with cross-thread posting and timers.
+// </summary>
+//--------------------------------------------------------------------------
+
+#ifndef EVENTLOOP_H
+#define EVENTLOOP_H
+
+#include "CSParve64.h"
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+class IoUring;
+
+/// <summary>
+/// How connections and servers on a loop do their socket I/O.
+/// </summary>
+enum NetTransport
+{
+	NetTransportEpoll = 0,      // readiness events, then recv and send
+	NetTransportUring = 1       // io_uring operations (IoUring.h); epoll where the kernel has no io_uring
+};
+
+class EventLoop
+{
+public:
+
+	typedef std::function<void()>       Task;
+	typedef std::function<void(UINT32)> IoHandler;    // receives the epoll event mask
+
+	EventLoop();
+	~EventLoop();
+
+	/// <summary>
+	/// Run the loop on a new thread.
+	/// </summary>
+	void Start();
+
+	/// <summary>
+	/// Run the loop on the calling thread until Stop is called.
+	/// </summary>
+	void Run();
+
+	/// <summary>
+	/// Ask the loop to exit.  Safe to call from any thread.
+	/// </summary>
+	void Stop();
+
+	/// <summary>
+	/// Wait for the thread started by Start to exit.
+	/// </summary>
+	void Join();
+
+	/// <summary>
+	/// Queue a task to run on the loop thread.  Safe to call from any thread.
+	/// </summary>
+	void Post(Task task);
+
+	/// <summary>
+	/// Run the task now if called on the loop thread, otherwise Post it.
+	/// </summary>
+	void Dispatch(Task task);
+
+	bool InLoopThread() const;
+
+	// The following must be called on the loop thread.
+
+	/// <summary>
+	/// Watch a file descriptor for the given epoll events.
+	/// </summary>
+	bool Watch(int fd, UINT32 events, IoHandler handler);
+	bool Modify(int fd, UINT32 events);
+	void Unwatch(int fd);
+
+	/// <summary>
+	/// Run a task once after delayMs milliseconds.  Returns an id for CancelTimer.
+	/// </summary>
+	UINT64 AddTimer(UINT32 delayMs, Task task);
+	void CancelTimer(UINT64 timerId);
+
+	/// <summary>
+	/// The loop's io_uring, created on first use, or NULL if the kernel cannot provide one.  Operations
+	/// queued on it are submitted together each time the loop is about to wait.
+	/// </summary>
+	IoUring* Uring();
+
+	/// <summary>
+	/// Monotonic clock in microseconds.
+	/// </summary>
+	static UINT64 NowUs();
+
+private:
+
+	EventLoop(const EventLoop&) = delete;
+	EventLoop& operator=(const EventLoop&) = delete;
+
+	void Wake();
+	void RunPosted();
+	void RunTimers();
+	int  NextTimeoutMs() const;
+
+	int                 _epollFd;
+	int                 _wakeFd;
+	std::atomic<bool>   _stopping;
+	std::thread         _thread;
+	std::thread::id     _loopThreadId;
+
+	std::mutex          _postedLock;
+	std::vector<Task>   _posted;
+
+	std::unordered_map<int, IoHandler>               _handlers;
+	std::map<std::pair<UINT64, UINT64>, Task>        _timers;        // (deadline, id) -> task
+	std::unordered_map<UINT64, UINT64>               _timerDeadlines; // id -> deadline
+	UINT64                                           _nextTimerId;
+	std::unique_ptr<IoUring>                         _uring;
+	bool                                             _uringTried;
+};
+
+#endif
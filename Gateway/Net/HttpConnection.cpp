@@ -0,0 +1,704 @@
+//--------------------------------------------------------------------------
+// <copyright file="HttpConnection.cpp" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// Non-blocking HTTP/1.1 client connection with request pipelining.
+// </summary>
+//--------------------------------------------------------------------------
+
+#include "HttpConnection.h"
+#include "CompanionProbes.h"
+#include "IoUring.h"
+#include "UringHttpConnection.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static const size_t ReadChunkSize = 16384;
+
+//------------------------------------------------------------------------------------------------------
+
+/// <summary>
+/// Step to the next header line of a head after *pos, which starts past the status line.  Returns 1 with
+/// the name and value, 0 at the blank line that ends the head, -1 if the line has no colon.
+/// </summary>
+static int NextHeader(const char* head, size_t length, size_t* pos, const char** name, size_t* nameLength, const char** value, size_t* valueLength)
+{
+	const char* line = head + *pos;
+	const char* end = (const char*)memmem(line, length - *pos, "\r\n", 2);
+	if (end == NULL || end == line)
+		return 0;
+
+	const char* colon = (const char*)memchr(line, ':', end - line);
+	if (colon == NULL)
+		return -1;
+
+	const char* start = colon + 1;
+	while (start < end && (*start == ' ' || *start == '\t'))
+		++start;
+
+	*name = line;
+	*nameLength = colon - line;
+	*value = start;
+	*valueLength = end - start;
+	*pos = end + 2 - head;
+	return 1;
+}
+
+static bool EqualsNoCase(const char* data, size_t length, const char* value)
+{
+	return strlen(value) == length && strncasecmp(data, value, length) == 0;
+}
+
+static size_t FirstHeader(const char* head, size_t length)
+{
+	const char* end = (const char*)memmem(head, length, "\r\n", 2);
+	return end != NULL ? end + 2 - head : length;
+}
+
+// Digits only, so no sign, and no more than fit; trailing blanks are allowed, as in any header value.
+static bool ParseContentLength(const char* value, size_t length, size_t* contentLength)
+{
+	while (length > 0 && (value[length - 1] == ' ' || value[length - 1] == '\t'))
+		--length;
+	if (length == 0 || length > 18)
+		return false;
+
+	size_t result = 0;
+	for (size_t i = 0; i < length; ++i)
+	{
+		if (value[i] < '0' || value[i] > '9')
+			return false;
+		result = result * 10 + (size_t)(value[i] - '0');
+	}
+	*contentLength = result;
+	return true;
+}
+
+bool ParseHttpRequestHead(const char* data, size_t length, size_t maxHeadLength, size_t maxBodyLength, HttpRequestHead* head, bool* complete)
+{
+	*complete = false;
+
+	const char* headEnd = (const char*)memmem(data, length, "\r\n\r\n", 4);
+	if (headEnd == NULL)
+		return length <= maxHeadLength;
+	size_t headLength = headEnd + 4 - data;
+	if (headLength > maxHeadLength)
+		return false;
+
+	// Request line: POST /companion?... HTTP/1.1
+	size_t lineEnd = FirstHeader(data, headLength);
+	const char* space = (const char*)memchr(data, ' ', lineEnd);
+	const char* targetEnd = space == NULL ? NULL : (const char*)memchr(space + 1, ' ', data + lineEnd - space - 1);
+	if (space == NULL || space == data || targetEnd == NULL || targetEnd == space + 1)
+		return false;
+
+	HttpRequestHead parsed;
+	parsed.MethodLength = space - data;
+	parsed.TargetOffset = space + 1 - data;
+	parsed.TargetLength = targetEnd - space - 1;
+	parsed.HeadLength = headLength;
+
+	size_t pos = lineEnd;
+	const char* name;
+	const char* value;
+	size_t nameLength, valueLength;
+	bool hasLength = false;
+	int found;
+	while ((found = NextHeader(data, headLength, &pos, &name, &nameLength, &value, &valueLength)) > 0)
+	{
+		if (EqualsNoCase(name, nameLength, "Content-Length"))
+		{
+			if (hasLength || !ParseContentLength(value, valueLength, &parsed.ContentLength))
+				return false;
+			hasLength = true;
+		}
+		else if (EqualsNoCase(name, nameLength, "Transfer-Encoding"))
+		{
+			return false;
+		}
+	}
+	if (found < 0 || parsed.ContentLength > maxBodyLength)
+		return false;
+
+	*head = parsed;
+	*complete = true;
+	return true;
+}
+
+const char* HttpResponse::Header(const char* name, size_t* length) const
+{
+	size_t pos = FirstHeader(Head, HeadLength);
+	const char* headerName;
+	const char* value;
+	size_t nameLength, valueLength;
+	while (NextHeader(Head, HeadLength, &pos, &headerName, &nameLength, &value, &valueLength) > 0)
+	{
+		if (EqualsNoCase(headerName, nameLength, name))
+		{
+			*length = valueLength;
+			return value;
+		}
+	}
+	return NULL;
+}
+
+bool HttpResponse::HeaderIs(const char* name, const char* value) const
+{
+	size_t length = 0;
+	const char* found = Header(name, &length);
+	return found != NULL && EqualsNoCase(found, length, value);
+}
+
+bool HttpResponse::AppendBody(const BYTE* data, size_t length)
+{
+	if (BodyLength + length > BodyCapacity)
+	{
+		size_t capacity = BodyCapacity * 2 > BodyLength + length ? BodyCapacity * 2 : BodyLength + length;
+		if (capacity < 256)
+			capacity = 256;
+		BYTE* grown = Arena != NULL ? (BYTE*)Arena->Extend(Body, BodyLength, capacity) : NULL;
+		if (grown == NULL)
+			return false;
+		Body = grown;
+		BodyCapacity = capacity;
+	}
+
+	if (length != 0)
+		memcpy(Body + BodyLength, data, length);
+	BodyLength += length;
+	return true;
+}
+
+void HttpResponse::Clear()
+{
+	*this = HttpResponse();
+}
+
+std::string HttpPostHead(const std::string& host, UINT16 port, const std::string& query, size_t contentLength)
+{
+	char lengths[64];
+	snprintf(lengths, sizeof(lengths), ":%u\r\nContent-Length: %zu\r\n", (unsigned)port, contentLength);
+
+	std::string head;
+	head.reserve(192 + query.length());
+	head += "POST ";
+	head += query;
+	head += " HTTP/1.1\r\nHost: ";
+	head += host;
+	head += lengths;
+	head += "Accept: text/xml\r\nContent-Type: application/x-www-form-urlencoded\r\n\r\n";
+	return head;
+}
+
+const char* HttpPostHead(CompanionArena* arena, const std::string& host, UINT16 port, const char* query, size_t contentLength, size_t* headLength)
+{
+	// The fixed text, port and length come to well under 192 bytes.
+	size_t size = 192 + strlen(query) + host.length();
+	char* head = (char*)arena->Allocate(size);
+	if (head == NULL)
+		return NULL;
+
+	int length = snprintf(head, size, "POST %s HTTP/1.1\r\nHost: %s:%u\r\nContent-Length: %zu\r\n"
+		"Accept: text/xml\r\nContent-Type: application/x-www-form-urlencoded\r\n\r\n", query, host.c_str(), (unsigned)port, contentLength);
+	*headLength = (size_t)length;
+	return head;
+}
+
+//------------------------------------------------------------------------------------------------------
+
+HttpResponseParser::HttpResponseParser()
+	: _bodyHandler(NULL), _requestArena(NULL), _arenaUsed(false)
+{
+	Reset();
+}
+
+void HttpResponseParser::Reset()
+{
+	// The last response may still be in use, so _arena is only reset when the next one starts.
+	_state = ParseHead;
+	_head.clear();
+	_bodyHandler = NULL;
+	_requestArena = NULL;
+	_bodyLength = 0;
+	_contentLength = 0;
+	_hasLength = false;
+	_keepAlive = true;
+	_response.Clear();
+}
+
+size_t HttpResponseParser::Feed(const char* data, size_t length)
+{
+	size_t used = 0;
+
+	if (_state == ParseHead)
+	{
+		if (_response.FirstByteUs == 0 && length > 0)
+		{
+			_response.FirstByteUs = EventLoop::NowUs();
+			if (_arenaUsed)
+			{
+				_arena.Reset();
+				_arenaUsed = false;
+			}
+		}
+
+		// Scan for the blank line that ends the head, allowing it to straddle reads.
+		size_t scanFrom = _head.length() >= 3 ? _head.length() - 3 : 0;
+		_head.append(data, length);
+		size_t end = _head.find("\r\n\r\n", scanFrom);
+		if (end == std::string::npos)
+		{
+			if (_head.length() > 65536)
+				_state = ParseError;
+			return length;
+		}
+
+		size_t headLength = end + 4;
+		used = length - (_head.length() - headLength);
+		_head.resize(headLength);
+
+		if (!ParseHeadBlock())
+		{
+			_state = ParseError;
+			return used;
+		}
+
+		_state = (_hasLength && _contentLength == 0) ? ParseDone : ParseBody;
+	}
+
+	if (_state == ParseBody)
+	{
+		size_t available = length - used;
+		if (_hasLength)
+		{
+			size_t wanted = _contentLength - _bodyLength;
+			size_t take = available < wanted ? available : wanted;
+			if (!TakeBody(data + used, take))
+				return used;
+			used += take;
+			if (_bodyLength == _contentLength)
+				_state = ParseDone;
+		}
+		else
+		{
+			if (!TakeBody(data + used, available))
+				return used;
+			used = length;
+		}
+	}
+
+	return used;
+}
+
+bool HttpResponseParser::TakeBody(const char* data, size_t length)
+{
+	_bodyLength += length;
+	if (!Streaming())
+	{
+		if (_response.AppendBody((const BYTE*)data, length))
+			return true;
+		_state = ParseError;
+		return false;
+	}
+
+	if (length != 0 && !(*_bodyHandler)(_response, (const BYTE*)data, length))
+	{
+		_state = ParseError;
+		return false;
+	}
+	return true;
+}
+
+void HttpResponseParser::FeedEof()
+{
+	if (_state == ParseBody && !_hasLength)
+		_state = ParseDone;
+	else if (_state != ParseDone)
+		_state = ParseError;
+	_keepAlive = false;
+}
+
+bool HttpResponseParser::ParseHeadBlock()
+{
+	// Status line: HTTP/1.x SSS reason
+	size_t lineEnd = _head.find("\r\n");
+	if (lineEnd == std::string::npos || _head.compare(0, 5, "HTTP/") != 0)
+		return false;
+
+	size_t space = _head.find(' ');
+	if (space == std::string::npos || space > lineEnd)
+		return false;
+	_response.Status = atoi(_head.c_str() + space + 1);
+	if (_head.compare(0, 8, "HTTP/1.0") == 0)
+		_keepAlive = false;
+
+	size_t pos = lineEnd + 2;
+	const char* name;
+	const char* value;
+	size_t nameLength, valueLength;
+	int found;
+	while ((found = NextHeader(_head.data(), _head.length(), &pos, &name, &nameLength, &value, &valueLength)) > 0)
+	{
+		if (EqualsNoCase(name, nameLength, "Content-Length"))
+		{
+			_contentLength = (size_t)strtoul(value, NULL, 10);
+			_hasLength = true;
+		}
+		else if (EqualsNoCase(name, nameLength, "Connection"))
+		{
+			if (EqualsNoCase(value, valueLength, "close"))
+				_keepAlive = false;
+			else if (EqualsNoCase(value, valueLength, "keep-alive"))
+				_keepAlive = true;
+		}
+		else if (EqualsNoCase(name, nameLength, "Transfer-Encoding"))
+		{
+			// Companion responses are never chunked.
+			return false;
+		}
+	}
+	if (found < 0)
+		return false;
+
+	// The head and a body of known length go into the arena in one block.
+	CompanionArena* arena = _requestArena != NULL ? _requestArena : &_arena;
+	_arenaUsed = _arenaUsed || arena == &_arena;
+	size_t bodySize = _hasLength && !Streaming() ? _contentLength : 0;
+	if (!arena->Reserve(_head.length() + bodySize + COMPANION_ARENA_ALIGNMENT))
+		return false;
+
+	_response.Arena = arena;
+	_response.Head = (const char*)arena->Copy(_head.data(), _head.length());
+	_response.HeadLength = _head.length();
+	if (bodySize != 0)
+	{
+		_response.Body = (BYTE*)arena->Allocate(bodySize);
+		_response.BodyCapacity = bodySize;
+	}
+	return _response.Head != NULL && (bodySize == 0 || _response.Body != NULL);
+}
+
+//------------------------------------------------------------------------------------------------------
+
+std::unique_ptr<HttpConnection> HttpConnection::Create(EventLoop& loop, const std::string& host, UINT16 port, NetTransport transport)
+{
+	if (transport == NetTransportUring && IoUring::Supported())
+		return std::unique_ptr<HttpConnection>(new UringHttpConnection(loop, host, port));
+	return std::unique_ptr<HttpConnection>(new EpollHttpConnection(loop, host, port));
+}
+
+HttpConnection::HttpConnection(EventLoop& loop, const std::string& host, UINT16 port)
+	: _loop(loop), _host(host), _port(port), _connecting(false), _queued(0), _written(0), _readPaused(false)
+{
+}
+
+HttpConnection::~HttpConnection()
+{
+}
+
+void HttpConnection::Submit(HttpRequest request, Completion completion)
+{
+	Pending pending;
+	pending.Request = std::make_shared<HttpRequest>(std::move(request));
+	pending.Done = std::move(completion);
+	pending.OutEnd = 0;
+	_pending.push_back(std::move(pending));
+
+	if (!IsOpen() && !Connect())
+	{
+		Abort(COMPANION_E_CONNECTION);
+		return;
+	}
+
+	if (!_connecting)
+		StartWrites();
+}
+
+void HttpConnection::Abort(COMPANION_RESULT result)
+{
+	CloseSocket();
+	_parser.Reset();
+
+	// Completions may submit new requests to this connection; those must not be failed with the old ones.
+	std::deque<Pending> pending;
+	pending.swap(_pending);
+	while (!pending.empty())
+	{
+		Pending front = std::move(pending.front());
+		pending.pop_front();
+		HttpResponse response;
+		if (front.Done)
+			front.Done(result, response);
+	}
+}
+
+void HttpConnection::PauseReading()
+{
+	if (_readPaused || !IsOpen())
+		return;
+	_readPaused = true;
+	UpdateReading();
+}
+
+void HttpConnection::ResumeReading()
+{
+	if (!_readPaused)
+		return;
+	_readPaused = false;
+	if (IsOpen())
+		UpdateReading();
+}
+
+bool HttpConnection::Receive(const char* data, size_t length)
+{
+	size_t offset = 0;
+	while (offset < length)
+	{
+		if (_pending.empty())
+		{
+			// Unsolicited data: the stream is out of step with our requests.
+			Abort(COMPANION_E_CONNECTION);
+			return false;
+		}
+
+		const HttpRequest& request = *_pending.front().Request;
+		bool first = _parser.Response().FirstByteUs == 0;
+		_parser.SetBodyHandler(&request.OnBody);
+		_parser.SetArena(request.Arena.Get());
+		size_t used = _parser.Feed(data + offset, length - offset);
+		if (first && _parser.Response().FirstByteUs != 0)
+			COMPANION_PROBE3(first_byte, request.Cid, request.SeqNum, (UINT32)(length - offset));
+		offset += used;
+
+		if (_parser.GetState() == HttpResponseParser::ParseError)
+		{
+			Abort(COMPANION_E_CONNECTION);
+			return false;
+		}
+
+		if (_parser.GetState() == HttpResponseParser::ParseDone)
+		{
+			bool keepAlive = _parser.KeepAlive();
+			CompleteFront(COMPANION_OK);
+			if (!IsOpen())
+				return false;   // the completion aborted the connection
+			if (!keepAlive)
+			{
+				// Requests pipelined behind this one must be resent on a new connection.
+				CloseSocket();
+				if (!_pending.empty() && !Connect())
+					Abort(COMPANION_E_CONNECTION);
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+void HttpConnection::ReceiveEof()
+{
+	_parser.FeedEof();
+	if (_parser.GetState() == HttpResponseParser::ParseDone && !_pending.empty())
+		CompleteFront(COMPANION_OK);
+	// Anything still outstanding was lost with the connection.
+	Abort(COMPANION_E_CONNECTION);
+}
+
+void HttpConnection::CompleteFront(COMPANION_RESULT result)
+{
+	Pending pending = std::move(_pending.front());
+	_pending.pop_front();
+	if (_queued > 0)
+		--_queued;
+	if (_written > 0)
+		--_written;
+
+	// The response's bytes stay in the request's arena (or the parser's) until Done returns.
+	HttpResponse response;
+	if (result == COMPANION_OK)
+		response = _parser.Response();
+	_parser.Reset();
+
+	if (pending.Done)
+		pending.Done(result, response);
+}
+
+//------------------------------------------------------------------------------------------------------
+
+EpollHttpConnection::EpollHttpConnection(EventLoop& loop, const std::string& host, UINT16 port)
+	: HttpConnection(loop, host, port), _fd(-1), _outOffset(0)
+{
+}
+
+EpollHttpConnection::~EpollHttpConnection()
+{
+	Abort(COMPANION_E_CANCELLED);
+}
+
+bool EpollHttpConnection::Connect()
+{
+	struct sockaddr_in addr = {};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(_port);
+	if (inet_pton(AF_INET, _host.c_str(), &addr.sin_addr) != 1)
+		return false;
+
+	_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (_fd < 0)
+		return false;
+
+	int one = 1;
+	setsockopt(_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	if (connect(_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 && errno != EINPROGRESS)
+	{
+		CloseSocket();
+		return false;
+	}
+
+	_connecting = true;
+	_parser.Reset();
+	if (!_loop.Watch(_fd, EPOLLOUT | EPOLLIN | EPOLLRDHUP, [this](UINT32 events) { OnEvents(events); }))
+	{
+		CloseSocket();
+		return false;
+	}
+	return true;
+}
+
+void EpollHttpConnection::CloseSocket()
+{
+	if (_fd >= 0)
+	{
+		_loop.Unwatch(_fd);
+		close(_fd);
+		_fd = -1;
+	}
+	_connecting = false;
+	_out.clear();
+	_outOffset = 0;
+	_queued = 0;
+	_written = 0;
+	_readPaused = false;
+}
+
+void EpollHttpConnection::StartWrites()
+{
+	QueueWrites();
+	OnWritable();
+}
+
+void EpollHttpConnection::OnEvents(UINT32 events)
+{
+	if (_connecting && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+	{
+		int error = 0;
+		socklen_t length = sizeof(error);
+		getsockopt(_fd, SOL_SOCKET, SO_ERROR, &error, &length);
+		if (error != 0)
+		{
+			Abort(COMPANION_E_CONNECTION);
+			return;
+		}
+		_connecting = false;
+		QueueWrites();
+	}
+
+	if (events & EPOLLOUT)
+		OnWritable();
+	if (_fd >= 0 && (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+		OnReadable();
+}
+
+void EpollHttpConnection::QueueWrites()
+{
+	// Append every request not yet copied to the output buffer so they are written back to back.
+	for (; _queued < _pending.size(); ++_queued)
+	{
+		const HttpRequest& request = *_pending[_queued].Request;
+		_out.insert(_out.end(), request.Head, request.Head + request.HeadLength);
+		_out.insert(_out.end(), request.Body, request.Body + request.BodyLength);
+		_pending[_queued].OutEnd = _out.size();
+	}
+}
+
+void EpollHttpConnection::OnWritable()
+{
+	while (_outOffset < _out.size())
+	{
+		ssize_t written = send(_fd, &_out[_outOffset], _out.size() - _outOffset, MSG_NOSIGNAL);
+		if (written < 0)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			if (errno == EINTR)
+				continue;
+			Abort(COMPANION_E_CONNECTION);
+			return;
+		}
+		_outOffset += (size_t)written;
+	}
+
+	for (; _written < _queued && _pending[_written].OutEnd <= _outOffset; ++_written)
+	{
+		const HttpRequest& request = *_pending[_written].Request;
+		COMPANION_PROBE3(send, request.Cid, request.SeqNum, (UINT32)(request.HeadLength + request.BodyLength));
+	}
+
+	if (_outOffset == _out.size())
+	{
+		_out.clear();
+		_outOffset = 0;
+	}
+	UpdateInterest();
+}
+
+void EpollHttpConnection::UpdateInterest()
+{
+	if (_fd < 0)
+		return;
+	UINT32 events = _readPaused ? 0 : EPOLLIN | EPOLLRDHUP;
+	if (_connecting || _outOffset < _out.size())
+		events |= EPOLLOUT;
+	_loop.Modify(_fd, events);
+}
+
+void EpollHttpConnection::OnReadable()
+{
+	char buffer[ReadChunkSize];
+	for (;;)
+	{
+		ssize_t received = recv(_fd, buffer, sizeof(buffer), 0);
+		if (received < 0)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return;
+			if (errno == EINTR)
+				continue;
+			Abort(COMPANION_E_CONNECTION);
+			return;
+		}
+
+		if (received == 0)
+		{
+			ReceiveEof();
+			return;
+		}
+
+		// A paused connection is left readable; the loop reports it again once reading resumes.
+		if (!Receive(buffer, (size_t)received) || _readPaused)
+			return;
+	}
+}
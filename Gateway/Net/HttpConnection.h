@@ -0,0 +1,300 @@
+//--------------------------------------------------------------------------
+// <copyright file="HttpConnection.h" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// Non-blocking HTTP/1.1 client connection with request pipelining.
+// </summary>
+//--------------------------------------------------------------------------
+
+#ifndef HTTPCONNECTION_H
+#define HTTPCONNECTION_H
+
+#include "CompanionArena.h"
+#include "CompanionCodec.h"
+#include "EventLoop.h"
+
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+struct HttpResponse;
+
+/// <summary>
+/// Receives response body bytes as they arrive, after the head has been parsed.  Returning false fails
+/// the request.
+/// </summary>
+typedef std::function<bool(HttpResponse&, const BYTE*, size_t)> HttpBodyHandler;
+
+/// <summary>
+/// A request and the arena (CompanionArena.h) its bytes are in.  The response to it is received into the
+/// same arena, so a whole round trip is returned to the pool when the request is destroyed.
+/// </summary>
+struct HttpRequest
+{
+	const char*         Head;       // request line and headers, terminated by an empty line
+	size_t              HeadLength;
+	const BYTE*         Body;
+	size_t              BodyLength;
+	CompanionArenaLease Arena;      // holds Head and Body; without one they must outlive the request
+	HttpBodyHandler     OnBody;     // when set, the response body is streamed here instead of kept in Body
+	const char*         Cid;        // for the send and first_byte probes (CompanionProbes.h); must outlive the request
+	UINT32              SeqNum;
+
+	HttpRequest() : Head(""), HeadLength(0), Body(NULL), BodyLength(0), Cid(""), SeqNum(0) {}
+};
+
+/// <summary>
+/// A received response.  Head and Body are in the request's arena, or the parser's for a request without
+/// one, and are valid until the completion returns.
+/// </summary>
+struct HttpResponse
+{
+	int             Status;
+	const char*     Head;           // status line and headers, terminated by an empty line
+	size_t          HeadLength;
+	BYTE*           Body;           // writable, so that it can be decoded where it is
+	size_t          BodyLength;
+	size_t          BodyCapacity;
+	CompanionArena* Arena;          // where AppendBody grows Body
+	UINT64          FirstByteUs;    // when the first byte of this response arrived
+
+	HttpResponse() : Status(0), Head(""), HeadLength(0), Body(NULL), BodyLength(0), BodyCapacity(0), Arena(NULL), FirstByteUs(0) {}
+
+	/// <summary>
+	/// Case-insensitive header lookup.  Returns the value, not NUL-terminated, or NULL if the header is absent.
+	/// </summary>
+	const char* Header(const char* name, size_t* length) const;
+
+	/// <summary>
+	/// True if the header is present with value, compared without regard to case.
+	/// </summary>
+	bool HeaderIs(const char* name, const char* value) const;
+
+	/// <summary>
+	/// Add to the body, growing it in the arena.  False if the arena cannot grow.
+	/// </summary>
+	bool AppendBody(const BYTE* data, size_t length);
+
+	void Clear();
+};
+
+/// <summary>
+/// Build a POST request head for the companion endpoint.
+/// </summary>
+std::string HttpPostHead(const std::string& host, UINT16 port, const std::string& query, size_t contentLength);
+
+/// <summary>
+/// As above, in arena.  Returns NULL if the arena cannot grow.
+/// </summary>
+const char* HttpPostHead(CompanionArena* arena, const std::string& host, UINT16 port, const char* query, size_t contentLength, size_t* headLength);
+
+/// <summary>
+/// Where the parts of a received request head are, as offsets into it.  The method starts the head.
+/// </summary>
+struct HttpRequestHead
+{
+	size_t MethodLength;
+	size_t TargetOffset;
+	size_t TargetLength;
+	size_t HeadLength;          // through the empty line; the body follows
+	size_t ContentLength;       // 0 without the header
+
+	HttpRequestHead() : MethodLength(0), TargetOffset(0), TargetLength(0), HeadLength(0), ContentLength(0) {}
+};
+
+/// <summary>
+/// Parse the request head at the start of data, for the servers.  False if it is longer than maxHeadLength
+/// or malformed: no method and target, a header line without a colon, a Content-Length that is not a
+/// decimal number or is over maxBodyLength, two Content-Lengths, or a Transfer-Encoding, since request
+/// bodies are never chunked.  True with *complete false while the head has not all arrived.
+/// </summary>
+bool ParseHttpRequestHead(const char* data, size_t length, size_t maxHeadLength, size_t maxBodyLength, HttpRequestHead* head, bool* complete);
+
+/// <summary>
+/// Incremental HTTP/1.1 response parser.  Supports Content-Length and connection-close delimited bodies.
+/// </summary>
+class HttpResponseParser
+{
+public:
+
+	enum State { ParseHead, ParseBody, ParseDone, ParseError };
+
+	HttpResponseParser();
+
+	/// <summary>
+	/// Consume up to length bytes.  Returns the number consumed; stops at the end of a response.
+	/// </summary>
+	size_t Feed(const char* data, size_t length);
+
+	/// <summary>
+	/// The peer closed the connection; completes a close-delimited body.
+	/// </summary>
+	void FeedEof();
+
+	/// <summary>
+	/// Stream the body of the current response to handler instead of buffering it.  NULL buffers.
+	/// </summary>
+	void SetBodyHandler(const HttpBodyHandler* handler) { _bodyHandler = handler; }
+
+	/// <summary>
+	/// Receive the current response into arena, or into the parser's own if NULL.  The parser's own arena
+	/// is reused from one response to the next.
+	/// </summary>
+	void SetArena(CompanionArena* arena) { _requestArena = arena; }
+
+	State GetState() const { return _state; }
+	bool KeepAlive() const { return _keepAlive; }
+	HttpResponse& Response() { return _response; }
+	void Reset();
+
+private:
+
+	bool ParseHeadBlock();
+	bool TakeBody(const char* data, size_t length);
+	bool Streaming() const { return _bodyHandler != NULL && *_bodyHandler; }
+
+	State                  _state;
+	std::string            _head;           // until it is complete; then copied to the arena
+	const HttpBodyHandler* _bodyHandler;
+	CompanionArena*        _requestArena;
+	CompanionArena         _arena;          // for requests without one
+	bool                   _arenaUsed;      // _arena holds the last response; reset when the next one starts
+	size_t                 _bodyLength;     // body bytes received so far
+	size_t                 _contentLength;
+	bool                   _hasLength;
+	bool                   _keepAlive;
+	HttpResponse           _response;
+};
+
+/// <summary>
+/// A pipelined connection to one host.  The request queue, response parsing and completions are shared;
+/// how bytes reach the socket is up to the transport (EpollHttpConnection, UringHttpConnection).
+/// </summary>
+class HttpConnection
+{
+public:
+
+	typedef std::function<void(COMPANION_RESULT, HttpResponse&)> Completion;
+
+	/// <summary>
+	/// A connection over transport.  NetTransportUring gives an epoll connection where the kernel has
+	/// no io_uring.
+	/// </summary>
+	static std::unique_ptr<HttpConnection> Create(EventLoop& loop, const std::string& host, UINT16 port, NetTransport transport = NetTransportEpoll);
+
+	virtual ~HttpConnection();
+
+	/// <summary>
+	/// Queue a request.  Requests are written back to back; responses complete in request order.
+	/// Must be called on the loop thread.
+	/// </summary>
+	void Submit(HttpRequest request, Completion completion);
+
+	/// <summary>
+	/// Number of requests submitted and not yet completed.
+	/// </summary>
+	size_t Outstanding() const { return _pending.size(); }
+
+	/// <summary>
+	/// Fail every outstanding request with result and drop the socket.
+	/// </summary>
+	void Abort(COMPANION_RESULT result);
+
+	/// <summary>
+	/// Stop reading the socket, leaving what the peer sends to TCP flow control, until ResumeReading.
+	/// Bytes already received are still parsed.  A new socket starts out reading.  Loop thread only.
+	/// </summary>
+	void PauseReading();
+	void ResumeReading();
+	bool ReadingPaused() const { return _readPaused; }
+
+	const std::string& Host() const { return _host; }
+	UINT16 Port() const { return _port; }
+
+	virtual NetTransport Transport() const = 0;
+
+protected:
+
+	HttpConnection(EventLoop& loop, const std::string& host, UINT16 port);
+
+	struct Pending
+	{
+		std::shared_ptr<HttpRequest> Request;    // shared with sends still in flight
+		Completion                   Done;
+		size_t                       OutEnd;     // offset in the transport's output just past the request, once queued
+	};
+
+	// The transport.  The destructor of each must Abort, since these cannot be called from here then.
+	virtual bool Connect() = 0;             // start connecting; false if that failed at once
+	virtual void CloseSocket() = 0;         // also resets _connecting, _queued, _written and _readPaused
+	virtual bool IsOpen() const = 0;
+	virtual void StartWrites() = 0;         // write the requests from _queued on; called once connected
+	virtual void UpdateReading() = 0;       // start or stop reading as _readPaused says
+
+	/// <summary>
+	/// Feed received bytes to the parser and complete responses.  False if the socket was closed or
+	/// replaced meanwhile, when the caller must stop reading it.
+	/// </summary>
+	bool Receive(const char* data, size_t length);
+
+	/// <summary>
+	/// The peer closed the connection.
+	/// </summary>
+	void ReceiveEof();
+
+	void CompleteFront(COMPANION_RESULT result);
+
+	EventLoop&          _loop;
+	std::string         _host;
+	UINT16              _port;
+	bool                _connecting;
+	std::deque<Pending> _pending;
+	size_t              _queued;        // number of _pending entries handed to the transport
+	size_t              _written;       // number of _pending entries written to the socket
+	bool                _readPaused;
+	HttpResponseParser  _parser;
+
+private:
+
+	HttpConnection(const HttpConnection&) = delete;
+	HttpConnection& operator=(const HttpConnection&) = delete;
+};
+
+/// <summary>
+/// Readiness-driven transport: requests are copied into one output buffer and written as the socket
+/// allows; responses are read into a stack buffer.
+/// </summary>
+class EpollHttpConnection : public HttpConnection
+{
+public:
+
+	EpollHttpConnection(EventLoop& loop, const std::string& host, UINT16 port);
+	~EpollHttpConnection();
+
+	NetTransport Transport() const { return NetTransportEpoll; }
+
+protected:
+
+	bool Connect();
+	void CloseSocket();
+	bool IsOpen() const { return _fd >= 0; }
+	void StartWrites();
+	void UpdateReading() { UpdateInterest(); }
+
+private:
+
+	void OnEvents(UINT32 events);
+	void OnWritable();
+	void OnReadable();
+	void UpdateInterest();
+	void QueueWrites();
+
+	int                 _fd;
+	std::vector<char>   _out;
+	size_t              _outOffset;
+};
+
+#endif
@@ -0,0 +1,470 @@
+//--------------------------------------------------------------------------
+// <copyright file="IoUring.cpp" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// Minimal io_uring submission and completion rings with a provided buffer ring.
+// </summary>
+//--------------------------------------------------------------------------
+
+#include "IoUring.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+
+// Built without the transport where the headers predate multishot recv; Supported() is then false.
+#if defined(IORING_RECV_MULTISHOT) && defined(__NR_io_uring_setup)
+#define IOURING_AVAILABLE 1
+#else
+#define IOURING_AVAILABLE 0
+#endif
+
+#define IOURING_BUFFER_GROUP 0
+
+#if IOURING_AVAILABLE
+
+struct IoUring::Ring
+{
+	void*                     SqMap;
+	size_t                    SqMapSize;
+	void*                     CqMap;          // SqMap with IORING_FEAT_SINGLE_MMAP
+	size_t                    CqMapSize;
+	struct io_uring_sqe*      Sqes;
+	size_t                    SqesSize;
+
+	UINT32*                   SqHead;
+	UINT32*                   SqTail;
+	UINT32                    SqMask;
+	UINT32                    SqEntries;
+	UINT32                    SqNext;         // tail of the operations queued, published by Submit
+
+	UINT32*                   CqHead;
+	UINT32*                   CqTail;
+	UINT32                    CqMask;
+	struct io_uring_cqe*      Cqes;
+
+	struct io_uring_buf*      Buffers;        // the provided buffer ring; its tail overlays Buffers[0].resv
+	size_t                    BuffersSize;
+	UINT16                    BufferTail;
+	UINT16                    BufferMask;
+
+	Ring() : SqMap(MAP_FAILED), SqMapSize(0), CqMap(MAP_FAILED), CqMapSize(0), Sqes((struct io_uring_sqe*)MAP_FAILED), SqesSize(0),
+		SqHead(NULL), SqTail(NULL), SqMask(0), SqEntries(0), SqNext(0), CqHead(NULL), CqTail(NULL), CqMask(0), Cqes(NULL),
+		Buffers((struct io_uring_buf*)MAP_FAILED), BuffersSize(0), BufferTail(0), BufferMask(0) {}
+};
+
+static int Setup(UINT32 entries, struct io_uring_params* params)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int Enter(int fd, UINT32 submit)
+{
+	return (int)syscall(__NR_io_uring_enter, fd, submit, 0, 0, NULL, 0);
+}
+
+static int Register(int fd, UINT32 opcode, void* arg, UINT32 count)
+{
+	return (int)syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+#endif
+
+//------------------------------------------------------------------------------------------------------
+
+IoUring::IoUring()
+	: _fd(-1), _ring(NULL), _bufferCount(0), _bufferSize(0), _buffers(NULL), _queued(0), _serial(0)
+{
+}
+
+IoUring::~IoUring()
+{
+	Close();
+}
+
+bool IoUring::Supported()
+{
+#if IOURING_AVAILABLE
+	static const bool supported = []()
+	{
+		IoUring probe;
+		return probe.Open(8, 8, 4096) == COMPANION_OK;
+	}();
+	return supported;
+#else
+	return false;
+#endif
+}
+
+COMPANION_RESULT IoUring::Open(UINT32 entries, UINT32 bufferCount, UINT32 bufferSize)
+{
+	Close();
+
+#if IOURING_AVAILABLE
+	if (bufferCount == 0 || bufferCount > 32768 || (bufferCount & (bufferCount - 1)) != 0 || bufferSize == 0)
+		return COMPANION_FAIL;
+
+	// SINGLE_ISSUER (Linux 6.0) also stands in for the multishot recv of the same release.
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP | IORING_SETUP_SINGLE_ISSUER;
+	params.cq_entries = entries * 4;
+	_fd = Setup(entries, &params);
+	if (_fd < 0)
+		return COMPANION_FAIL;
+
+	_ring = new Ring();
+	Ring& ring = *_ring;
+	ring.SqMapSize = params.sq_off.array + params.sq_entries * sizeof(UINT32);
+	ring.CqMapSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if (ring.CqMapSize > ring.SqMapSize)
+			ring.SqMapSize = ring.CqMapSize;
+		ring.CqMapSize = 0;
+	}
+
+	ring.SqMap = mmap(NULL, ring.SqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQ_RING);
+	if (ring.SqMap == MAP_FAILED)
+	{
+		Close();
+		return COMPANION_FAIL;
+	}
+	if (ring.CqMapSize != 0)
+	{
+		ring.CqMap = mmap(NULL, ring.CqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_CQ_RING);
+		if (ring.CqMap == MAP_FAILED)
+		{
+			Close();
+			return COMPANION_FAIL;
+		}
+	}
+	ring.SqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring.Sqes = (struct io_uring_sqe*)mmap(NULL, ring.SqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQES);
+	if (ring.Sqes == MAP_FAILED)
+	{
+		Close();
+		return COMPANION_FAIL;
+	}
+
+	BYTE* sq = (BYTE*)ring.SqMap;
+	BYTE* cq = (BYTE*)(ring.CqMapSize != 0 ? ring.CqMap : ring.SqMap);
+	ring.SqHead = (UINT32*)(sq + params.sq_off.head);
+	ring.SqTail = (UINT32*)(sq + params.sq_off.tail);
+	ring.SqMask = *(UINT32*)(sq + params.sq_off.ring_mask);
+	ring.SqEntries = params.sq_entries;
+	ring.SqNext = *ring.SqTail;
+	ring.CqHead = (UINT32*)(cq + params.cq_off.head);
+	ring.CqTail = (UINT32*)(cq + params.cq_off.tail);
+	ring.CqMask = *(UINT32*)(cq + params.cq_off.ring_mask);
+	ring.Cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+	// Submission slot i always holds SQE i, so queueing only has to fill in the SQE.
+	UINT32* array = (UINT32*)(sq + params.sq_off.array);
+	for (UINT32 i = 0; i < ring.SqEntries; ++i)
+		array[i] = i;
+
+	// The provided buffer ring: its entries, then the buffers they point at, all registered at once.
+	_bufferCount = bufferCount;
+	_bufferSize = bufferSize;
+	ring.BuffersSize = (size_t)bufferCount * sizeof(struct io_uring_buf);
+	ring.Buffers = (struct io_uring_buf*)mmap(NULL, ring.BuffersSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	_buffers = new BYTE[(size_t)bufferCount * bufferSize];
+	if (ring.Buffers == MAP_FAILED)
+	{
+		Close();
+		return COMPANION_FAIL;
+	}
+
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (UINT64)(uintptr_t)ring.Buffers;
+	reg.ring_entries = bufferCount;
+	reg.bgid = IOURING_BUFFER_GROUP;
+	if (Register(_fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0)
+	{
+		Close();
+		return COMPANION_FAIL;
+	}
+
+	ring.BufferMask = (UINT16)(bufferCount - 1);
+	for (UINT32 i = 0; i < bufferCount; ++i)
+		Recycle((UINT16)i);
+	return COMPANION_OK;
+#else
+	(void)entries;
+	(void)bufferCount;
+	(void)bufferSize;
+	return COMPANION_FAIL;
+#endif
+}
+
+void IoUring::Close()
+{
+#if IOURING_AVAILABLE
+	if (_ring != NULL)
+	{
+		if (_ring->Sqes != MAP_FAILED)
+			munmap(_ring->Sqes, _ring->SqesSize);
+		if (_ring->CqMap != MAP_FAILED)
+			munmap(_ring->CqMap, _ring->CqMapSize);
+		if (_ring->SqMap != MAP_FAILED)
+			munmap(_ring->SqMap, _ring->SqMapSize);
+		// Closing the ring unregisters the buffer ring, so it is unmapped after.
+		if (_fd >= 0)
+			close(_fd);
+		if (_ring->Buffers != MAP_FAILED)
+			munmap(_ring->Buffers, _ring->BuffersSize);
+		delete _ring;
+		_ring = NULL;
+	}
+	else if (_fd >= 0)
+	{
+		close(_fd);
+	}
+#endif
+	_fd = -1;
+	delete[] _buffers;
+	_buffers = NULL;
+	_bufferCount = 0;
+	_bufferSize = 0;
+	_queued = 0;
+
+	// Handlers still waiting for a completion never get one; dropping them frees what they hold.
+	_handlers.clear();
+	_freeHandlers.clear();
+}
+
+UINT64 IoUring::AddHandler(Handler handler)
+{
+	if (!_freeHandlers.empty())
+	{
+		UINT32 index = _freeHandlers.back();
+		_freeHandlers.pop_back();
+		_handlers[index] = std::move(handler);
+		return index;
+	}
+	_handlers.push_back(std::move(handler));
+	return _handlers.size() - 1;
+}
+
+#if IOURING_AVAILABLE
+
+struct io_uring_sqe* IoUring::Queue(UINT64* userData, Handler handler)
+{
+	if (_fd < 0 || !Reserve(1))
+		return NULL;
+
+	Ring& ring = *_ring;
+	struct io_uring_sqe* sqe = &ring.Sqes[ring.SqNext & ring.SqMask];
+	memset(sqe, 0, sizeof(*sqe));
+	*userData = AddHandler(std::move(handler)) | ((UINT64)++_serial << 32);
+	sqe->user_data = *userData;
+	++ring.SqNext;
+	++_queued;
+	return sqe;
+}
+
+bool IoUring::Reserve(UINT32 count)
+{
+	if (_fd < 0 || count > _ring->SqEntries)
+		return false;
+
+	Ring& ring = *_ring;
+	if (ring.SqNext - __atomic_load_n(ring.SqHead, __ATOMIC_ACQUIRE) + count > ring.SqEntries)
+		Submit();
+	return ring.SqNext - __atomic_load_n(ring.SqHead, __ATOMIC_ACQUIRE) + count <= ring.SqEntries;
+}
+
+bool IoUring::Accept(int fd, Handler handler)
+{
+	UINT64 userData;
+	struct io_uring_sqe* sqe = Queue(&userData, std::move(handler));
+	if (sqe == NULL)
+		return false;
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_CLOEXEC;
+	return true;
+}
+
+bool IoUring::Connect(int fd, const struct sockaddr* addr, socklen_t length, Handler handler)
+{
+	UINT64 userData;
+	struct io_uring_sqe* sqe = Queue(&userData, std::move(handler));
+	if (sqe == NULL)
+		return false;
+	sqe->opcode = IORING_OP_CONNECT;
+	sqe->fd = fd;
+	sqe->addr = (UINT64)(uintptr_t)addr;
+	sqe->off = length;
+	return true;
+}
+
+bool IoUring::Recv(int fd, Handler handler, UINT64* operation)
+{
+	UINT64 userData;
+	struct io_uring_sqe* sqe = Queue(&userData, std::move(handler));
+	if (sqe == NULL)
+		return false;
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = IOURING_BUFFER_GROUP;
+	if (operation != NULL)
+		*operation = userData;
+	return true;
+}
+
+bool IoUring::Cancel(UINT64 operation)
+{
+	// Its own completion (0, -ENOENT or -EALREADY) says nothing the cancelled operation's will not.
+	UINT64 userData;
+	struct io_uring_sqe* sqe = Queue(&userData, nullptr);
+	if (sqe == NULL)
+		return false;
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = operation;
+	return true;
+}
+
+bool IoUring::Send(int fd, const void* data, size_t length, bool link, Handler handler)
+{
+	UINT64 userData;
+	struct io_uring_sqe* sqe = Queue(&userData, std::move(handler));
+	if (sqe == NULL)
+		return false;
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = fd;
+	sqe->addr = (UINT64)(uintptr_t)data;
+	sqe->len = (UINT32)length;
+	// MSG_WAITALL makes the kernel finish a short send itself rather than complete it.  A linked send
+	// is followed by more of the same stream, so MSG_MORE lets the chain leave in full segments.
+	sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL | (link ? MSG_MORE : 0);
+	if (link)
+		sqe->flags = IOSQE_IO_LINK;
+	return true;
+}
+
+int IoUring::Submit()
+{
+	if (_queued == 0)
+		return 0;
+
+	__atomic_store_n(_ring->SqTail, _ring->SqNext, __ATOMIC_RELEASE);
+	int submitted;
+	do
+	{
+		submitted = Enter(_fd, _queued);
+		++_stats.Enters;
+	} while (submitted < 0 && errno == EINTR);
+
+	// EBUSY or EAGAIN: the completion queue is backed up; what was not taken goes with the next Submit.
+	if (submitted > 0)
+	{
+		_queued -= (UINT32)submitted < _queued ? (UINT32)submitted : _queued;
+		_stats.Submitted += (UINT64)submitted;
+	}
+	return submitted;
+}
+
+void IoUring::Reap()
+{
+	if (_fd < 0)
+		return;
+
+	Ring& ring = *_ring;
+	UINT32 head = *ring.CqHead;
+	for (;;)
+	{
+		UINT32 tail = __atomic_load_n(ring.CqTail, __ATOMIC_ACQUIRE);
+		if (head == tail)
+			break;
+
+		for (; head != tail; ++head)
+		{
+			// Copied, and the slot handed back, before the handler can queue anything.
+			struct io_uring_cqe cqe = ring.Cqes[head & ring.CqMask];
+			__atomic_store_n(ring.CqHead, head + 1, __ATOMIC_RELEASE);
+			++_stats.Completions;
+
+			IoUringCompletion completion;
+			completion.Result = cqe.res;
+			completion.Flags = cqe.flags;
+			completion.More = (cqe.flags & IORING_CQE_F_MORE) != 0;
+			bool buffered = (cqe.flags & IORING_CQE_F_BUFFER) != 0;
+			UINT16 bufferId = (UINT16)(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+			if (buffered)
+				completion.Data = (char*)_buffers + (size_t)bufferId * _bufferSize;
+			if (cqe.res == -ENOBUFS)
+				++_stats.NoBuffers;
+
+			UINT32 index = (UINT32)cqe.user_data;
+			if (index < _handlers.size())
+			{
+				if (completion.More)
+				{
+					// The handler stays for the next completion.  It is called where it lies: the deque does
+					// not move it when the handler queues more, and its slot is not freed until its last CQE.
+					Handler& handler = _handlers[index];
+					if (handler)
+						handler(completion);
+				}
+				else
+				{
+					Handler handler = std::move(_handlers[index]);
+					_handlers[index] = nullptr;
+					_freeHandlers.push_back(index);
+					if (handler)
+						handler(completion);
+				}
+			}
+
+			// The handler has finished with the buffer, in place or not.
+			if (buffered && _fd >= 0)
+				Recycle(bufferId);
+			if (_fd < 0)
+				return;
+		}
+	}
+}
+
+void IoUring::Recycle(UINT16 bufferId)
+{
+	Ring& ring = *_ring;
+	// Indexed as plain io_uring_buf: C++ places io_uring_buf_ring::bufs after an empty struct, at offset 8.
+	struct io_uring_buf* buffer = &ring.Buffers[ring.BufferTail & ring.BufferMask];
+	buffer->addr = (UINT64)(uintptr_t)(_buffers + (size_t)bufferId * _bufferSize);
+	buffer->len = _bufferSize;
+	buffer->bid = bufferId;
+	++ring.BufferTail;
+	__atomic_store_n(&ring.Buffers[0].resv, ring.BufferTail, __ATOMIC_RELEASE);
+}
+
+#else
+
+struct io_uring_sqe* IoUring::Queue(UINT64*, Handler) { return NULL; }
+bool IoUring::Reserve(UINT32) { return false; }
+bool IoUring::Accept(int, Handler) { return false; }
+bool IoUring::Connect(int, const struct sockaddr*, socklen_t, Handler) { return false; }
+bool IoUring::Recv(int, Handler, UINT64*) { return false; }
+bool IoUring::Cancel(UINT64) { return false; }
+bool IoUring::Send(int, const void*, size_t, bool, Handler) { return false; }
+int IoUring::Submit() { return 0; }
+void IoUring::Reap() {}
+void IoUring::Recycle(UINT16) {}
+
+#endif
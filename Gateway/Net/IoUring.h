@@ -0,0 +1,173 @@
+//--------------------------------------------------------------------------
+// <copyright file="IoUring.h" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// Minimal io_uring submission and completion rings with a provided buffer ring.
+// </summary>
+//--------------------------------------------------------------------------
+
+/*
+ Using IoUring:
+ The io_uring transport (NetTransportUring, EventLoop.h) does its socket work as ring operations instead of
+ readiness events and system calls: one multishot accept per listening socket, one multishot recv per
+ connection, and sends that are linked so a pipelined batch goes out in order with one submission.  The ring
+ belongs to the EventLoop, which creates it on first use (EventLoop::Uring), watches its descriptor like any
+ other and submits everything queued during an iteration at once, just before it waits:
+
+    IoUring* ring = loop.Uring();           // NULL where the kernel has no io_uring
+    ring->Recv(fd, [](const IoUringCompletion& c)
+    {
+        if (c.Data != NULL)
+            ...                             // c.Result bytes at c.Data, valid until this returns
+    });
+
+ Received data lands in a ring of buffers registered with the kernel (IORING_REGISTER_PBUF_RING), which
+ picks one per completion.  The completion may read and modify the buffer in place - the server decodes
+ request bodies there - and it goes back to the kernel when the completion returns, so anything kept must be
+ copied.  A multishot operation keeps its completion until a CQE arrives without IORING_CQE_F_MORE; the
+ owner re-arms it if it still wants it, as after ENOBUFS when every buffer was in use.
+
+ Closing is how operations end: their owner shuts the socket down, and must keep whatever the completion
+ refers to alive until then, or make it check that it still exists.  Send data in particular must stay put
+ until its completion runs.  A multishot recv can also be cancelled, to stop reading a socket that stays
+ open; its last completion then has -ECANCELED.
+
+ Only what the transport needs is here; there is no liburing dependency.  Must be used on the loop thread.
+ */
+
+#ifndef IOURING_H
+#define IOURING_H
+
+#include "CompanionCodec.h"
+
+#include <deque>
+#include <functional>
+#include <sys/socket.h>
+#include <vector>
+
+#define IOURING_DEFAULT_ENTRIES       1024    // submission queue; the completion queue is four times this
+#define IOURING_DEFAULT_BUFFERS       256     // provided receive buffers; a power of two
+#define IOURING_DEFAULT_BUFFER_SIZE   8192
+
+struct IoUringCompletion
+{
+	INT32  Result;     // as the system call would return, negative errno on failure
+	UINT32 Flags;      // IORING_CQE_F_*
+	char*  Data;       // the provided buffer received into, or NULL
+	bool   More;       // a multishot operation continues
+
+	IoUringCompletion() : Result(0), Flags(0), Data(NULL), More(false) {}
+};
+
+struct IoUringStats
+{
+	UINT64 Submitted;       // operations
+	UINT64 Enters;          // io_uring_enter calls
+	UINT64 Completions;
+	UINT64 NoBuffers;       // receives that found every provided buffer in use
+
+	IoUringStats() : Submitted(0), Enters(0), Completions(0), NoBuffers(0) {}
+};
+
+class IoUring
+{
+public:
+
+	typedef std::function<void(const IoUringCompletion&)> Handler;
+
+	IoUring();
+	~IoUring();
+
+	/// <summary>
+	/// Whether this kernel has what the transport needs: multishot accept and recv and provided buffer
+	/// rings (Linux 6.0).  Tried once per process.
+	/// </summary>
+	static bool Supported();
+
+	/// <summary>
+	/// Set up the rings and register bufferCount receive buffers of bufferSize bytes.
+	/// </summary>
+	COMPANION_RESULT Open(UINT32 entries = IOURING_DEFAULT_ENTRIES, UINT32 bufferCount = IOURING_DEFAULT_BUFFERS,
+		UINT32 bufferSize = IOURING_DEFAULT_BUFFER_SIZE);
+	void Close();
+
+	bool IsOpen() const { return _fd >= 0; }
+
+	/// <summary>
+	/// The ring descriptor, readable while completions are waiting.
+	/// </summary>
+	int Fd() const { return _fd; }
+
+	/// <summary>
+	/// Multishot accept: one completion per connection, Result the new descriptor.
+	/// </summary>
+	bool Accept(int fd, Handler handler);
+
+	/// <summary>
+	/// Connect fd to addr, which must stay valid until the completion.
+	/// </summary>
+	bool Connect(int fd, const struct sockaddr* addr, socklen_t length, Handler handler);
+
+	/// <summary>
+	/// Multishot recv into the provided buffers; Result 0 is the end of the stream.  operation, if given,
+	/// receives what Cancel takes.
+	/// </summary>
+	bool Recv(int fd, Handler handler, UINT64* operation = NULL);
+
+	/// <summary>
+	/// Cancel an operation that has not had its last completion.  Completions already on their way still
+	/// arrive; an operation that has ended meanwhile is left alone.
+	/// </summary>
+	bool Cancel(UINT64 operation);
+
+	/// <summary>
+	/// Send all of length bytes.  With link, the next operation queued starts only after this one
+	/// succeeds, and is cancelled (-ECANCELED) if it does not; it should be a send on the same socket,
+	/// since this one is sent MSG_MORE.  Reserve room for the whole chain first.
+	/// </summary>
+	bool Send(int fd, const void* data, size_t length, bool link, Handler handler);
+
+	/// <summary>
+	/// Make room for count operations queued back to back, submitting what is queued if need be.
+	/// False if the ring can never hold that many.
+	/// </summary>
+	bool Reserve(UINT32 count);
+
+	/// <summary>
+	/// Hand everything queued to the kernel.  The loop calls this before it waits.
+	/// </summary>
+	int Submit();
+
+	/// <summary>
+	/// Run the handler of every completion waiting.
+	/// </summary>
+	void Reap();
+
+	UINT32 BufferSize() const { return _bufferSize; }
+	const IoUringStats& Stats() const { return _stats; }
+
+private:
+
+	IoUring(const IoUring&) = delete;
+	IoUring& operator=(const IoUring&) = delete;
+
+	struct Ring;
+
+	struct io_uring_sqe* Queue(UINT64* userData, Handler handler);
+	UINT64 AddHandler(Handler handler);
+	void Recycle(UINT16 bufferId);
+
+	int                  _fd;
+	Ring*                _ring;
+	UINT32               _bufferCount;
+	UINT32               _bufferSize;
+	BYTE*                _buffers;
+	UINT32               _queued;        // operations queued since the last Submit
+	std::deque<Handler>  _handlers;      // by the low 32 bits of user_data
+	UINT32               _serial;        // the high 32 bits, so a cancel cannot reach a reused handler slot
+	std::vector<UINT32>  _freeHandlers;
+	IoUringStats         _stats;
+};
+
+#endif
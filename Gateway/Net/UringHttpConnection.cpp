@@ -0,0 +1,247 @@
+//--------------------------------------------------------------------------
+// <copyright file="UringHttpConnection.cpp" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// HTTP/1.1 client connection whose socket I/O goes through the loop's io_uring.
+// </summary>
+//--------------------------------------------------------------------------
+
+#include "UringHttpConnection.h"
+#include "CompanionProbes.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static const size_t MaxChainRequests = 64;     // two sends each
+
+/// <summary>
+/// The requests one chain of linked sends writes, kept until its last send completes.
+/// </summary>
+struct UringHttpConnection::Chain
+{
+	std::vector<std::shared_ptr<HttpRequest>> Requests;
+	UINT32                                    Remaining;    // sends not yet completed
+	bool                                      Failed;
+
+	Chain() : Remaining(0), Failed(false) {}
+};
+
+//------------------------------------------------------------------------------------------------------
+
+UringHttpConnection::UringHttpConnection(EventLoop& loop, const std::string& host, UINT16 port)
+	: HttpConnection(loop, host, port), _ring(NULL), _fd(-1), _generation(0), _sending(false), _receiving(false), _recv(0), _alive(std::make_shared<char>(0))
+{
+}
+
+UringHttpConnection::~UringHttpConnection()
+{
+	Abort(COMPANION_E_CANCELLED);
+}
+
+bool UringHttpConnection::Connect()
+{
+	_ring = _loop.Uring();
+	if (_ring == NULL)
+		return false;
+
+	// Kept by the completion: the kernel reads the address when the connect is submitted.
+	std::shared_ptr<struct sockaddr_in> addr = std::make_shared<struct sockaddr_in>();
+	addr->sin_family = AF_INET;
+	addr->sin_port = htons(_port);
+	if (inet_pton(AF_INET, _host.c_str(), &addr->sin_addr) != 1)
+		return false;
+
+	// Blocking: io_uring waits on the socket itself, and would hand EAGAIN back on a non-blocking one.
+	_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (_fd < 0)
+		return false;
+
+	int one = 1;
+	setsockopt(_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	UINT32 generation = ++_generation;
+	std::weak_ptr<char> alive = _alive;
+	_connecting = true;
+	_parser.Reset();
+	if (!_ring->Connect(_fd, (const struct sockaddr*)addr.get(), sizeof(*addr), [this, alive, generation, addr](const IoUringCompletion& completion)
+		{
+			if (!alive.expired())
+				OnConnected(generation, completion.Result);
+		}))
+	{
+		CloseSocket();
+		return false;
+	}
+	return true;
+}
+
+void UringHttpConnection::OnConnected(UINT32 generation, INT32 result)
+{
+	if (generation != _generation || _fd < 0)
+		return;
+
+	if (result < 0 || (!_readPaused && !ArmRecv()))
+	{
+		Abort(COMPANION_E_CONNECTION);
+		return;
+	}
+	_connecting = false;
+	StartWrites();
+}
+
+void UringHttpConnection::CloseSocket()
+{
+	if (_fd >= 0)
+	{
+		// Ends the recv (and a chain still sending); their completions then find a new generation.
+		shutdown(_fd, SHUT_RDWR);
+		close(_fd);
+		_fd = -1;
+		++_generation;
+	}
+	_connecting = false;
+	_sending = false;
+	_receiving = false;
+	_queued = 0;
+	_written = 0;
+	_readPaused = false;
+}
+
+bool UringHttpConnection::ArmRecv()
+{
+	UINT32 generation = _generation;
+	std::weak_ptr<char> alive = _alive;
+	_receiving = _ring->Recv(_fd, [this, alive, generation](const IoUringCompletion& completion)
+	{
+		if (!alive.expired())
+			OnRecv(generation, completion);
+	}, &_recv);
+	return _receiving;
+}
+
+void UringHttpConnection::UpdateReading()
+{
+	if (_fd < 0 || _connecting)
+		return;
+
+	// Resumed before the cancelled recv's last completion: that completion arms the next.
+	if (_readPaused)
+	{
+		if (_receiving && !_ring->Cancel(_recv))
+			Abort(COMPANION_E_CONNECTION);
+	}
+	else if (!_receiving && !ArmRecv())
+	{
+		Abort(COMPANION_E_CONNECTION);
+	}
+}
+
+void UringHttpConnection::OnRecv(UINT32 generation, const IoUringCompletion& completion)
+{
+	if (generation != _generation || _fd < 0)
+		return;
+	if (!completion.More)
+		_receiving = false;
+
+	if (completion.Result > 0 && completion.Data != NULL)
+	{
+		// Parsed where the kernel put it; the parser copies what it keeps.
+		if (!Receive(completion.Data, (size_t)completion.Result))
+			return;
+	}
+	else if (completion.Result == 0)
+	{
+		ReceiveEof();
+		return;
+	}
+	else if (completion.Result != -ENOBUFS && completion.Result != -ECANCELED)
+	{
+		Abort(COMPANION_E_CONNECTION);
+		return;
+	}
+
+	// A multishot recv ends when the buffers run out, among other things; this one's come back on return.
+	if (!completion.More && !_receiving && !_readPaused && !ArmRecv())
+		Abort(COMPANION_E_CONNECTION);
+}
+
+void UringHttpConnection::StartWrites()
+{
+	if (_fd < 0 || _connecting || _sending || _queued >= _pending.size())
+		return;
+
+	size_t count = _pending.size() - _queued;
+	if (count > MaxChainRequests)
+		count = MaxChainRequests;
+	if (!_ring->Reserve((UINT32)(count * 2)))
+	{
+		Abort(COMPANION_E_CONNECTION);
+		return;
+	}
+
+	std::shared_ptr<Chain> chain = std::make_shared<Chain>();
+	chain->Requests.reserve(count);
+	for (size_t i = 0; i < count; ++i)
+		chain->Requests.push_back(_pending[_queued + i].Request);
+
+	UINT32 generation = _generation;
+	std::weak_ptr<char> alive = _alive;
+	for (size_t i = 0; i < count; ++i)
+	{
+		const HttpRequest& request = *chain->Requests[i];
+		bool lastRequest = i + 1 == count;
+		for (int part = 0; part < 2; ++part)
+		{
+			const void* data = part == 0 ? (const void*)request.Head : (const void*)request.Body;
+			size_t length = part == 0 ? request.HeadLength : request.BodyLength;
+			bool lastPart = part == 1 || request.BodyLength == 0;
+			if (length == 0 && part == 1)
+				break;
+
+			// Every send but the chain's last is linked to the next.
+			bool link = !(lastRequest && lastPart);
+			++chain->Remaining;
+			_ring->Send(_fd, data, length, link, [this, alive, generation, chain, i, length, lastPart](const IoUringCompletion& completion)
+			{
+				if (completion.Result < 0 || (size_t)completion.Result != length)
+					chain->Failed = true;
+				else if (lastPart)
+				{
+					const HttpRequest& sent = *chain->Requests[i];
+					COMPANION_PROBE3(send, sent.Cid, sent.SeqNum, (UINT32)(sent.HeadLength + sent.BodyLength));
+				}
+				if (--chain->Remaining == 0 && !alive.expired())
+					OnSent(generation, chain);
+			});
+			if (lastPart)
+				break;
+		}
+	}
+
+	_queued += count;
+	_sending = true;
+}
+
+void UringHttpConnection::OnSent(UINT32 generation, const std::shared_ptr<Chain>& chain)
+{
+	if (generation != _generation || _fd < 0)
+		return;
+
+	_sending = false;
+	if (chain->Failed)
+	{
+		Abort(COMPANION_E_CONNECTION);
+		return;
+	}
+
+	// Responses may already have completed some of these; _written never runs ahead of _queued.
+	_written += chain->Requests.size();
+	if (_written > _queued)
+		_written = _queued;
+	StartWrites();
+}
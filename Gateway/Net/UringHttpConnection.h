@@ -0,0 +1,71 @@
+//--------------------------------------------------------------------------
+// <copyright file="UringHttpConnection.h" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// HTTP/1.1 client connection whose socket I/O goes through the loop's io_uring.
+// </summary>
+//--------------------------------------------------------------------------
+
+/*
+ Using the io_uring connection:
+ Created by HttpConnection::Create with NetTransportUring; callers see only HttpConnection.  The connect is
+ an IORING_OP_CONNECT, and from then on one multishot recv stays armed on the socket, so responses arrive
+ as completions carrying a provided buffer (IoUring.h) with no readiness event or recv call in between.
+ They are parsed straight out of that buffer.
+
+ Requests are not copied into an output buffer.  Every request queued while nothing is being sent goes out
+ as one chain of linked sends, head then body of each in turn, in a single submission; requests queued
+ meanwhile make up the next chain once it completes.  The chain holds the requests it sends, so a response
+ that arrives before its request is fully written (a server refusing it on the head) cannot free the bytes
+ under the kernel.  If a send fails the rest of the chain is cancelled and the connection aborted.
+
+ Pausing cancels the recv and resuming arms a new one; data the cancelled recv had already taken is still
+ parsed.  Closing shuts the socket down, which ends its operations; completions for a socket that has since
+ been replaced, or for a connection that has been destroyed, are ignored.
+ */
+
+#ifndef URINGHTTPCONNECTION_H
+#define URINGHTTPCONNECTION_H
+
+#include "HttpConnection.h"
+#include "IoUring.h"
+
+#include <memory>
+
+class UringHttpConnection : public HttpConnection
+{
+public:
+
+	UringHttpConnection(EventLoop& loop, const std::string& host, UINT16 port);
+	~UringHttpConnection();
+
+	NetTransport Transport() const { return NetTransportUring; }
+
+protected:
+
+	bool Connect();
+	void CloseSocket();
+	bool IsOpen() const { return _fd >= 0; }
+	void StartWrites();
+	void UpdateReading();
+
+private:
+
+	struct Chain;
+
+	void OnConnected(UINT32 generation, INT32 result);
+	bool ArmRecv();
+	void OnRecv(UINT32 generation, const IoUringCompletion& completion);
+	void OnSent(UINT32 generation, const std::shared_ptr<Chain>& chain);
+
+	IoUring*              _ring;
+	int                   _fd;
+	UINT32                _generation;    // of _fd; completions for earlier sockets are ignored
+	bool                  _sending;       // a chain is in flight
+	bool                  _receiving;     // a recv is armed, until its last completion
+	UINT64                _recv;          // which, for IoUring::Cancel
+	std::shared_ptr<char> _alive;         // its weak_ptrs in the completions expire with the connection
+};
+
+#endif
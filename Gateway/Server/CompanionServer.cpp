@@ -0,0 +1,666 @@
+//--------------------------------------------------------------------------
+// <copyright file="CompanionServer.cpp" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// Stand-in STB companion endpoint with injected delay and loss.
+// </summary>
+//--------------------------------------------------------------------------
+
+#include "CompanionServer.h"
+#include "HttpConnection.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+static const size_t ReadChunkSize = 16384;
+static const size_t MaxHeadLength = 65536;
+static const size_t MaxBodyLength = 1 << 20;
+static const UINT64 CpuSampleUs = 100000;
+
+static const char DefaultAnswer[] = "<response status=\"ok\"/>";
+
+/// <summary>
+/// Value of name=value in the query string of a request target, or empty.
+/// </summary>
+static std::string QueryValue(const std::string& target, const char* name)
+{
+	size_t nameLength = strlen(name);
+	size_t at = target.find('?');
+	while (at != std::string::npos)
+	{
+		++at;
+		size_t end = target.find('&', at);
+		if (end == std::string::npos)
+			end = target.length();
+		if (end - at > nameLength && target.compare(at, nameLength, name) == 0 && target[at + nameLength] == '=')
+			return target.substr(at + nameLength + 1, end - at - nameLength - 1);
+		at = end < target.length() ? end : std::string::npos;
+	}
+	return std::string();
+}
+
+/// <summary>
+/// CPU time used by the calling thread.
+/// </summary>
+static UINT64 ThreadCpuUs()
+{
+	struct timespec ts;
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0)
+		return 0;
+	return (UINT64)ts.tv_sec * 1000000 + (UINT64)ts.tv_nsec / 1000;
+}
+
+static const char* Reason(int status)
+{
+	switch (status)
+	{
+	case 403: return "Forbidden";
+	case 429: return "Too Many Requests";
+	case 503: return "Service Unavailable";
+	default:  return "Error";
+	}
+}
+
+static std::string StatusOnly(int status, const char* reason)
+{
+	char head[128];
+	snprintf(head, sizeof(head), "HTTP/1.1 %d %s\r\nContent-Length: 0\r\n\r\n", status, reason);
+	return head;
+}
+
+//------------------------------------------------------------------------------------------------------
+
+CompanionServer::CompanionServer(EventLoop& loop, const CompanionPairingInfo& pairing, const CompanionServerOptions& options)
+	: _loop(loop), _pairing(pairing), _options(options), _ring(NULL), _alive(std::make_shared<char>(0)), _listenFd(-1), _port(0), _random(options.Seed != 0 ? options.Seed : 1), _windows(1),
+		_cpuSampleUs(0), _cpuSampleCpuUs(0)
+{
+}
+
+CompanionServer::~CompanionServer()
+{
+	Stop();
+}
+
+COMPANION_RESULT CompanionServer::Start()
+{
+	COMPANION_RESULT result = _codec.Open(_pairing);
+	if (result != COMPANION_OK)
+		return result;
+
+	struct sockaddr_in addr = {};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(_options.Port);
+	if (inet_pton(AF_INET, _options.Address.c_str(), &addr.sin_addr) != 1)
+		return COMPANION_E_CONNECTION;
+
+	_ring = _options.Transport == NetTransportUring ? _loop.Uring() : NULL;
+
+	// io_uring sockets stay blocking: the ring waits on them itself.
+	_listenFd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC | (_ring != NULL ? 0 : SOCK_NONBLOCK), 0);
+	if (_listenFd < 0)
+		return COMPANION_E_CONNECTION;
+
+	int one = 1;
+	setsockopt(_listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	socklen_t length = sizeof(addr);
+	if (bind(_listenFd, (struct sockaddr*)&addr, sizeof(addr)) != 0
+		|| listen(_listenFd, 128) != 0
+		|| getsockname(_listenFd, (struct sockaddr*)&addr, &length) != 0
+		|| (_ring != NULL ? !ArmAccept() : !_loop.Watch(_listenFd, EPOLLIN, [this](UINT32) { OnAccept(); })))
+	{
+		close(_listenFd);
+		_listenFd = -1;
+		return COMPANION_E_CONNECTION;
+	}
+
+	_port = ntohs(addr.sin_port);
+	return COMPANION_OK;
+}
+
+void CompanionServer::Stop()
+{
+	if (_listenFd >= 0)
+	{
+		// On io_uring the shutdown ends the multishot accept.
+		if (_ring != NULL)
+			shutdown(_listenFd, SHUT_RDWR);
+		else
+			_loop.Unwatch(_listenFd);
+		close(_listenFd);
+		_listenFd = -1;
+	}
+
+	std::unordered_map<int, ConnectionRef> connections;
+	connections.swap(_connections);
+	for (std::unordered_map<int, ConnectionRef>::iterator it = connections.begin(); it != connections.end(); ++it)
+		Close(it->second);
+}
+
+void CompanionServer::OnAccept()
+{
+	for (;;)
+	{
+		int fd = accept4(_listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+
+		AddConnection(fd);
+	}
+}
+
+void CompanionServer::AddConnection(int fd)
+{
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	ConnectionRef connection = std::make_shared<Connection>();
+	connection->Fd = fd;
+	if (_ring != NULL ? !ArmRecv(connection) : !_loop.Watch(fd, EPOLLIN | EPOLLRDHUP, [this, connection](UINT32 events) { OnEvents(connection, events); }))
+	{
+		close(fd);
+		return;
+	}
+
+	_connections[fd] = connection;
+	++_stats.Connections;
+}
+
+void CompanionServer::OnEvents(ConnectionRef connection, UINT32 events)
+{
+	if ((events & EPOLLOUT) && connection->Fd >= 0)
+		Flush(connection);
+
+	if ((events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) && connection->Fd >= 0 && !OnReadable(connection))
+	{
+		_connections.erase(connection->Fd);
+		Close(connection);
+	}
+}
+
+bool CompanionServer::OnReadable(ConnectionRef connection)
+{
+	char buffer[ReadChunkSize];
+	for (;;)
+	{
+		ssize_t received = recv(connection->Fd, buffer, sizeof(buffer), 0);
+		if (received < 0)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		if (received == 0)
+			return false;
+
+		if (!Receive(connection, buffer, (size_t)received))
+			return false;
+		if (connection->Fd < 0)
+			break;      // closed while answering
+	}
+	return true;
+}
+
+bool CompanionServer::ArmAccept()
+{
+	std::weak_ptr<char> alive = _alive;
+	return _ring->Accept(_listenFd, [this, alive](const IoUringCompletion& completion)
+	{
+		if (alive.expired())
+		{
+			if (completion.Result >= 0)
+				close(completion.Result);
+			return;
+		}
+
+		if (completion.Result >= 0)
+			AddConnection(completion.Result);
+		// Ended by Stop's shutdown (EINVAL), or by the kernel for its own reasons, after which it is re-armed.
+		if (!completion.More && _listenFd >= 0 && completion.Result != -EINVAL && completion.Result != -EBADF)
+			ArmAccept();
+	});
+}
+
+bool CompanionServer::ArmRecv(ConnectionRef connection)
+{
+	std::weak_ptr<char> alive = _alive;
+	return _ring->Recv(connection->Fd, [this, alive, connection](const IoUringCompletion& completion)
+	{
+		if (!alive.expired())
+			OnRecv(connection, completion);
+	});
+}
+
+void CompanionServer::OnRecv(ConnectionRef connection, const IoUringCompletion& completion)
+{
+	if (connection->Fd < 0)
+		return;
+
+	bool open;
+	if (completion.Result > 0 && completion.Data != NULL)
+		open = Receive(connection, completion.Data, (size_t)completion.Result);
+	else
+		open = completion.Result == -ENOBUFS;
+	if (connection->Fd < 0)
+		return;     // closed while answering
+
+	// The multishot recv ends when the provided buffers run out; they are back by the time it is re-armed.
+	if (!open || (!completion.More && !ArmRecv(connection)))
+	{
+		_connections.erase(connection->Fd);
+		Close(connection);
+	}
+}
+
+bool CompanionServer::Receive(ConnectionRef connection, char* data, size_t length)
+{
+	// What is left of a refused request's body is dropped as it arrives.
+	size_t skip = connection->Discard < length ? connection->Discard : length;
+	connection->Discard -= skip;
+	data += skip;
+	length -= skip;
+	if (length == 0)
+		return true;
+
+	// Whole requests are taken where they were received; only one straddling reads is pieced together in In.
+	std::string& in = connection->In;
+	bool buffered = !in.empty();
+	if (buffered)
+	{
+		in.append(data, length);
+		_stats.BytesBuffered += length;
+		data = &in[0];
+		length = in.length();
+	}
+
+	size_t offset = 0;
+	bool complete = true;
+	while (complete && offset < length)
+	{
+		size_t used = 0;
+		if (!TakeRequest(connection, data + offset, length - offset, &used, &complete))
+			return false;
+		offset += used;
+	}
+	if (connection->Fd < 0)
+		return true;
+
+	if (buffered)
+	{
+		in.erase(0, offset);
+	}
+	else if (offset < length)
+	{
+		in.assign(data + offset, length - offset);
+		_stats.BytesBuffered += length - offset;
+	}
+	return true;
+}
+
+bool CompanionServer::TakeRequest(ConnectionRef connection, char* data, size_t length, size_t* used, bool* complete)
+{
+	*used = 0;
+	*complete = false;
+
+	HttpRequestHead head;
+	bool headComplete = false;
+	if (!ParseHttpRequestHead(data, length, MaxHeadLength, MaxBodyLength, &head, &headComplete))
+		return false;
+	if (!headComplete)
+		return true;
+
+	size_t headLength = head.HeadLength;
+	size_t contentLength = head.ContentLength;
+	if (!connection->Admitted)
+	{
+		std::string target(data + head.TargetOffset, head.TargetLength);
+		int status = Admit(target, contentLength, &connection->SeqNum);
+		if (status != 0)
+		{
+			// Refused on the head: whatever of the body is here goes now, the rest as it arrives.
+			size_t available = length - headLength < contentLength ? length - headLength : contentLength;
+			*used = headLength + available;
+			connection->Discard = contentLength - available;
+			++_stats.Requests;
+			++_stats.RefusedEarly;
+			_stats.BodyBytesDropped += contentLength;
+			Refuse(connection, status);
+			*complete = connection->Fd >= 0;
+			return true;
+		}
+		connection->Admitted = true;
+	}
+
+	if (length < headLength + contentLength)
+		return true;
+
+	// The body is decoded where it lies.
+	*used = headLength + contentLength;
+	connection->Admitted = false;
+	OnRequest(connection, connection->SeqNum, (BYTE*)data + headLength, (UINT32)contentLength);
+	*complete = connection->Fd >= 0;
+	return true;
+}
+
+int CompanionServer::Admit(const std::string& target, size_t contentLength, UINT32* seqNum)
+{
+	// Cheapest first; only the signature check costs anything, a ComputeHash over 16 bytes.
+	std::string cid = QueryValue(target, "cid");
+	*seqNum = 0;
+	if (!_codec.IsTestPairing() && cid != _codec.DeviceId())
+	{
+		++_stats.Rejected;
+		return 403;
+	}
+
+	if (Overloaded())
+	{
+		++_stats.Shed;
+		return 503;
+	}
+
+	if (!_codec.IsTestPairing())
+	{
+		// The same checks decryptResponse: makes, in the other direction.
+		std::string hash = QueryValue(target, "hash");
+		UINT32 length = 0;
+		if (_codec.Verify(hash.data(), (UINT32)hash.length(), seqNum, &length) != COMPANION_OK
+			|| strtoul(QueryValue(target, "seq").c_str(), NULL, 16) != *seqNum
+			|| length != contentLength || contentLength == 0)
+		{
+			++_stats.Rejected;
+			return 403;
+		}
+	}
+
+	// The token is taken before the window records the sequence number, so a throttled request can be
+	// sent again, and given back if the window refuses it: only new, verified requests spend tokens, so
+	// forged and replayed ones cannot use up a client's.
+	if (!TakeToken(cid))
+	{
+		++_stats.Throttled;
+		return 429;
+	}
+
+	if (_options.CheckSequence && !_codec.IsTestPairing())
+	{
+		SequenceCheck check = _windows.Check(cid, *seqNum);
+		if (check != SequenceAccepted)
+		{
+			ReturnToken(cid);
+			++(check == SequenceDuplicate ? _stats.Replayed : _stats.OutOfWindow);
+			return 403;
+		}
+	}
+	return 0;
+}
+
+bool CompanionServer::Overloaded()
+{
+	if (_options.ShedCpuPercent == 0)
+		return false;
+
+	UINT64 nowUs = EventLoop::NowUs();
+	if (nowUs - _cpuSampleUs >= CpuSampleUs)
+	{
+		UINT64 cpuUs = ThreadCpuUs();
+		if (_cpuSampleUs != 0)
+			_stats.CpuPercent = (UINT32)((cpuUs - _cpuSampleCpuUs) * 100 / (nowUs - _cpuSampleUs));
+		_cpuSampleUs = nowUs;
+		_cpuSampleCpuUs = cpuUs;
+	}
+
+	// Over budget, admit ShedCpuPercent / CpuPercent of the requests, which brings the load back to it.
+	return _stats.CpuPercent > _options.ShedCpuPercent && Random() % _stats.CpuPercent >= _options.ShedCpuPercent;
+}
+
+bool CompanionServer::TakeToken(const std::string& cid)
+{
+	if (_options.RatePerCid == 0)
+		return true;
+
+	double burst = _options.BurstPerCid != 0 ? _options.BurstPerCid : _options.RatePerCid;
+	UINT64 nowUs = EventLoop::NowUs();
+	TokenBucket& bucket = _buckets[cid];
+	if (bucket.LastUs == 0)
+		bucket.Tokens = burst;
+	else
+		bucket.Tokens += (double)(nowUs - bucket.LastUs) * _options.RatePerCid / 1e6;
+	if (bucket.Tokens > burst)
+		bucket.Tokens = burst;
+	bucket.LastUs = nowUs;
+
+	if (bucket.Tokens < 1)
+		return false;
+	bucket.Tokens -= 1;
+	return true;
+}
+
+void CompanionServer::ReturnToken(const std::string& cid)
+{
+	if (_options.RatePerCid != 0)
+		_buckets[cid].Tokens += 1;
+}
+
+void CompanionServer::Refuse(ConnectionRef connection, int status)
+{
+	// Answered at once, but still in request order behind anything admitted before it.
+	Answer answer;
+	answer.Bytes = StatusOnly(status, Reason(status));
+	answer.Ready = false;
+	UINT64 answerId = connection->FrontId + connection->Answers.size();
+	connection->Answers.push_back(std::move(answer));
+	MarkReady(connection, answerId);
+}
+
+void CompanionServer::OnRequest(ConnectionRef connection, UINT32 seqNum, BYTE* body, UINT32 length)
+{
+	++_stats.Requests;
+
+	Answer answer;
+	answer.Bytes = BuildAnswer(seqNum, body, length);
+	answer.Ready = false;
+
+	UINT64 answerId = connection->FrontId + connection->Answers.size();
+	connection->Answers.push_back(std::move(answer));
+
+	if (_options.LossPercent != 0 && Random() % 100 < _options.LossPercent)
+	{
+		// Never ready, so this connection answers nothing more.
+		++_stats.Lost;
+		return;
+	}
+
+	UINT32 delayMs = _options.DelayMs;
+	if (_options.JitterMs != 0)
+		delayMs += Random() % (_options.JitterMs + 1);
+	if (_options.SlowPercent != 0 && Random() % 100 < _options.SlowPercent)
+	{
+		delayMs = _options.SlowDelayMs;
+		++_stats.Slow;
+	}
+
+	if (delayMs == 0)
+	{
+		MarkReady(connection, answerId);
+		return;
+	}
+
+	// A stopped server has closed the connection; the timer must not touch the server then.
+	_loop.AddTimer(delayMs, [this, connection, answerId]()
+	{
+		if (connection->Fd >= 0)
+			MarkReady(connection, answerId);
+	});
+}
+
+std::string CompanionServer::BuildAnswer(UINT32 seqNum, BYTE* body, UINT32 length)
+{
+	std::string plain;
+
+	if (_codec.IsTestPairing())
+	{
+		plain.assign((const char*)body, length);
+	}
+	else
+	{
+		// Admit has verified the signature; the body must still decode to what it claims.
+		UINT32 plainLength = 0;
+		++_stats.Decoded;
+		if (_codec.DecodeBody(body, length, &plainLength) != COMPANION_OK)
+		{
+			++_stats.Rejected;
+			return StatusOnly(403, "Forbidden");
+		}
+		plain.assign((const char*)&body[COMPANION_ORIG_LENGTH_SIZE], plainLength);
+	}
+
+	std::string reply = _handler ? _handler(plain, seqNum) : std::string(DefaultAnswer);
+
+	char head[256];
+	if (_codec.IsTestPairing())
+	{
+		snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\nContent-Length: %zu\r\nContent-Type: text/xml\r\n\r\n", reply.length());
+		return head + reply;
+	}
+
+	std::string encoded(CompanionCodec::EncodedLength((UINT32)reply.length()), '\0');
+	char signature[COMPANION_SIGNATURE_CHARS + 1];
+	if (_codec.EncodeBody(reply.data(), (UINT32)reply.length(), (BYTE*)&encoded[0], (UINT32)encoded.length()) != COMPANION_OK
+		|| _codec.Sign(seqNum, (UINT32)encoded.length(), signature) != COMPANION_OK)
+		return StatusOnly(500, "Internal Server Error");
+
+	snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\nContent-Length: %zu\r\n%s: %s\r\n%s: %s\r\n\r\n", encoded.length(),
+		COMPANION_SIGNATURE_HEADER, signature, COMPANION_ENCODING_HEADER, COMPANION_ENCODING_VALUE);
+	return head + encoded;
+}
+
+void CompanionServer::MarkReady(ConnectionRef connection, UINT64 answerId)
+{
+	if (connection->Fd < 0)
+		return;
+
+	connection->Answers[answerId - connection->FrontId].Ready = true;
+
+	// Answers go out in request order, so a ready one may still wait for those ahead of it.
+	while (!connection->Answers.empty() && connection->Answers.front().Ready)
+	{
+		connection->Out += connection->Answers.front().Bytes;
+		connection->Answers.pop_front();
+		++connection->FrontId;
+		++_stats.Answered;
+	}
+	Flush(connection);
+}
+
+void CompanionServer::Flush(ConnectionRef connection)
+{
+	if (_ring != NULL)
+	{
+		SendUring(connection);
+		return;
+	}
+
+	while (connection->OutOffset < connection->Out.length())
+	{
+		ssize_t written = send(connection->Fd, connection->Out.data() + connection->OutOffset, connection->Out.length() - connection->OutOffset, MSG_NOSIGNAL);
+		if (written < 0)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			if (errno == EINTR)
+				continue;
+			_connections.erase(connection->Fd);
+			Close(connection);
+			return;
+		}
+		connection->OutOffset += (size_t)written;
+	}
+
+	if (connection->OutOffset == connection->Out.length())
+	{
+		connection->Out.clear();
+		connection->OutOffset = 0;
+	}
+
+	UINT32 events = EPOLLIN | EPOLLRDHUP;
+	if (!connection->Out.empty())
+		events |= EPOLLOUT;
+	_loop.Modify(connection->Fd, events);
+}
+
+void CompanionServer::SendUring(ConnectionRef connection)
+{
+	if (connection->Sending || connection->Out.empty())
+		return;
+
+	// Answers made ready meanwhile collect in Out and go with the next send.
+	connection->InFlight.swap(connection->Out);
+	connection->Out.clear();
+	connection->Sending = true;
+
+	std::weak_ptr<char> alive = _alive;
+	bool queued = _ring->Send(connection->Fd, connection->InFlight.data(), connection->InFlight.length(), false,
+		[this, alive, connection](const IoUringCompletion& completion)
+	{
+		// The connection, and with it InFlight, is held here until the kernel is done with it.
+		connection->Sending = false;
+		if (alive.expired() || connection->Fd < 0)
+			return;
+		if (completion.Result < 0 || (size_t)completion.Result != connection->InFlight.length())
+		{
+			_connections.erase(connection->Fd);
+			Close(connection);
+			return;
+		}
+		connection->InFlight.clear();
+		SendUring(connection);
+	});
+	if (!queued)
+	{
+		connection->Sending = false;
+		_connections.erase(connection->Fd);
+		Close(connection);
+	}
+}
+
+void CompanionServer::Close(ConnectionRef connection)
+{
+	if (connection->Fd < 0)
+		return;
+
+	// On io_uring the shutdown ends the connection's recv and send; InFlight stays until the send completes.
+	if (_ring != NULL)
+		shutdown(connection->Fd, SHUT_RDWR);
+	else
+		_loop.Unwatch(connection->Fd);
+	close(connection->Fd);
+	connection->Fd = -1;
+	connection->Answers.clear();
+	connection->Out.clear();
+}
+
+UINT32 CompanionServer::Random()
+{
+	// xorshift32: cheap, and the same sequence for the same Seed.
+	_random ^= _random << 13;
+	_random ^= _random >> 17;
+	_random ^= _random << 5;
+	return _random;
+}
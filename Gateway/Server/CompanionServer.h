@@ -0,0 +1,223 @@
+//--------------------------------------------------------------------------
+// <copyright file="CompanionServer.h" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// Stand-in STB companion endpoint with injected delay and loss.
+// </summary>
+//--------------------------------------------------------------------------
+
+/*
+ Using the companion server:
+ CompanionServer answers the companion protocol as an STB does, on an EventLoop, so that the client can be
+ exercised without one:
+
+    CompanionServerOptions options;
+    options.Port = 0;               // any free port; read it back with Port()
+    options.LossPercent = 1;
+    CompanionServer stb(loop, pairing, options);
+    stb.Start();
+
+ Each request's hash query is verified against its body and the body decoded with the same pairing the
+ client uses.  The answer (by default <response status="ok"/>, or whatever the Handler returns) is encoded
+ and signed with the request's sequence number.  Requests that fail verification get 403.  With
+ CheckSequence, so do requests whose sequence number was seen before or has fallen out of the window
+ (SequenceWindow.h), as an STB refuses a replayed request.
+
+ The hash signs only the sequence number, the body length, the address and the GUID, so a request is
+ admitted or refused on its head alone, before its body is read: in order, the cid must be the pairing's,
+ the loop thread must have CPU to spare, the hash, seq and Content-Length must agree, the cid must have a
+ token left, and with CheckSequence the sequence number must be new (or the token is given back).  A
+ refused request is answered at once and its body discarded undecoded as it arrives, so a flood of forged,
+ replayed or excess requests costs one ComputeHash each at most and never a decode.  The stats count what
+ was refused that way.
+    RatePerCid      - token bucket per cid: requests per second, bursts of BurstPerCid; over it, 429
+    ShedCpuPercent  - when the loop thread used more CPU than this over the last 100 ms, only the
+                      share of requests the budget allows is admitted and the rest get 503
+
+ Requests are parsed, and their bodies decoded, where they were received: in the read buffer on epoll, in
+ the kernel-selected provided buffer on io_uring (Transport, IoUring.h).  Only the bytes of a request that
+ straddles reads are copied aside, and counted in BytesBuffered.  On io_uring one multishot accept and one
+ multishot recv per connection replace the readiness events and their accept and recv calls, and each
+ connection has one send of its ready answers in flight at a time.
+
+ Answers to admitted requests are held back by DelayMs plus up to JitterMs; SlowPercent of them take SlowDelayMs instead, and
+ LossPercent are never answered at all.  Answers leave each connection in request order, as HTTP/1.1 needs,
+ so everything pipelined behind a lost or slow answer waits for it - the head-of-line blocking a busy STB
+ shows.  Seed makes a run repeatable.
+
+ The server must be started, stopped and destroyed on its loop thread.
+ */
+
+#ifndef COMPANIONSERVER_H
+#define COMPANIONSERVER_H
+
+#include "CompanionCodec.h"
+#include "EventLoop.h"
+#include "IoUring.h"
+#include "SequenceWindow.h"
+
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct CompanionServerOptions
+{
+	std::string Address;        // listen address
+	UINT16      Port;           // 0 for any free port
+	UINT32      DelayMs;        // before every answer
+	UINT32      JitterMs;       // plus up to this much
+	UINT32      SlowPercent;    // answers that take SlowDelayMs instead
+	UINT32      SlowDelayMs;
+	UINT32      LossPercent;    // requests that are never answered
+	UINT32      Seed;
+	bool        CheckSequence;  // refuse replayed and out-of-window sequence numbers
+	UINT32      RatePerCid;     // requests per second admitted per cid; 0 for no limit
+	UINT32      BurstPerCid;    // bucket size; 0 for one second's worth
+	UINT32      ShedCpuPercent; // loop thread CPU above which requests are shed; 0 never sheds
+	NetTransport Transport;     // socket I/O; io_uring falls back to epoll
+
+	CompanionServerOptions() : Address("127.0.0.1"), Port(COMPANION_PORT), DelayMs(0), JitterMs(0), SlowPercent(0), SlowDelayMs(0), LossPercent(0), Seed(1), CheckSequence(false),
+		RatePerCid(0), BurstPerCid(0), ShedCpuPercent(0), Transport(NetTransportEpoll) {}
+};
+
+struct CompanionServerStats
+{
+	UINT64 Connections;
+	UINT64 Requests;
+	UINT64 Answered;
+	UINT64 Rejected;            // failed verification or decoding
+	UINT64 Replayed;            // CheckSequence: sequence number seen before
+	UINT64 OutOfWindow;         // CheckSequence: sequence number too far behind
+	UINT64 Throttled;           // over RatePerCid
+	UINT64 Shed;                // over ShedCpuPercent
+	UINT64 RefusedEarly;        // refused on the head, before their body was read: decodes avoided
+	UINT64 BodyBytesDropped;    // the bodies of those, discarded undecoded
+	UINT64 Decoded;             // bodies decoded
+	UINT64 BytesBuffered;       // received bytes copied aside because a request straddled reads
+	UINT32 CpuPercent;          // ShedCpuPercent: loop thread, over the last sample
+	UINT64 Slow;
+	UINT64 Lost;
+
+	CompanionServerStats() : Connections(0), Requests(0), Answered(0), Rejected(0), Replayed(0), OutOfWindow(0), Throttled(0), Shed(0), RefusedEarly(0),
+		BodyBytesDropped(0), Decoded(0), BytesBuffered(0), CpuPercent(0), Slow(0), Lost(0) {}
+};
+
+class CompanionServer
+{
+public:
+
+	/// <summary>
+	/// Produces the plain answer to a decoded request.
+	/// </summary>
+	typedef std::function<std::string(const std::string& request, UINT32 seqNum)> Handler;
+
+	CompanionServer(EventLoop& loop, const CompanionPairingInfo& pairing, const CompanionServerOptions& options = CompanionServerOptions());
+	~CompanionServer();
+
+	/// <summary>
+	/// Derive the encryption state and start listening.
+	/// </summary>
+	COMPANION_RESULT Start();
+
+	/// <summary>
+	/// Close the listening socket and every connection.
+	/// </summary>
+	void Stop();
+
+	void SetHandler(Handler handler) { _handler = std::move(handler); }
+
+	/// <summary>
+	/// The port listened on, once started.
+	/// </summary>
+	UINT16 Port() const { return _port; }
+
+	const CompanionServerStats& Stats() const { return _stats; }
+
+	/// <summary>
+	/// The transport in use once started: the Transport option, unless io_uring was not available.
+	/// </summary>
+	NetTransport Transport() const { return _ring != NULL ? NetTransportUring : NetTransportEpoll; }
+
+private:
+
+	CompanionServer(const CompanionServer&) = delete;
+	CompanionServer& operator=(const CompanionServer&) = delete;
+
+	struct Answer
+	{
+		std::string Bytes;      // complete HTTP response
+		bool        Ready;
+	};
+
+	struct Connection
+	{
+		int                Fd;
+		std::string        In;
+		std::string        Out;
+		size_t             OutOffset;
+		std::string        InFlight;    // io_uring: the answers being sent
+		bool               Sending;
+		std::deque<Answer> Answers;     // in request order
+		UINT64             FrontId;     // id of Answers.front()
+		size_t             Discard;     // body bytes of a refused request still to arrive
+		bool               Admitted;    // the head in In has been admitted; its body is awaited
+		UINT32             SeqNum;      // of the admitted request
+
+		Connection() : Fd(-1), OutOffset(0), Sending(false), FrontId(0), Discard(0), Admitted(false), SeqNum(0) {}
+	};
+
+	struct TokenBucket
+	{
+		double Tokens;
+		UINT64 LastUs;
+
+		TokenBucket() : Tokens(0), LastUs(0) {}
+	};
+
+	typedef std::shared_ptr<Connection> ConnectionRef;
+
+	void OnAccept();
+	void AddConnection(int fd);
+	void OnEvents(ConnectionRef connection, UINT32 events);
+	bool OnReadable(ConnectionRef connection);
+	bool ArmAccept();
+	bool ArmRecv(ConnectionRef connection);
+	void OnRecv(ConnectionRef connection, const IoUringCompletion& completion);
+	bool Receive(ConnectionRef connection, char* data, size_t length);
+	bool TakeRequest(ConnectionRef connection, char* data, size_t length, size_t* used, bool* complete);
+	int Admit(const std::string& target, size_t contentLength, UINT32* seqNum);
+	bool Overloaded();
+	bool TakeToken(const std::string& cid);
+	void ReturnToken(const std::string& cid);
+	void Refuse(ConnectionRef connection, int status);
+	void OnRequest(ConnectionRef connection, UINT32 seqNum, BYTE* body, UINT32 length);
+	std::string BuildAnswer(UINT32 seqNum, BYTE* body, UINT32 length);
+	void MarkReady(ConnectionRef connection, UINT64 answerId);
+	void Flush(ConnectionRef connection);
+	void SendUring(ConnectionRef connection);
+	void Close(ConnectionRef connection);
+	UINT32 Random();
+
+	EventLoop&                                    _loop;
+	CompanionPairingInfo                          _pairing;
+	CompanionServerOptions                        _options;
+	CompanionCodec                                _codec;
+	Handler                                       _handler;
+	IoUring*                                      _ring;              // NULL on epoll
+	std::shared_ptr<char>                         _alive;             // its weak_ptrs in ring completions expire with the server
+	int                                           _listenFd;
+	UINT16                                        _port;
+	UINT32                                        _random;
+	std::unordered_map<int, ConnectionRef>        _connections;
+	SequenceWindowTable                           _windows;
+	std::unordered_map<std::string, TokenBucket>  _buckets;
+	UINT64                                        _cpuSampleUs;       // when CPU use was last sampled
+	UINT64                                        _cpuSampleCpuUs;    // the loop thread's CPU time then
+	CompanionServerStats                          _stats;
+};
+
+#endif
@@ -0,0 +1,390 @@
+//--------------------------------------------------------------------------
+// <copyright file="CompanionArenaBench.cpp" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// Heap calls per companion round trip, with and without per-request arenas.
+// </summary>
+//--------------------------------------------------------------------------
+
+/*
+ Using CompanionArenaBench:
+    CompanionArenaBench [-n iterations] [-s seconds] [-i inflight] [-x responsebytes] [-e 0|1]
+
+ Counts the calls this program makes to operator new, and the blocks the arenas take from the heap, per
+ request, in two parts.
+
+ The data path alone, for iterations round trips without sockets: encode a request and write its HTTP
+ head, feed a canned encrypted response of about responsebytes through an HttpResponseParser, decrypt it
+ and pull its fields out with ParseCompanionResponse.  Once copying everything into a CompanionRequest,
+ the parser's own arena and a std::string, as the string-based calls do; once in a pooled arena
+ (CompanionArena.h) with the body decoded and parsed where it was received.
+
+ A CompanionClient against a CompanionServer on its own loop thread, keeping inflight requests outstanding
+ for seconds; only the client's thread is counted.  Once as usual and once with ArenaResponses, the
+ completion parsing Decoded in place either way.  What remains there is the client's bookkeeping (queued
+ operations, timers, completions), not the request's bytes.
+ */
+
+#include "CompanionArena.h"
+#include "CompanionClient.h"
+#include "CompanionServer.h"
+#include "CompanionXml.h"
+
+#include <future>
+#include <new>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <thread>
+
+static thread_local bool   Counting = false;
+static thread_local UINT64 HeapCalls = 0;
+
+void* operator new(size_t size)
+{
+	if (Counting)
+		++HeapCalls;
+	void* data = malloc(size != 0 ? size : 1);
+	if (data == NULL)
+		throw std::bad_alloc();
+	return data;
+}
+
+// Not inlined, so that the compiler does not see memory from a new expression reaching free.
+__attribute__((noinline)) void operator delete(void* data) noexcept
+{
+	free(data);
+}
+
+__attribute__((noinline)) void operator delete(void* data, size_t) noexcept
+{
+	free(data);
+}
+
+struct ArenaBenchOptions
+{
+	UINT32 Iterations;
+	UINT32 Seconds;
+	UINT32 InFlight;
+	UINT32 ResponseBytes;
+	bool   Encrypted;
+
+	ArenaBenchOptions() : Iterations(200000), Seconds(2), InFlight(16), ResponseBytes(512), Encrypted(true) {}
+};
+
+static void Usage()
+{
+	fprintf(stderr, "usage: CompanionArenaBench [-n iterations] [-s seconds] [-i inflight] [-x responsebytes] [-e 0|1]\n");
+}
+
+static int ParseArguments(int argc, char** argv, ArenaBenchOptions* options)
+{
+	for (int i = 1; i < argc; ++i)
+	{
+		if (i + 1 >= argc)
+			return -1;
+
+		std::string arg = argv[i];
+		UINT32 value = (UINT32)strtoul(argv[++i], NULL, 10);
+		if (arg == "-n")
+			options->Iterations = value;
+		else if (arg == "-s")
+			options->Seconds = value;
+		else if (arg == "-i")
+			options->InFlight = value;
+		else if (arg == "-x")
+			options->ResponseBytes = value;
+		else if (arg == "-e")
+			options->Encrypted = value != 0;
+		else
+			return -1;
+	}
+	return (options->Iterations == 0 || options->Seconds == 0 || options->InFlight == 0) ? -1 : 0;
+}
+
+/// <summary>
+/// A pairing response padded with a tags attribute to about bytes.
+/// </summary>
+static std::string PairingXml(UINT32 bytes)
+{
+	std::string xml = "<response status=\"ok\" usn=\"uuid:0001\" name=\"Living room\" api=\"2\"><device cid=\"abcdef12\" key=\"0123456789ABCDEF\" seq=\"77\" tags=\"";
+	const char* end = "\"/></response>";
+	if (bytes > xml.length() + 14)
+		xml.append(bytes - xml.length() - 14, 't');
+	return xml + end;
+}
+
+/// <summary>
+/// The complete HTTP response a server sends for xml.
+/// </summary>
+static std::string CannedResponse(const CompanionCodec& codec, UINT32 seqNum, const std::string& xml)
+{
+	char head[256];
+	if (codec.IsTestPairing())
+	{
+		snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\nContent-Length: %zu\r\nContent-Type: text/xml\r\n\r\n", xml.length());
+		return head + xml;
+	}
+
+	std::string encoded(CompanionCodec::EncodedLength((UINT32)xml.length()), '\0');
+	char signature[COMPANION_SIGNATURE_CHARS + 1];
+	codec.EncodeBody(xml.data(), (UINT32)xml.length(), (BYTE*)&encoded[0], (UINT32)encoded.length());
+	codec.Sign(seqNum, (UINT32)encoded.length(), signature);
+	snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\nContent-Length: %zu\r\n%s: %s\r\n%s: %s\r\n\r\n", encoded.length(),
+		COMPANION_SIGNATURE_HEADER, signature, COMPANION_ENCODING_HEADER, COMPANION_ENCODING_VALUE);
+	return head + encoded;
+}
+
+/// <summary>
+/// Decode the parsed response and pull out its fields.  False if anything failed.
+/// </summary>
+static bool Finish(const CompanionCodec& codec, HttpResponse& http, bool inPlace, std::string* copy)
+{
+	char* plain = (char*)http.Body;
+	UINT32 plainLength = (UINT32)http.BodyLength;
+	if (!codec.IsTestPairing())
+	{
+		size_t signatureLength = 0;
+		const char* signature = http.Header(COMPANION_SIGNATURE_HEADER, &signatureLength);
+		UINT32 rspSeq = 0;
+		if (signature == NULL)
+			return false;
+		if (inPlace)
+		{
+			if (codec.DecryptResponseInPlace(signature, (UINT32)signatureLength, http.Body, (UINT32)http.BodyLength, &rspSeq, &plain, &plainLength) != COMPANION_OK)
+				return false;
+		}
+		else if (codec.DecryptResponse(signature, (UINT32)signatureLength, http.Body, (UINT32)http.BodyLength, &rspSeq, copy) != COMPANION_OK)
+			return false;
+	}
+	if (!inPlace)
+	{
+		if (codec.IsTestPairing())
+			copy->assign(plain, plainLength);
+		plain = &(*copy)[0];
+		plainLength = (UINT32)copy->length();
+	}
+
+	CompanionResponseFields fields;
+	return ParseCompanionResponse(plain, plainLength, &fields) == COMPANION_OK && fields.Seq.Equals("77");
+}
+
+struct PathResult
+{
+	double              HeapPerRequest;     // operator new calls
+	CompanionArenaStats Arenas;
+	UINT32              Failures;
+
+	PathResult() : HeapPerRequest(0), Failures(0) {}
+};
+
+static PathResult RunDataPath(const ArenaBenchOptions& options, const CompanionCodec& codec, bool arenas)
+{
+	PathResult result;
+	std::string xml = PairingXml(options.ResponseBytes);
+	std::string canned = CannedResponse(codec, 1001, xml);
+	std::string plain = "op=pair&name=Living%20room&tags=livingroom";
+	std::shared_ptr<CompanionArenaPool> pool = std::make_shared<CompanionArenaPool>();
+	HttpResponseParser parser;
+	std::string copy;
+
+	UINT32 warmup = options.Iterations / 10 + 1;
+	for (UINT32 i = 0; i < warmup + options.Iterations; ++i)
+	{
+		if (i == warmup)
+			Counting = true;
+
+		parser.Reset();
+		bool ok;
+		if (arenas)
+		{
+			CompanionArenaLease arena(pool, 1024);
+			CompanionEnvelope envelope;
+			size_t headLength = 0;
+			ok = codec.EncodeRequest(plain.data(), (UINT32)plain.length(), 1001, arena.Get(), &envelope) == COMPANION_OK
+				&& HttpPostHead(arena.Get(), "127.0.0.1", COMPANION_PORT, envelope.Query, envelope.BodyLength, &headLength) != NULL;
+			parser.SetArena(arena.Get());
+			ok = ok && parser.Feed(canned.data(), canned.length()) == canned.length() && parser.GetState() == HttpResponseParser::ParseDone
+				&& Finish(codec, parser.Response(), true, NULL);
+		}
+		else
+		{
+			CompanionRequest request;
+			ok = codec.EncodeRequest(plain.data(), (UINT32)plain.length(), 1001, &request) == COMPANION_OK
+				&& !HttpPostHead("127.0.0.1", COMPANION_PORT, request.Query, request.Body.size()).empty();
+			ok = ok && parser.Feed(canned.data(), canned.length()) == canned.length() && parser.GetState() == HttpResponseParser::ParseDone
+				&& Finish(codec, parser.Response(), false, &copy);
+			std::string().swap(copy);
+		}
+		if (!ok)
+			++result.Failures;
+	}
+
+	Counting = false;
+	result.HeapPerRequest = (double)HeapCalls / options.Iterations;
+	HeapCalls = 0;
+	result.Arenas = pool->Stats();
+	return result;
+}
+
+struct ClientResult
+{
+	double              RequestsPerSecond;
+	double              HeapPerRequest;
+	CompanionArenaStats Arenas;         // over the measured interval
+	UINT32              Failures;
+
+	ClientResult() : RequestsPerSecond(0), HeapPerRequest(0), Failures(0) {}
+};
+
+static ClientResult RunClient(const ArenaBenchOptions& options, const CompanionPairingInfo& pairing, bool arenaResponses)
+{
+	ClientResult result;
+	std::string xml = PairingXml(options.ResponseBytes);
+
+	CompanionServerOptions serverOptions;
+	serverOptions.Port = 0;
+	EventLoop serverLoop;
+	serverLoop.Start();
+	CompanionServer* server = NULL;
+	std::promise<COMPANION_RESULT> started;
+	serverLoop.Post([&]()
+	{
+		server = new CompanionServer(serverLoop, pairing, serverOptions);
+		server->SetHandler([xml](const std::string&, UINT32) { return xml; });
+		started.set_value(server->Start());
+	});
+	if (started.get_future().get() != COMPANION_OK)
+	{
+		fprintf(stderr, "CompanionArenaBench: cannot listen\n");
+		exit(1);
+	}
+
+	EventLoop loop;
+	CompanionClientOptions clientOptions;
+	clientOptions.Port = server->Port();
+	clientOptions.Connections = 4;
+	clientOptions.PipelineDepth = 4;
+	clientOptions.MaxInFlight = options.InFlight;
+	clientOptions.TimeoutMs = 10000;
+	clientOptions.ArenaResponses = arenaResponses;
+	CompanionClient client(loop, pairing, clientOptions);
+	if (client.Open() != COMPANION_OK)
+	{
+		fprintf(stderr, "CompanionArenaBench: cannot open the pairing\n");
+		exit(1);
+	}
+
+	std::string request = "op=hello";
+	bool stopping = false;
+	UINT32 outstanding = 0;
+	UINT64 completed = 0;
+	UINT64 startUs = 0;
+	CompanionArenaStats arenasStart;
+
+	std::function<void()> send = [&]()
+	{
+		++outstanding;
+		client.SendAsync(request, [&](CompanionResponse& response)
+		{
+			--outstanding;
+			CompanionResponseFields fields;
+			if (response.Result != COMPANION_OK || ParseCompanionResponse(response.Decoded, response.DecodedLength, &fields) != COMPANION_OK)
+				++result.Failures;
+			else if (Counting)
+				++completed;
+			if (!stopping)
+				send();
+			else if (outstanding == 0)
+				loop.Stop();
+		});
+	};
+
+	loop.AddTimer(500, [&]()
+	{
+		arenasStart = client.ArenaStats();
+		startUs = EventLoop::NowUs();
+		Counting = true;
+		loop.AddTimer(options.Seconds * 1000, [&]()
+		{
+			Counting = false;
+			stopping = true;
+			double seconds = (EventLoop::NowUs() - startUs) / 1e6;
+			CompanionArenaStats arenasEnd = client.ArenaStats();
+			double requests = completed != 0 ? (double)completed : 1;
+			result.RequestsPerSecond = completed / seconds;
+			result.HeapPerRequest = HeapCalls / requests;
+			result.Arenas.Allocations = arenasEnd.Allocations - arenasStart.Allocations;
+			result.Arenas.HeapAllocations = arenasEnd.HeapAllocations - arenasStart.HeapAllocations;
+			result.Arenas.Overflows = arenasEnd.Overflows - arenasStart.Overflows;
+			result.Arenas.Resets = completed;
+			result.Arenas.HighWater = arenasEnd.HighWater;
+			HeapCalls = 0;
+		});
+	});
+	for (UINT32 i = 0; i < options.InFlight; ++i)
+		send();
+	loop.Run();
+	client.Shutdown();
+
+	std::promise<void> stopped;
+	serverLoop.Post([&]()
+	{
+		delete server;
+		stopped.set_value();
+	});
+	stopped.get_future().get();
+	serverLoop.Stop();
+	serverLoop.Join();
+	return result;
+}
+
+static void ReportArenas(const CompanionArenaStats& arenas, double requests)
+{
+	if (requests == 0)
+		requests = 1;
+	printf("           arena heap/request %.4f  bumps/request %.1f  overflows %llu  high water %llu bytes\n",
+		arenas.HeapAllocations / requests, arenas.Allocations / requests, (unsigned long long)arenas.Overflows, (unsigned long long)arenas.HighWater);
+}
+
+int main(int argc, char** argv)
+{
+	ArenaBenchOptions options;
+	if (ParseArguments(argc, argv, &options) != 0)
+	{
+		Usage();
+		return 2;
+	}
+
+	CompanionPairingInfo pairing;
+	pairing.TargetIPAddr = "127.0.0.1";
+	pairing.DeviceId = "ab72527a-582d-4d6d-98dd-3ddcd4e00ec5";
+	pairing.DeviceKey = options.Encrypted ? "0123456789ABCDEF" : "";
+	pairing.SeqNum = 1001;
+
+	CompanionCodec codec;
+	if (codec.Open(pairing) != COMPANION_OK)
+	{
+		fprintf(stderr, "CompanionArenaBench: cannot open the pairing\n");
+		return 1;
+	}
+
+	printf("%u-byte responses, %s\n", options.ResponseBytes, options.Encrypted ? "encrypted" : "test pairing");
+	printf("data path, %u round trips without sockets\n", options.Iterations);
+	PathResult copying = RunDataPath(options, codec, false);
+	printf("  copying  heap/request %.2f  failed %u\n", copying.HeapPerRequest, copying.Failures);
+	PathResult arena = RunDataPath(options, codec, true);
+	printf("  arena    heap/request %.2f  failed %u\n", arena.HeapPerRequest, arena.Failures);
+	ReportArenas(arena.Arenas, options.Iterations);
+
+	printf("client, %u in flight for %u s (client thread only)\n", options.InFlight, options.Seconds);
+	ClientResult body = RunClient(options, pairing, false);
+	printf("  Body     %9.0f req/s  heap/request %.2f  failed %u\n", body.RequestsPerSecond, body.HeapPerRequest, body.Failures);
+	ReportArenas(body.Arenas, (double)body.Arenas.Resets);
+	ClientResult decoded = RunClient(options, pairing, true);
+	printf("  Decoded  %9.0f req/s  heap/request %.2f  failed %u\n", decoded.RequestsPerSecond, decoded.HeapPerRequest, decoded.Failures);
+	ReportArenas(decoded.Arenas, (double)decoded.Arenas.Resets);
+
+	return (copying.Failures != 0 || arena.Failures != 0 || body.Failures != 0 || decoded.Failures != 0) ? 1 : 0;
+}
@@ -0,0 +1,431 @@
+//--------------------------------------------------------------------------
+// <copyright file="CompanionBulk.cpp" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// Bulk CSParve64 encode/decode/hash over memory-mapped files of framed records.
+// </summary>
+//--------------------------------------------------------------------------
+
+/*
+ Using CompanionBulk:
+    CompanionBulk encode|decode|hash -i input -o output -k key [-g guid] [-c config -s sbox] [-t threads] [--check]
+
+ The input is a sequence of records, each a 4-byte big-endian length followed by that many bytes.
+ encode and decode write the same framing to the output with every record transformed in place; records
+ must be a multiple of 8 bytes, as CSParve64 requires.  hash writes one 8-byte big-endian
+ CSParve64_ComputeHash value per record.  With --check, decode also counts records that do not end in the
+ context hash, which is how a companion body is verified.
+
+ The key is 16 hex characters, and the guid (default COMPANION_PAIR_DEVICE_ID) is the data the instance is
+ created from, as in CompanionCodec::Open.  config and sbox default to CompanionConfig and CompanionSBox;
+ either may be given as a binary file (80 bytes of native UINT32s, 256 bytes) or as text holding 20 or 256
+ numbers in C notation (// comments allowed), so other CSParve64 profiles can be processed too.
+
+ Both files are mapped; each record is copied once, from the input mapping to the output mapping, and
+ transformed there.  Records are split between threads (one per core by default) by byte count.
+ */
+
+#include "CompanionCodec.h"
+#include "CompanionConfig.h"
+#include "CSParve64.h"
+#include "iOSGUIDS.h"
+
+#include <atomic>
+#include <chrono>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+enum BulkMode { BulkEncode, BulkDecode, BulkHash };
+
+struct BulkOptions
+{
+	BulkMode    Mode;
+	std::string Input;
+	std::string Output;
+	std::string Key;
+	std::string Guid;
+	std::string Config;
+	std::string SBox;
+	UINT32      Threads;
+	bool        Check;
+
+	BulkOptions() : Mode(BulkEncode), Guid(COMPANION_PAIR_DEVICE_ID), Threads(0), Check(false) {}
+};
+
+struct Record
+{
+	size_t Offset;      // of the payload, past the length prefix
+	UINT32 Length;
+};
+
+static void Usage()
+{
+	fprintf(stderr,
+		"usage: CompanionBulk encode|decode|hash -i input -o output -k key [-g guid]\n"
+		"                     [-c config] [-s sbox] [-t threads] [--check]\n");
+}
+
+static UINT32 BytesToUInt32(const BYTE* data)
+{
+	return ((UINT32)data[0] << 24) | ((UINT32)data[1] << 16) | ((UINT32)data[2] << 8) | (UINT32)data[3];
+}
+
+static void UInt32ToBytes(UINT32 n, BYTE* data)
+{
+	data[0] = (BYTE)(n >> 24);
+	data[1] = (BYTE)(n >> 16);
+	data[2] = (BYTE)(n >> 8);
+	data[3] = (BYTE)(n);
+}
+
+static bool ReadFile(const std::string& path, std::string* contents)
+{
+	FILE* file = fopen(path.c_str(), "rb");
+	if (file == NULL)
+		return false;
+
+	char buffer[4096];
+	size_t read;
+	while ((read = fread(buffer, 1, sizeof(buffer), file)) > 0)
+		contents->append(buffer, read);
+
+	bool ok = ferror(file) == 0;
+	fclose(file);
+	return ok;
+}
+
+// Load count values of elementSize bytes, either as raw binary or as text numbers.  Returns 0 on success.
+static int LoadTable(const std::string& path, UINT32 count, UINT32 elementSize, void* table)
+{
+	std::string contents;
+	if (!ReadFile(path, &contents))
+		return -1;
+
+	const char* text = contents.c_str();
+	char* end = NULL;
+	UINT32 parsed = 0;
+	std::vector<unsigned long> values;
+	for (;;)
+	{
+		while (*text != '\0' && (*text == ',' || *text == ';' || *text == '{' || *text == '}' || isspace((unsigned char)*text)))
+			++text;
+		if (text[0] == '/' && text[1] == '/')
+		{
+			// Allow a table pasted from C source, such as CompanionConfig.c.
+			while (*text != '\0' && *text != '\n')
+				++text;
+			continue;
+		}
+		if (*text == '\0')
+			break;
+		unsigned long value = strtoul(text, &end, 0);
+		if (end == text)
+			break;
+		values.push_back(value);
+		text = end;
+		++parsed;
+	}
+
+	if (*text == '\0' && parsed == count)
+	{
+		for (UINT32 i = 0; i < count; ++i)
+		{
+			if (elementSize == 1)
+				((BYTE*)table)[i] = (BYTE)values[i];
+			else
+				((UINT32*)table)[i] = (UINT32)values[i];
+		}
+		return 0;
+	}
+
+	if (contents.size() == (size_t)count * elementSize)
+	{
+		memcpy(table, contents.data(), contents.size());
+		return 0;
+	}
+
+	return -1;
+}
+
+static int ParseArguments(int argc, char** argv, BulkOptions* options)
+{
+	if (argc < 2)
+		return -1;
+
+	if (strcmp(argv[1], "encode") == 0)
+		options->Mode = BulkEncode;
+	else if (strcmp(argv[1], "decode") == 0)
+		options->Mode = BulkDecode;
+	else if (strcmp(argv[1], "hash") == 0)
+		options->Mode = BulkHash;
+	else
+		return -1;
+
+	for (int i = 2; i < argc; ++i)
+	{
+		std::string arg = argv[i];
+		if (arg == "--check")
+		{
+			options->Check = true;
+			continue;
+		}
+		if (i + 1 >= argc)
+			return -1;
+
+		const char* value = argv[++i];
+		if (arg == "-i")
+			options->Input = value;
+		else if (arg == "-o")
+			options->Output = value;
+		else if (arg == "-k")
+			options->Key = value;
+		else if (arg == "-g")
+			options->Guid = value;
+		else if (arg == "-c")
+			options->Config = value;
+		else if (arg == "-s")
+			options->SBox = value;
+		else if (arg == "-t")
+			options->Threads = (UINT32)atoi(value);
+		else
+			return -1;
+	}
+
+	if (options->Input.empty() || options->Output.empty() || options->Key.length() != COMPANION_KEY_LENGTH_IN_BYTES * 2)
+		return -1;
+	return 0;
+}
+
+// Walk the record framing.  Returns 0 on success.
+static int ScanRecords(const BYTE* data, size_t length, bool blocksOnly, std::vector<Record>* records)
+{
+	size_t offset = 0;
+	while (offset < length)
+	{
+		if (length - offset < 4)
+			return -1;
+
+		Record record;
+		record.Length = BytesToUInt32(data + offset);
+		record.Offset = offset + 4;
+		if (record.Length > length - record.Offset)
+			return -1;
+		if (blocksOnly && (record.Length == 0 || (record.Length & 0x07) != 0))
+			return -1;
+
+		records->push_back(record);
+		offset = record.Offset + record.Length;
+	}
+	return 0;
+}
+
+int main(int argc, char** argv)
+{
+	BulkOptions options;
+	if (ParseArguments(argc, argv, &options) != 0)
+	{
+		Usage();
+		return 2;
+	}
+
+	UINT32 config[COMPANION_CONFIG_LENGTH];
+	BYTE sbox[COMPANION_SBOX_LENGTH];
+	memcpy(config, CompanionConfig, sizeof(config));
+	memcpy(sbox, CompanionSBox, sizeof(sbox));
+
+	if (!options.Config.empty() && LoadTable(options.Config, COMPANION_CONFIG_LENGTH, sizeof(UINT32), config) != 0)
+	{
+		fprintf(stderr, "CompanionBulk: %s is not a %d-entry config\n", options.Config.c_str(), COMPANION_CONFIG_LENGTH);
+		return 1;
+	}
+	if (!options.SBox.empty() && LoadTable(options.SBox, COMPANION_SBOX_LENGTH, 1, sbox) != 0)
+	{
+		fprintf(stderr, "CompanionBulk: %s is not a %d-byte sbox\n", options.SBox.c_str(), COMPANION_SBOX_LENGTH);
+		return 1;
+	}
+
+	BYTE key[COMPANION_KEY_LENGTH_IN_BYTES];
+	for (int i = 0; i < COMPANION_KEY_LENGTH_IN_BYTES; ++i)
+	{
+		if (hexToByte(options.Key.c_str() + i * 2, &key[i]) != 0)
+		{
+			fprintf(stderr, "CompanionBulk: key must be %d hex characters\n", COMPANION_KEY_LENGTH_IN_BYTES * 2);
+			return 1;
+		}
+	}
+
+	GUID guid;
+	if (GuidFromString(options.Guid.c_str(), &guid) != 0)
+	{
+		fprintf(stderr, "CompanionBulk: bad guid %s\n", options.Guid.c_str());
+		return 1;
+	}
+
+	void* context = NULL;
+	void* instance = NULL;
+	UINT32 hi, lo;
+	if (CSParve64_OpenContext(&context, config, sbox) != CSPARVE64_OK
+		|| CSParve64_Create(context, key, (const BYTE*)&guid, sizeof(guid), &hi, &lo, &instance) != CSPARVE64_OK)
+	{
+		fprintf(stderr, "CompanionBulk: cannot create the CSParve64 instance\n");
+		return 1;
+	}
+	BYTE contextHash[COMPANION_HASH_SIZE];
+	UInt32ToBytes(hi, contextHash);
+	UInt32ToBytes(lo, contextHash + 4);
+
+	// Map the input.
+	int inFd = open(options.Input.c_str(), O_RDONLY | O_CLOEXEC);
+	struct stat inStat;
+	if (inFd < 0 || fstat(inFd, &inStat) != 0)
+	{
+		fprintf(stderr, "CompanionBulk: %s: %s\n", options.Input.c_str(), strerror(errno));
+		return 1;
+	}
+
+	size_t inLength = (size_t)inStat.st_size;
+	const BYTE* in = NULL;
+	if (inLength > 0)
+	{
+		in = (const BYTE*)mmap(NULL, inLength, PROT_READ, MAP_PRIVATE | MAP_POPULATE, inFd, 0);
+		if (in == MAP_FAILED)
+		{
+			fprintf(stderr, "CompanionBulk: mmap %s: %s\n", options.Input.c_str(), strerror(errno));
+			return 1;
+		}
+		madvise((void*)in, inLength, MADV_SEQUENTIAL);
+	}
+
+	std::vector<Record> records;
+	if (ScanRecords(in, inLength, options.Mode != BulkHash, &records) != 0)
+	{
+		fprintf(stderr, "CompanionBulk: %s is not a sequence of %s records\n", options.Input.c_str(),
+			options.Mode == BulkHash ? "framed" : "framed 8-byte-multiple");
+		return 1;
+	}
+
+	// Map the output: the same layout for encode/decode, 8 bytes per record for hash.
+	size_t outLength = options.Mode == BulkHash ? records.size() * COMPANION_HASH_SIZE : inLength;
+	int outFd = open(options.Output.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (outFd < 0 || ftruncate(outFd, (off_t)outLength) != 0)
+	{
+		fprintf(stderr, "CompanionBulk: %s: %s\n", options.Output.c_str(), strerror(errno));
+		return 1;
+	}
+
+	BYTE* out = NULL;
+	if (outLength > 0)
+	{
+		out = (BYTE*)mmap(NULL, outLength, PROT_READ | PROT_WRITE, MAP_SHARED, outFd, 0);
+		if (out == MAP_FAILED)
+		{
+			fprintf(stderr, "CompanionBulk: mmap %s: %s\n", options.Output.c_str(), strerror(errno));
+			return 1;
+		}
+		madvise(out, outLength, MADV_SEQUENTIAL);
+	}
+
+	// Give each thread a contiguous run of records holding about the same number of bytes.
+	UINT32 threads = options.Threads != 0 ? options.Threads : std::thread::hardware_concurrency();
+	if (threads == 0)
+		threads = 1;
+	if (threads > records.size())
+		threads = records.size() > 0 ? (UINT32)records.size() : 1;
+
+	std::vector<size_t> starts;
+	size_t perThread = inLength / threads + 1;
+	starts.push_back(0);
+	for (size_t i = 0; i < records.size() && starts.size() < threads; ++i)
+	{
+		if (records[i].Offset >= perThread * starts.size())
+			starts.push_back(i);
+	}
+	starts.push_back(records.size());
+
+	std::atomic<UINT64> failures(0);
+	std::atomic<UINT64> mismatches(0);
+
+	auto worker = [&](size_t first, size_t end)
+	{
+		UINT64 failed = 0, mismatched = 0;
+		for (size_t i = first; i < end; ++i)
+		{
+			const Record& record = records[i];
+			const BYTE* source = in + record.Offset;
+			UINT32 h, l;
+
+			if (options.Mode == BulkHash)
+			{
+				BYTE* hash = out + i * COMPANION_HASH_SIZE;
+				if (CSParve64_ComputeHash(context, key, source, record.Length, &h, &l) != CSPARVE64_OK)
+				{
+					h = l = 0;
+					++failed;
+				}
+				UInt32ToBytes(h, hash);
+				UInt32ToBytes(l, hash + 4);
+				continue;
+			}
+
+			BYTE* target = out + record.Offset;
+			memcpy(target - 4, source - 4, record.Length + 4);
+
+			CSPARVE64_RESULT result = options.Mode == BulkEncode
+				? CSParve64_Encode(instance, target, record.Length, &h, &l)
+				: CSParve64_Decode(instance, target, record.Length, &h, &l);
+			if (result != CSPARVE64_OK)
+				++failed;
+			else if (options.Check && options.Mode == BulkDecode && memcmp(target + record.Length - COMPANION_HASH_SIZE, contextHash, COMPANION_HASH_SIZE) != 0)
+				++mismatched;
+		}
+		failures += failed;
+		mismatches += mismatched;
+	};
+
+	std::chrono::steady_clock::time_point began = std::chrono::steady_clock::now();
+
+	std::vector<std::thread> pool;
+	for (size_t t = 0; t + 1 < starts.size(); ++t)
+		pool.push_back(std::thread(worker, starts[t], starts[t + 1]));
+	for (size_t t = 0; t < pool.size(); ++t)
+		pool[t].join();
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - began).count();
+
+	if (out != NULL && msync(out, outLength, MS_SYNC) != 0)
+	{
+		fprintf(stderr, "CompanionBulk: msync %s: %s\n", options.Output.c_str(), strerror(errno));
+		return 1;
+	}
+
+	UINT64 payload = inLength - records.size() * 4;
+	printf("%s: %zu records, %llu bytes, %u threads, %.3f s, %.1f MB/s, %.0f records/s\n",
+		argv[1], records.size(), (unsigned long long)payload, (UINT32)pool.size(), seconds,
+		seconds > 0 ? payload / seconds / 1e6 : 0.0, seconds > 0 ? records.size() / seconds : 0.0);
+	if (failures != 0)
+		printf("%llu records failed\n", (unsigned long long)failures.load());
+	if (options.Check)
+		printf("%llu records failed the context hash check\n", (unsigned long long)mismatches.load());
+
+	if (out != NULL)
+		munmap(out, outLength);
+	if (in != NULL)
+		munmap((void*)in, inLength);
+	close(outFd);
+	close(inFd);
+	CSParve64_Destroy(instance);
+	CSParve64_CloseContext(context);
+
+	return failures == 0 && mismatches == 0 ? 0 : 1;
+}
@@ -0,0 +1,263 @@
+//--------------------------------------------------------------------------
+// <copyright file="CompanionFanoutBench.cpp" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// Completion spread of one command sent to many STBs.
+// </summary>
+//--------------------------------------------------------------------------
+
+/*
+ Using CompanionFanoutBench:
+    CompanionFanoutBench [-t targets] [-n rounds] [-w workers] [-d delayms] [-j jitterms] [-p port]
+
+ Starts targets CompanionServers, one per loopback address from 127.0.0.2 up, each with its own pairing
+ key, and sends op=key&k=pause to all of them rounds times:
+    serial - one target after another, as sending to each MRPairing in turn does
+    fanout - CompanionFanout, encoding on workers threads (0 encodes on the calling thread)
+ and reports, per round, when the first and last STB answered and the spread between them.
+ */
+
+#include "CompanionFanout.h"
+#include "CompanionServer.h"
+
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+static const char Command[] = "op=key&k=pause";
+
+struct FanoutBenchOptions
+{
+	UINT32                 Targets;
+	UINT32                 Rounds;
+	UINT32                 Workers;
+	CompanionServerOptions Server;
+
+	FanoutBenchOptions() : Targets(8), Rounds(200), Workers(2)
+	{
+		Server.Port = 18400;
+		Server.DelayMs = 1;
+		Server.JitterMs = 2;
+	}
+};
+
+struct FanoutSamples
+{
+	std::vector<double> FirstMs;
+	std::vector<double> LastMs;
+	std::vector<double> SpreadMs;
+	std::vector<double> EncodeUs;
+	UINT32              Failures;
+
+	FanoutSamples() : Failures(0) {}
+};
+
+static void Usage()
+{
+	fprintf(stderr, "usage: CompanionFanoutBench [-t targets] [-n rounds] [-w workers] [-d delayms] [-j jitterms] [-p port]\n");
+}
+
+static int ParseArguments(int argc, char** argv, FanoutBenchOptions* options)
+{
+	for (int i = 1; i < argc; ++i)
+	{
+		if (i + 1 >= argc)
+			return -1;
+
+		std::string arg = argv[i];
+		UINT32 value = (UINT32)strtoul(argv[++i], NULL, 10);
+		if (arg == "-t")
+			options->Targets = value;
+		else if (arg == "-n")
+			options->Rounds = value;
+		else if (arg == "-w")
+			options->Workers = value;
+		else if (arg == "-d")
+			options->Server.DelayMs = value;
+		else if (arg == "-j")
+			options->Server.JitterMs = value;
+		else if (arg == "-p")
+			options->Server.Port = (UINT16)value;
+		else
+			return -1;
+	}
+	return (options->Targets == 0 || options->Targets > 200 || options->Rounds == 0) ? -1 : 0;
+}
+
+/// <summary>
+/// Runs the rounds one after another, each either serially or through the fan-out, then stops the loop.
+/// </summary>
+class RoundDriver
+{
+public:
+
+	RoundDriver(EventLoop& loop, CompanionFanout& fanout, UINT32 rounds)
+		: _loop(loop), _fanout(fanout), _rounds(rounds), _round(0), _serial(true), _target(0), _startUs(0), _firstUs(0)
+	{
+	}
+
+	void Start() { NextRound(); }
+
+	FanoutSamples Serial;
+	FanoutSamples Fanout;
+
+private:
+
+	void NextRound()
+	{
+		if (_round == 2 * _rounds)
+		{
+			_loop.Stop();
+			return;
+		}
+
+		// Alternate, so both see the same servers and timers.
+		_serial = (_round++ % 2) == 0;
+		_startUs = EventLoop::NowUs();
+		if (_serial)
+		{
+			_target = 0;
+			SendNext();
+			return;
+		}
+
+		_fanout.SendAsync(Command, [this](CompanionFanoutResult& result)
+		{
+			Fanout.FirstMs.push_back(result.FirstUs / 1000.0);
+			Fanout.LastMs.push_back(result.LastUs / 1000.0);
+			Fanout.SpreadMs.push_back(result.SpreadUs() / 1000.0);
+			Fanout.EncodeUs.push_back((double)result.EncodeUs);
+			Fanout.Failures += result.Failed;
+			NextRound();
+		});
+	}
+
+	void SendNext()
+	{
+		UINT64 encodeStart = EventLoop::NowUs();
+		CompanionRequest encoded;
+		CompanionClient& client = _fanout.Target(_target);
+		COMPANION_RESULT result = client.Encode(Command, &encoded);
+		Serial.EncodeUs.push_back((double)(EventLoop::NowUs() - encodeStart));
+		if (result != COMPANION_OK)
+		{
+			++Serial.Failures;
+			OnSerialAnswer();
+			return;
+		}
+
+		client.SendEncodedAsync(Command, encoded, [this](CompanionResponse& response)
+		{
+			if (response.Result != COMPANION_OK)
+				++Serial.Failures;
+			OnSerialAnswer();
+		});
+	}
+
+	void OnSerialAnswer()
+	{
+		UINT64 elapsedUs = EventLoop::NowUs() - _startUs;
+		if (_target == 0)
+			_firstUs = elapsedUs;
+
+		if (++_target < _fanout.Targets())
+		{
+			SendNext();
+			return;
+		}
+
+		Serial.FirstMs.push_back(_firstUs / 1000.0);
+		Serial.LastMs.push_back(elapsedUs / 1000.0);
+		Serial.SpreadMs.push_back((elapsedUs - _firstUs) / 1000.0);
+		NextRound();
+	}
+
+	EventLoop&       _loop;
+	CompanionFanout& _fanout;
+	UINT32           _rounds;
+	UINT32           _round;
+	bool             _serial;
+	size_t           _target;
+	UINT64           _startUs;
+	UINT64           _firstUs;
+};
+
+static double Percentile(std::vector<double> samples, UINT32 percentile)
+{
+	std::sort(samples.begin(), samples.end());
+	return samples[(samples.size() - 1) * percentile / 100];
+}
+
+static void Report(const char* name, const FanoutSamples& samples)
+{
+	printf("%-6s first p50 %6.2f ms  last p50 %6.2f p99 %6.2f ms  spread p50 %6.2f p99 %6.2f max %6.2f ms  failed %u\n", name,
+		Percentile(samples.FirstMs, 50), Percentile(samples.LastMs, 50), Percentile(samples.LastMs, 99),
+		Percentile(samples.SpreadMs, 50), Percentile(samples.SpreadMs, 99), Percentile(samples.SpreadMs, 100), samples.Failures);
+}
+
+int main(int argc, char** argv)
+{
+	FanoutBenchOptions options;
+	if (ParseArguments(argc, argv, &options) != 0)
+	{
+		Usage();
+		return 2;
+	}
+
+	EventLoop loop;
+
+	std::vector<CompanionPairingInfo> pairings;
+	std::vector<std::unique_ptr<CompanionServer>> servers;
+	for (UINT32 i = 0; i < options.Targets; ++i)
+	{
+		char address[32], key[32];
+		snprintf(address, sizeof(address), "127.0.0.%u", i + 2);
+		snprintf(key, sizeof(key), "0123456789AB%04X", i);
+
+		CompanionPairingInfo pairing;
+		pairing.TargetIPAddr = address;
+		pairing.DeviceId = "ab72527a-582d-4d6d-98dd-3ddcd4e00ec5";
+		pairing.DeviceKey = key;
+		pairing.SeqNum = 1001 + 2 * i;
+		pairings.push_back(pairing);
+
+		CompanionServerOptions serverOptions = options.Server;
+		serverOptions.Address = address;
+		serverOptions.Seed = i + 1;
+		servers.push_back(std::unique_ptr<CompanionServer>(new CompanionServer(loop, pairing, serverOptions)));
+		if (servers.back()->Start() != COMPANION_OK)
+		{
+			fprintf(stderr, "CompanionFanoutBench: cannot listen on %s:%u\n", address, (unsigned)options.Server.Port);
+			return 1;
+		}
+	}
+
+	std::unique_ptr<CompanionWorkerPool> pool(options.Workers != 0 ? new CompanionWorkerPool(options.Workers) : NULL);
+	CompanionFanoutOptions fanoutOptions;
+	fanoutOptions.Client.Port = options.Server.Port;
+	fanoutOptions.Client.Connections = 1;
+	fanoutOptions.EncodePool = pool.get();
+
+	CompanionFanout fanout(loop, pairings, fanoutOptions);
+	if (fanout.Open() != COMPANION_OK)
+	{
+		fprintf(stderr, "CompanionFanoutBench: cannot open the pairings\n");
+		return 1;
+	}
+
+	RoundDriver driver(loop, fanout, options.Rounds);
+	loop.Post([&driver]() { driver.Start(); });
+	loop.Run();
+	fanout.Shutdown();
+
+	printf("%u targets, %u rounds, delay %u+%u ms, %u encode workers\n", options.Targets, options.Rounds,
+		options.Server.DelayMs, options.Server.JitterMs, options.Workers);
+	Report("serial", driver.Serial);
+	Report("fanout", driver.Fanout);
+	printf("encode for all targets: serial p50 %.1f us (sum), fanout p50 %.1f us\n",
+		Percentile(driver.Serial.EncodeUs, 50) * options.Targets, Percentile(driver.Fanout.EncodeUs, 50));
+	return driver.Serial.Failures + driver.Fanout.Failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,341 @@
+//--------------------------------------------------------------------------
+// <copyright file="CompanionFloodBench.cpp" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// A companion client's service while its STB is flooded with bad requests.
+// </summary>
+//--------------------------------------------------------------------------
+
+/*
+ Using CompanionFloodBench:
+    CompanionFloodBench [-s seconds] [-r rate] [-f flooders] [-b bodybytes] [-R ratepercid] [-P shedcpupercent]
+                        [-m forgedpercent]
+
+ Starts a CompanionServer with CheckSequence on its own thread, and a client sending op=hello to it at rate
+ requests per second.  After seconds of that alone, flooders connections send it requests as fast as it
+ will take them, each with a bodybytes body: forgedpercent with a signature that does not verify, the rest
+ the same correctly signed request over and over, which after the first is a replay.  For the quiet and
+ the flooded phase the client's latency and failures are reported, with what the server did: requests
+ taken, refused on the head (and the body bytes it never read), bodies decoded, throttled (ratepercid, 0 for
+ none) and shed (shedcpupercent, 0 for never), and the CPU its thread used.  RefusedEarly is the decode work
+ the admission stage saved; without it every one of those bodies would have been read and decoded.
+ */
+
+#include "CompanionClient.h"
+#include "CompanionServer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <future>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#define FLOOD_BATCH 32      // requests a flooder writes before reading their answers
+
+struct FloodBenchOptions
+{
+	UINT32                 Seconds;
+	UINT32                 Rate;
+	UINT32                 Flooders;
+	UINT32                 BodyBytes;
+	UINT32                 ForgedPercent;
+	CompanionServerOptions Server;
+
+	FloodBenchOptions() : Seconds(3), Rate(200), Flooders(4), BodyBytes(1024), ForgedPercent(50)
+	{
+		Server.Port = 0;
+		Server.CheckSequence = true;
+		Server.RatePerCid = 1000;
+		Server.ShedCpuPercent = 90;
+	}
+};
+
+static void Usage()
+{
+	fprintf(stderr, "usage: CompanionFloodBench [-s seconds] [-r rate] [-f flooders] [-b bodybytes] [-R ratepercid] [-P shedcpupercent]\n"
+		"                           [-m forgedpercent]\n");
+}
+
+static int ParseArguments(int argc, char** argv, FloodBenchOptions* options)
+{
+	for (int i = 1; i < argc; ++i)
+	{
+		if (i + 1 >= argc)
+			return -1;
+
+		std::string arg = argv[i];
+		UINT32 value = (UINT32)strtoul(argv[++i], NULL, 10);
+		if (arg == "-s")
+			options->Seconds = value;
+		else if (arg == "-r")
+			options->Rate = value;
+		else if (arg == "-f")
+			options->Flooders = value;
+		else if (arg == "-b")
+			options->BodyBytes = value;
+		else if (arg == "-R")
+			options->Server.RatePerCid = value;
+		else if (arg == "-P")
+			options->Server.ShedCpuPercent = value;
+		else if (arg == "-m")
+			options->ForgedPercent = value;
+		else
+			return -1;
+	}
+	return (options->Seconds == 0 || options->Rate == 0 || options->Rate > 1000 || options->ForgedPercent > 100) ? -1 : 0;
+}
+
+static UINT64 ThreadCpuUs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (UINT64)ts.tv_sec * 1000000 + (UINT64)ts.tv_nsec / 1000;
+}
+
+/// <summary>
+/// What the server had done, and the CPU its thread had used, at one moment.
+/// </summary>
+struct ServerSample
+{
+	CompanionServerStats Stats;
+	UINT64               CpuUs;
+	UINT64               WallUs;
+};
+
+static ServerSample Sample(EventLoop& loop, CompanionServer& server)
+{
+	std::promise<ServerSample> done;
+	loop.Post([&]()
+	{
+		ServerSample sample;
+		sample.Stats = server.Stats();
+		sample.CpuUs = ThreadCpuUs();
+		sample.WallUs = EventLoop::NowUs();
+		done.set_value(sample);
+	});
+	return done.get_future().get();
+}
+
+/// <summary>
+/// One flooding connection: writes a batch of requests, reads their answers, and again until stopped.
+/// </summary>
+static void Flood(UINT16 port, const std::vector<std::string>& requests, const std::atomic<bool>& stop, std::atomic<UINT64>* sent)
+{
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	struct sockaddr_in addr = {};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+	{
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
+
+	std::string batch;
+	char buffer[16384];
+	for (size_t next = 0; !stop.load(std::memory_order_relaxed); )
+	{
+		batch.clear();
+		for (UINT32 i = 0; i < FLOOD_BATCH; ++i, next = (next + 1) % requests.size())
+			batch += requests[next];
+		if (send(fd, batch.data(), batch.length(), MSG_NOSIGNAL) != (ssize_t)batch.length())
+			break;
+		sent->fetch_add(FLOOD_BATCH, std::memory_order_relaxed);
+
+		// Every answer starts with its status line; the only bodies are the odd accepted replay's.
+		UINT32 answers = 0;
+		std::string tail;
+		while (answers < FLOOD_BATCH)
+		{
+			ssize_t received = recv(fd, buffer, sizeof(buffer), 0);
+			if (received <= 0)
+			{
+				close(fd);
+				return;
+			}
+			tail.append(buffer, (size_t)received);
+			for (size_t at = tail.find("HTTP/1.1 "); at != std::string::npos; at = tail.find("HTTP/1.1 ", at + 1))
+				++answers;
+			tail.erase(0, tail.length() > 8 ? tail.length() - 8 : 0);
+		}
+	}
+	close(fd);
+}
+
+struct ClientSample
+{
+	std::vector<double> LatencyMs;
+	UINT32              Failures;
+	UINT32              Refused;        // answered 4xx/5xx
+
+	ClientSample() : Failures(0), Refused(0) {}
+};
+
+static void Report(const char* name, ClientSample& client, const ServerSample& before, const ServerSample& after, UINT64 flooded)
+{
+	std::vector<double>& latency = client.LatencyMs;
+	std::sort(latency.begin(), latency.end());
+	if (latency.empty())
+		latency.push_back(0);
+
+	const CompanionServerStats& a = after.Stats;
+	const CompanionServerStats& b = before.Stats;
+	UINT64 requests = a.Requests - b.Requests;
+	double seconds = (after.WallUs - before.WallUs) / 1e6;
+	printf("%-7s client: %zu answered  p50 %6.2f ms  p99 %6.2f ms  max %7.2f ms  failed %u (%u refused)\n", name,
+		client.LatencyMs.size(), latency[latency.size() / 2], latency[latency.size() * 99 / 100], latency.back(),
+		client.Failures, client.Refused);
+	printf("        server: %llu requests (%llu flooded, %.0f/s)  refused early %llu  body bytes not decoded %llu  decoded %llu\n",
+		(unsigned long long)requests, (unsigned long long)flooded, requests / seconds,
+		(unsigned long long)(a.RefusedEarly - b.RefusedEarly), (unsigned long long)(a.BodyBytesDropped - b.BodyBytesDropped),
+		(unsigned long long)(a.Decoded - b.Decoded));
+	printf("                rejected %llu  replayed %llu  out of window %llu  throttled %llu  shed %llu  cpu %.0f%%  %.2f us/request\n",
+		(unsigned long long)(a.Rejected - b.Rejected), (unsigned long long)(a.Replayed - b.Replayed), (unsigned long long)(a.OutOfWindow - b.OutOfWindow),
+		(unsigned long long)(a.Throttled - b.Throttled), (unsigned long long)(a.Shed - b.Shed),
+		(after.CpuUs - before.CpuUs) * 100.0 / (after.WallUs - before.WallUs),
+		requests != 0 ? (double)(after.CpuUs - before.CpuUs) / requests : 0.0);
+}
+
+int main(int argc, char** argv)
+{
+	FloodBenchOptions options;
+	if (ParseArguments(argc, argv, &options) != 0)
+	{
+		Usage();
+		return 2;
+	}
+
+	CompanionPairingInfo pairing;
+	pairing.TargetIPAddr = "127.0.0.1";
+	pairing.DeviceId = "ab72527a-582d-4d6d-98dd-3ddcd4e00ec5";
+	pairing.DeviceKey = "0123456789ABCDEF";
+	pairing.SeqNum = 1001;
+
+	EventLoop serverLoop;
+	serverLoop.Start();
+	CompanionServer* server = NULL;
+	std::promise<COMPANION_RESULT> started;
+	serverLoop.Post([&]()
+	{
+		server = new CompanionServer(serverLoop, pairing, options.Server);
+		started.set_value(server->Start());
+	});
+	if (started.get_future().get() != COMPANION_OK)
+	{
+		fprintf(stderr, "CompanionFloodBench: cannot listen\n");
+		return 1;
+	}
+	UINT16 port = server->Port();
+
+	// The flood: forged signatures, and one good request replayed.
+	CompanionCodec codec;
+	codec.Open(pairing);
+	std::string plain = "op=hello&pad=" + std::string(options.BodyBytes > 13 ? options.BodyBytes - 13 : 0, 'x');
+	CompanionRequest replayed;
+	codec.EncodeRequest(plain.data(), (UINT32)plain.length(), 999, &replayed);
+	std::string replayedHttp = HttpPostHead("127.0.0.1", port, replayed.Query, replayed.Body.size())
+		+ std::string(replayed.Body.begin(), replayed.Body.end());
+
+	std::vector<std::string> requests;
+	UINT32 random = 2463534242u;
+	for (UINT32 i = 0; i < 100; ++i)
+	{
+		if (i < options.ForgedPercent)
+		{
+			random ^= random << 13;
+			random ^= random >> 17;
+			random ^= random << 5;
+			char query[160];
+			snprintf(query, sizeof(query), "/companion?hash=%08X%08X%08X%08X&cid=%s&seq=%08X", 1001 + 2 * i, (UINT32)replayed.Body.size(),
+				random, random * 2654435761u, pairing.DeviceId.c_str(), 1001 + 2 * i);
+			requests.push_back(HttpPostHead("127.0.0.1", port, query, replayed.Body.size()) + std::string(replayed.Body.begin(), replayed.Body.end()));
+		}
+		else
+			requests.push_back(replayedHttp);
+	}
+
+	// The client, on this thread.
+	EventLoop loop;
+	CompanionClientOptions clientOptions;
+	clientOptions.Port = port;
+	clientOptions.Connections = 2;
+	CompanionClient client(loop, pairing, clientOptions);
+	if (client.Open() != COMPANION_OK)
+	{
+		fprintf(stderr, "CompanionFloodBench: cannot open the pairing\n");
+		return 1;
+	}
+
+	ClientSample phases[2];
+	ClientSample* phase = &phases[0];
+	std::function<void()> tick = [&]()
+	{
+		ClientSample* current = phase;
+		client.SendAsync("op=hello", [current](CompanionResponse& response)
+		{
+			if (response.Result == COMPANION_OK)
+				current->LatencyMs.push_back(response.LatencyUs / 1000.0);
+			else
+			{
+				++current->Failures;
+				if (response.HttpStatus >= 400)
+					++current->Refused;
+			}
+		});
+		loop.AddTimer(1000 / options.Rate, tick);
+	};
+
+	printf("client %u/s, %u flooders with %u-byte bodies (%u%% forged, the rest replayed), RatePerCid %u, ShedCpuPercent %u, %u hardware threads\n",
+		options.Rate, options.Flooders, (UINT32)replayed.Body.size(), options.ForgedPercent, options.Server.RatePerCid,
+		options.Server.ShedCpuPercent, std::thread::hardware_concurrency());
+
+	std::atomic<bool> stop(false);
+	std::atomic<UINT64> flooded(0);
+	std::vector<std::thread> flooders;
+	ServerSample samples[3];
+	samples[0] = Sample(serverLoop, *server);
+	loop.AddTimer(options.Seconds * 1000, [&]()
+	{
+		samples[1] = Sample(serverLoop, *server);
+		phase = &phases[1];
+		for (UINT32 i = 0; i < options.Flooders; ++i)
+			flooders.push_back(std::thread(Flood, port, std::cref(requests), std::cref(stop), &flooded));
+		loop.AddTimer(options.Seconds * 1000, [&]()
+		{
+			samples[2] = Sample(serverLoop, *server);
+			loop.Stop();
+		});
+	});
+	tick();
+	loop.Run();
+
+	stop.store(true);
+	for (size_t i = 0; i < flooders.size(); ++i)
+		flooders[i].join();
+	client.Shutdown();
+
+	Report("quiet", phases[0], samples[0], samples[1], 0);
+	Report("flooded", phases[1], samples[1], samples[2], flooded.load());
+
+	std::promise<void> stopped;
+	serverLoop.Post([&]()
+	{
+		delete server;
+		stopped.set_value();
+	});
+	stopped.get_future().get();
+	serverLoop.Stop();
+	serverLoop.Join();
+	return 0;
+}
@@ -0,0 +1,232 @@
+//--------------------------------------------------------------------------
+// <copyright file="CompanionHedgeBench.cpp" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// Tail latency of companion requests with and without hedging.
+// </summary>
+//--------------------------------------------------------------------------
+
+/*
+ Using CompanionHedgeBench:
+    CompanionHedgeBench [-n requests] [-c concurrency] [-C connections] [-d delayms] [-j jitterms]
+                        [-s slowpercent] [-S slowms] [-l losspercent] [-p percentile] [-t timeoutms]
+                        [-b budgetpercent] [-r seed]
+
+ Starts a CompanionServer on loopback that delays, slows and drops answers as asked, then sends the same
+ op=hello load to it twice with concurrency requests outstanding:
+    fixed  - TimeoutMs timeouts, no hedging: how the client behaved before
+    hedged - AdaptiveTimeout, hedging after the given RTT percentile, retry budget of budgetpercent
+ Both runs see the same injected faults (the server is reseeded).  For each, the latency percentiles, the
+ failures and the extra load put on the server are reported.
+ */
+
+#include "CompanionClient.h"
+#include "CompanionServer.h"
+
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+struct HedgeBenchOptions
+{
+	UINT32                 Requests;
+	UINT32                 Concurrency;
+	UINT32                 Connections;
+	UINT32                 TimeoutMs;
+	UINT32                 HedgePercentile;
+	UINT32                 BudgetPercent;
+	CompanionServerOptions Server;
+
+	HedgeBenchOptions() : Requests(2000), Concurrency(4), Connections(8), TimeoutMs(1000), HedgePercentile(95), BudgetPercent(10)
+	{
+		Server.Port = 0;
+		Server.DelayMs = 2;
+		Server.JitterMs = 3;
+		Server.SlowPercent = 3;
+		Server.SlowDelayMs = 150;
+		Server.LossPercent = 1;
+	}
+};
+
+struct HedgeBenchResult
+{
+	std::vector<double>  LatencyMs;
+	UINT32               Failures;
+	CompanionClientStats Client;
+	CompanionServerStats Server;
+
+	HedgeBenchResult() : Failures(0) {}
+};
+
+static void Usage()
+{
+	fprintf(stderr, "usage: CompanionHedgeBench [-n requests] [-c concurrency] [-C connections] [-d delayms] [-j jitterms]\n"
+		"                           [-s slowpercent] [-S slowms] [-l losspercent] [-p percentile] [-t timeoutms]\n"
+		"                           [-b budgetpercent] [-r seed]\n");
+}
+
+static int ParseArguments(int argc, char** argv, HedgeBenchOptions* options)
+{
+	for (int i = 1; i < argc; ++i)
+	{
+		if (i + 1 >= argc)
+			return -1;
+
+		std::string arg = argv[i];
+		UINT32 value = (UINT32)strtoul(argv[++i], NULL, 10);
+		if (arg == "-n")
+			options->Requests = value;
+		else if (arg == "-c")
+			options->Concurrency = value;
+		else if (arg == "-C")
+			options->Connections = value;
+		else if (arg == "-d")
+			options->Server.DelayMs = value;
+		else if (arg == "-j")
+			options->Server.JitterMs = value;
+		else if (arg == "-s")
+			options->Server.SlowPercent = value;
+		else if (arg == "-S")
+			options->Server.SlowDelayMs = value;
+		else if (arg == "-l")
+			options->Server.LossPercent = value;
+		else if (arg == "-p")
+			options->HedgePercentile = value;
+		else if (arg == "-t")
+			options->TimeoutMs = value;
+		else if (arg == "-b")
+			options->BudgetPercent = value;
+		else if (arg == "-r")
+			options->Server.Seed = value;
+		else
+			return -1;
+	}
+	return (options->Requests == 0 || options->Concurrency == 0 || options->TimeoutMs == 0) ? -1 : 0;
+}
+
+/// <summary>
+/// Keeps Concurrency requests outstanding until Requests have completed, then stops the loop.
+/// </summary>
+class LoadDriver
+{
+public:
+
+	LoadDriver(EventLoop& loop, CompanionClient& client, UINT32 requests, HedgeBenchResult* result)
+		: _loop(loop), _client(client), _remaining(requests), _outstanding(0), _result(result)
+	{
+	}
+
+	void Send()
+	{
+		--_remaining;
+		++_outstanding;
+		_client.SendAsync("op=hello", [this](CompanionResponse& response)
+		{
+			--_outstanding;
+			_result->LatencyMs.push_back(response.LatencyUs / 1000.0);
+			if (response.Result != COMPANION_OK)
+				++_result->Failures;
+
+			if (_remaining > 0)
+				Send();
+			else if (_outstanding == 0)
+				_loop.Stop();
+		});
+	}
+
+private:
+
+	EventLoop&        _loop;
+	CompanionClient&  _client;
+	UINT32            _remaining;
+	UINT32            _outstanding;
+	HedgeBenchResult* _result;
+};
+
+static int Run(const HedgeBenchOptions& options, const CompanionPairingInfo& pairing, bool hedged, HedgeBenchResult* result)
+{
+	EventLoop loop;
+
+	CompanionServer server(loop, pairing, options.Server);
+	if (server.Start() != COMPANION_OK)
+	{
+		fprintf(stderr, "CompanionHedgeBench: cannot listen\n");
+		return -1;
+	}
+
+	CompanionClientOptions clientOptions;
+	clientOptions.Port = server.Port();
+	clientOptions.Connections = options.Connections;
+	clientOptions.MaxInFlight = options.Connections;
+	clientOptions.TimeoutMs = options.TimeoutMs;
+	if (hedged)
+	{
+		clientOptions.AdaptiveTimeout = true;
+		clientOptions.HedgePercentile = options.HedgePercentile;
+		clientOptions.RetryBudget.Percent = options.BudgetPercent;
+	}
+
+	CompanionClient client(loop, pairing, clientOptions);
+	if (client.Open() != COMPANION_OK)
+	{
+		fprintf(stderr, "CompanionHedgeBench: cannot open the pairing\n");
+		return -1;
+	}
+
+	LoadDriver driver(loop, client, options.Requests, result);
+	UINT32 initial = options.Concurrency < options.Requests ? options.Concurrency : options.Requests;
+	for (UINT32 i = 0; i < initial; ++i)
+		driver.Send();
+	loop.Run();
+
+	result->Client = client.Stats();
+	result->Server = server.Stats();
+	return 0;
+}
+
+static void Report(const char* name, UINT32 requests, HedgeBenchResult& result)
+{
+	std::vector<double>& latency = result.LatencyMs;
+	std::sort(latency.begin(), latency.end());
+	double total = 0;
+	for (size_t i = 0; i < latency.size(); ++i)
+		total += latency[i];
+
+	printf("%-6s mean %7.2f ms  p50 %7.2f  p90 %7.2f  p99 %7.2f  p99.9 %7.2f  max %7.2f  failed %u\n", name,
+		total / latency.size(), latency[latency.size() / 2], latency[latency.size() * 90 / 100],
+		latency[latency.size() * 99 / 100], latency[latency.size() * 999 / 1000], latency.back(), result.Failures);
+	printf("       sent %llu (x%.3f)  hedges %llu  hedge wins %llu  retries %llu  suppressed %llu  timeouts %llu  lost %llu\n",
+		(unsigned long long)result.Client.Sent, (double)result.Server.Requests / requests,
+		(unsigned long long)result.Client.Hedges, (unsigned long long)result.Client.HedgeWins,
+		(unsigned long long)result.Client.Retries, (unsigned long long)result.Client.Suppressed,
+		(unsigned long long)result.Client.Timeouts, (unsigned long long)result.Server.Lost);
+}
+
+int main(int argc, char** argv)
+{
+	HedgeBenchOptions options;
+	if (ParseArguments(argc, argv, &options) != 0)
+	{
+		Usage();
+		return 2;
+	}
+
+	CompanionPairingInfo pairing;
+	pairing.TargetIPAddr = "127.0.0.1";
+	pairing.DeviceId = "ab72527a-582d-4d6d-98dd-3ddcd4e00ec5";
+	pairing.DeviceKey = "0123456789ABCDEF";
+	pairing.SeqNum = 1001;
+
+	HedgeBenchResult fixed, hedged;
+	if (Run(options, pairing, false, &fixed) != 0 || Run(options, pairing, true, &hedged) != 0)
+		return 1;
+
+	printf("%u requests, %u outstanding, delay %u+%u ms, %u%% slow (%u ms), %u%% lost\n", options.Requests, options.Concurrency,
+		options.Server.DelayMs, options.Server.JitterMs, options.Server.SlowPercent, options.Server.SlowDelayMs, options.Server.LossPercent);
+	Report("fixed", options.Requests, fixed);
+	Report("hedged", options.Requests, hedged);
+	return 0;
+}
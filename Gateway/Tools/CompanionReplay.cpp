@@ -0,0 +1,573 @@
+//--------------------------------------------------------------------------
+// <copyright file="CompanionReplay.cpp" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// Replays captured companion traffic against the codec or an STB.
+// </summary>
+//--------------------------------------------------------------------------
+
+/*
+ Using CompanionReplay:
+    CompanionReplay -f capture [-m info|encode|decode|stb] [-k key | -p pairings] [-a address] [-x speed]
+                    [-s seconds] [-n records] [-r repeat] [-P port] [-S 1]
+
+ Reads a capture written through a CaptureRecorder (for instance companiond -r) and
+    info   - reports its records, time span, operation mix and message sizes
+    encode - encodes each captured request's plaintext again and checks the body and signature against
+             the captured ones, byte for byte, timing the encoder
+    decode - verifies and decodes each captured response (DecryptResponse), checking the plaintext
+    stb    - sends the captured requests through a CompanionClient per STB to address:port, or with -S 1 to
+             stand-in CompanionServers started on the captured addresses (use loopback captures)
+ The keys come from -k (one key for every STB) or the PairingStore given by -p.  -a keeps only one STB's
+ records; -s starts that many seconds into the capture and -n stops after so many records.
+ -x paces records by their captured timestamps: 1 is the original speed, 10 ten times faster, 0 (the
+ default) as fast as the codec or the STB allow.  -r repeats encode and decode passes for steadier timings.
+ */
+
+#include "CompanionCapture.h"
+#include "CompanionClient.h"
+#include "CompanionServer.h"
+#include "PairingStore.h"
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <strings.h>
+#include <thread>
+#include <vector>
+
+struct ReplayOptions
+{
+	std::string CapturePath;
+	std::string Mode;
+	std::string Key;
+	std::string PairingsPath;
+	std::string Address;
+	double      Speed;
+	UINT32      SkipSeconds;
+	UINT64      Limit;
+	UINT32      Repeat;
+	UINT16      Port;
+	bool        StandIn;
+
+	ReplayOptions() : Mode("info"), Speed(0), SkipSeconds(0), Limit(0), Repeat(1), Port(COMPANION_PORT), StandIn(false) {}
+};
+
+static void Usage()
+{
+	fprintf(stderr, "usage: CompanionReplay -f capture [-m info|encode|decode|stb] [-k key | -p pairings] [-a address] [-x speed]\n"
+		"                       [-s seconds] [-n records] [-r repeat] [-P port] [-S 1]\n");
+}
+
+static int ParseArguments(int argc, char** argv, ReplayOptions* options)
+{
+	for (int i = 1; i < argc; ++i)
+	{
+		if (i + 1 >= argc)
+			return -1;
+
+		std::string arg = argv[i];
+		std::string value = argv[++i];
+		if (arg == "-f")
+			options->CapturePath = value;
+		else if (arg == "-m")
+			options->Mode = value;
+		else if (arg == "-k")
+			options->Key = value;
+		else if (arg == "-p")
+			options->PairingsPath = value;
+		else if (arg == "-a")
+			options->Address = value;
+		else if (arg == "-x")
+			options->Speed = strtod(value.c_str(), NULL);
+		else if (arg == "-s")
+			options->SkipSeconds = (UINT32)strtoul(value.c_str(), NULL, 10);
+		else if (arg == "-n")
+			options->Limit = strtoull(value.c_str(), NULL, 10);
+		else if (arg == "-r")
+			options->Repeat = (UINT32)strtoul(value.c_str(), NULL, 10);
+		else if (arg == "-P")
+			options->Port = (UINT16)strtoul(value.c_str(), NULL, 10);
+		else if (arg == "-S")
+			options->StandIn = value != "0";
+		else
+			return -1;
+	}
+
+	bool modeKnown = options->Mode == "info" || options->Mode == "encode" || options->Mode == "decode" || options->Mode == "stb";
+	bool needsKey = options->Mode != "info";
+	if (options->CapturePath.empty() || !modeKnown || options->Speed < 0 || options->Repeat == 0
+		|| (needsKey && options->Key.empty() && options->PairingsPath.empty()))
+		return -1;
+	return 0;
+}
+
+static double Percentile(std::vector<double> samples, UINT32 percentile)
+{
+	if (samples.empty())
+		return 0;
+	std::sort(samples.begin(), samples.end());
+	return samples[(samples.size() - 1) * percentile / 100];
+}
+
+/// <summary>
+/// The records a run covers: after -s, for the -a STB, at most -n of them.
+/// </summary>
+class ReplaySource
+{
+public:
+
+	ReplaySource(const CaptureReader& reader, const ReplayOptions& options) : _reader(reader), _options(options), _taken(0)
+	{
+		_start = reader.Seek(reader.FirstUs() + (UINT64)options.SkipSeconds * 1000000);
+		_position = _start;
+	}
+
+	bool Next(CaptureRecordView* record)
+	{
+		while (_options.Limit == 0 || _taken < _options.Limit)
+		{
+			if (!_reader.Next(&_position, record))
+				return false;
+			if (!_options.Address.empty() && record->TargetIPAddr() != _options.Address)
+				continue;
+			++_taken;
+			return true;
+		}
+		return false;
+	}
+
+	void Rewind()
+	{
+		_position = _start;
+		_taken = 0;
+	}
+
+private:
+
+	const CaptureReader&  _reader;
+	const ReplayOptions&  _options;
+	CapturePosition       _start;
+	CapturePosition       _position;
+	UINT64                _taken;
+};
+
+/// <summary>
+/// Holds back each record until its captured offset, divided by the speed, has passed.
+/// </summary>
+class ReplayPacer
+{
+public:
+
+	explicit ReplayPacer(double speed) : _speed(speed), _firstUs(0), _startUs(0) {}
+
+	UINT64 DelayUs(UINT64 timestampUs)
+	{
+		if (_speed == 0)
+			return 0;
+
+		UINT64 nowUs = EventLoop::NowUs();
+		if (_firstUs == 0)
+		{
+			_firstUs = timestampUs;
+			_startUs = nowUs;
+		}
+
+		UINT64 dueUs = _startUs + (UINT64)((timestampUs - _firstUs) / _speed);
+		return dueUs > nowUs ? dueUs - nowUs : 0;
+	}
+
+	void Wait(UINT64 timestampUs)
+	{
+		UINT64 delayUs = DelayUs(timestampUs);
+		if (delayUs != 0)
+			std::this_thread::sleep_for(std::chrono::microseconds(delayUs));
+	}
+
+private:
+
+	double _speed;
+	UINT64 _firstUs;
+	UINT64 _startUs;
+};
+
+/// <summary>
+/// Pairings for the STBs in a capture, from -k or the PairingStore.
+/// </summary>
+class ReplayPairings
+{
+public:
+
+	COMPANION_RESULT Open(const ReplayOptions& options)
+	{
+		_key = options.Key;
+		return options.PairingsPath.empty() ? COMPANION_OK : _store.Open(options.PairingsPath);
+	}
+
+	bool Find(const CaptureRecordView& record, CompanionPairingInfo* pairing)
+	{
+		pairing->TargetIPAddr = record.TargetIPAddr();
+		pairing->DeviceId = record.CidString();
+		pairing->SeqNum = record.SeqNum;
+		if (record.Flags & CAPTURE_FLAG_TEST_PAIRING)
+		{
+			pairing->DeviceKey.clear();
+			return true;
+		}
+		if (!_key.empty())
+		{
+			pairing->DeviceKey = _key;
+			return true;
+		}
+
+		bool found = false;
+		_store.ForEach([&](const PairingRecord& stored)
+		{
+			PairingEntry entry;
+			PairingStore::ToEntry(stored, &entry);
+			if (!found && entry.TargetIPAddr == pairing->TargetIPAddr && strcasecmp(entry.DeviceId.c_str(), pairing->DeviceId.c_str()) == 0)
+			{
+				pairing->DeviceKey = entry.DeviceKey;
+				found = true;
+			}
+		});
+		return found;
+	}
+
+	/// <summary>
+	/// An opened codec for the record's STB, created on first use.  NULL if there is no key for it.
+	/// </summary>
+	CompanionCodec* Codec(const CaptureRecordView& record)
+	{
+		std::string id = record.TargetIPAddr() + "/" + record.CidString();
+		std::map<std::string, std::unique_ptr<CompanionCodec> >::iterator it = _codecs.find(id);
+		if (it != _codecs.end())
+			return it->second.get();
+
+		CompanionPairingInfo pairing;
+		std::unique_ptr<CompanionCodec> codec(new CompanionCodec());
+		if (!Find(record, &pairing) || codec->Open(pairing) != COMPANION_OK)
+			codec.reset();
+		return (_codecs[id] = std::move(codec)).get();
+	}
+
+private:
+
+	std::string                                             _key;
+	PairingStore                                            _store;
+	std::map<std::string, std::unique_ptr<CompanionCodec> > _codecs;
+};
+
+static const char* OpOf(const CaptureRecordView& record, char* op, size_t size)
+{
+	if (!record.HasPlain())
+		return "(unknown)";
+
+	const char* plain = record.Plain;
+	const char* end = plain + record.PlainLength;
+	const char* at = plain;
+	while (at + 3 <= end && !(strncmp(at, "op=", 3) == 0 && (at == plain || at[-1] == '&')))
+		++at;
+	if (at + 3 > end)
+		return "(unknown)";
+
+	size_t length = 0;
+	for (at += 3; at < end && *at != '&' && length + 1 < size; ++at)
+		op[length++] = *at;
+	op[length] = '\0';
+	return op;
+}
+
+static int RunInfo(const CaptureReader& reader, ReplaySource& source)
+{
+	std::map<std::string, UINT64> ops;
+	std::map<std::string, UINT64> stbs;
+	std::vector<double> requestBytes, responseBytes;
+	UINT64 withPlain = 0;
+
+	CaptureRecordView record;
+	while (source.Next(&record))
+	{
+		++stbs[record.TargetIPAddr()];
+		if (record.HasPlain())
+			++withPlain;
+
+		if (record.Kind == CaptureRequest)
+		{
+			char op[32];
+			++ops[OpOf(record, op, sizeof(op))];
+			requestBytes.push_back(record.CipherLength);
+		}
+		else
+			responseBytes.push_back(record.CipherLength);
+	}
+
+	printf("%llu records in %zu blocks (%s), %.1f s, %zu STBs, %llu with plaintext\n", (unsigned long long)reader.Records(), reader.Blocks(),
+		reader.HasIndex() ? "indexed" : "not closed, blocks walked", (reader.LastUs() - reader.FirstUs()) / 1e6, stbs.size(), (unsigned long long)withPlain);
+	printf("requests  %8zu  body p50 %6.0f p99 %6.0f max %6.0f bytes\n", requestBytes.size(),
+		Percentile(requestBytes, 50), Percentile(requestBytes, 99), Percentile(requestBytes, 100));
+	printf("responses %8zu  body p50 %6.0f p99 %6.0f max %6.0f bytes\n", responseBytes.size(),
+		Percentile(responseBytes, 50), Percentile(responseBytes, 99), Percentile(responseBytes, 100));
+
+	std::vector<std::pair<UINT64, std::string> > mix;
+	for (std::map<std::string, UINT64>::iterator it = ops.begin(); it != ops.end(); ++it)
+		mix.push_back(std::make_pair(it->second, it->first));
+	std::sort(mix.rbegin(), mix.rend());
+	for (size_t i = 0; i < mix.size(); ++i)
+		printf("  op=%-16s %8llu  %5.1f%%\n", mix[i].second.c_str(), (unsigned long long)mix[i].first, 100.0 * mix[i].first / requestBytes.size());
+	return 0;
+}
+
+static int RunCodec(ReplaySource& source, ReplayPairings& pairings, const ReplayOptions& options)
+{
+	bool encode = options.Mode == "encode";
+	UINT64 checked = 0, identical = 0, differ = 0, failed = 0, skipped = 0, plainBytes = 0, busyUs = 0;
+
+	for (UINT32 pass = 0; pass < options.Repeat; ++pass)
+	{
+		source.Rewind();
+		ReplayPacer pacer(options.Speed);
+		CompanionRequest request;
+		std::string plain;
+
+		CaptureRecordView record;
+		while (source.Next(&record))
+		{
+			CompanionCodec* codec = NULL;
+			if (record.Kind != (encode ? CaptureRequest : CaptureResponse) || (encode && !record.HasPlain())
+				|| (record.Flags & CAPTURE_FLAG_TEST_PAIRING) || (codec = pairings.Codec(record)) == NULL)
+			{
+				++skipped;
+				continue;
+			}
+
+			pacer.Wait(record.TimestampUs);
+			std::string signature = record.Signature();
+
+			UINT64 startUs = EventLoop::NowUs();
+			COMPANION_RESULT result;
+			UINT32 rspSeq = 0;
+			if (encode)
+				result = codec->EncodeRequest(record.Plain, record.PlainLength, record.SeqNum, &request);
+			else
+				result = codec->DecryptResponse(signature.data(), (UINT32)signature.length(), record.Cipher, record.CipherLength, &rspSeq, &plain);
+			busyUs += EventLoop::NowUs() - startUs;
+			++checked;
+
+			if (result != COMPANION_OK)
+			{
+				++failed;
+				continue;
+			}
+
+			bool same;
+			if (encode)
+			{
+				plainBytes += record.PlainLength;
+				same = request.Body.size() == record.CipherLength && memcmp(&request.Body[0], record.Cipher, record.CipherLength) == 0
+					&& request.Query.find("hash=" + signature + "&") != std::string::npos;
+			}
+			else
+			{
+				plainBytes += plain.length();
+				same = rspSeq == record.SeqNum && (!record.HasPlain() || (plain.length() == record.PlainLength && memcmp(plain.data(), record.Plain, plain.length()) == 0));
+			}
+			++(same ? identical : differ);
+		}
+	}
+
+	printf("%s: %llu %s, %llu identical, %llu differ, %llu failed, %llu records skipped\n", options.Mode.c_str(), (unsigned long long)checked,
+		encode ? "requests" : "responses", (unsigned long long)identical, (unsigned long long)differ, (unsigned long long)failed, (unsigned long long)skipped);
+	if (checked != 0 && busyUs != 0)
+		printf("%.2f us per message, %.0f messages/s, %.1f MB/s of plaintext\n", (double)busyUs / checked, checked * 1e6 / busyUs, plainBytes / (double)busyUs);
+	return differ + failed == 0 ? 0 : 1;
+}
+
+/// <summary>
+/// Sends the captured requests at their paced times and collects the answers.
+/// </summary>
+class StbReplay
+{
+public:
+
+	StbReplay(EventLoop& loop, ReplaySource& source, ReplayPairings& pairings, const ReplayOptions& options)
+		: _loop(loop), _source(source), _pairings(pairings), _options(options), _pacer(options.Speed), _sending(true), _outstanding(0),
+		  _sent(0), _failed(0), _skipped(0), _startUs(0)
+	{
+	}
+
+	~StbReplay()
+	{
+		for (std::map<std::string, std::unique_ptr<CompanionClient> >::iterator it = _clients.begin(); it != _clients.end(); ++it)
+			it->second->Shutdown();
+		for (size_t i = 0; i < _servers.size(); ++i)
+			_servers[i]->Stop();
+	}
+
+	void Start()
+	{
+		_startUs = EventLoop::NowUs();
+		SendDue();
+	}
+
+	void Report() const
+	{
+		double elapsedS = (EventLoop::NowUs() - _startUs) / 1e6;
+		printf("stb: %llu requests to %zu STBs in %.2f s (%.0f/s), %llu failed, %llu records skipped\n", (unsigned long long)_sent, _clients.size(),
+			elapsedS, _sent / elapsedS, (unsigned long long)_failed, (unsigned long long)_skipped);
+		printf("latency p50 %.2f p99 %.2f max %.2f ms\n", Percentile(_latencyMs, 50), Percentile(_latencyMs, 99), Percentile(_latencyMs, 100));
+	}
+
+	UINT64 Failed() const { return _failed; }
+
+private:
+
+	CompanionClient* Client(const CaptureRecordView& record)
+	{
+		std::string id = record.TargetIPAddr() + "/" + record.CidString();
+		std::map<std::string, std::unique_ptr<CompanionClient> >::iterator it = _clients.find(id);
+		if (it != _clients.end())
+			return it->second.get();
+
+		// The captured number was used; start just behind it.
+		CompanionPairingInfo pairing;
+		std::unique_ptr<CompanionClient> client;
+		if (_pairings.Find(record, &pairing))
+		{
+			pairing.SeqNum = record.SeqNum >= 2 ? record.SeqNum - 2 : record.SeqNum;
+			if (_options.StandIn)
+			{
+				CompanionServerOptions serverOptions;
+				serverOptions.Address = pairing.TargetIPAddr;
+				serverOptions.Port = _options.Port;
+				_servers.push_back(std::unique_ptr<CompanionServer>(new CompanionServer(_loop, pairing, serverOptions)));
+				if (_servers.back()->Start() != COMPANION_OK)
+					fprintf(stderr, "CompanionReplay: cannot start a stand-in STB on %s:%u\n", pairing.TargetIPAddr.c_str(), (unsigned)_options.Port);
+			}
+
+			CompanionClientOptions clientOptions;
+			clientOptions.Port = _options.Port;
+			client.reset(new CompanionClient(_loop, pairing, clientOptions));
+			if (client->Open() != COMPANION_OK)
+				client.reset();
+		}
+		return (_clients[id] = std::move(client)).get();
+	}
+
+	void SendDue()
+	{
+		CaptureRecordView record;
+		while (_sending)
+		{
+			if (!_source.Next(&record))
+			{
+				_sending = false;
+				break;
+			}
+
+			CompanionClient* client = NULL;
+			if (record.Kind != CaptureRequest || !record.HasPlain() || (client = Client(record)) == NULL)
+			{
+				++_skipped;
+				continue;
+			}
+
+			UINT64 delayUs = _pacer.DelayUs(record.TimestampUs);
+			if (delayUs >= 1000)
+			{
+				std::string request(record.Plain, record.PlainLength);
+				_loop.AddTimer((UINT32)(delayUs / 1000), [this, client, request]()
+				{
+					Send(client, request);
+					SendDue();
+				});
+				return;
+			}
+			Send(client, std::string(record.Plain, record.PlainLength));
+		}
+		Finish();
+	}
+
+	void Send(CompanionClient* client, std::string request)
+	{
+		++_outstanding;
+		++_sent;
+		client->SendAsync(std::move(request), [this](CompanionResponse& response)
+		{
+			--_outstanding;
+			if (response.Result == COMPANION_OK)
+				_latencyMs.push_back(response.LatencyUs / 1000.0);
+			else
+				++_failed;
+			Finish();
+		});
+	}
+
+	void Finish()
+	{
+		if (!_sending && _outstanding == 0)
+			_loop.Stop();
+	}
+
+	EventLoop&                                              _loop;
+	ReplaySource&                                           _source;
+	ReplayPairings&                                         _pairings;
+	const ReplayOptions&                                    _options;
+	ReplayPacer                                             _pacer;
+	std::map<std::string, std::unique_ptr<CompanionClient> > _clients;
+	std::vector<std::unique_ptr<CompanionServer> >          _servers;
+	bool                                                    _sending;
+	UINT64                                                  _outstanding;
+	UINT64                                                  _sent;
+	UINT64                                                  _failed;
+	UINT64                                                  _skipped;
+	UINT64                                                  _startUs;
+	std::vector<double>                                     _latencyMs;
+};
+
+int main(int argc, char** argv)
+{
+	ReplayOptions options;
+	if (ParseArguments(argc, argv, &options) != 0)
+	{
+		Usage();
+		return 2;
+	}
+
+	CaptureReader reader;
+	if (reader.Open(options.CapturePath) != COMPANION_OK)
+	{
+		fprintf(stderr, "CompanionReplay: %s is not a capture\n", options.CapturePath.c_str());
+		return 1;
+	}
+
+	ReplayPairings pairings;
+	if (pairings.Open(options) != COMPANION_OK)
+	{
+		fprintf(stderr, "CompanionReplay: cannot open %s\n", options.PairingsPath.c_str());
+		return 1;
+	}
+
+	ReplaySource source(reader, options);
+	if (options.Mode == "info")
+		return RunInfo(reader, source);
+	if (options.Mode != "stb")
+		return RunCodec(source, pairings, options);
+
+	EventLoop loop;
+	int status;
+	{
+		StbReplay replay(loop, source, pairings, options);
+		loop.Post([&replay]() { replay.Start(); });
+		loop.Run();
+		replay.Report();
+		status = replay.Failed() == 0 ? 0 : 1;
+	}
+	return status;
+}
@@ -0,0 +1,401 @@
+//--------------------------------------------------------------------------
+// <copyright file="CompanionScalingBench.cpp" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// How CSParve64 encode, decode and hash throughput scales with threads.
+// </summary>
+//--------------------------------------------------------------------------
+
+/*
+ Using CompanionScalingBench:
+    CompanionScalingBench [-t maxthreads] [-s bytes] [-m milliseconds] [-p 0|1] [-a 0|1] [-c 0|1]
+
+ A gateway runs CSParve64 on many threads at once, either all through one context and instance (one pairing
+ serving many connections) or through one of each per thread.  For encode, decode and hash, with a shared
+ instance and with an instance per thread, runs 1, 2, 4 ... maxthreads threads (by default one per CPU) for
+ the given time and reports operations per second in all, per thread, and per thread against one thread
+ alone.  Each row has a bar plotting throughput per core, so scaling is linear while the bars stay as long
+ as the first; -c 1 prints CSV instead, for plotting elsewhere.
+ Each thread counts its operations in a slot on a cache line of its own, as per-thread state should be.
+ -p 0 packs the slots together instead, to show what a falsely shared line costs.  -a 1, the default,
+ pins thread i to the i-th CPU the process may use (Linux only).  Before the clock starts, every thread
+ checks that it encodes, decodes and hashes exactly what a single thread does.
+ */
+
+#include "CompanionConfig.h"
+#include "CSParve64.h"
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#define SCALING_BAR_WIDTH   40
+
+enum ScalingOperation
+{
+	ScalingEncode,
+	ScalingDecode,
+	ScalingHash
+};
+
+static const char* const ScalingOperationNames[] = { "encode", "decode", "hash" };
+
+struct ScalingBenchOptions
+{
+	UINT32 MaxThreads;      // 0 is one per CPU
+	UINT32 Size;
+	UINT32 Milliseconds;
+	bool   Padded;
+	bool   Pin;
+	bool   Csv;
+
+	ScalingBenchOptions() : MaxThreads(0), Size(256), Milliseconds(500), Padded(true), Pin(true), Csv(false) {}
+};
+
+/// <summary>
+/// What one thread alone produces, for every thread to check itself against.
+/// </summary>
+struct ScalingReference
+{
+	std::vector<BYTE> Plain;
+	std::vector<BYTE> Encoded;
+	UINT32            MacHi;
+	UINT32            MacLo;
+	UINT32            HashHi;
+	UINT32            HashLo;
+};
+
+/// <summary>
+/// One thread's operation count, alone on its cache line.
+/// </summary>
+struct alignas(CSPARVE64_CACHE_LINE_SIZE) ScalingSlot
+{
+	std::atomic<UINT64> Operations;
+};
+
+/// <summary>
+/// One measurement: an operation on some number of threads.
+/// </summary>
+struct ScalingRun
+{
+	ScalingOperation    Operation;
+	UINT32              Size;
+	void*               Context;        // shared by every thread, or NULL for one each
+	void*               Instance;
+	std::atomic<UINT32> Ready;
+	std::atomic<bool>   Go;
+	std::atomic<bool>   Stop;
+	std::atomic<bool>   Failed;
+
+	ScalingRun() : Operation(ScalingEncode), Size(0), Context(NULL), Instance(NULL), Ready(0), Go(false), Stop(false), Failed(false) {}
+};
+
+static const BYTE ScalingKey[8] = { 0x01, 0x23, 0x45, 0x67, 0x89, 0xAB, 0xCD, 0xEF };
+static const BYTE ScalingGuid[16] = { 0xab, 0x72, 0x52, 0x7a, 0x58, 0x2d, 0x4d, 0x6d, 0x98, 0xdd, 0x3d, 0xdc, 0xd4, 0xe0, 0x0e, 0xc5 };
+
+static void Usage()
+{
+	fprintf(stderr, "usage: CompanionScalingBench [-t maxthreads] [-s bytes] [-m milliseconds] [-p 0|1] [-a 0|1] [-c 0|1]\n");
+}
+
+static int ParseArguments(int argc, char** argv, ScalingBenchOptions* options)
+{
+	for (int i = 1; i < argc; ++i)
+	{
+		if (i + 1 >= argc)
+			return -1;
+
+		std::string arg = argv[i];
+		UINT32 value = (UINT32)strtoul(argv[++i], NULL, 10);
+		if (arg == "-t")
+			options->MaxThreads = value;
+		else if (arg == "-s")
+			options->Size = value;
+		else if (arg == "-m")
+			options->Milliseconds = value;
+		else if (arg == "-p")
+			options->Padded = value != 0;
+		else if (arg == "-a")
+			options->Pin = value != 0;
+		else if (arg == "-c")
+			options->Csv = value != 0;
+		else
+			return -1;
+	}
+	return (options->Size < 16 || options->Size % 8 != 0 || options->Milliseconds == 0) ? -1 : 0;
+}
+
+/// <summary>
+/// The CPUs this process may run on, in order.  Empty where that cannot be asked.
+/// </summary>
+static std::vector<int> AllowedCpus()
+{
+	std::vector<int> cpus;
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if (sched_getaffinity(0, sizeof(set), &set) == 0)
+	{
+		for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+		{
+			if (CPU_ISSET(cpu, &set))
+				cpus.push_back(cpu);
+		}
+	}
+#endif
+	return cpus;
+}
+
+static void PinTo(int cpu)
+{
+#ifdef __linux__
+	if (cpu < 0)
+		return;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+	(void)cpu;
+#endif
+}
+
+static bool Open(void** context, void** instance)
+{
+	UINT32 hiHash, loHash;
+	*instance = NULL;
+	if (CSParve64_OpenContext(context, CompanionConfig, CompanionSBox) != CSPARVE64_OK)
+		return false;
+	if (CSParve64_Create(*context, ScalingKey, ScalingGuid, sizeof(ScalingGuid), &hiHash, &loHash, instance) != CSPARVE64_OK)
+	{
+		CSParve64_CloseContext(*context);
+		*context = NULL;
+		return false;
+	}
+	return true;
+}
+
+static void Close(void* context, void* instance)
+{
+	CSParve64_Destroy(instance);
+	CSParve64_CloseContext(context);
+}
+
+static void Fill(std::vector<BYTE>& message, UINT32 size)
+{
+	message.resize(size);
+	for (UINT32 i = 0; i < size; ++i)
+		message[i] = (BYTE)("op=key&key=ok&seq=000003E9&cid=ab72527a-582d-4d6d-98dd-3ddcd4e00ec5&"[i % 68] + i / 68);
+}
+
+static bool MakeReference(void* context, void* instance, UINT32 size, ScalingReference* reference)
+{
+	Fill(reference->Plain, size);
+	reference->Encoded = reference->Plain;
+	return CSParve64_Encode(instance, reference->Encoded.data(), size, &reference->MacHi, &reference->MacLo) == CSPARVE64_OK
+		&& CSParve64_ComputeHash(context, ScalingKey, reference->Plain.data(), size, &reference->HashHi, &reference->HashLo) == CSPARVE64_OK;
+}
+
+/// <summary>
+/// This thread's context and instance agree with the reference.
+/// </summary>
+static bool Check(void* context, void* instance, const ScalingReference& reference)
+{
+	UINT32 size = (UINT32)reference.Plain.size();
+	std::vector<BYTE> message = reference.Plain;
+	UINT32 hi, lo;
+	if (CSParve64_Encode(instance, message.data(), size, &hi, &lo) != CSPARVE64_OK
+		|| message != reference.Encoded || hi != reference.MacHi || lo != reference.MacLo)
+		return false;
+	if (CSParve64_Decode(instance, message.data(), size, &hi, &lo) != CSPARVE64_OK
+		|| message != reference.Plain || hi != reference.MacHi || lo != reference.MacLo)
+		return false;
+	return CSParve64_ComputeHash(context, ScalingKey, reference.Plain.data(), size, &hi, &lo) == CSPARVE64_OK
+		&& hi == reference.HashHi && lo == reference.HashLo;
+}
+
+static void Work(ScalingRun* run, const ScalingReference* reference, std::atomic<UINT64>* operations, int cpu)
+{
+	PinTo(cpu);
+
+	// Everything this thread writes is its own: the message, and (when padded) the counter's line.
+	void* context = run->Context;
+	void* instance = run->Instance;
+	bool ok = context != NULL || Open(&context, &instance);
+	ok = ok && Check(context, instance, *reference);
+	if (!ok)
+		run->Failed.store(true);
+
+	std::vector<BYTE> message = run->Operation == ScalingDecode ? reference->Encoded : reference->Plain;
+	UINT32 size = run->Size;
+
+	run->Ready.fetch_add(1);
+	while (!run->Go.load(std::memory_order_acquire))
+		std::this_thread::yield();
+
+	UINT64 count = 0;
+	UINT32 hi, lo;
+	while (ok && !run->Stop.load(std::memory_order_relaxed))
+	{
+		// Encoding or decoding in place again and again is as much work as a fresh message each time.
+		switch (run->Operation)
+		{
+		case ScalingEncode:
+			CSParve64_Encode(instance, message.data(), size, &hi, &lo);
+			break;
+		case ScalingDecode:
+			CSParve64_Decode(instance, message.data(), size, &hi, &lo);
+			break;
+		case ScalingHash:
+			CSParve64_ComputeHash(context, ScalingKey, message.data(), size, &hi, &lo);
+			break;
+		}
+		operations->store(++count, std::memory_order_relaxed);
+	}
+
+	if (context != NULL && context != run->Context)
+		Close(context, instance);
+}
+
+/// <summary>
+/// Operations per second of threads threads together.  False if a thread disagreed with the reference.
+/// </summary>
+static bool Measure(ScalingOperation operation, bool shared, UINT32 threads, const ScalingBenchOptions& options,
+	const std::vector<int>& cpus, void* context, void* instance, const ScalingReference& reference, double* perSecond)
+{
+	ScalingRun run;
+	run.Operation = operation;
+	run.Size = options.Size;
+	run.Context = shared ? context : NULL;
+	run.Instance = shared ? instance : NULL;
+
+	std::unique_ptr<ScalingSlot[]> slots(new ScalingSlot[threads]);
+	std::unique_ptr<std::atomic<UINT64>[]> packed(new std::atomic<UINT64>[threads]);
+	std::vector<std::thread> workers;
+	for (UINT32 i = 0; i < threads; ++i)
+	{
+		slots[i].Operations.store(0);
+		packed[i].store(0);
+		std::atomic<UINT64>* operations = options.Padded ? &slots[i].Operations : &packed[i];
+		int cpu = options.Pin && !cpus.empty() ? cpus[i % cpus.size()] : -1;
+		workers.emplace_back(Work, &run, &reference, operations, cpu);
+	}
+
+	while (run.Ready.load() != threads)
+		std::this_thread::yield();
+
+	auto start = std::chrono::steady_clock::now();
+	run.Go.store(true, std::memory_order_release);
+	std::this_thread::sleep_for(std::chrono::milliseconds(options.Milliseconds));
+
+	UINT64 total = 0;
+	for (UINT32 i = 0; i < threads; ++i)
+		total += options.Padded ? slots[i].Operations.load(std::memory_order_relaxed) : packed[i].load(std::memory_order_relaxed);
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	run.Stop.store(true);
+
+	for (size_t i = 0; i < workers.size(); ++i)
+		workers[i].join();
+
+	*perSecond = seconds > 0 ? total / seconds : 0;
+	return !run.Failed.load();
+}
+
+static void PrintBar(double ratio)
+{
+	int width = (int)(ratio * SCALING_BAR_WIDTH + 0.5);
+	if (width > SCALING_BAR_WIDTH * 3 / 2)
+		width = SCALING_BAR_WIDTH * 3 / 2;
+	printf("  ");
+	for (int i = 0; i < width; ++i)
+		putchar('#');
+	putchar('\n');
+}
+
+int main(int argc, char** argv)
+{
+	ScalingBenchOptions options;
+	if (ParseArguments(argc, argv, &options) != 0)
+	{
+		Usage();
+		return 2;
+	}
+
+	std::vector<int> cpus = AllowedCpus();
+	if (options.MaxThreads == 0)
+		options.MaxThreads = !cpus.empty() ? (UINT32)cpus.size() : std::thread::hardware_concurrency();
+	if (options.MaxThreads == 0)
+		options.MaxThreads = 1;
+
+	std::vector<UINT32> threadCounts;
+	for (UINT32 threads = 1; threads < options.MaxThreads; threads *= 2)
+		threadCounts.push_back(threads);
+	threadCounts.push_back(options.MaxThreads);
+
+	void* context = NULL;
+	void* instance = NULL;
+	ScalingReference reference;
+	if (!Open(&context, &instance) || !MakeReference(context, instance, options.Size, &reference))
+	{
+		fprintf(stderr, "CompanionScalingBench: cannot create a CSParve64 instance\n");
+		return 1;
+	}
+
+	if (options.Csv)
+		printf("operation,instance,threads,ops_per_second,ops_per_second_per_thread,scaling\n");
+	else
+		printf("%u-byte messages, %u ms per run, %u CPUs, counters %s, threads %s\n", options.Size, options.Milliseconds,
+			(UINT32)cpus.size(), options.Padded ? "padded" : "packed", options.Pin && !cpus.empty() ? "pinned" : "unpinned");
+
+	int result = 0;
+	for (int operation = ScalingEncode; operation <= ScalingHash; ++operation)
+	{
+		for (int shared = 1; shared >= 0; --shared)
+		{
+			const char* layout = shared ? "shared" : "per-thread";
+			if (!options.Csv)
+				printf("\n%s, %s instance\n%7s  %12s  %12s  %7s\n", ScalingOperationNames[operation], layout, "threads", "ops/s", "ops/s/thread", "scaling");
+
+			double single = 0;
+			for (size_t i = 0; i < threadCounts.size(); ++i)
+			{
+				UINT32 threads = threadCounts[i];
+				double perSecond = 0;
+				if (!Measure((ScalingOperation)operation, shared != 0, threads, options, cpus, context, instance, reference, &perSecond))
+				{
+					fprintf(stderr, "CompanionScalingBench: %s on %u threads disagrees with one thread\n", ScalingOperationNames[operation], threads);
+					result = 1;
+					break;
+				}
+
+				double perThread = perSecond / threads;
+				if (i == 0)
+					single = perThread;
+				double scaling = single > 0 ? perThread / single : 0;
+
+				if (options.Csv)
+				{
+					printf("%s,%s,%u,%.0f,%.0f,%.3f\n", ScalingOperationNames[operation], layout, threads, perSecond, perThread, scaling);
+					continue;
+				}
+				printf("%7u  %12.0f  %12.0f  %6.1f%%", threads, perSecond, perThread, scaling * 100);
+				PrintBar(scaling);
+			}
+		}
+	}
+
+	Close(context, instance);
+	return result;
+}
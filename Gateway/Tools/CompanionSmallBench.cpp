@@ -0,0 +1,193 @@
+//--------------------------------------------------------------------------
+// <copyright file="CompanionSmallBench.cpp" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// Per-call cost of CSParve64_Encode and CSParve64_Decode on small messages.
+// </summary>
+//--------------------------------------------------------------------------
+
+/*
+ Using CompanionSmallBench:
+    CompanionSmallBench [-n iterations] [-s maxsize]
+
+ Companion commands are short: most encode to well under 128 bytes, where the BV4 key setup (an RC4 key
+ schedule and 132 bytes of keystream) costs more than the encryption itself.  For each size from 16 to
+ maxsize bytes in steps of 8, encodes and decodes a message iterations times with an instance from a context
+ whose small-message size (CSParve64_SetSmallMessageSize) is 0 and one whose is maxsize, and reports the
+ median cycles per call of each and the speedup.  CSPARVE64_SMALL_MESSAGE_SIZE should stay within the sizes
+ where the speedup is above 1 on both.  Cycles are read with rdtsc where there is one, and are otherwise nanoseconds.
+ Every size is first checked both ways: both paths must produce the same ciphertext and MAC, and each must
+ decode what the other encoded.
+ */
+
+#include "CompanionConfig.h"
+#include "CSParve64.h"
+
+#include <algorithm>
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define SMALL_BENCH_UNIT "cycles"
+static inline UINT64 Ticks() { return __rdtsc(); }
+#else
+#define SMALL_BENCH_UNIT "ns"
+static inline UINT64 Ticks()
+{
+	return (UINT64)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+#endif
+
+struct SmallBenchOptions
+{
+	UINT32 Iterations;
+	UINT32 MaxSize;
+
+	SmallBenchOptions() : Iterations(20000), MaxSize(128) {}
+};
+
+static void Usage()
+{
+	fprintf(stderr, "usage: CompanionSmallBench [-n iterations] [-s maxsize]\n");
+}
+
+static int ParseArguments(int argc, char** argv, SmallBenchOptions* options)
+{
+	for (int i = 1; i < argc; ++i)
+	{
+		if (i + 1 >= argc)
+			return -1;
+
+		std::string arg = argv[i];
+		UINT32 value = (UINT32)strtoul(argv[++i], NULL, 10);
+		if (arg == "-n")
+			options->Iterations = value;
+		else if (arg == "-s")
+			options->MaxSize = value;
+		else
+			return -1;
+	}
+	return (options->Iterations == 0 || options->MaxSize < 16) ? -1 : 0;
+}
+
+static void Fill(std::vector<BYTE>& message, UINT32 size)
+{
+	message.resize(size);
+	for (UINT32 i = 0; i < size; ++i)
+		message[i] = (BYTE)("op=key&key=ok&seq=000003E9&cid=ab72527a-582d-4d6d-98dd-3ddcd4e00ec5&"[i % 68] + i / 68);
+}
+
+/// <summary>
+/// Both paths agree on every message of this size.
+/// </summary>
+static bool Verify(void* generalInstance, void* smallInstance, UINT32 size)
+{
+	std::vector<BYTE> plain, general, small;
+	Fill(plain, size);
+
+	UINT32 hi[2], lo[2];
+	general = plain;
+	CSParve64_Encode(generalInstance, general.data(), size, &hi[0], &lo[0]);
+	small = plain;
+	CSParve64_Encode(smallInstance, small.data(), size, &hi[1], &lo[1]);
+	if (general != small || hi[0] != hi[1] || lo[0] != lo[1])
+		return false;
+
+	// Decode each with the other path.
+	UINT32 decodedHi[2], decodedLo[2];
+	CSParve64_Decode(smallInstance, general.data(), size, &decodedHi[0], &decodedLo[0]);
+	CSParve64_Decode(generalInstance, small.data(), size, &decodedHi[1], &decodedLo[1]);
+	return general == plain && small == plain && decodedHi[0] == hi[0] && decodedLo[0] == lo[0]
+		&& decodedHi[1] == hi[0] && decodedLo[1] == lo[0];
+}
+
+/// <summary>
+/// Median ticks of one call of Encode (decode false) or Decode.
+/// </summary>
+static UINT64 Time(void* instance, UINT32 size, bool decode, UINT32 iterations)
+{
+	std::vector<BYTE> plain, message;
+	Fill(plain, size);
+
+	std::vector<BYTE> encoded = plain;
+	UINT32 hi, lo;
+	CSParve64_Encode(instance, encoded.data(), size, &hi, &lo);
+	const std::vector<BYTE>& input = decode ? encoded : plain;
+
+	std::vector<UINT64> ticks(iterations);
+	for (UINT32 i = 0; i < iterations; ++i)
+	{
+		// Restore the input outside the timed call, so each call sees the same message.
+		message = input;
+		UINT64 start = Ticks();
+		if (decode)
+			CSParve64_Decode(instance, message.data(), size, &hi, &lo);
+		else
+			CSParve64_Encode(instance, message.data(), size, &hi, &lo);
+		ticks[i] = Ticks() - start;
+	}
+
+	std::nth_element(ticks.begin(), ticks.begin() + iterations / 2, ticks.end());
+	return ticks[iterations / 2];
+}
+
+int main(int argc, char** argv)
+{
+	SmallBenchOptions options;
+	if (ParseArguments(argc, argv, &options) != 0)
+	{
+		Usage();
+		return 2;
+	}
+
+	// The same key in two contexts, one that never takes the small-message path and one that always does.
+	void* contexts[2] = { NULL, NULL };
+	void* instances[2] = { NULL, NULL };
+	const BYTE key[8] = { 0x01, 0x23, 0x45, 0x67, 0x89, 0xAB, 0xCD, 0xEF };
+	const BYTE guid[16] = { 0xab, 0x72, 0x52, 0x7a, 0x58, 0x2d, 0x4d, 0x6d, 0x98, 0xdd, 0x3d, 0xdc, 0xd4, 0xe0, 0x0e, 0xc5 };
+	UINT32 hiHash, loHash;
+	for (int i = 0; i < 2; ++i)
+	{
+		if (CSParve64_OpenContext(&contexts[i], CompanionConfig, CompanionSBox) != CSPARVE64_OK
+			|| CSParve64_SetSmallMessageSize(contexts[i], i == 0 ? 0 : options.MaxSize) != CSPARVE64_OK
+			|| CSParve64_Create(contexts[i], key, guid, sizeof(guid), &hiHash, &loHash, &instances[i]) != CSPARVE64_OK)
+		{
+			fprintf(stderr, "CompanionSmallBench: cannot create a CSParve64 instance\n");
+			return 1;
+		}
+	}
+
+	int result = 0;
+	printf("median %s per call, %u iterations\n", SMALL_BENCH_UNIT, options.Iterations);
+	printf("%5s  %10s %10s %7s  %10s %10s %7s\n", "bytes", "encode", "small", "speedup", "decode", "small", "speedup");
+	for (UINT32 size = 16; size <= options.MaxSize; size += 8)
+	{
+		if (!Verify(instances[0], instances[1], size))
+		{
+			fprintf(stderr, "CompanionSmallBench: paths disagree on %u-byte messages\n", size);
+			result = 1;
+			continue;
+		}
+
+		UINT64 encode = Time(instances[0], size, false, options.Iterations);
+		UINT64 encodeSmall = Time(instances[1], size, false, options.Iterations);
+		UINT64 decode = Time(instances[0], size, true, options.Iterations);
+		UINT64 decodeSmall = Time(instances[1], size, true, options.Iterations);
+		printf("%5u  %10llu %10llu %6.2fx  %10llu %10llu %6.2fx\n", size,
+			(unsigned long long)encode, (unsigned long long)encodeSmall, (double)encode / std::max<UINT64>(encodeSmall, 1),
+			(unsigned long long)decode, (unsigned long long)decodeSmall, (double)decode / std::max<UINT64>(decodeSmall, 1));
+	}
+
+	for (int i = 0; i < 2; ++i)
+	{
+		CSParve64_Destroy(instances[i]);
+		CSParve64_CloseContext(contexts[i]);
+	}
+	return result;
+}
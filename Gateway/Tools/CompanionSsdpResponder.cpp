@@ -0,0 +1,204 @@
+//--------------------------------------------------------------------------
+// <copyright file="CompanionSsdpResponder.cpp" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// SSDP responder standing in for STBs, for testing discovery.
+// </summary>
+//--------------------------------------------------------------------------
+
+/*
+ Using CompanionSsdpResponder:
+    CompanionSsdpResponder [-i interface] [-p port] [-d usn@address]... [-a maxage] [-w delayms]
+                           [-x seconds] [-n answers]
+
+ Joins the SSDP group on interface (default 127.0.0.1, so SsdpDiscovery with Interfaces = { "127.0.0.1" }
+ finds it) and answers every M-SEARCH for ssdp:all, upnp:rootdevice or a device's own UDN with one response
+ per device, giving address in its LOCATION.  -w waits before answering, as an STB honouring MX does.
+ -x moves every device to the next address (last octet + 1) each given number of seconds, as a DHCP lease
+ change would.  Exits after -n answers, or runs until killed.
+ */
+
+#include "SsdpDiscovery.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+struct ResponderDevice
+{
+	std::string Usn;
+	std::string Address;
+};
+
+struct ResponderOptions
+{
+	std::string                  Interface;
+	UINT16                       Port;
+	std::vector<ResponderDevice> Devices;
+	UINT32                       MaxAgeSeconds;
+	UINT32                       DelayMs;
+	UINT32                       MoveSeconds;
+	UINT32                       Answers;
+
+	ResponderOptions() : Interface("127.0.0.1"), Port(SSDP_PORT), MaxAgeSeconds(1800), DelayMs(0), MoveSeconds(0), Answers(0) {}
+};
+
+static void Usage()
+{
+	fprintf(stderr, "usage: CompanionSsdpResponder [-i interface] [-p port] [-d usn@address]... [-a maxage] [-w delayms]\n"
+		"                              [-x seconds] [-n answers]\n");
+}
+
+static int ParseArguments(int argc, char** argv, ResponderOptions* options)
+{
+	for (int i = 1; i < argc; ++i)
+	{
+		if (i + 1 >= argc)
+			return -1;
+
+		std::string arg = argv[i];
+		std::string value = argv[++i];
+		if (arg == "-i")
+			options->Interface = value;
+		else if (arg == "-p")
+			options->Port = (UINT16)strtoul(value.c_str(), NULL, 10);
+		else if (arg == "-d")
+		{
+			size_t at = value.rfind('@');
+			if (at == std::string::npos || at == 0)
+				return -1;
+			ResponderDevice device;
+			device.Usn = value.substr(0, at);
+			device.Address = value.substr(at + 1);
+			options->Devices.push_back(device);
+		}
+		else if (arg == "-a")
+			options->MaxAgeSeconds = (UINT32)strtoul(value.c_str(), NULL, 10);
+		else if (arg == "-w")
+			options->DelayMs = (UINT32)strtoul(value.c_str(), NULL, 10);
+		else if (arg == "-x")
+			options->MoveSeconds = (UINT32)strtoul(value.c_str(), NULL, 10);
+		else if (arg == "-n")
+			options->Answers = (UINT32)strtoul(value.c_str(), NULL, 10);
+		else
+			return -1;
+	}
+
+	if (options->Devices.empty())
+	{
+		ResponderDevice device;
+		device.Usn = "uuid:00000000-0000-0000-0000-000000000001";
+		device.Address = "127.0.0.2";
+		options->Devices.push_back(device);
+	}
+	return 0;
+}
+
+/// <summary>
+/// address with generation added to its last octet.
+/// </summary>
+static std::string MovedAddress(const std::string& address, UINT32 generation)
+{
+	struct in_addr parsed;
+	if (generation == 0 || inet_pton(AF_INET, address.c_str(), &parsed) != 1)
+		return address;
+
+	UINT32 host = ntohl(parsed.s_addr);
+	host = (host & 0xFFFFFF00) | (((host & 0xFF) + generation - 1) % 254 + 1);
+	parsed.s_addr = htonl(host);
+
+	char moved[INET_ADDRSTRLEN];
+	return inet_ntop(AF_INET, &parsed, moved, sizeof(moved)) != NULL ? moved : address;
+}
+
+static bool Wanted(const SsdpMessage& message, const ResponderDevice& device)
+{
+	return message.Target.EqualsNoCase("ssdp:all")
+		|| message.Target.EqualsNoCase("upnp:rootdevice")
+		|| message.Target.EqualsNoCase(SsdpDeviceKey(device.Usn).c_str());
+}
+
+int main(int argc, char** argv)
+{
+	ResponderOptions options;
+	if (ParseArguments(argc, argv, &options) != 0)
+	{
+		Usage();
+		return 2;
+	}
+
+	struct ip_mreq membership = {};
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	int one = 1;
+	struct sockaddr_in local = {};
+	local.sin_family = AF_INET;
+	local.sin_port = htons(options.Port);
+	local.sin_addr.s_addr = htonl(INADDR_ANY);
+	if (fd < 0
+		|| setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0
+		|| bind(fd, (struct sockaddr*)&local, sizeof(local)) != 0
+		|| inet_pton(AF_INET, SSDP_MULTICAST_ADDRESS, &membership.imr_multiaddr) != 1
+		|| inet_pton(AF_INET, options.Interface.c_str(), &membership.imr_interface) != 1
+		|| setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership)) != 0)
+	{
+		fprintf(stderr, "CompanionSsdpResponder: cannot join %s on %s port %u\n", SSDP_MULTICAST_ADDRESS, options.Interface.c_str(), (unsigned)options.Port);
+		return 1;
+	}
+
+	printf("answering on %s port %u for %u devices\n", options.Interface.c_str(), (unsigned)options.Port, (UINT32)options.Devices.size());
+	fflush(stdout);
+
+	time_t started = time(NULL);
+	UINT32 answers = 0;
+	char buffer[SSDP_MAX_MESSAGE];
+
+	while (options.Answers == 0 || answers < options.Answers)
+	{
+		struct sockaddr_in sender = {};
+		socklen_t senderLength = sizeof(sender);
+		ssize_t received = recvfrom(fd, buffer, sizeof(buffer), 0, (struct sockaddr*)&sender, &senderLength);
+		if (received <= 0)
+			continue;
+
+		SsdpMessage message;
+		if (SsdpParse(buffer, (UINT32)received, &message) != COMPANION_OK || message.Kind != SsdpSearch || !message.Man.EqualsNoCase("\"ssdp:discover\""))
+			continue;
+
+		if (options.DelayMs != 0)
+			usleep(options.DelayMs * 1000);
+
+		UINT32 generation = options.MoveSeconds != 0 ? (UINT32)((time(NULL) - started) / options.MoveSeconds) : 0;
+		std::string target = message.Target.ToString();
+		for (size_t i = 0; i < options.Devices.size(); ++i)
+		{
+			const ResponderDevice& device = options.Devices[i];
+			if (!Wanted(message, device))
+				continue;
+
+			std::string address = MovedAddress(device.Address, generation);
+			char response[1024];
+			int length = snprintf(response, sizeof(response),
+				"HTTP/1.1 200 OK\r\nCACHE-CONTROL: max-age=%u\r\nEXT:\r\nLOCATION: http://%s:%u/description.xml\r\n"
+				"SERVER: Linux/3.x UPnP/1.0 CompanionSsdpResponder/1.0\r\nST: %s\r\nUSN: %s::%s\r\n\r\n",
+				options.MaxAgeSeconds, address.c_str(), (unsigned)COMPANION_PORT, target.c_str(),
+				SsdpDeviceKey(device.Usn).c_str(), target.c_str());
+			sendto(fd, response, (size_t)length, 0, (struct sockaddr*)&sender, senderLength);
+
+			++answers;
+			printf("%s -> %s\n", device.Usn.c_str(), address.c_str());
+			fflush(stdout);
+		}
+	}
+
+	close(fd);
+	return 0;
+}
@@ -0,0 +1,294 @@
+//--------------------------------------------------------------------------
+// <copyright file="CompanionTransportBench.cpp" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// The same companion load over the epoll and the io_uring transport.
+// </summary>
+//--------------------------------------------------------------------------
+
+/*
+ Using CompanionTransportBench:
+    CompanionTransportBench [-s seconds] [-c connections] [-d pipelinedepth] [-i inflight] [-b bodybytes] [-e 0|1]
+
+ Runs the same load twice, once with both ends on NetTransportEpoll and once on NetTransportUring: a
+ CompanionServer on its own loop thread and a CompanionClient on this one, over connections connections with
+ pipelinedepth requests written back to back on each, keeping inflight requests outstanding for seconds
+ (after a short warm-up).  Each request carries a bodybytes body; with -e 0 the pairing is a test pairing,
+ so nothing is encrypted and the transport is most of what is measured.
+ For each transport it reports requests per second, latency percentiles, the CPU each thread spent per
+ request, the bytes the server had to copy aside because a request straddled reads (the rest it decoded
+ where they were received), and on io_uring the io_uring_enter calls each loop made per request.  If the
+ kernel has no io_uring, the second run falls back to epoll and says so.
+ */
+
+#include "CompanionClient.h"
+#include "CompanionServer.h"
+#include "IoUring.h"
+
+#include <algorithm>
+#include <future>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <thread>
+#include <time.h>
+#include <vector>
+
+#define TRANSPORT_WARMUP_MS 300
+
+struct TransportBenchOptions
+{
+	UINT32 Seconds;
+	UINT32 Connections;
+	UINT32 PipelineDepth;
+	UINT32 InFlight;
+	UINT32 BodyBytes;
+	bool   Encrypted;
+
+	TransportBenchOptions() : Seconds(3), Connections(4), PipelineDepth(4), InFlight(64), BodyBytes(64), Encrypted(true) {}
+};
+
+static void Usage()
+{
+	fprintf(stderr, "usage: CompanionTransportBench [-s seconds] [-c connections] [-d pipelinedepth] [-i inflight] [-b bodybytes] [-e 0|1]\n");
+}
+
+static int ParseArguments(int argc, char** argv, TransportBenchOptions* options)
+{
+	for (int i = 1; i < argc; ++i)
+	{
+		if (i + 1 >= argc)
+			return -1;
+
+		std::string arg = argv[i];
+		UINT32 value = (UINT32)strtoul(argv[++i], NULL, 10);
+		if (arg == "-s")
+			options->Seconds = value;
+		else if (arg == "-c")
+			options->Connections = value;
+		else if (arg == "-d")
+			options->PipelineDepth = value;
+		else if (arg == "-i")
+			options->InFlight = value;
+		else if (arg == "-b")
+			options->BodyBytes = value;
+		else if (arg == "-e")
+			options->Encrypted = value != 0;
+		else
+			return -1;
+	}
+	return (options->Seconds == 0 || options->Connections == 0 || options->PipelineDepth == 0 || options->InFlight == 0) ? -1 : 0;
+}
+
+static UINT64 ThreadCpuUs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (UINT64)ts.tv_sec * 1000000 + (UINT64)ts.tv_nsec / 1000;
+}
+
+/// <summary>
+/// One loop thread's counters at one moment.
+/// </summary>
+struct LoopSample
+{
+	UINT64 CpuUs;
+	UINT64 Enters;      // io_uring_enter calls; 0 on epoll
+	UINT64 BytesBuffered;
+
+	LoopSample() : CpuUs(0), Enters(0), BytesBuffered(0) {}
+};
+
+/// <summary>
+/// Must run on the loop's thread.  The loop's ring is only looked at on io_uring, so as not to create one.
+/// </summary>
+static LoopSample SampleLoop(EventLoop& loop, NetTransport transport, const CompanionServer* server)
+{
+	LoopSample sample;
+	sample.CpuUs = ThreadCpuUs();
+	IoUring* ring = transport == NetTransportUring ? loop.Uring() : NULL;
+	if (ring != NULL)
+		sample.Enters = ring->Stats().Enters;
+	if (server != NULL)
+		sample.BytesBuffered = server->Stats().BytesBuffered;
+	return sample;
+}
+
+struct RunResult
+{
+	NetTransport        Transport;      // what the server actually used
+	UINT64              Completed;
+	UINT32              Failures;
+	double              Seconds;
+	std::vector<double> LatencyUs;
+	LoopSample          Client;         // differences over the measured interval
+	LoopSample          Server;
+
+	RunResult() : Transport(NetTransportEpoll), Completed(0), Failures(0), Seconds(0) {}
+};
+
+static RunResult Run(const TransportBenchOptions& options, const CompanionPairingInfo& pairing, NetTransport transport)
+{
+	RunResult result;
+
+	CompanionServerOptions serverOptions;
+	serverOptions.Port = 0;
+	serverOptions.Transport = transport;
+
+	EventLoop serverLoop;
+	serverLoop.Start();
+	CompanionServer* server = NULL;
+	std::promise<COMPANION_RESULT> started;
+	serverLoop.Post([&]()
+	{
+		server = new CompanionServer(serverLoop, pairing, serverOptions);
+		started.set_value(server->Start());
+	});
+	if (started.get_future().get() != COMPANION_OK)
+	{
+		fprintf(stderr, "CompanionTransportBench: cannot listen\n");
+		exit(1);
+	}
+	result.Transport = server->Transport();
+
+	auto sampleServer = [&]()
+	{
+		std::promise<LoopSample> done;
+		serverLoop.Post([&]() { done.set_value(SampleLoop(serverLoop, result.Transport, server)); });
+		return done.get_future().get();
+	};
+
+	EventLoop loop;
+	CompanionClientOptions clientOptions;
+	clientOptions.Port = server->Port();
+	clientOptions.Connections = options.Connections;
+	clientOptions.PipelineDepth = options.PipelineDepth;
+	clientOptions.MaxInFlight = options.InFlight;
+	clientOptions.TimeoutMs = 10000;
+	clientOptions.Transport = result.Transport;
+	CompanionClient client(loop, pairing, clientOptions);
+	if (client.Open() != COMPANION_OK)
+	{
+		fprintf(stderr, "CompanionTransportBench: cannot open the pairing\n");
+		exit(1);
+	}
+
+	std::string request = "op=hello&pad=" + std::string(options.BodyBytes > 13 ? options.BodyBytes - 13 : 0, 'x');
+	bool measuring = false;
+	bool stopping = false;
+	UINT32 outstanding = 0;
+	LoopSample clientStart, serverStart;
+	UINT64 startUs = 0;
+
+	// Closed loop: every answer sends the next request.
+	std::function<void()> send = [&]()
+	{
+		++outstanding;
+		client.SendAsync(request, [&](CompanionResponse& response)
+		{
+			--outstanding;
+			if (measuring)
+			{
+				if (response.Result == COMPANION_OK)
+				{
+					++result.Completed;
+					result.LatencyUs.push_back((double)response.LatencyUs);
+				}
+				else
+					++result.Failures;
+			}
+			if (!stopping)
+				send();
+			else if (outstanding == 0)
+				loop.Stop();
+		});
+	};
+
+	loop.AddTimer(TRANSPORT_WARMUP_MS, [&]()
+	{
+		measuring = true;
+		clientStart = SampleLoop(loop, result.Transport, NULL);
+		serverStart = sampleServer();
+		startUs = EventLoop::NowUs();
+		loop.AddTimer(options.Seconds * 1000, [&]()
+		{
+			measuring = false;
+			stopping = true;
+			result.Seconds = (EventLoop::NowUs() - startUs) / 1e6;
+			LoopSample clientEnd = SampleLoop(loop, result.Transport, NULL);
+			LoopSample serverEnd = sampleServer();
+			result.Client.CpuUs = clientEnd.CpuUs - clientStart.CpuUs;
+			result.Client.Enters = clientEnd.Enters - clientStart.Enters;
+			result.Server.CpuUs = serverEnd.CpuUs - serverStart.CpuUs;
+			result.Server.Enters = serverEnd.Enters - serverStart.Enters;
+			result.Server.BytesBuffered = serverEnd.BytesBuffered - serverStart.BytesBuffered;
+		});
+	});
+	for (UINT32 i = 0; i < options.InFlight; ++i)
+		send();
+	loop.Run();
+	client.Shutdown();
+
+	std::promise<void> stopped;
+	serverLoop.Post([&]()
+	{
+		delete server;
+		stopped.set_value();
+	});
+	stopped.get_future().get();
+	serverLoop.Stop();
+	serverLoop.Join();
+	return result;
+}
+
+static void Report(const char* name, RunResult& run)
+{
+	std::vector<double>& latency = run.LatencyUs;
+	std::sort(latency.begin(), latency.end());
+	if (latency.empty())
+		latency.push_back(0);
+	double requests = run.Completed != 0 ? (double)run.Completed : 1;
+
+	printf("%-7s %9.0f req/s  p50 %7.1f us  p99 %7.1f us  failed %u\n", name, run.Completed / run.Seconds,
+		latency[latency.size() / 2], latency[latency.size() * 99 / 100], run.Failures);
+	printf("        cpu/request  client %6.2f us  server %6.2f us   server bytes copied aside %llu\n",
+		run.Client.CpuUs / requests, run.Server.CpuUs / requests, (unsigned long long)run.Server.BytesBuffered);
+	if (run.Transport == NetTransportUring)
+		printf("        io_uring_enter/request  client %.3f  server %.3f\n", run.Client.Enters / requests, run.Server.Enters / requests);
+}
+
+int main(int argc, char** argv)
+{
+	TransportBenchOptions options;
+	if (ParseArguments(argc, argv, &options) != 0)
+	{
+		Usage();
+		return 2;
+	}
+
+	CompanionPairingInfo pairing;
+	pairing.TargetIPAddr = "127.0.0.1";
+	pairing.DeviceId = "ab72527a-582d-4d6d-98dd-3ddcd4e00ec5";
+	pairing.DeviceKey = options.Encrypted ? "0123456789ABCDEF" : "";
+	pairing.SeqNum = 1001;
+
+	printf("%u s, %u connections, pipeline depth %u, %u in flight, %u-byte requests, %s, %u hardware threads\n",
+		options.Seconds, options.Connections, options.PipelineDepth, options.InFlight, options.BodyBytes,
+		options.Encrypted ? "encrypted" : "test pairing", std::thread::hardware_concurrency());
+
+	RunResult epoll = Run(options, pairing, NetTransportEpoll);
+	Report("epoll", epoll);
+
+	RunResult uring = Run(options, pairing, NetTransportUring);
+	if (uring.Transport != NetTransportUring)
+		printf("io_uring is not available on this kernel; the second run used epoll\n");
+	Report("uring", uring);
+
+	if (epoll.Completed != 0 && uring.Completed != 0)
+		printf("uring/epoll  throughput %.2fx  cpu/request client %.2fx  server %.2fx\n",
+			(uring.Completed / uring.Seconds) / (epoll.Completed / epoll.Seconds),
+			((double)uring.Client.CpuUs / uring.Completed) / ((double)epoll.Client.CpuUs / epoll.Completed),
+			((double)uring.Server.CpuUs / uring.Completed) / ((double)epoll.Server.CpuUs / epoll.Completed));
+	return (epoll.Failures != 0 || uring.Failures != 0) ? 1 : 0;
+}
@@ -0,0 +1,231 @@
+//--------------------------------------------------------------------------
+// <copyright file="CompanionWarmStart.cpp" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// Cold-start versus warm-start cost of a companion codec.
+// </summary>
+//--------------------------------------------------------------------------
+
+/*
+ Using CompanionWarmStart:
+    CompanionWarmStart [-a address] [-g guid] [-k key] [-n iterations] [-f statefile] [-I instances]
+
+ Times the work between launch and the first encoded request, both ways:
+    cold   - CompanionCodec::Open (address, key and GUID parsing, CSParve64_OpenContext, CSParve64_Create)
+    warm   - CompanionCodec::RestoreState from a SaveState blob (with -f, read from statefile each time)
+    shared - with -I, CompanionCodec::Open finding the instance in the SharedInstanceCache at instances
+ and then, in each case, to the first EncodeRequest of an op=key command.  The figures are reported, and
+ the requests are compared byte for byte.  With -I the segment's counters and the memory it saves over
+ per-process caches are reported too; run several at once to see it shared.
+ A cold start also needs an op=hello round trip to learn the sequence number; that is network time and is
+ not included, so the cold figures are a lower bound.
+ */
+
+#include "CompanionCodec.h"
+#include "SharedInstanceCache.h"
+
+#include <algorithm>
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+struct WarmStartOptions
+{
+	CompanionPairingInfo Pairing;
+	UINT32               Iterations;
+	std::string          StateFile;
+	std::string          InstancesPath;
+
+	WarmStartOptions() : Iterations(20000)
+	{
+		Pairing.TargetIPAddr = "192.168.1.64";
+		Pairing.DeviceId = "ab72527a-582d-4d6d-98dd-3ddcd4e00ec5";
+		Pairing.DeviceKey = "0123456789ABCDEF";
+		Pairing.SeqNum = 1001;
+	}
+};
+
+static void Usage()
+{
+	fprintf(stderr, "usage: CompanionWarmStart [-a address] [-g guid] [-k key] [-n iterations] [-f statefile] [-I instances]\n");
+}
+
+static int ParseArguments(int argc, char** argv, WarmStartOptions* options)
+{
+	for (int i = 1; i < argc; ++i)
+	{
+		if (i + 1 >= argc)
+			return -1;
+
+		std::string arg = argv[i];
+		const char* value = argv[++i];
+		if (arg == "-a")
+			options->Pairing.TargetIPAddr = value;
+		else if (arg == "-g")
+			options->Pairing.DeviceId = value;
+		else if (arg == "-k")
+			options->Pairing.DeviceKey = value;
+		else if (arg == "-n")
+			options->Iterations = (UINT32)strtoul(value, NULL, 10);
+		else if (arg == "-f")
+			options->StateFile = value;
+		else if (arg == "-I")
+			options->InstancesPath = value;
+		else
+			return -1;
+	}
+	return options->Iterations == 0 ? -1 : 0;
+}
+
+static int WriteFile(const std::string& path, const std::vector<BYTE>& data)
+{
+	FILE* file = fopen(path.c_str(), "wb");
+	if (file == NULL)
+		return -1;
+	size_t written = fwrite(&data[0], 1, data.size(), file);
+	return (fclose(file) == 0 && written == data.size()) ? 0 : -1;
+}
+
+static int ReadFile(const std::string& path, std::vector<BYTE>* data)
+{
+	FILE* file = fopen(path.c_str(), "rb");
+	if (file == NULL)
+		return -1;
+	data->resize(COMPANION_STATE_MAX_SIZE);
+	size_t read = fread(&(*data)[0], 1, data->size(), file);
+	fclose(file);
+	data->resize(read);
+	return read > 0 ? 0 : -1;
+}
+
+static void Report(const char* name, std::vector<double>& samples)
+{
+	std::sort(samples.begin(), samples.end());
+	double total = 0;
+	for (size_t i = 0; i < samples.size(); ++i)
+		total += samples[i];
+
+	printf("%-6s mean %7.2f us  p50 %7.2f us  p99 %7.2f us  max %8.2f us\n", name,
+		total / samples.size(), samples[samples.size() / 2], samples[samples.size() * 99 / 100], samples.back());
+}
+
+int main(int argc, char** argv)
+{
+	WarmStartOptions options;
+	if (ParseArguments(argc, argv, &options) != 0)
+	{
+		Usage();
+		return 2;
+	}
+
+	static const char command[] = "op=key&k=chup";
+	typedef std::chrono::steady_clock Clock;
+
+	// Reference request and the state to restore from.
+	CompanionCodec codec;
+	CompanionRequest reference, request;
+	std::vector<BYTE> state;
+	if (codec.Open(options.Pairing) != COMPANION_OK
+		|| codec.EncodeRequest(command, sizeof(command) - 1, options.Pairing.SeqNum + 2, &reference) != COMPANION_OK
+		|| codec.SaveState(options.Pairing.SeqNum, &state) != COMPANION_OK)
+	{
+		fprintf(stderr, "CompanionWarmStart: cannot open the pairing\n");
+		return 1;
+	}
+	if (!options.StateFile.empty() && WriteFile(options.StateFile, state) != 0)
+	{
+		fprintf(stderr, "CompanionWarmStart: cannot write %s\n", options.StateFile.c_str());
+		return 1;
+	}
+	printf("state %u bytes\n", (UINT32)state.size());
+
+	// Open once through the segment, so that it holds the instance if no other process has put it there.
+	SharedInstanceCache instances;
+	if (!options.InstancesPath.empty())
+	{
+		CompanionCodec first;
+		first.SetInstanceCache(&instances);
+		if (instances.Open(options.InstancesPath) != COMPANION_OK || first.Open(options.Pairing) != COMPANION_OK)
+		{
+			fprintf(stderr, "CompanionWarmStart: cannot map %s\n", options.InstancesPath.c_str());
+			return 1;
+		}
+	}
+
+	std::vector<double> cold, warm, shared, coldFirst, warmFirst, sharedFirst;
+	UINT32 mismatches = 0;
+
+	for (UINT32 i = 0; i < options.Iterations; ++i)
+	{
+		// Alternate so that both paths see the same cache and frequency conditions.
+		{
+			Clock::time_point start = Clock::now();
+			CompanionCodec cs;
+			COMPANION_RESULT result = cs.Open(options.Pairing);
+			Clock::time_point opened = Clock::now();
+			if (result == COMPANION_OK)
+				result = cs.EncodeRequest(command, sizeof(command) - 1, options.Pairing.SeqNum + 2, &request);
+			cold.push_back(std::chrono::duration<double, std::micro>(opened - start).count());
+			coldFirst.push_back(std::chrono::duration<double, std::micro>(Clock::now() - start).count());
+			if (result != COMPANION_OK || request.Body != reference.Body || request.Query != reference.Query)
+				++mismatches;
+		}
+		{
+			Clock::time_point start = Clock::now();
+			CompanionCodec cs;
+			std::vector<BYTE> saved;
+			UINT32 seqNum = 0;
+			COMPANION_RESULT result = options.StateFile.empty() ? COMPANION_OK : (ReadFile(options.StateFile, &saved) == 0 ? COMPANION_OK : COMPANION_FAIL);
+			const std::vector<BYTE>& blob = options.StateFile.empty() ? state : saved;
+			if (result == COMPANION_OK)
+				result = cs.RestoreState(&blob[0], blob.size(), &seqNum);
+			Clock::time_point opened = Clock::now();
+			if (result == COMPANION_OK)
+				result = cs.EncodeRequest(command, sizeof(command) - 1, seqNum + 2, &request);
+			warm.push_back(std::chrono::duration<double, std::micro>(opened - start).count());
+			warmFirst.push_back(std::chrono::duration<double, std::micro>(Clock::now() - start).count());
+			if (result != COMPANION_OK || request.Body != reference.Body || request.Query != reference.Query)
+				++mismatches;
+		}
+		if (instances.IsOpen())
+		{
+			Clock::time_point start = Clock::now();
+			CompanionCodec cs;
+			cs.SetInstanceCache(&instances);
+			COMPANION_RESULT result = cs.Open(options.Pairing);
+			Clock::time_point opened = Clock::now();
+			if (result == COMPANION_OK)
+				result = cs.EncodeRequest(command, sizeof(command) - 1, options.Pairing.SeqNum + 2, &request);
+			shared.push_back(std::chrono::duration<double, std::micro>(opened - start).count());
+			sharedFirst.push_back(std::chrono::duration<double, std::micro>(Clock::now() - start).count());
+			if (result != COMPANION_OK || request.Body != reference.Body || request.Query != reference.Query)
+				++mismatches;
+		}
+	}
+
+	printf("open:\n");
+	Report("cold", cold);
+	Report("warm", warm);
+	if (!shared.empty())
+		Report("shared", shared);
+	printf("open and first request:\n");
+	Report("cold", coldFirst);
+	Report("warm", warmFirst);
+	if (!sharedFirst.empty())
+		Report("shared", sharedFirst);
+
+	if (instances.IsOpen())
+	{
+		SharedInstanceCacheStats stats = instances.Stats();
+		printf("segment: %u of %u slots, %u processes, %llu hits, %llu misses, %llu read retries\n", stats.Entries, stats.Capacity,
+			stats.Processes, (unsigned long long)stats.Hits, (unsigned long long)stats.Misses, (unsigned long long)stats.Retries);
+		printf("segment %llu bytes, per-process caches %llu bytes: %lld bytes saved\n", (unsigned long long)stats.SegmentBytes,
+			(unsigned long long)stats.PerProcessBytes, stats.SavedBytes);
+	}
+	printf("requests differing from the reference: %u\n", mismatches);
+	return mismatches == 0 ? 0 : 1;
+}
@@ -0,0 +1,270 @@
+//--------------------------------------------------------------------------
+// <copyright file="CompanionWindowBench.cpp" company="Ericsson">
+//  Copyright (c) Ericsson, Inc. All rights reserved.
+// </copyright>
+// <summary>
+// Throughput of sequence-window checks from many threads.
+// </summary>
+//--------------------------------------------------------------------------
+
+/*
+ Using CompanionWindowBench:
+    CompanionWindowBench [-t threads] [-n checks] [-c cids] [-b batch] [-r replaypercent]
+
+ Each of 1, 2, 4 ... threads threads checks n sequence numbers, spread over cids senders.  Every sender
+ allocates its sequence numbers from one CompanionSequence, batch at a time, as a client with several
+ connections does, so threads checking the same cid race each other in and out of order.  replaypercent
+ of the checks resend a sequence number the thread had accepted before, which must never be accepted
+ again.  Each thread count is run against:
+    locked   - one mutex around a map of bitmap windows: what a straightforward receiver does
+    lockfree - SequenceWindowTable
+ and the checks per second, the outcome counts, and any sequence number accepted twice (which would be a
+ bug) are reported.
+ */
+
+#include "SequenceWindow.h"
+
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+struct WindowBenchOptions
+{
+	UINT32 Threads;
+	UINT32 Checks;              // per thread
+	UINT32 Cids;
+	UINT32 Batch;
+	UINT32 ReplayPercent;
+
+	WindowBenchOptions() : Threads(8), Checks(1000000), Cids(4), Batch(8), ReplayPercent(1) {}
+};
+
+static void Usage()
+{
+	fprintf(stderr, "usage: CompanionWindowBench [-t threads] [-n checks] [-c cids] [-b batch] [-r replaypercent]\n");
+}
+
+static int ParseArguments(int argc, char** argv, WindowBenchOptions* options)
+{
+	for (int i = 1; i < argc; ++i)
+	{
+		if (i + 1 >= argc)
+			return -1;
+
+		std::string arg = argv[i];
+		UINT32 value = (UINT32)strtoul(argv[++i], NULL, 10);
+		if (arg == "-t")
+			options->Threads = value;
+		else if (arg == "-n")
+			options->Checks = value;
+		else if (arg == "-c")
+			options->Cids = value;
+		else if (arg == "-b")
+			options->Batch = value;
+		else if (arg == "-r")
+			options->ReplayPercent = value;
+		else
+			return -1;
+	}
+	return (options->Threads == 0 || options->Checks == 0 || options->Cids == 0 || options->Batch == 0 || options->ReplayPercent > 100) ? -1 : 0;
+}
+
+/// <summary>
+/// The same window rule as SequenceWindow, one bit per odd sequence number, under one mutex.
+/// </summary>
+class LockedWindowTable
+{
+public:
+
+	SequenceCheck Check(const std::string& cid, UINT32 seqNum)
+	{
+		std::lock_guard<std::mutex> hold(_lock);
+		Window& window = _windows[cid];
+
+		INT32 seqDelta = (INT32)(window.Newest - seqNum);
+		if (window.Valid && seqDelta >= COMPANION_SEQUENCE_WINDOW)
+			return SequenceOutOfWindow;
+
+		if (!window.Valid || seqDelta < 0)
+		{
+			// Slide forward, forgetting the bits that fall out.
+			UINT32 steps = window.Valid ? (UINT32)(-seqDelta) / 2 : COMPANION_SEQUENCE_WINDOW;
+			for (UINT32 i = 1; i <= steps && i <= COMPANION_SEQUENCE_WINDOW; ++i)
+				window.Bits[((window.Newest >> 1) + i) % COMPANION_SEQUENCE_WINDOW] = false;
+			window.Newest = seqNum;
+			window.Valid = true;
+		}
+
+		std::vector<bool>::reference bit = window.Bits[(seqNum >> 1) % COMPANION_SEQUENCE_WINDOW];
+		if (bit)
+			return SequenceDuplicate;
+		bit = true;
+		return SequenceAccepted;
+	}
+
+private:
+
+	struct Window
+	{
+		UINT32            Newest;
+		bool              Valid;
+		std::vector<bool> Bits;
+
+		Window() : Newest(0), Valid(false), Bits(COMPANION_SEQUENCE_WINDOW) {}
+	};
+
+	std::mutex                              _lock;
+	std::unordered_map<std::string, Window> _windows;
+};
+
+/// <summary>
+/// One sender: its sequence, and how often each of its sequence numbers was accepted.
+/// </summary>
+struct Sender
+{
+	std::string                          Cid;
+	CompanionSequence                    Sequence;
+	UINT32                               First;
+	std::unique_ptr<std::atomic<BYTE>[]> Accepted;
+	UINT32                               Capacity;
+
+	Sender(const std::string& cid, UINT32 capacity)
+		: Cid(cid), Sequence(1001), First(1003), Accepted(new std::atomic<BYTE>[capacity]), Capacity(capacity)
+	{
+		for (UINT32 i = 0; i < capacity; ++i)
+			Accepted[i].store(0, std::memory_order_relaxed);
+	}
+};
+
+struct WindowBenchCounts
+{
+	UINT64 Accepted;
+	UINT64 Duplicates;
+	UINT64 OutOfWindow;
+	UINT64 Replays;
+
+	WindowBenchCounts() : Accepted(0), Duplicates(0), OutOfWindow(0), Replays(0) {}
+};
+
+template <class Table>
+static void RunThread(Table& table, std::vector<std::unique_ptr<Sender> >& senders, const WindowBenchOptions& options, UINT32 thread, WindowBenchCounts* counts)
+{
+	std::vector<UINT32> batch;
+	std::vector<std::vector<UINT32> > accepted(senders.size());    // a few this thread accepted, to replay
+	UINT32 random = 2463534242u + thread;
+
+	for (UINT32 i = 0; i < options.Checks; )
+	{
+		size_t senderIndex = (thread + i / options.Batch) % senders.size();
+		Sender& sender = *senders[senderIndex];
+		std::vector<UINT32>& replayable = accepted[senderIndex];
+
+		batch.clear();
+		for (UINT32 j = 0; j < options.Batch && i + j < options.Checks; ++j)
+			batch.push_back(sender.Sequence.Next());
+
+		for (size_t j = 0; j < batch.size(); ++j, ++i)
+		{
+			random ^= random << 13;
+			random ^= random >> 17;
+			random ^= random << 5;
+
+			UINT32 seqNum = batch[j];
+			bool replay = !replayable.empty() && random % 100 < options.ReplayPercent;
+			if (replay)
+				seqNum = replayable[random % replayable.size()];
+
+			SequenceCheck check = table.Check(sender.Cid, seqNum);
+			if (check == SequenceAccepted)
+			{
+				++counts->Accepted;
+				UINT32 index = (seqNum - sender.First) / 2;
+				if (index < sender.Capacity)
+					sender.Accepted[index].fetch_add(1, std::memory_order_relaxed);
+				if (!replay && replayable.size() < 64)
+					replayable.push_back(seqNum);
+				else if (!replay)
+					replayable[random % 64] = seqNum;
+			}
+			else if (check == SequenceDuplicate)
+				++counts->Duplicates;
+			else
+				++counts->OutOfWindow;
+			if (replay)
+				++counts->Replays;
+		}
+	}
+}
+
+template <class Table>
+static void Run(const char* name, const WindowBenchOptions& options, UINT32 threads)
+{
+	Table table;
+	std::vector<std::unique_ptr<Sender> > senders;
+	UINT32 perSender = (UINT32)(((UINT64)options.Checks * threads + options.Cids - 1) / options.Cids) + options.Batch * threads;
+	for (UINT32 i = 0; i < options.Cids; ++i)
+	{
+		char cid[64];
+		snprintf(cid, sizeof(cid), "ab72527a-582d-4d6d-98dd-%012x", i);
+		senders.push_back(std::unique_ptr<Sender>(new Sender(cid, perSender)));
+	}
+
+	std::vector<WindowBenchCounts> counts(threads);
+	std::vector<std::thread> workers;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (UINT32 t = 0; t < threads; ++t)
+		workers.push_back(std::thread(RunThread<Table>, std::ref(table), std::ref(senders), std::cref(options), t, &counts[t]));
+	for (size_t t = 0; t < workers.size(); ++t)
+		workers[t].join();
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	WindowBenchCounts total;
+	for (UINT32 t = 0; t < threads; ++t)
+	{
+		total.Accepted += counts[t].Accepted;
+		total.Duplicates += counts[t].Duplicates;
+		total.OutOfWindow += counts[t].OutOfWindow;
+		total.Replays += counts[t].Replays;
+	}
+
+	UINT64 twice = 0;
+	for (size_t i = 0; i < senders.size(); ++i)
+		for (UINT32 j = 0; j < senders[i]->Capacity; ++j)
+			if (senders[i]->Accepted[j].load(std::memory_order_relaxed) > 1)
+				++twice;
+
+	UINT64 checks = (UINT64)options.Checks * threads;
+	printf("%-8s %2u threads  %8.2f M checks/s  %6.1f ns/check  accepted %llu  duplicate %llu  out of window %llu  replays %llu  accepted twice %llu\n",
+		name, threads, checks / seconds / 1e6, seconds * 1e9 / checks * threads, (unsigned long long)total.Accepted,
+		(unsigned long long)total.Duplicates, (unsigned long long)total.OutOfWindow, (unsigned long long)total.Replays,
+		(unsigned long long)twice);
+}
+
+int main(int argc, char** argv)
+{
+	WindowBenchOptions options;
+	if (ParseArguments(argc, argv, &options) != 0)
+	{
+		Usage();
+		return 2;
+	}
+
+	printf("%u checks per thread over %u cids, batches of %u, %u%% replayed, %u hardware threads\n", options.Checks, options.Cids,
+		options.Batch, options.ReplayPercent, std::thread::hardware_concurrency());
+	for (UINT32 threads = 1; ; threads *= 2)
+	{
+		if (threads > options.Threads)
+			threads = options.Threads;
+		Run<LockedWindowTable>("locked", options, threads);
+		Run<SequenceWindowTable>("lockfree", options, threads);
+		if (threads == options.Threads)
+			break;
+	}
+	return 0;
+}